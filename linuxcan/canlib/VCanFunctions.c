@@ -78,18 +78,25 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include "VCanMemoFunctions.h"
 #include "VCanScriptFunctions.h"
 #include "VCanFunctions.h"
 #include "VCanFuncUtil.h"
+#include "canlib_channel_list.h"
 #include "debug.h"
 
 
@@ -102,6 +109,9 @@
 // Standard resolution for the time stamps and canReadTimer is
 // 1 ms, i.e. 100 VCAND ticks.
 #define DEFAULT_TIMER_FACTOR 100
+#define RCV_BATCH_SIZE       64   // Max events fetched per VCAN_IOC_RECVMSG_BATCH
+#define TX_BATCH_SIZE        64   // Max messages passed per VCAN_IOC_SENDMSG_BATCH
+#define NOTIFY_EVENTS_PER_PASS 16   // Max events dispatched for one handle before serving the next
 
 
 static uint32_t capabilities_table[][2] = {
@@ -131,13 +141,21 @@ static uint64_t capabilities_ex_table[][2] = {
     {VCAN_CHANNEL_EX_CAP_HAS_BUSPARAMS_TQ,  canCHANNEL_CAP_EX_BUSPARAMS_TQ}
 };
 
-// If there are more handles than this, the rest will be
-// handled by a linked list.
-#define MAX_ARRAY_HANDLES 64
-
-static HandleData  *handleArray[MAX_ARRAY_HANDLES];
-static HandleList  *handleList;
-static CanHandle   handleMax   = MAX_ARRAY_HANDLES;
+// Handles index a two level table: a fixed array of pointers to blocks
+// of HANDLE_BLOCK_SIZE slots. Blocks are allocated when first needed and
+// are never moved or freed, so findHandle() reads the table without
+// taking a lock. handleMutex serializes the changes to the table.
+#define HANDLE_BLOCK_SIZE 64
+#define HANDLE_BLOCKS     1024
+#define MAX_HANDLES       (HANDLE_BLOCK_SIZE * HANDLE_BLOCKS)
+
+typedef struct {
+  HandleData *slot[HANDLE_BLOCK_SIZE];
+} HandleBlock;
+
+static HandleBlock  handleBlock0;   // Enough for most applications
+static HandleBlock *handleBlocks[HANDLE_BLOCKS] = {&handleBlock0};
+static CanHandle    handleFree = 0; // No free slot below this
 #if defined(PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP)
 static pthread_mutex_t handleMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #elif defined(PTHREAD_RECURSIVE_MUTEX_INITIALIZER)
@@ -156,57 +174,45 @@ static int check_args (void* buf, uint32_t buf_len, uint32_t limit, uint32_t met
 static canStatus vCanSetBusOutputControl (HandleData *hData, unsigned int drivertype);
 
 //******************************************************
-// Compare handles
-//******************************************************
-static int hndCmp (const void *hData1, const void *hData2)
-{
-  return ((HandleData *)(hData1))->handle ==
-         ((HandleData *)(hData2))->handle;
-}
-
-
-//******************************************************
-// Find handle in list
+// Find handle in table
 //******************************************************
 HandleData * findHandle (CanHandle hnd)
 {
-  HandleData dummyHandleData, *found;
-  dummyHandleData.handle = hnd;
+  HandleBlock *block;
 
-  if (hnd < 0) {
+  if ((hnd < 0) || (hnd >= MAX_HANDLES)) {
     return NULL;
   }
 
-  pthread_mutex_lock(&handleMutex);
-  if (hnd < MAX_ARRAY_HANDLES) {
-    found = handleArray[hnd];
-  } else {
-    found = listFind(&handleList, &dummyHandleData, &hndCmp);
+  block = __atomic_load_n(&handleBlocks[hnd / HANDLE_BLOCK_SIZE], __ATOMIC_ACQUIRE);
+  if (block == NULL) {
+    return NULL;
   }
-  pthread_mutex_unlock(&handleMutex);
 
-  return found;
+  return __atomic_load_n(&block->slot[hnd % HANDLE_BLOCK_SIZE], __ATOMIC_ACQUIRE);
 }
 
 
 //******************************************************
-// Remove handle from list
+// Remove handle from table
 //******************************************************
 HandleData * removeHandle (CanHandle hnd)
 {
-  HandleData dummyHandleData, *found;
-  dummyHandleData.handle = hnd;
+  HandleBlock *block;
+  HandleData  *found = NULL;
 
-  if (hnd < 0) {
+  if ((hnd < 0) || (hnd >= MAX_HANDLES)) {
     return NULL;
   }
 
   pthread_mutex_lock(&handleMutex);
-  if (hnd < MAX_ARRAY_HANDLES) {
-    found = handleArray[hnd];
-    handleArray[hnd] = NULL;
-  } else {
-    found = listRemove(&handleList, &dummyHandleData, &hndCmp);
+  block = handleBlocks[hnd / HANDLE_BLOCK_SIZE];
+  if (block != NULL) {
+    found = block->slot[hnd % HANDLE_BLOCK_SIZE];
+    __atomic_store_n(&block->slot[hnd % HANDLE_BLOCK_SIZE], NULL, __ATOMIC_RELEASE);
+    if (found && (hnd < handleFree)) {
+      handleFree = hnd;
+    }
   }
   pthread_mutex_unlock(&handleMutex);
 
@@ -214,26 +220,32 @@ HandleData * removeHandle (CanHandle hnd)
 }
 
 //******************************************************
-// Insert handle in list
+// Insert handle in table
 //******************************************************
 CanHandle insertHandle (HandleData *hData)
 {
   CanHandle hnd = -1;
-  int i;
+  CanHandle i;
 
   pthread_mutex_lock(&handleMutex);
 
-  for(i = 0; i < MAX_ARRAY_HANDLES; i++) {
-    if (!handleArray[i]) {
-      hData->handle = hnd = (CanHandle)i;
-      handleArray[i] = hData;
-      break;
+  for (i = handleFree; i < MAX_HANDLES; i++) {
+    HandleBlock *block = handleBlocks[i / HANDLE_BLOCK_SIZE];
+
+    if (block == NULL) {
+      block = calloc(1, sizeof(HandleBlock));
+      if (block == NULL) {
+        break;
+      }
+      __atomic_store_n(&handleBlocks[i / HANDLE_BLOCK_SIZE], block, __ATOMIC_RELEASE);
     }
-  }
 
-  if (i == MAX_ARRAY_HANDLES) {
-    if (listInsertFirst(&handleList, hData) == 0) {
-      hData->handle = hnd = handleMax++;
+    if (!block->slot[i % HANDLE_BLOCK_SIZE]) {
+      // Set before publishing, as readers may find hData at once
+      hData->handle = hnd = i;
+      __atomic_store_n(&block->slot[i % HANDLE_BLOCK_SIZE], hData, __ATOMIC_RELEASE);
+      handleFree = i + 1;
+      break;
     }
   }
 
@@ -244,31 +256,24 @@ CanHandle insertHandle (HandleData *hData)
 
 void foreachHandle (int (*func)(const CanHandle))
 {
-  int i;
+  int i, j;
   pthread_mutex_lock(&handleMutex);
-  for (i = 0; i < MAX_ARRAY_HANDLES; i++) {
-    CanHandle hnd = -1;
-    if (!handleArray[i]) {
+  for (i = 0; i < HANDLE_BLOCKS; i++) {
+    HandleBlock *block = handleBlocks[i];
+
+    if (block == NULL) {
       continue;
     }
-    hnd = handleArray[i]->handle;
-    if (func(hnd) != canOK) {
-      DEBUGPRINT((TXT("foreachHandle func failed.\n")));
-    }
-  }
-  if (handleMax > MAX_ARRAY_HANDLES) {
-    HandleList *hndListNext = handleList;
-    while (hndListNext != NULL) {
-      HandleData *found;
-      HandleList *hndList = hndListNext;
-      hndListNext = hndList->next;
-      if ((found = hndList->elem)) {
-        if (func(found->handle) != canOK) {
-          DEBUGPRINT((TXT("foreachHandle func failed.\n")));
-        }
+    for (j = 0; j < HANDLE_BLOCK_SIZE; j++) {
+      CanHandle hnd = -1;
+      if (!block->slot[j]) {
+        continue;
+      }
+      hnd = block->slot[j]->handle;
+      if (func(hnd) != canOK) {
+        DEBUGPRINT((TXT("foreachHandle func failed.\n")));
       }
     }
-    handleMax = MAX_ARRAY_HANDLES;
   }
   pthread_mutex_unlock(&handleMutex);
 }
@@ -285,6 +290,9 @@ static canStatus kCanSetOpenMode (HandleData *hData)
   memset(&open_data, 0, sizeof(KCAN_IOCTL_OPEN_MODE_T));
   open_data.mode = hData->openMode;
   open_data.action = CAN_MODE_SET;
+  if (hData->openMode == OPEN_AS_CAN) {
+    open_data.flags = CAN_OPEN_MODE_FLAG_COMPACT_EVENTS;
+  }
 
   ret = ioctl(hData->fd, KCAN_IOCTL_OPEN_MODE, &open_data);
   if (ret != 0) {
@@ -298,6 +306,9 @@ static canStatus kCanSetOpenMode (HandleData *hData)
     return canERR_NOTFOUND;
   }
 
+  // Older drivers leave flagsReply untouched
+  hData->compactEvents = (open_data.flagsReply & CAN_OPEN_MODE_FLAG_COMPACT_EVENTS) != 0;
+
   return canOK;
 }
 
@@ -381,55 +392,155 @@ static void notify (HandleData *hData, VCAN_EVENT *msg, uint32_t *prev_busoff, u
 }
 
 //======================================================================
-// Notification thread
+// Notification dispatcher
+// A single thread serves the notification fds of all handles through
+// epoll, instead of one thread per handle blocking in VCAN_IOC_RECVMSG.
 //======================================================================
-static void *vCanNotifyThread (void *arg)
+static struct {
+  pthread_mutex_t  lock;
+  pthread_cond_t   passDone;
+  pthread_t        thread;
+  int              started;
+  int              epollFd;
+  int              wakeFd;
+  unsigned int     pass;     // Incremented each time the thread is done with a handle
+  HandleData      *current;  // Only used by the dispatcher thread
+} notifyDispatcher = {
+  .lock     = PTHREAD_MUTEX_INITIALIZER,
+  .passDone = PTHREAD_COND_INITIALIZER,
+  .epollFd  = -1,
+  .wakeFd   = -1,
+};
+
+static void *vCanNotifyDispatcher (void *arg)
 {
-  HandleData        *hData = (HandleData *)arg;
-  int                ret;
+  struct epoll_event ev;
   VCAN_IOCTL_READ_T  ioctl_read_arg;
   VCAN_EVENT         msg;
-  VCanRead           read;
-  uint32_t           busoff;
-  uint32_t           bus_status;
+  VCanRead           readOpt;
+  uint64_t           count;
+  int                i;
 
-  memset(&read, 0, sizeof(VCanRead));
+  (void)arg;
+  memset(&readOpt, 0, sizeof(VCanRead));
 
-  read.timeout        = 50;  //50 ms
+  readOpt.timeout     = 0;
   ioctl_read_arg.msg  = &msg;
-  ioctl_read_arg.read = &read;
+  ioctl_read_arg.read = &readOpt;
 
-  //are we buson or busoff?
-  {
-    VCanRequestChipStatus  chip_status;
-    
-    if (ioctl(hData->notifyFd, VCAN_IOC_GET_CHIP_STATE, &chip_status)) {
-      pthread_exit(0); // When this thread is cancelled, ioctl will be interrupted by a signal.
-    }
-    
-    if (chip_status.busStatus & CHIPSTAT_BUSOFF) {
-      busoff = 1;
-    } else {
-      busoff = 0;
+  while (1) {
+    // Only one handle is taken per wait, so the callback may close any
+    // handle without leaving a stale one among pending epoll events.
+    if (epoll_wait(notifyDispatcher.epollFd, &ev, 1, -1) == 1) {
+      if (ev.data.ptr) {
+        notifyDispatcher.current = ev.data.ptr;
+      } else if (read(notifyDispatcher.wakeFd, &count, sizeof(count)) < 0) {
+        // Nothing to do, the wake-up was already consumed
+      }
+    }
+
+    // Take a limited number of events so that a busy channel does not
+    // starve the others; epoll reports the handle again if more are queued.
+    for (i = 0; notifyDispatcher.current && (i < NOTIFY_EVENTS_PER_PASS); i++) {
+      HandleData *hData = notifyDispatcher.current;
+
+      if (ioctl(hData->notifyFd, VCAN_IOC_RECVMSG, &ioctl_read_arg)) {
+        break;
+      }
+      // The callback may turn off notification for its own handle,
+      // which clears current.
+      notify(hData, &msg, &hData->notifyBusoff, &hData->notifyBusStatus);
     }
 
-    bus_status = (uint32_t)chip_status.busStatus;
+    pthread_mutex_lock(&notifyDispatcher.lock);
+    notifyDispatcher.current = NULL;
+    notifyDispatcher.pass++;
+    pthread_cond_broadcast(&notifyDispatcher.passDone);
+    pthread_mutex_unlock(&notifyDispatcher.lock);
   }
-  
-  while (1) {
-    pthread_testcancel();
 
-    hData->notifyThread_running = 1;
-    ret = ioctl(hData->notifyFd, VCAN_IOC_RECVMSG, &ioctl_read_arg);
+  return NULL;
+}
 
-    if (ret == 0) {
-      notify(hData, &msg, &busoff, &bus_status);
-    } else {
-      if (errno != EAGAIN) {
-        pthread_exit(0); // When this thread is cancelled, ioctl will be interrupted by a signal.
+//======================================================================
+// Add a handle's notification fd to the dispatcher
+//======================================================================
+static canStatus vCanNotifyRegister (HandleData *hData)
+{
+  struct epoll_event ev;
+  canStatus          stat = canOK;
+
+  pthread_mutex_lock(&notifyDispatcher.lock);
+
+  if (!notifyDispatcher.started) {
+    notifyDispatcher.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    notifyDispatcher.wakeFd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if ((notifyDispatcher.epollFd < 0) || (notifyDispatcher.wakeFd < 0) ||
+        epoll_ctl(notifyDispatcher.epollFd, EPOLL_CTL_ADD,
+                  notifyDispatcher.wakeFd, &ev) ||
+        pthread_create(&notifyDispatcher.thread, NULL,
+                       vCanNotifyDispatcher, NULL)) {
+      if (notifyDispatcher.epollFd >= 0) {
+        close(notifyDispatcher.epollFd);
+      }
+      if (notifyDispatcher.wakeFd >= 0) {
+        close(notifyDispatcher.wakeFd);
       }
+      notifyDispatcher.epollFd = -1;
+      notifyDispatcher.wakeFd  = -1;
+      pthread_mutex_unlock(&notifyDispatcher.lock);
+      return canERR_NOMEM;
+    }
+    // The thread lives as long as the process
+    pthread_detach(notifyDispatcher.thread);
+    notifyDispatcher.started = 1;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events   = EPOLLIN;
+  ev.data.ptr = hData;
+  if (epoll_ctl(notifyDispatcher.epollFd, EPOLL_CTL_ADD, hData->notifyFd, &ev)) {
+    stat = errnoToCanStatus(errno);
+  }
+
+  pthread_mutex_unlock(&notifyDispatcher.lock);
+
+  return stat;
+}
+
+//======================================================================
+// Remove a handle's notification fd from the dispatcher
+// When this returns, the dispatcher no longer uses hData.
+//======================================================================
+static void vCanNotifyUnregister (HandleData *hData)
+{
+  pthread_mutex_lock(&notifyDispatcher.lock);
+
+  epoll_ctl(notifyDispatcher.epollFd, EPOLL_CTL_DEL, hData->notifyFd, NULL);
+
+  if (pthread_equal(pthread_self(), notifyDispatcher.thread)) {
+    // Called from a callback
+    if (notifyDispatcher.current == hData) {
+      notifyDispatcher.current = NULL;
+    }
+  } else {
+    // The thread may already have got hData from epoll_wait, so wait
+    // until it has finished one more pass.
+    unsigned int target = notifyDispatcher.pass + 1;
+    uint64_t     one    = 1;
+
+    if (write(notifyDispatcher.wakeFd, &one, sizeof(one)) < 0) {
+      // The counter is already non-zero, so the thread wakes up anyway
+    }
+    while ((int)(notifyDispatcher.pass - target) < 0) {
+      pthread_cond_wait(&notifyDispatcher.passDone, &notifyDispatcher.lock);
     }
   }
+
+  pthread_mutex_unlock(&notifyDispatcher.lock);
 }
 
 
@@ -441,9 +552,26 @@ static canStatus vCanSetNotify (HandleData *hData,
                                 kvCallback_t callback2,
                                 unsigned int notifyFlags)
 {
-  int           ret;
-  VCanMsgFilter filter;
-  unsigned char transId;
+  int                   ret;
+  VCanMsgFilter         filter;
+  VCanRequestChipStatus chip_status;
+  unsigned char         transId;
+
+  if (hData->notifyFd != canINVALID_HANDLE) {
+    // Must stop notifications in order to set new params.
+    vCanNotifyUnregister(hData);
+  }
+
+  if (notifyFlags == 0 || (callback == NULL && callback2 == NULL)) {
+    // We want to shut off notification, close file and clear callback
+    if (hData->notifyFd != canINVALID_HANDLE) {
+      close(hData->notifyFd);
+      hData->notifyFd = canINVALID_HANDLE;
+    }
+    hData->callback  = NULL;
+    hData->callback2 = NULL;
+    return canOK;
+  }
 
   if (hData->notifyFd == canINVALID_HANDLE) {
     // Open an fd to read events from
@@ -463,15 +591,9 @@ static canStatus vCanSetNotify (HandleData *hData,
     if (ret != 0) {
       goto error_ioc;
     }
-  } else { //must kill thread in order to set new params.
-    pthread_cancel(hData->notifyThread);
-
-    // Wait for thread to finish
-    pthread_join(hData->notifyThread, NULL);
   }
 
-  hData->notifyThread_running = 0;
-  hData->notifyFlags          = notifyFlags;
+  hData->notifyFlags = notifyFlags;
 
   // Set filters
   memset(&filter, 0, sizeof(VCanMsgFilter));
@@ -501,12 +623,15 @@ static canStatus vCanSetNotify (HandleData *hData,
     }
   }
 
-  ret = ioctl(hData->fd, VCAN_IOC_FLUSH_RCVBUFFER, NULL);
+  //are we buson or busoff?
+  ret = ioctl(hData->notifyFd, VCAN_IOC_GET_CHIP_STATE, &chip_status);
   if (ret != 0) {
     goto error_ioc;
   }
+  hData->notifyBusoff    = (chip_status.busStatus & CHIPSTAT_BUSOFF) ? 1 : 0;
+  hData->notifyBusStatus = (uint32_t)chip_status.busStatus;
 
-  ret = pthread_create(&hData->notifyThread, NULL, vCanNotifyThread, hData);
+  ret = ioctl(hData->fd, VCAN_IOC_FLUSH_RCVBUFFER, NULL);
   if (ret != 0) {
     goto error_ioc;
   }
@@ -514,20 +639,8 @@ static canStatus vCanSetNotify (HandleData *hData,
   hData->callback  = callback;
   hData->callback2 = callback2;
 
-  //wait for the thread to start
-  {
-    uint32_t n = 0;
-    while (1) {
-      if (hData->notifyThread_running) {
-        break;
-      }
-
-      n++;
-      if (n > 10) {
-        break;
-      }
-      usleep(1000);
-    }
+  if (vCanNotifyRegister(hData) != canOK) {
+    goto error_ioc;
   }
 
   return canOK;
@@ -917,6 +1030,79 @@ static canStatus vCanGetBusStats(HandleData *hData, canBusStatistics *stat)
 }
 
 
+//======================================================================
+// vCanConvertRxMsg
+// Translate a received message from driver to canlib format
+//======================================================================
+static void vCanConvertRxMsg (HandleData *hData, uint32_t msgId,
+                              uint16_t msgFlags, uint8_t msgDlc,
+                              const unsigned char *msgData,
+                              unsigned long timeStamp,
+                              long *id, void *msgPtr, unsigned int *dlc,
+                              unsigned int *flag, unsigned long *time)
+{
+  int i;
+  unsigned int flags;
+  int count = 0;
+
+  if (msgId & EXT_MSG) {
+    flags = canMSG_EXT;
+  } else {
+    flags = canMSG_STD;
+  }
+  if (msgFlags & VCAN_MSG_FLAG_ERROR_FRAME)
+    flags = canMSG_ERROR_FRAME;
+  if (msgFlags & VCAN_MSG_FLAG_FDF)
+    flags |= canFDMSG_FDF;
+  if (msgFlags & VCAN_MSG_FLAG_BRS)
+    flags |= canFDMSG_BRS;
+  if (msgFlags & VCAN_MSG_FLAG_ESI)
+    flags |= canFDMSG_ESI;
+  if (msgFlags & VCAN_MSG_FLAG_OVERRUN)
+    flags |= canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN;
+  if (msgFlags & VCAN_MSG_FLAG_REMOTE_FRAME)
+    flags |= canMSG_RTR;
+  if (msgFlags & VCAN_MSG_FLAG_TX_START)
+    flags |= canMSG_TXRQ;
+
+  if (flags & canFDMSG_FDF) {
+    count = dlc_dlc_to_bytes_fd (msgDlc);
+  } else {
+    count = dlc_dlc_to_bytes_classic (msgDlc);
+  }
+
+  if (msgFlags & VCAN_MSG_FLAG_SSM_NACK) {
+    flags |= canMSG_TXNACK;
+  } else if (msgFlags & VCAN_MSG_FLAG_SSM_NACK_ABL) {
+    flags |= canMSG_TXNACK;
+    flags |= canMSG_ABL;
+  } else {
+    if (msgFlags & VCAN_MSG_FLAG_TXACK) {
+      flags |= canMSG_TXACK;
+    }
+  }
+
+  // Copy data unless remote request
+  if (msgPtr && !(flags & canMSG_RTR)) {
+    for (i = 0; i < count; i++)
+      ((unsigned char *)msgPtr)[i] = msgData[i];
+  }
+
+  // MSb is extended flag
+  if (id)   *id   = msgId & ~EXT_MSG;
+  if (dlc) {
+    if (hData->acceptLargeDlc && !(flags & canFDMSG_FDF)) {
+      *dlc = msgDlc;
+    }
+    else {
+      *dlc  = count;
+    }
+  }
+  if (time) *time = (timeStamp * 10UL) / (hData->timerResolution) ;
+  if (flag) *flag = flags;
+}
+
+
 //======================================================================
 // vCanReadInternal
 //======================================================================
@@ -925,7 +1111,6 @@ static canStatus vCanReadInternal (HandleData *hData, unsigned int iotcl_cmd,
                                    void *msgPtr, unsigned int *dlc,
                                    unsigned int *flag, unsigned long *time)
 {
-  int i;
   int ret;
   VCAN_IOCTL_READ_T ioctl_read_arg;
   VCAN_EVENT msg;
@@ -940,69 +1125,450 @@ static canStatus vCanReadInternal (HandleData *hData, unsigned int iotcl_cmd,
     }
     // Receive CAN message
     if (msg.tag == V_RECEIVE_MSG) {
-      unsigned int flags;
-      int count = 0;
+      vCanConvertRxMsg(hData, msg.tagData.msg.id, msg.tagData.msg.flags,
+                       msg.tagData.msg.dlc, msg.tagData.msg.data,
+                       msg.timeStamp, id, msgPtr, dlc, flag, time);
+      break;
+    }
+  }
 
-      if (msg.tagData.msg.id & EXT_MSG) {
-        flags = canMSG_EXT;
-      } else {
-        flags = canMSG_STD;
-      }
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_ERROR_FRAME)
-        flags = canMSG_ERROR_FRAME;
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_FDF)
-        flags |= canFDMSG_FDF;
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_BRS)
-        flags |= canFDMSG_BRS;
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_ESI)
-        flags |= canFDMSG_ESI;
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_OVERRUN)
-        flags |= canMSGERR_HW_OVERRUN | canMSGERR_SW_OVERRUN;
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_REMOTE_FRAME)
-        flags |= canMSG_RTR;
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_TX_START)
-        flags |= canMSG_TXRQ;
-
-      if (flags & canFDMSG_FDF) {
-        count = dlc_dlc_to_bytes_fd (msg.tagData.msg.dlc);
-      } else {
-        count = dlc_dlc_to_bytes_classic (msg.tagData.msg.dlc);
+  return canOK;
+}
+
+
+//======================================================================
+// vCanDeadline
+// Returns the absolute time when a timeout in ms, started now, expires
+//======================================================================
+static struct timespec vCanDeadline (unsigned long timeout)
+{
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec  += timeout / 1000;
+  deadline.tv_nsec += (long)(timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  return deadline;
+}
+
+
+//======================================================================
+// vCanTimeLeft
+// Returns the ms left until deadline, or 0 if it has passed
+//======================================================================
+static unsigned long vCanTimeLeft (const struct timespec *deadline)
+{
+  struct timespec now;
+  long long ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (long long)(deadline->tv_sec - now.tv_sec) * 1000 +
+       (deadline->tv_nsec - now.tv_nsec) / 1000000L;
+  return (ms > 0) ? (unsigned long)ms : 0;
+}
+
+
+//======================================================================
+// vCanRxRingPeek
+// Returns the oldest message in the memory mapped receive ring, or NULL
+// if there is none. Other events in front of it are dropped, just like
+// vCanReadInternal does with the events it reads.
+//======================================================================
+static VCanRxRecord *vCanRxRingPeek (HandleData *hData)
+{
+  uint32_t head = __atomic_load_n(&hData->rxRing->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = hData->rxRing->tail;
+  VCanRxRecord *rec;
+
+  while (tail != head) {
+    rec = &hData->rxRecords[tail & hData->rxRingMask];
+    if (rec->tag == V_RECEIVE_MSG) {
+      return rec;
+    }
+    tail++;
+    __atomic_store_n(&hData->rxRing->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+
+//======================================================================
+// vCanRxRingWait
+// Wait until there is a message in the memory mapped receive ring, or
+// timeout
+//======================================================================
+static canStatus vCanRxRingWait (HandleData *hData, unsigned long timeout)
+{
+  struct pollfd pfd;
+  struct timespec deadline;
+  int infinite = (timeout == (unsigned long)-1) || (timeout == 0xFFFFFFFF);
+  int ms;
+  int ret;
+
+  if (vCanRxRingPeek(hData)) {
+    return canOK;
+  }
+  if (!infinite) {
+    deadline = vCanDeadline(timeout);
+  }
+
+  // The driver only reports POLLIN for a ring handle when the ring is not
+  // empty, but the ring may hold nothing but other events
+  while (timeout) {
+    if (infinite || (timeout > INT_MAX)) {
+      ms = -1;
+    } else {
+      ms = (int)timeout;
+    }
+
+    pfd.fd      = hData->fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    ret = poll(&pfd, 1, ms);
+    if (ret < 0) {
+      return errnoToCanStatus(errno);
+    }
+
+    if (vCanRxRingPeek(hData)) {
+      return canOK;
+    }
+    if (ret == 0) {
+      break;
+    }
+    if (!infinite) {
+      timeout = vCanTimeLeft(&deadline);
+    }
+  }
+
+  return canERR_NOMSG;
+}
+
+
+//======================================================================
+// vCanRxRingRead
+// Read one message from the memory mapped receive ring, no system calls
+// are made unless the ring is empty.
+//======================================================================
+static canStatus vCanRxRingRead (HandleData *hData, unsigned long timeout,
+                                 long *id, void *msgPtr, unsigned int *dlc,
+                                 unsigned int *flag, unsigned long *time)
+{
+  VCanRxRecord *rec;
+  uint32_t tail;
+  canStatus stat;
+
+  stat = vCanRxRingWait(hData, timeout);
+  if (stat != canOK) {
+    return stat;
+  }
+
+  // vCanRxRingWait left the message at the tail
+  tail = hData->rxRing->tail;
+  rec  = &hData->rxRecords[tail & hData->rxRingMask];
+  vCanConvertRxMsg(hData, rec->id, rec->flags, rec->dlc, rec->data,
+                   rec->timeStamp, id, msgPtr, dlc, flag, time);
+  // Hand the record back to the driver
+  __atomic_store_n(&hData->rxRing->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return canOK;
+}
+
+
+//======================================================================
+// vCanRxRingFind
+// Returns the free running index of the oldest message with id in the
+// memory mapped receive ring, up to head, or head if there is none.
+//======================================================================
+static uint32_t vCanRxRingFind (HandleData *hData, long id, uint32_t head)
+{
+  uint32_t i;
+  VCanRxRecord *rec;
+
+  for (i = hData->rxRing->tail; i != head; i++) {
+    rec = &hData->rxRecords[i & hData->rxRingMask];
+    // Standard and extended ids are not told apart, as in the driver
+    if ((rec->tag == V_RECEIVE_MSG) &&
+        ((long)(rec->id & ~VCAN_EXT_MSG_ID) == id)) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+
+//======================================================================
+// vCanRxRingReadSpecific
+// Read the oldest message with id from the memory mapped receive ring.
+// Records between tail and head belong to the reader, so the records in
+// front of the message can be moved up one step to keep the ring in order.
+//======================================================================
+static canStatus vCanRxRingReadSpecific (HandleData *hData, long id, int skip,
+                                         void *msgPtr, unsigned int *dlc,
+                                         unsigned int *flag,
+                                         unsigned long *time)
+{
+  VCanRxRecord *rec;
+  uint32_t head = __atomic_load_n(&hData->rxRing->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = hData->rxRing->tail;
+  uint32_t i;
+
+  i = vCanRxRingFind(hData, id, head);
+  if (i == head) {
+    return canERR_NOMSG;
+  }
+
+  rec = &hData->rxRecords[i & hData->rxRingMask];
+  vCanConvertRxMsg(hData, rec->id, rec->flags, rec->dlc, rec->data,
+                   rec->timeStamp, NULL, msgPtr, dlc, flag, time);
+
+  if (skip == READ_SPECIFIC_SKIP_MATCHING) {
+    for (; i != tail; i--) {
+      hData->rxRecords[i & hData->rxRingMask] =
+        hData->rxRecords[(i - 1) & hData->rxRingMask];
+    }
+  }
+  // Hand the record(s) back to the driver
+  __atomic_store_n(&hData->rxRing->tail, i + 1, __ATOMIC_RELEASE);
+
+  return canOK;
+}
+
+
+//======================================================================
+// vCanRxRingWaitSpecific
+// Wait until there is a message with id in the memory mapped receive ring,
+// or timeout
+//======================================================================
+static canStatus vCanRxRingWaitSpecific (HandleData *hData, long id,
+                                         unsigned long timeout)
+{
+  VCAN_IOCTL_RX_RING_WAIT_T ringWait;
+  struct timespec deadline;
+  int infinite = (timeout == (unsigned long)-1) || (timeout == 0xFFFFFFFF);
+
+  if (!infinite) {
+    deadline = vCanDeadline(timeout);
+  }
+
+  // Other messages keep the ring from being empty, so poll would not
+  // sleep. Wait for the driver to move head on instead.
+  for (;;) {
+    ringWait.head = __atomic_load_n(&hData->rxRing->head, __ATOMIC_ACQUIRE);
+    if (vCanRxRingFind(hData, id, ringWait.head) != ringWait.head) {
+      return canOK;
+    }
+    if (!infinite) {
+      timeout = vCanTimeLeft(&deadline);
+      if (timeout == 0) {
+        return canERR_TIMEOUT;
       }
+    }
+    ringWait.timeout = infinite ? 0xFFFFFFFF : (uint32_t)timeout;
+    if (ioctl(hData->fd, VCAN_IOC_RX_RING_WAIT, &ringWait) &&
+        (errno != ETIMEDOUT)) {
+      return errnoToCanStatus(errno);
+    }
+  }
+}
 
-      if (msg.tagData.msg.flags & VCAN_MSG_FLAG_SSM_NACK) {
-        flags |= canMSG_TXNACK;
-      } else if (msg.tagData.msg.flags & VCAN_MSG_FLAG_SSM_NACK_ABL) {
-        flags |= canMSG_TXNACK;
-        flags |= canMSG_ABL;
-      } else {
-        if (msg.tagData.msg.flags & VCAN_MSG_FLAG_TXACK) {
-          flags |= canMSG_TXACK;
-        }
+
+//======================================================================
+// vCanMapRxRing
+//======================================================================
+static canStatus vCanMapRxRing (HandleData *hData, uint32_t size)
+{
+  VCAN_IOCTL_RX_RING_T ring;
+  void *map;
+
+  if (hData->rxRing) {
+    return canERR_PARAM;
+  }
+
+  ring.size    = size;
+  ring.mapSize = 0;
+  if (ioctl(hData->fd, VCAN_IOC_MAP_RX_RING, &ring)) {
+    return errnoToCanStatus(errno);
+  }
+
+  map = mmap(NULL, ring.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+             hData->fd, 0);
+  if (map == MAP_FAILED) {
+    return errnoToCanStatus(errno);
+  }
+
+  hData->rxRingBytes = ring.mapSize;
+  hData->rxRingMask  = ring.size - 1;
+  hData->rxRecords   = (VCanRxRecord *)((char *)map + VCAN_RX_RING_HDR_SIZE);
+  hData->rxRing      = map;
+
+  return canOK;
+}
+
+
+//======================================================================
+// vCanReadBatch
+//======================================================================
+static canStatus vCanReadBatch (HandleData    *hData,
+                                canMsgRecord  *msgs,
+                                unsigned int  max,
+                                unsigned int  *got,
+                                unsigned long timeout)
+{
+  int ret;
+  unsigned int i;
+  unsigned int n = 0;
+  VCAN_IOCTL_READ_BATCH_T ioctl_read_arg;
+  VCAN_EVENT events[RCV_BATCH_SIZE];
+  size_t evtSize = hData->compactEvents ? sizeof(VCAN_COMPACT_EVENT) : sizeof(VCAN_EVENT);
+  int infinite = (timeout == (unsigned long)-1) || (timeout == 0xFFFFFFFF);
+  struct timespec deadline;
+
+  if (msgs == NULL || got == NULL || max == 0) {
+    return canERR_PARAM;
+  }
+  *got = 0;
+
+  if (hData->rxRing) {
+    canStatus stat = vCanRxRingWait(hData, timeout);
+
+    if (stat != canOK) {
+      return stat;
+    }
+    while ((n < max) && (vCanRxRingRead(hData, 0, &msgs[n].id, msgs[n].data,
+                                        &msgs[n].dlc, &msgs[n].flags,
+                                        &msgs[n].time) == canOK)) {
+      n++;
+    }
+    *got = n;
+    return canOK;
+  }
+
+  ioctl_read_arg.timeout = timeout;
+  ioctl_read_arg.msg     = events;
+  if (timeout && !infinite) {
+    deadline = vCanDeadline(timeout);
+  }
+
+  while (n < max) {
+    ioctl_read_arg.max   = (max - n < RCV_BATCH_SIZE) ? max - n : RCV_BATCH_SIZE;
+    ioctl_read_arg.count = 0;
+    ret = ioctl(hData->fd, VCAN_IOC_RECVMSG_BATCH, &ioctl_read_arg);
+    if (ret != 0) {
+      if (n > 0) {
+        break;
       }
+      return errnoToCanStatus(errno);
+    }
 
-      // Copy data unless remote request
-      if (msgPtr && !(flags & canMSG_RTR)) {
-        for (i = 0; i < count; i++)
-          ((unsigned char *)msgPtr)[i] = msg.tagData.msg.data[i];
+    for (i = 0; i < ioctl_read_arg.count; i++) {
+      // Events are packed, and a compact event is the start of a VCAN_EVENT
+      const VCAN_EVENT *e = (const VCAN_EVENT *)((const char *)events + i * evtSize);
+
+      // Only CAN messages are returned, other events are dropped
+      if (e->tag == V_RECEIVE_MSG) {
+        vCanConvertRxMsg(hData, e->tagData.msg.id, e->tagData.msg.flags,
+                         e->tagData.msg.dlc, e->tagData.msg.data,
+                         e->timeStamp, &msgs[n].id, msgs[n].data,
+                         &msgs[n].dlc, &msgs[n].flags, &msgs[n].time);
+        n++;
       }
+    }
 
-      // MSb is extended flag
-      if (id)   *id   = msg.tagData.msg.id & ~EXT_MSG;
-      if (dlc) {
-        if (hData->acceptLargeDlc && !(flags & canFDMSG_FDF)) {
-          *dlc = msg.tagData.msg.dlc;
-        }
-        else {
-          *dlc  = count;
-        }
+    // Only wait for the first message, and if only other events arrived
+    // wait for what is left of the timeout
+    if (n > 0) {
+      ioctl_read_arg.timeout = 0;
+    }
+    else if (timeout && !infinite) {
+      ioctl_read_arg.timeout = vCanTimeLeft(&deadline);
+    }
+    if ((n > 0) && (ioctl_read_arg.count < ioctl_read_arg.max)) {
+      break;
+    }
+  }
+
+  *got = n;
+  return canOK;
+}
+
+
+//======================================================================
+// vCanReadLatest
+//======================================================================
+static canStatus vCanReadLatest (HandleData    *hData,
+                                 long          id,
+                                 void          *msgPtr,
+                                 unsigned int  *dlc,
+                                 unsigned int  *flag,
+                                 unsigned long *time,
+                                 unsigned long *updates)
+{
+  VCAN_IOCTL_MAILBOX_READ_T ioctl_read;
+
+  // canLATEST_EXT_ID is the driver's VCAN_EXT_MSG_ID
+  ioctl_read.id = (uint32_t)id;
+  if (ioctl(hData->fd, VCAN_IOC_READ_MAILBOX, &ioctl_read)) {
+    return errnoToCanStatus(errno);
+  }
+
+  vCanConvertRxMsg(hData, ioctl_read.rec.id, ioctl_read.rec.flags,
+                   ioctl_read.rec.dlc, ioctl_read.rec.data,
+                   (unsigned long)ioctl_read.rec.timeStamp,
+                   NULL, msgPtr, dlc, flag, time);
+  if (updates) *updates = ioctl_read.rec.updates;
+
+  return canOK;
+}
+
+
+//======================================================================
+// vCanSnapshot
+//======================================================================
+static canStatus vCanSnapshot (HandleData      *hData,
+                               canLatestRecord *recs,
+                               unsigned int    max,
+                               unsigned int    *got)
+{
+  unsigned int i;
+  unsigned int n = 0;
+  VCAN_IOCTL_MAILBOX_SNAPSHOT_T ioctl_snap;
+  VCanMailboxRecord rec[RCV_BATCH_SIZE];
+
+  if (recs == NULL || got == NULL) {
+    return canERR_PARAM;
+  }
+  *got = 0;
+
+  ioctl_snap.rec = rec;
+  while (n < max) {
+    ioctl_snap.max   = (max - n < RCV_BATCH_SIZE) ? max - n : RCV_BATCH_SIZE;
+    ioctl_snap.count = 0;
+    if (ioctl(hData->fd, VCAN_IOC_MAILBOX_SNAPSHOT, &ioctl_snap)) {
+      if (n > 0) {
+        break;
       }
-      if (time) *time = (msg.timeStamp * 10UL) / (hData->timerResolution) ;
-      if (flag) *flag = flags;
+      return errnoToCanStatus(errno);
+    }
 
+    for (i = 0; i < ioctl_snap.count; i++, n++) {
+      vCanConvertRxMsg(hData, rec[i].id, rec[i].flags, rec[i].dlc,
+                       rec[i].data, (unsigned long)rec[i].timeStamp,
+                       &recs[n].id, recs[n].data, &recs[n].dlc,
+                       &recs[n].flags, &recs[n].time);
+      recs[n].updates = rec[i].updates;
+    }
+
+    if (ioctl_snap.count < ioctl_snap.max) {
       break;
     }
   }
 
+  *got = n;
   return canOK;
 }
 
@@ -1019,6 +1585,10 @@ static canStatus vCanRead (HandleData    *hData,
 {
   VCanRead read;
 
+  if (hData->rxRing) {
+    return vCanRxRingRead(hData, 0, id, msgPtr, dlc, flag, time);
+  }
+
   memset(&read, 0, sizeof(VCanRead));
   read.timeout = 0;
   return vCanReadInternal(hData, VCAN_IOC_RECVMSG, &read,
@@ -1033,6 +1603,11 @@ static canStatus vCanReadSync (HandleData    *hData,
 {
   int ret;
 
+  if (hData->rxRing) {
+    canStatus stat = vCanRxRingWait(hData, timeout);
+    return (stat == canERR_NOMSG) ? canERR_TIMEOUT : stat;
+  }
+
   ret = ioctl(hData->fd, VCAN_IOC_RECVMSG_SYNC, &timeout);
   if (ret != 0) {
     return errnoToCanStatus(errno);
@@ -1053,6 +1628,11 @@ static canStatus vCanReadSpecific (HandleData    *hData,
 {
   VCanRead read;
 
+  if (hData->rxRing) {
+    return vCanRxRingReadSpecific(hData, id, READ_SPECIFIC_SKIP_MATCHING,
+                                  msgPtr, dlc, flag, time);
+  }
+
   read.specific.skip = READ_SPECIFIC_SKIP_MATCHING;
   read.specific.id   = id;
   read.timeout       = 0;
@@ -1073,6 +1653,11 @@ static canStatus vCanReadSpecificSkip (HandleData    *hData,
 {
   VCanRead read;
 
+  if (hData->rxRing) {
+    return vCanRxRingReadSpecific(hData, id, READ_SPECIFIC_SKIP_PRECEEDING,
+                                  msgPtr, dlc, flag, time);
+  }
+
   read.specific.skip = READ_SPECIFIC_SKIP_PRECEEDING;
   read.specific.id   = id;
   read.timeout       = 0;
@@ -1090,6 +1675,10 @@ static canStatus vCanReadSyncSpecific (HandleData    *hData,
 {
   VCanRead read;
 
+  if (hData->rxRing) {
+    return vCanRxRingWaitSpecific(hData, id, timeout);
+  }
+
   read.specific.skip = READ_SPECIFIC_NO_SKIP;
   read.specific.id   = id;
   read.timeout       = timeout;
@@ -1111,6 +1700,10 @@ static canStatus vCanReadWait (HandleData    *hData,
 {
   VCanRead read;
 
+  if (hData->rxRing) {
+    return vCanRxRingRead(hData, timeout, id, msgPtr, dlc, flag, time);
+  }
+
   memset(&read, 0, sizeof(VCanRead));
   read.timeout = timeout;
   return vCanReadInternal(hData, VCAN_IOC_RECVMSG, &read,
@@ -1488,19 +2081,62 @@ static canStatus vCanAccept(HandleData *hData,
 
 
 //======================================================================
-// vCanWriteInternal
+// vCanSetIdFilter
 //======================================================================
-static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
-                                   unsigned int dlc, unsigned int flag)
+static canStatus vCanSetIdFilter (HandleData *hData,
+                                  const unsigned int *stdIds,
+                                  unsigned int stdCount,
+                                  const canIdRange *extRanges,
+                                  unsigned int extCount,
+                                  unsigned int extMask)
 {
-  CAN_MSG msg;
-
+  VCAN_IOCTL_ID_FILTER_T filter;
+  unsigned int i;
   int ret;
+
+  memset(&filter, 0, sizeof(filter));
+  if (stdIds) {
+    filter.flags |= VCAN_ID_FILTER_STD;
+    for (i = 0; i < stdCount; i++) {
+      if (stdIds[i] > 0x7FF) {
+        return canERR_PARAM;
+      }
+      filter.stdBitmap[stdIds[i] / 32] |= 1u << (stdIds[i] % 32);
+    }
+  }
+  if (extRanges) {
+    if (extCount > VCAN_ID_FILTER_MAX_RANGES) {
+      return canERR_PARAM;
+    }
+    filter.flags    |= VCAN_ID_FILTER_EXT;
+    filter.extMask   = extMask;
+    filter.extCount  = extCount;
+    // canIdRange has the same layout as VCanIdRange
+    filter.extRanges = (VCanIdRange *)extRanges;
+  }
+
+  ret = ioctl(hData->fd, VCAN_IOC_SET_ID_FILTER, &filter);
+  if (ret != 0) {
+    return errnoToCanStatus(errno);
+  }
+
+  return canOK;
+}
+
+
+//======================================================================
+// vCanBuildMsg
+// Validate a message and translate it to driver format
+//======================================================================
+static canStatus vCanBuildMsg(HandleData *hData, CAN_MSG *msg, long id,
+                              const void *msgPtr, unsigned int dlc,
+                              unsigned int flag)
+{
   unsigned char sendExtended;
   unsigned int nbytes;
   unsigned int dlcFD;
 
-  msg.flags = 0;
+  msg->flags = 0;
 
   if      (flag & canMSG_STD) sendExtended = 0;
   else if (flag & canMSG_EXT) sendExtended = 1;
@@ -1511,13 +2147,13 @@ static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
       DEBUGPRINT((TXT("canERR_PARAM on line %d\n"), __LINE__));  // Was 3,
       return canERR_PARAM;
     }
-    msg.id = (id | EXT_MSG);
+    msg->id = (id | EXT_MSG);
   } else {
     if (id >= (1 << 11)) {
       DEBUGPRINT((TXT("canERR_PARAM on line %d\n"), __LINE__));  // Was 3,
       return canERR_PARAM;
     }
-    msg.id = id;
+    msg->id = id;
   }
 
   if (!dlc_is_dlc_ok (hData->acceptLargeDlc, (flag & canFDMSG_FDF), dlc)) {
@@ -1526,7 +2162,7 @@ static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
 
   if (flag & canFDMSG_FDF) {
     if (hData->openMode) {
-      msg.flags |= VCAN_MSG_FLAG_FDF;
+      msg->flags |= VCAN_MSG_FLAG_FDF;
     } else {
       return canERR_PARAM;
     }
@@ -1535,7 +2171,7 @@ static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
       return canERR_PARAM;
     }
 
-    if (flag & canFDMSG_BRS)  msg.flags |= VCAN_MSG_FLAG_BRS;
+    if (flag & canFDMSG_BRS)  msg->flags |= VCAN_MSG_FLAG_BRS;
 
     dlcFD  = dlc_bytes_to_dlc_fd (dlc);
     nbytes = dlc_dlc_to_bytes_fd (dlcFD);
@@ -1545,7 +2181,7 @@ static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
       return canERR_PARAM;
     }
 
-    if (flag & canMSG_RTR) msg.flags |= VCAN_MSG_FLAG_REMOTE_FRAME;
+    if (flag & canMSG_RTR) msg->flags |= VCAN_MSG_FLAG_REMOTE_FRAME;
 
     nbytes = dlc > 8 ? 8   : dlc;
     dlcFD  = dlc > 15 ? 15 : dlc;
@@ -1561,16 +2197,47 @@ static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
       return canERR_NOT_SUPPORTED;
     }
     else {
-      msg.flags |= VCAN_MSG_FLAG_SINGLE_SHOT;
+      msg->flags |= VCAN_MSG_FLAG_SINGLE_SHOT;
     }
   }
 
-  msg.length = dlcFD;
+  msg->length = dlcFD;
 
-  if (flag & canMSG_ERROR_FRAME) msg.flags |= VCAN_MSG_FLAG_ERROR_FRAME;
+  if (flag & canMSG_ERROR_FRAME) msg->flags |= VCAN_MSG_FLAG_ERROR_FRAME;
 
   if (msgPtr) {
-    memcpy(msg.data, msgPtr, nbytes);
+    memcpy(msg->data, msgPtr, nbytes);
+  }
+
+  return canOK;
+}
+
+
+//======================================================================
+// vCanWriteStatus
+// Status for a failed transmit ioctl. The driver returns EAGAIN both
+// when the transmit queue is full and when the handle is not bus on.
+//======================================================================
+static canStatus vCanWriteStatus (int err)
+{
+  if (err == EAGAIN) return canERR_TXBUFOFL;
+  else               return errnoToCanStatus(err);
+}
+
+
+//======================================================================
+// vCanWriteInternal
+//======================================================================
+static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
+                                   unsigned int dlc, unsigned int flag)
+{
+  CAN_MSG msg;
+  canStatus stat;
+  int ret;
+
+  stat = vCanBuildMsg(hData, &msg, id, msgPtr, dlc, flag);
+  if (stat != canOK) {
+    return stat;
   }
 
   ret = ioctl(hData->fd, VCAN_IOC_SENDMSG, &msg);
@@ -1589,9 +2256,8 @@ static canStatus vCanWriteInternal(HandleData *hData, long id, void *msgPtr,
   }
 #endif
 
-  if      (ret   == 0)       return canOK;
-  else if (errno == EAGAIN)  return canERR_TXBUFOFL;
-  else                       return errnoToCanStatus(errno);
+  if (ret == 0) return canOK;
+  else          return vCanWriteStatus(errno);
 }
 
 
@@ -1605,6 +2271,66 @@ static canStatus vCanWrite (HandleData *hData, long id, void *msgPtr,
 }
 
 
+//======================================================================
+// vCanWriteBatch
+//======================================================================
+static canStatus vCanWriteBatch (HandleData *hData, const canMsgRecord *msgs,
+                                 unsigned int count, unsigned int *sent)
+{
+  int ret;
+  unsigned int i;
+  unsigned int n = 0;
+  canStatus stat = canOK;
+  VCAN_IOCTL_WRITE_BATCH_T ioctl_write_arg;
+  CAN_MSG msg[TX_BATCH_SIZE];
+
+  if (msgs == NULL || sent == NULL) {
+    return canERR_PARAM;
+  }
+  *sent = 0;
+
+  ioctl_write_arg.msg = msg;
+
+  while (n < count) {
+    ioctl_write_arg.count = 0;
+    for (i = 0; (i < TX_BATCH_SIZE) && (n + i < count); i++) {
+      const canMsgRecord *rec = &msgs[n + i];
+
+      stat = vCanBuildMsg(hData, &msg[i], rec->id, rec->data, rec->dlc,
+                          rec->flags);
+      if (stat != canOK) {
+        break;
+      }
+      ioctl_write_arg.count++;
+    }
+
+    if (ioctl_write_arg.count > 0) {
+      ioctl_write_arg.sent = 0;
+      ret = ioctl(hData->fd, VCAN_IOC_SENDMSG_BATCH, &ioctl_write_arg);
+      if (ret != 0) {
+        // Same status as vCanWrite() for every error, including a
+        // handle that is not bus on
+        stat = vCanWriteStatus(errno);
+        break;
+      }
+      n += ioctl_write_arg.sent;
+      if (ioctl_write_arg.sent < ioctl_write_arg.count) {
+        // The transmit queue is full
+        stat = canERR_TXBUFOFL;
+        break;
+      }
+    }
+
+    if (stat != canOK) {
+      break;
+    }
+  }
+
+  *sent = n;
+  return stat;
+}
+
+
 //======================================================================
 // vCanWriteSync
 //======================================================================
@@ -1827,6 +2553,158 @@ static canStatus vCanRequestChipStatus (HandleData *hData)
   return canOK;
 }
 
+//======================================================================
+// Channel data cache
+//
+// The items in VCAN_IOCTL_CHANNEL_DATA_T do not change while a card is
+// present. They are fetched with one ioctl the first time any of them is
+// asked for, and kept until the channel list generation changes. The
+// generation is read from the driver on every lookup, as a card may have
+// been replaced by another one on the same minor number.
+//======================================================================
+#define CHANNEL_DATA_CACHE_SIZE 128   // As many as in the channel list
+
+typedef struct {
+  char                      deviceName[DEVICE_NAME_LEN];
+  VCAN_IOCTL_CHANNEL_DATA_T data;
+} ChannelDataCacheEntry;
+
+static ChannelDataCacheEntry channelDataCache[CHANNEL_DATA_CACHE_SIZE];
+static unsigned int          channelDataCacheCount = 0;
+static unsigned int          channelDataCacheGeneration;
+static pthread_mutex_t       channelDataCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns 1 if data was filled in, 0 if the items must be fetched one by one
+static int getCachedChannelData (const char *deviceName,
+                                 VCAN_IOCTL_CHANNEL_DATA_T *data)
+{
+  unsigned int generation;
+  unsigned int i;
+  int          fd;
+  int          found = 0;
+
+  // Without a generation there is no telling when the cache is stale
+  if (ccl_get_generation(&generation) != canOK) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&channelDataCacheMutex);
+  if (generation != channelDataCacheGeneration) {
+    channelDataCacheCount      = 0;
+    channelDataCacheGeneration = generation;
+  }
+
+  for (i = 0; i < channelDataCacheCount; i++) {
+    if (strcmp(channelDataCache[i].deviceName, deviceName) == 0) {
+      *data = channelDataCache[i].data;
+      found = 1;
+      break;
+    }
+  }
+
+  if (!found) {
+    fd = open(deviceName, O_RDONLY);
+    if (fd != -1) {
+      // Fails with older drivers
+      if (ioctl(fd, VCAN_IOC_GET_CHANNEL_DATA, data) == 0) {
+        found = 1;
+        if (channelDataCacheCount < CHANNEL_DATA_CACHE_SIZE &&
+            strlen(deviceName) < sizeof(channelDataCache[0].deviceName)) {
+          strcpy(channelDataCache[channelDataCacheCount].deviceName, deviceName);
+          channelDataCache[channelDataCacheCount].data = *data;
+          channelDataCacheCount++;
+        }
+      }
+      close(fd);
+    }
+  }
+  pthread_mutex_unlock(&channelDataCacheMutex);
+
+  return found;
+}
+
+static canStatus copyCachedChannelData (const VCAN_IOCTL_CHANNEL_DATA_T *data,
+                                        int item, void *buffer, size_t bufsize)
+{
+  switch (item) {
+  case canCHANNELDATA_CARD_NUMBER:
+    if (bufsize < 4) {
+      return canERR_PARAM;
+    }
+    *(uint32_t *)buffer = data->cardNumber;
+    break;
+
+  case canCHANNELDATA_CARD_SERIAL_NO:
+    if (bufsize < 8) {
+      return canERR_PARAM;
+    }
+    memcpy(buffer, data->serial, 8);
+    break;
+
+  case canCHANNELDATA_CARD_UPC_NO:
+    if (bufsize < 8) {
+      return canERR_PARAM;
+    }
+    memcpy(buffer, data->ean, 8);
+    break;
+
+  case canCHANNELDATA_DRIVER_NAME:
+    if (bufsize < MAX_IOCTL_DRIVER_NAME + 1) {
+      return canERR_PARAM;
+    }
+    memcpy(buffer, data->driverName, MAX_IOCTL_DRIVER_NAME + 1);
+    break;
+
+  case canCHANNELDATA_CARD_FIRMWARE_REV:
+    if (bufsize < 8) {
+      return canERR_PARAM;
+    }
+    memcpy(buffer, data->firmwareRev, 8);
+    break;
+
+  case canCHANNELDATA_CARD_HARDWARE_REV:
+    if (bufsize < 8) {
+      return canERR_PARAM;
+    }
+    memcpy(buffer, data->hardwareRev, 8);
+    break;
+
+  case canCHANNELDATA_CHANNEL_CAP:
+    if (bufsize < 4) {
+      return canERR_PARAM;
+    }
+    *(uint32_t *)buffer = get_capabilities(data->capabilities);
+    break;
+
+  case canCHANNELDATA_CHANNEL_CAP_MASK:
+    if (bufsize < 4) {
+      return canERR_PARAM;
+    }
+    *(uint32_t *)buffer = get_capabilities(data->capabilitiesMask);
+    break;
+
+  case canCHANNELDATA_CHANNEL_CAP_EX:
+    if (bufsize < 16) {
+      return canERR_PARAM;
+    }
+    ((uint64_t *)buffer)[0] = get_capabilities_ex(data->capabilitiesEx[0]);
+    ((uint64_t *)buffer)[1] = get_capabilities_ex(data->capabilitiesEx[1]);
+    break;
+
+  case canCHANNELDATA_CARD_TYPE:
+    if (bufsize < 4) {
+      return canERR_PARAM;
+    }
+    *(uint32_t *)buffer = data->cardType;
+    break;
+
+  default:
+    return canERR_PARAM;
+  }
+
+  return canOK;
+}
+
 //======================================================================
 // vCanGetChannelData
 //======================================================================
@@ -1835,6 +2713,27 @@ static canStatus vCanGetChannelData (char *deviceName, int item,
 {
   int fd = -1;
   int err = canOK;
+  VCAN_IOCTL_CHANNEL_DATA_T data;
+
+  switch (item) {
+    case canCHANNELDATA_CARD_NUMBER:
+    case canCHANNELDATA_CARD_SERIAL_NO:
+    case canCHANNELDATA_CARD_UPC_NO:
+    case canCHANNELDATA_DRIVER_NAME:
+    case canCHANNELDATA_CARD_FIRMWARE_REV:
+    case canCHANNELDATA_CARD_HARDWARE_REV:
+    case canCHANNELDATA_CHANNEL_CAP:
+    case canCHANNELDATA_CHANNEL_CAP_MASK:
+    case canCHANNELDATA_CHANNEL_CAP_EX:
+    case canCHANNELDATA_CARD_TYPE:
+      if (getCachedChannelData(deviceName, &data)) {
+        return copyCachedChannelData(&data, item, buffer, bufsize);
+      }
+      break;
+
+    default:
+      break;
+  }
 
   /* If, at the end, err is not canOK, return that err.  Otherwise, if
      errno is not 0, return a canlib error for that code.  On any
@@ -2201,6 +3100,11 @@ static canStatus vCanIoCtl(HandleData *hData, unsigned int func,
     if (ioctl(hData->fd, VCAN_IOC_FLUSH_RCVBUFFER, buf)) {
       return errnoToCanStatus(errno);
     }
+    if (hData->rxRing) {
+      __atomic_store_n(&hData->rxRing->tail,
+                       __atomic_load_n(&hData->rxRing->head, __ATOMIC_ACQUIRE),
+                       __ATOMIC_RELEASE);
+    }
     break;
   case canIOCTL_FLUSH_TX_BUFFER:
     //  Discard the current contents of the TX queue.
@@ -2356,6 +3260,156 @@ static canStatus vCanIoCtl(HandleData *hData, unsigned int func,
       break;
     }
 
+  case canIOCTL_MAP_RX_RING:
+    // buf points at a uint32_t with the number of messages the ring
+    // should hold, or 0 for the default size.
+    if (check_args (buf, buflen, sizeof (uint32_t), ERROR_WHEN_NEQ)) {
+      return canERR_PARAM;
+    }
+
+    return vCanMapRxRing(hData, *(uint32_t *)buf);
+
+  case canIOCTL_SET_RX_QUEUE_SIZE:
+    // buf points at a uint32_t with the new receive queue size, or 0 for
+    // the default size.
+    if (check_args (buf, buflen, sizeof (uint32_t), ERROR_WHEN_NEQ)) {
+      return canERR_PARAM;
+    }
+
+    if (ioctl(hData->fd, VCAN_IOC_SET_RX_QUEUE_SIZE, buf)) {
+      return errnoToCanStatus(errno);
+    }
+    break;
+
+  case canIOCTL_GET_RX_QUEUE_HIGH_WATER:
+    // buf points at a uint32_t which receives the highest RX queue level
+    // seen since the queue was last flushed or resized.
+    if (check_args (buf, buflen, sizeof (uint32_t), ERROR_WHEN_NEQ)) {
+      return canERR_PARAM;
+    }
+
+    if (ioctl(hData->fd, VCAN_IOC_GET_RX_QUEUE_HIGH_WATER, buf)) {
+      return errnoToCanStatus(errno);
+    }
+    break;
+
+  case canIOCTL_SET_RX_WAKEUP:
+    {
+      VCAN_IOCTL_RX_WAKEUP_T wakeup;
+
+      if (check_args (buf, buflen, sizeof (canRxWakeup), ERROR_WHEN_NEQ)) {
+        return canERR_PARAM;
+      }
+
+      wakeup.count   = ((canRxWakeup *)buf)->count;
+      wakeup.delayUs = ((canRxWakeup *)buf)->delayUs;
+      if (ioctl(hData->fd, VCAN_IOC_SET_RX_WAKEUP, &wakeup)) {
+        return errnoToCanStatus(errno);
+      }
+      break;
+    }
+
+  case canIOCTL_GET_BUS_STATISTICS_EX:
+    {
+      VCAN_IOCTL_BUS_STATS_EX_T  tstat;
+      canBusStatisticsEx        *stat = (canBusStatisticsEx *)buf;
+      int                        i;
+
+      if (check_args (buf, buflen, sizeof (canBusStatisticsEx), ERROR_WHEN_NEQ)) {
+        return canERR_PARAM;
+      }
+
+      tstat.idCount = stat->idCount;
+      if (ioctl(hData->fd, VCAN_IOC_GET_BUS_STATS_EX, &tstat)) {
+        return errnoToCanStatus(errno);
+      }
+
+      memset(&stat->stat, 0, sizeof(stat->stat));
+      stat->stat.stdData   = tstat.stats.stdData;
+      stat->stat.stdRemote = tstat.stats.stdRemote;
+      stat->stat.extData   = tstat.stats.extData;
+      stat->stat.extRemote = tstat.stats.extRemote;
+      stat->stat.errFrame  = tstat.stats.errFrame;
+      stat->stat.busLoad   = tstat.stats.busLoad;
+      stat->stat.overruns  = tstat.stats.overruns;
+      for (i = 0; i < canBUS_STATISTICS_INTERVALS; i++) {
+        stat->interval[i] = tstat.interval[i];
+      }
+      break;
+    }
+
+  case canIOCTL_SET_ID_MONITOR:
+    // buf points at a uint32_t with the number of ids to monitor, or 0 to
+    // stop monitoring.
+    if (check_args (buf, buflen, sizeof (uint32_t), ERROR_WHEN_NEQ)) {
+      return canERR_PARAM;
+    }
+
+    if (ioctl(hData->fd, VCAN_IOC_SET_ID_MONITOR, buf)) {
+      return errnoToCanStatus(errno);
+    }
+    break;
+
+  case canIOCTL_GET_ID_MONITOR:
+    {
+      VCAN_IOCTL_ID_MONITOR_T  req;
+      canIdMonitor            *mon = (canIdMonitor *)buf;
+      unsigned int             n;
+      int                      i;
+
+      if (check_args (buf, buflen, sizeof (canIdMonitor), ERROR_WHEN_NEQ)) {
+        return canERR_PARAM;
+      }
+      if (mon->max && mon->recs == NULL) {
+        return canERR_PARAM;
+      }
+
+      req.max = mon->max;
+      req.rec = NULL;
+      if (req.max) {
+        req.rec = malloc(req.max * sizeof(VCanIdMonitorRecord));
+        if (req.rec == NULL) {
+          return canERR_NOMEM;
+        }
+      }
+      if (ioctl(hData->fd, VCAN_IOC_GET_ID_MONITOR, &req)) {
+        free(req.rec);
+        return errnoToCanStatus(errno);
+      }
+
+      for (n = 0; n < req.count; n++) {
+        VCanIdMonitorRecord *rec = &req.rec[n];
+        canIdMonitorRecord  *out = &mon->recs[n];
+
+        vCanConvertRxMsg(hData, rec->id, 0, 0, NULL,
+                         (unsigned long)rec->lastTime,
+                         &out->id, NULL, NULL, &out->flags, &out->time);
+        out->count       = rec->count;
+        out->minInterval = rec->minInterval * 10;
+        out->maxInterval = rec->maxInterval * 10;
+        for (i = 0; i < VCAN_BUS_HIST_BUCKETS; i++) {
+          out->interval[i] = rec->interval[i];
+        }
+      }
+      mon->count   = req.count;
+      mon->ids     = req.nIds;
+      mon->dropped = req.dropped;
+      free(req.rec);
+      break;
+    }
+
+  case canIOCTL_SET_LATEST_VALUE_MODE:
+    // buf points at a uint32_t with the number of ids to keep the latest
+    // message for, or 0 to queue all messages again.
+    if (check_args (buf, buflen, sizeof (uint32_t), ERROR_WHEN_NEQ)) {
+      return canERR_PARAM;
+    }
+
+    if (ioctl(hData->fd, VCAN_IOC_SET_MAILBOX, buf)) {
+      return errnoToCanStatus(errno);
+    }
+    break;
+
    case canIOCTL_SET_BUSON_TIME_AUTO_RESET:
     {
       if (check_args (buf, buflen, sizeof (uint32_t), ERROR_WHEN_NEQ)) {
@@ -2746,6 +3800,9 @@ CANOps vCanOps = {
   .getBusStats              = vCanGetBusStats,
   .read                = vCanRead,
   .readSync            = vCanReadSync,
+  .readBatch           = vCanReadBatch,
+  .readLatest          = vCanReadLatest,
+  .snapshot            = vCanSnapshot,
   .readWait            = vCanReadWait,
   .readSpecific        = vCanReadSpecific,
   .readSpecificSkip    = vCanReadSpecificSkip,
@@ -2777,7 +3834,9 @@ CANOps vCanOps = {
   .kvScriptGetText     = vCanScriptGetText,  
   .kvScriptStatus      = vCanScriptStatus,
   .accept              = vCanAccept,
+  .setIdFilter         = vCanSetIdFilter,
   .write               = vCanWrite,
+  .writeBatch          = vCanWriteBatch,
   .writeWait           = vCanWriteWait,
   .writeSync           = vCanWriteSync,
   .readTimer           = vCanReadTimer,
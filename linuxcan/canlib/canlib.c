@@ -87,6 +87,7 @@
 #include <pthread.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "canlib_channel_list.h"
 
@@ -454,6 +455,10 @@ int CANLIBAPI canClose (const CanHandle hnd)
     return canERR_INVHANDLE;
   }
 
+  if (hData->rxRing) {
+    munmap(hData->rxRing, hData->rxRingBytes);
+  }
+
   if (close(hData->fd) != 0) {
     return canERR_INVHANDLE;
   }
@@ -905,6 +910,25 @@ canStatus CANLIBAPI canSetAcceptanceFilter(const CanHandle hnd,
   return canERR_NOT_IMPLEMENTED;
 }
 
+/***************************************************************************/
+canStatus CANLIBAPI canSetIdFilter (const CanHandle hnd,
+                                    const unsigned int *stdIds,
+                                    unsigned int stdCount,
+                                    const canIdRange *extRanges,
+                                    unsigned int extCount,
+                                    unsigned int extMask)
+{
+  HandleData *hData;
+
+  hData = findHandle(hnd);
+  if (hData == NULL) {
+    return canERR_INVHANDLE;
+  }
+
+  return hData->canOps->setIdFilter(hData, stdIds, stdCount,
+                                    extRanges, extCount, extMask);
+}
+
 //******************************************************
 // Read bus status
 //******************************************************
@@ -999,6 +1023,24 @@ canWrite (const CanHandle hnd, long id, void *msgPtr,
 }
 
 
+//******************************************************
+// Write several can messages
+//******************************************************
+canStatus CANLIBAPI
+canWriteBatch (const CanHandle hnd, const canMsgRecord *msgs,
+               unsigned int count, unsigned int *sent)
+{
+  HandleData *hData;
+
+  hData = findHandle(hnd);
+  if (hData == NULL) {
+    return canERR_INVHANDLE;
+  }
+
+  return hData->canOps->writeBatch(hData, msgs, count, sent);
+}
+
+
 //******************************************************
 // Write can message and wait
 //******************************************************
@@ -1039,6 +1081,57 @@ canRead (const CanHandle hnd, long *id, void *msgPtr, unsigned int *dlc,
   return hData->canOps->read(hData, id, msgPtr, dlc, flag, time);
 }
 
+//******************************************************
+// Read several can messages
+//******************************************************
+canStatus CANLIBAPI
+canReadBatch (const CanHandle hnd, canMsgRecord *msgs, unsigned int max,
+              unsigned int *got, unsigned long timeout)
+{
+  HandleData *hData;
+
+  hData = findHandle(hnd);
+  if (hData == NULL) {
+    return canERR_INVHANDLE;
+  }
+
+  return hData->canOps->readBatch(hData, msgs, max, got, timeout);
+}
+
+//******************************************************
+// Read the latest can message with a specific id
+//******************************************************
+canStatus CANLIBAPI
+canReadLatest (const CanHandle hnd, long id, void *msgPtr, unsigned int *dlc,
+               unsigned int *flag, unsigned long *time, unsigned long *updates)
+{
+  HandleData *hData;
+
+  hData = findHandle(hnd);
+  if (hData == NULL) {
+    return canERR_INVHANDLE;
+  }
+
+  return hData->canOps->readLatest(hData, id, msgPtr, dlc, flag, time, updates);
+}
+
+//******************************************************
+// Read the latest values that changed since last call
+//******************************************************
+canStatus CANLIBAPI
+canSnapshot (const CanHandle hnd, canLatestRecord *recs, unsigned int max,
+             unsigned int *got)
+{
+  HandleData *hData;
+
+  hData = findHandle(hnd);
+  if (hData == NULL) {
+    return canERR_INVHANDLE;
+  }
+
+  return hData->canOps->snapshot(hData, recs, max, got);
+}
+
 //*********************************************************
 // Reads a message with the specified identifier (if available). Any
 // preceeding message not matching the specified identifier will be retained
@@ -2887,21 +2980,8 @@ canSetNotify (const CanHandle hnd, void (*callback)(canNotifyData *),
     return canERR_INVHANDLE;
   }
   if (notifyFlags == 0 || callback == NULL) {
-    if (hData->notifyFd != canINVALID_HANDLE) {
-      // We want to shut off notification, close file and clear callback
-
-      pthread_cancel(hData->notifyThread);
-
-      // Wait for thread to finish
-      pthread_join(hData->notifyThread, NULL);
-
-      if (hData->notifyFd != canINVALID_HANDLE) {
-        close(hData->notifyFd);
-      }
-      hData->notifyFd = canINVALID_HANDLE;
-    }
-
-    return canOK;
+    // Shut off notification
+    return hData->canOps->setNotify(hData, NULL, NULL, 0);
   }
 
   hData->notifyData.tag = tag;
@@ -2926,26 +3006,32 @@ kvStatus CANLIBAPI kvSetNotifyCallback(const CanHandle hnd,
     return canERR_INVHANDLE;
   }
   if (notifyFlags == 0 || callback == NULL) {
-    if (hData->notifyFd != canINVALID_HANDLE) {
-      // We want to shut off notification, close file and clear callback
+    // Shut off notification
+    return hData->canOps->setNotify(hData, NULL, NULL, 0);
+  }
 
-      pthread_cancel(hData->notifyThread);
+  hData->notifyData.tag = context;
 
-      // Wait for thread to finish
-      pthread_join(hData->notifyThread, NULL);
+  return hData->canOps->setNotify(hData, NULL, callback, notifyFlags);
+}
 
-      if (hData->notifyFd != canINVALID_HANDLE) {
-        close(hData->notifyFd);
-      }
-      hData->notifyFd = canINVALID_HANDLE;
-    }
+kvStatus CANLIBAPI kvGetEventFd (const CanHandle hnd, int *fd)
+{
+  HandleData *hData;
 
-    return canOK;
+  if (fd == NULL) {
+    return canERR_PARAM;
   }
 
-  hData->notifyData.tag = context;
+  hData = findHandle(hnd);
+  if (hData == NULL) {
+    return canERR_INVHANDLE;
+  }
 
-  return hData->canOps->setNotify(hData, NULL, callback, notifyFlags);
+  // The driver reports the handle readable from vCanPoll()
+  *fd = hData->fd;
+
+  return canOK;
 }
 
 
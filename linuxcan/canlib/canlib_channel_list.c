@@ -69,6 +69,8 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "canlib.h"
 #include "vcan_ioctl.h"
 #include "canlib_channel_list.h"
@@ -85,6 +87,16 @@ static const char *off_name[] = {"LAPcan", "PCIcan", "PCIcanII",
                                  "PCIe CAN",
                                  "VIRTUALcan"}; // Virtual channels should always be last
 
+// Listing of all present channels, maintained by the kernel driver.
+// Its first line holds a generation number that changes whenever a card
+// is added or removed, so the sorted list is cached until then.
+#define CCL_PROC_NAME "/proc/kvaser_channels"
+
+static pthread_mutex_t ccl_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ccl_class       ccl_cache;
+static int             ccl_cache_valid = 0;
+static unsigned int    ccl_cache_generation;
+
 
 int cmpfunc_ean (const void * a, const void * b) {
   //skip virtual as the always are last in the list with driver names
@@ -115,11 +127,13 @@ int cmpfunc_snr (const void * a, const void * b) {
   }
 }
 
-canStatus ccl_get_channel_list (ccl_class *self)
+//
+// Open every possible device node of every driver.
+// Only used when the kernel does not provide the channel list.
+//
+static canStatus ccl_scan_devices (ccl_class *self)
 {
-  uint32_t    driver_index, minor_index, index;
-  int         number_on_card = 0;
-  ccl_channel prev_channel;
+  uint32_t    driver_index, minor_index;
   uint32_t    max_nof_channel = (uint32_t)(sizeof(self->channel)/sizeof(ccl_channel));
 
   self->n_channel = 0;
@@ -182,6 +196,19 @@ canStatus ccl_get_channel_list (ccl_class *self)
     }
   }
 
+  return canOK;
+}
+
+//
+// Sort the channels on ean and serial number and number the channels
+// on each card.
+//
+static void ccl_sort (ccl_class *self)
+{
+  uint32_t    index;
+  int         number_on_card = 0;
+  ccl_channel prev_channel;
+
   //sort on ean and serial-number
   if (self->n_channel > 0) {
     qsort(&self->channel, self->n_channel, sizeof(ccl_channel), cmpfunc_ean);
@@ -203,6 +230,165 @@ canStatus ccl_get_channel_list (ccl_class *self)
 
     self->channel[index].number_on_card = number_on_card;
   }
+}
+
+typedef struct {
+  uint32_t driver_index;
+  uint32_t minor;
+  uint64_t snr;
+  uint64_t ean;
+} ccl_listing;
+
+static int cmpfunc_listing (const void * a, const void * b) {
+  const ccl_listing *la = a;
+  const ccl_listing *lb = b;
+
+  if (la->driver_index != lb->driver_index) {
+    return (la->driver_index > lb->driver_index) ? 1 : -1;
+  }
+  if (la->minor != lb->minor) {
+    return (la->minor > lb->minor) ? 1 : -1;
+  }
+  return 0;
+}
+
+//
+// Build the channel list from the listing in CCL_PROC_NAME, with the
+// "generation" line already consumed. Gives the same (unsorted) order as
+// ccl_scan_devices(): by driver and then by minor number.
+//
+static canStatus ccl_read_listing (FILE *f, ccl_class *self)
+{
+  ccl_listing        listing[sizeof(self->channel)/sizeof(ccl_channel)];
+  uint32_t           max_nof_channel = (uint32_t)(sizeof(self->channel)/sizeof(ccl_channel));
+  uint32_t           n_listing = 0;
+  uint32_t           driver_index, index;
+  uint32_t           number_on_driver = 0;
+  char               device_name[32];
+  unsigned int       minor;
+  unsigned long long snr, ean;
+
+  self->n_channel = 0;
+
+  while (fscanf(f, "%31s %u %llu %llu", device_name, &minor, &snr, &ean) == 4) {
+    for (driver_index = 0; driver_index < sizeof(driver_name) / sizeof(*driver_name); driver_index++) {
+      if (strcmp(device_name, driver_name[driver_index]) == 0) {
+        break;
+      }
+    }
+    // Skip drivers that canlib does not know about
+    if (driver_index == sizeof(driver_name) / sizeof(*driver_name)) {
+      continue;
+    }
+
+    listing[n_listing].driver_index = driver_index;
+    listing[n_listing].minor        = minor;
+    listing[n_listing].snr          = snr;
+    listing[n_listing].ean          = ean;
+    n_listing++;
+
+    if (n_listing >= max_nof_channel) {
+      break;
+    }
+  }
+
+  if (n_listing > 0) {
+    qsort(listing, n_listing, sizeof(ccl_listing), cmpfunc_listing);
+  }
+
+  for (index = 0; index < n_listing; index++) {
+    ccl_channel *channel = &self->channel[index];
+    int          n_bytes_written;
+
+    if ((index > 0) && (listing[index].driver_index != listing[index - 1].driver_index)) {
+      number_on_driver = 0;
+    }
+
+    n_bytes_written = snprintf(channel->mknod_name, sizeof(channel->mknod_name), "/dev/%s%u",
+                               driver_name[listing[index].driver_index], listing[index].minor);
+    if (n_bytes_written >= (int)sizeof(channel->mknod_name)) {
+      return canERR_NOTFOUND;
+    }
+
+    n_bytes_written = snprintf(channel->official_name, sizeof(channel->official_name), "%s",
+                               off_name[listing[index].driver_index]);
+    if (n_bytes_written >= (int)sizeof(channel->official_name)) {
+      return canERR_NOTFOUND;
+    }
+
+    channel->snr              = listing[index].snr;
+    channel->ean              = listing[index].ean;
+    channel->number_on_driver = number_on_driver;
+    number_on_driver++;
+    self->n_channel++;
+  }
+
+  return canOK;
+}
+
+canStatus ccl_get_channel_list (ccl_class *self)
+{
+  canStatus    stat;
+  FILE         *f;
+  unsigned int generation;
+
+  f = fopen(CCL_PROC_NAME, "r");
+  if (f == NULL) {
+    // Older driver without the channel list
+    stat = ccl_scan_devices(self);
+    if (stat == canOK) {
+      ccl_sort(self);
+    }
+    return stat;
+  }
+
+  if (fscanf(f, "generation %u", &generation) != 1) {
+    fclose(f);
+    return canERR_NOTFOUND;
+  }
+
+  pthread_mutex_lock(&ccl_cache_mutex);
+  if (ccl_cache_valid && (generation == ccl_cache_generation)) {
+    *self = ccl_cache;
+    stat  = canOK;
+  } else {
+    stat = ccl_read_listing(f, self);
+    if (stat == canOK) {
+      ccl_sort(self);
+      ccl_cache            = *self;
+      ccl_cache_generation = generation;
+      ccl_cache_valid      = 1;
+    }
+  }
+  pthread_mutex_unlock(&ccl_cache_mutex);
+
+  fclose(f);
+
+  return stat;
+}
+
+canStatus ccl_get_generation (unsigned int *generation)
+{
+  char    buf[32];
+  ssize_t n;
+  int     fd;
+
+  // Only the first line is needed, so read it directly instead of going
+  // through the cached list, which may be older than the driver's.
+  fd = open(CCL_PROC_NAME, O_RDONLY);
+  if (fd == -1) {
+    return canERR_NOT_IMPLEMENTED;
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return canERR_NOT_IMPLEMENTED;
+  }
+  buf[n] = '\0';
+
+  if (sscanf(buf, "generation %u", generation) != 1) {
+    return canERR_NOT_IMPLEMENTED;
+  }
 
   return canOK;
 }
@@ -86,4 +86,10 @@ typedef struct {
 
 canStatus ccl_get_channel_list (ccl_class *self);
 
+/*
+returns the current hotplug generation, read from the driver. Fails when
+the driver does not provide one.
+*/
+canStatus ccl_get_generation (unsigned int *generation);
+
 #endif
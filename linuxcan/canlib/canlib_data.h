@@ -120,6 +120,7 @@ typedef struct HandleData
   CanHandle          handle;
   unsigned char      isExtended;
   unsigned char      openMode;
+  unsigned char      compactEvents; // Driver returns VCAN_COMPACT_EVENT
   unsigned char      acceptLargeDlc;
   unsigned char      wantExclusive;
   unsigned char      overrideExclusive;
@@ -135,14 +136,18 @@ typedef struct HandleData
   void               (*callback2)(CanHandle hnd, void* ctx, unsigned int event);
   canNotifyData      notifyData;
   int                notifyFd;
-  uint32_t           notifyThread_running;
-  pthread_t          notifyThread;
+  uint32_t           notifyBusoff;
+  uint32_t           notifyBusStatus;
   unsigned int       notifyFlags;
   struct CANOps      *canOps;
   int                valid;
   uint32_t           capabilities;
   unsigned char      auto_reset;
   print_text_t       print_text;  // printf text from scripts etc.
+  VCanRxRingHeader   *rxRing;     // Memory mapped receive ring, if any
+  VCanRxRecord       *rxRecords;
+  uint32_t           rxRingMask;
+  size_t             rxRingBytes;
 } HandleData;
 
 
@@ -182,6 +187,15 @@ typedef struct CANOps
 
   canStatus (*readSync)(HandleData *, unsigned long);
 
+  canStatus (*readBatch)(HandleData *, canMsgRecord *, unsigned int,
+                         unsigned int *, unsigned long);
+
+  canStatus (*readLatest)(HandleData *, long, void *, unsigned int *,
+                          unsigned int *, unsigned long *, unsigned long *);
+
+  canStatus (*snapshot)(HandleData *, canLatestRecord *, unsigned int,
+                        unsigned int *);
+
   canStatus (*readWait)(HandleData *, long *, void *, unsigned int *,
                         unsigned int *, unsigned long *, long);
 
@@ -218,7 +232,11 @@ typedef struct CANOps
   canStatus (*kvScriptGetText)  (HandleData *, int *, unsigned long *, unsigned int *, char *, size_t);
 
   canStatus (*accept)(HandleData *, const long, const unsigned int);
+  canStatus (*setIdFilter)(HandleData *, const unsigned int *, unsigned int,
+                           const canIdRange *, unsigned int, unsigned int);
   canStatus (*write)(HandleData *, long, void *, unsigned int, unsigned int);
+  canStatus (*writeBatch)(HandleData *, const canMsgRecord *, unsigned int,
+                          unsigned int *);
   canStatus (*writeWait)(HandleData *, long, void *,
                          unsigned int, unsigned int, long);
   canStatus (*writeSync)(HandleData *, unsigned long);
@@ -0,0 +1,206 @@
+/*
+**             Copyright 2017 by Kvaser AB, Molndal, Sweden
+**                         http://www.kvaser.com
+**
+** This software is dual licensed under the following two licenses:
+** BSD-new and GPLv2. You may use either one. See the included
+** COPYING file for details.
+**
+** License: BSD-new
+** ==============================================================================
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of the <organization> nor the
+**       names of its contributors may be used to endorse or promote products
+**       derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+** BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+** IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+**
+**
+** License: GPLv2
+** ==============================================================================
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+**
+**
+** IMPORTANT NOTICE:
+** ==============================================================================
+** This source code is made available for free, as an open license, by Kvaser AB,
+** for use with its applications. Kvaser AB does not accept any liability
+** whatsoever for any third party patent or other immaterial property rights
+** violations that may result from any usage of this source code, regardless of
+** the combination of source code and various applications that it can be used
+** in, or with.
+**
+** -----------------------------------------------------------------------------
+*/
+
+/*
+ * Kvaser Linux Canlib
+ * Measure handle lookup throughput with several threads
+ *
+ * Each thread opens its own handle on the channel and then calls
+ * canGetRawHandle, which does nothing but look the handle up, as fast as
+ * it can. Idle handles can be opened first, so that the handles used by
+ * the threads are not among the first ones.
+ */
+
+#include <canlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_THREADS 64
+
+static volatile int willExit = 0;
+
+typedef struct {
+  pthread_t     thread;
+  canHandle     hnd;
+  unsigned long count;
+} ThreadData;
+
+static void check(char* id, canStatus stat)
+{
+  if (stat != canOK) {
+    char buf[50];
+    buf[0] = '\0';
+    canGetErrorText(stat, buf, sizeof(buf));
+    printf("%s: failed, stat=%d (%s)\n", id, (int)stat, buf);
+  }
+}
+
+static void printUsageAndExit(char *prgName)
+{
+  printf("Usage: '%s [-t threads] [-s seconds] [-i idle handles] <channel>'\n", prgName);
+  exit(1);
+}
+
+static void *lookupThread(void *arg)
+{
+  ThreadData *td = arg;
+  int fd;
+
+  while (!willExit) {
+    if (canGetRawHandle(td->hnd, &fd) != canOK) {
+      break;
+    }
+    td->count++;
+  }
+
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  ThreadData threads[MAX_THREADS];
+  canHandle *idle = NULL;
+  int nThreads = 4;
+  int seconds = 2;
+  int nIdle = 0;
+  int channel;
+  int opt;
+  int i;
+  unsigned long total = 0;
+
+  while ((opt = getopt(argc, argv, "t:s:i:")) != -1) {
+    switch (opt) {
+    case 't':
+      nThreads = atoi(optarg);
+      break;
+    case 's':
+      seconds = atoi(optarg);
+      break;
+    case 'i':
+      nIdle = atoi(optarg);
+      break;
+    default:
+      printUsageAndExit(argv[0]);
+    }
+  }
+  if ((optind != argc - 1) || (nThreads < 1) || (nThreads > MAX_THREADS) ||
+      (seconds < 1) || (nIdle < 0)) {
+    printUsageAndExit(argv[0]);
+  }
+  channel = atoi(argv[optind]);
+
+  canInitializeLibrary();
+
+  if (nIdle) {
+    idle = calloc(nIdle, sizeof(canHandle));
+    if (idle == NULL) {
+      printf("Out of memory\n");
+      return -1;
+    }
+  }
+  for (i = 0; i < nIdle; i++) {
+    idle[i] = canOpenChannel(channel, canOPEN_ACCEPT_VIRTUAL);
+    if (idle[i] < 0) {
+      check("canOpenChannel", idle[i]);
+      nIdle = i;
+      break;
+    }
+  }
+
+  for (i = 0; i < nThreads; i++) {
+    threads[i].count = 0;
+    threads[i].hnd = canOpenChannel(channel, canOPEN_ACCEPT_VIRTUAL);
+    if (threads[i].hnd < 0) {
+      check("canOpenChannel", threads[i].hnd);
+      nThreads = i;
+      break;
+    }
+  }
+
+  printf("Looking up %d handles from %d threads for %d s, %d idle handles\n",
+         nThreads, nThreads, seconds, nIdle);
+
+  for (i = 0; i < nThreads; i++) {
+    pthread_create(&threads[i].thread, NULL, lookupThread, &threads[i]);
+  }
+  sleep(seconds);
+  willExit = 1;
+  for (i = 0; i < nThreads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    printf("handle %d: %lu lookups/s\n", threads[i].hnd, threads[i].count / seconds);
+    total += threads[i].count;
+  }
+  printf("total: %lu lookups/s\n", total / seconds);
+
+  for (i = 0; i < nThreads; i++) {
+    check("canClose", canClose(threads[i].hnd));
+  }
+  for (i = 0; i < nIdle; i++) {
+    check("canClose", canClose(idle[i]));
+  }
+  free(idle);
+
+  return 0;
+}
@@ -0,0 +1,254 @@
+/*
+**             Copyright 2017 by Kvaser AB, Molndal, Sweden
+**                         http://www.kvaser.com
+**
+** This software is dual licensed under the following two licenses:
+** BSD-new and GPLv2. You may use either one. See the included
+** COPYING file for details.
+**
+** License: BSD-new
+** ==============================================================================
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of the <organization> nor the
+**       names of its contributors may be used to endorse or promote products
+**       derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+** BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+** IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+**
+**
+** License: GPLv2
+** ==============================================================================
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+**
+**
+** IMPORTANT NOTICE:
+** ==============================================================================
+** This source code is made available for free, as an open license, by Kvaser AB,
+** for use with its applications. Kvaser AB does not accept any liability
+** whatsoever for any third party patent or other immaterial property rights
+** violations that may result from any usage of this source code, regardless of
+** the combination of source code and various applications that it can be used
+** in, or with.
+**
+** -----------------------------------------------------------------------------
+*/
+
+/*
+ * Kvaser Linux Canlib
+ * Measure receive queue throughput
+ *
+ * One thread floods the channel from a second handle, with a sequence
+ * number in each frame, while the reader takes the frames off its receive
+ * queue with canReadWait, or canReadBatch with -b, as fast as it can.
+ * A delay per read (-u) together with a small queue (-q) makes the queue
+ * overrun, and the sequence numbers then show which frames were dropped.
+ */
+
+#include <canlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BATCH_SIZE 64
+
+static volatile int willExit = 0;
+
+typedef struct {
+  canHandle     hnd;
+  unsigned long sent;
+} WriterData;
+
+static void check(char* id, canStatus stat)
+{
+  if (stat != canOK) {
+    char buf[50];
+    buf[0] = '\0';
+    canGetErrorText(stat, buf, sizeof(buf));
+    printf("%s: failed, stat=%d (%s)\n", id, (int)stat, buf);
+  }
+}
+
+static void printUsageAndExit(char *prgName)
+{
+  printf("Usage: '%s [-s seconds] [-q queue size] [-u us per read] [-b] <channel>'\n", prgName);
+  exit(1);
+}
+
+static void *writerThread(void *arg)
+{
+  WriterData *wd = arg;
+  unsigned char data[8] = {0};
+  uint32_t seq = 0;
+  canStatus stat;
+
+  while (!willExit) {
+    memcpy(data, &seq, sizeof(seq));
+    stat = canWrite(wd->hnd, 0x100, data, sizeof(data), 0);
+    if (stat == canERR_TXBUFOFL) {
+      canWriteSync(wd->hnd, 100);
+      continue;
+    }
+    if (stat != canOK) {
+      check("canWrite", stat);
+      break;
+    }
+    seq++;
+    wd->sent++;
+  }
+
+  return NULL;
+}
+
+static canHandle openBusOn(int channel, unsigned int queueSize)
+{
+  canHandle hnd;
+
+  hnd = canOpenChannel(channel, canOPEN_ACCEPT_VIRTUAL);
+  if (hnd < 0) {
+    check("canOpenChannel", hnd);
+    return hnd;
+  }
+  check("canSetBusParams", canSetBusParams(hnd, canBITRATE_1M, 0, 0, 0, 0, 0));
+  if (queueSize) {
+    check("canIoCtl(SET_RX_QUEUE_SIZE)",
+          canIoCtl(hnd, canIOCTL_SET_RX_QUEUE_SIZE, &queueSize, sizeof(queueSize)));
+  }
+  check("canBusOn", canBusOn(hnd));
+
+  return hnd;
+}
+
+int main(int argc, char *argv[])
+{
+  canMsgRecord msgs[BATCH_SIZE];
+  WriterData writer;
+  pthread_t thread;
+  canHandle reader;
+  canStatus stat;
+  unsigned int queueSize = 0;
+  unsigned int got;
+  unsigned int i;
+  unsigned long received = 0;
+  unsigned long overruns = 0;
+  unsigned long lost = 0;
+  uint32_t expected = 0;
+  uint32_t seq;
+  int seconds = 2;
+  int delayUs = 0;
+  int batch = 0;
+  int channel;
+  int opt;
+  time_t end;
+
+  while ((opt = getopt(argc, argv, "s:q:u:b")) != -1) {
+    switch (opt) {
+    case 's':
+      seconds = atoi(optarg);
+      break;
+    case 'q':
+      queueSize = atoi(optarg);
+      break;
+    case 'u':
+      delayUs = atoi(optarg);
+      break;
+    case 'b':
+      batch = 1;
+      break;
+    default:
+      printUsageAndExit(argv[0]);
+    }
+  }
+  if ((optind != argc - 1) || (seconds < 1) || (delayUs < 0)) {
+    printUsageAndExit(argv[0]);
+  }
+  channel = atoi(argv[optind]);
+
+  canInitializeLibrary();
+
+  reader     = openBusOn(channel, queueSize);
+  writer.hnd = openBusOn(channel, 0);
+  writer.sent = 0;
+  if ((reader < 0) || (writer.hnd < 0)) {
+    return -1;
+  }
+
+  printf("Receiving for %d s with %s%s\n", seconds,
+         batch ? "canReadBatch" : "canReadWait",
+         delayUs ? ", delayed reads" : "");
+
+  pthread_create(&thread, NULL, writerThread, &writer);
+  end = time(NULL) + seconds;
+  while (time(NULL) < end) {
+    if (batch) {
+      stat = canReadBatch(reader, msgs, BATCH_SIZE, &got, 100);
+    } else {
+      stat = canReadWait(reader, &msgs[0].id, msgs[0].data, &msgs[0].dlc,
+                         &msgs[0].flags, &msgs[0].time, 100);
+      got = (stat == canOK) ? 1 : 0;
+    }
+    if ((stat != canOK) && (stat != canERR_NOMSG)) {
+      check("read", stat);
+      break;
+    }
+
+    for (i = 0; i < got; i++) {
+      if (msgs[i].flags & canMSGERR_OVERRUN) {
+        overruns++;
+      }
+      memcpy(&seq, msgs[i].data, sizeof(seq));
+      // Frames missing in front of this one were dropped by an overrun
+      if (seq != expected) {
+        lost += seq - expected;
+      }
+      expected = seq + 1;
+    }
+    received += got;
+
+    if (delayUs) {
+      usleep(delayUs);
+    }
+  }
+  willExit = 1;
+  pthread_join(thread, NULL);
+
+  printf("sent: %lu frames/s\n", writer.sent / seconds);
+  printf("received: %lu frames/s\n", received / seconds);
+  printf("overrun flags: %lu, frames lost: %lu\n", overruns, lost);
+
+  check("canClose", canClose(writer.hnd));
+  check("canClose", canClose(reader));
+
+  return 0;
+}
@@ -0,0 +1,243 @@
+/*
+**             Copyright 2017 by Kvaser AB, Molndal, Sweden
+**                         http://www.kvaser.com
+**
+** This software is dual licensed under the following two licenses:
+** BSD-new and GPLv2. You may use either one. See the included
+** COPYING file for details.
+**
+** License: BSD-new
+** ==============================================================================
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of the <organization> nor the
+**       names of its contributors may be used to endorse or promote products
+**       derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+** BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+** IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+**
+**
+** License: GPLv2
+** ==============================================================================
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+**
+**
+** IMPORTANT NOTICE:
+** ==============================================================================
+** This source code is made available for free, as an open license, by Kvaser AB,
+** for use with its applications. Kvaser AB does not accept any liability
+** whatsoever for any third party patent or other immaterial property rights
+** violations that may result from any usage of this source code, regardless of
+** the combination of source code and various applications that it can be used
+** in, or with.
+**
+** -----------------------------------------------------------------------------
+*/
+
+/*
+ * Kvaser Linux Canlib
+ * Measure canReadSpecific with a deep receive queue
+ *
+ * A second handle on the same channel fills the receive queue of the first
+ * one with frames that are never read, then sends one frame with the id
+ * that is read back with canReadSpecific for each round. Only the time
+ * spent in canReadSpecific is measured, so run it with a few queue depths
+ * to see how the cost depends on the number of frames in front of the one
+ * that is read.
+ */
+
+#include <canlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#define NOISE_ID  0x200
+#define READ_ID   0x100
+
+static void check(char* id, canStatus stat)
+{
+  if (stat != canOK) {
+    char buf[50];
+    buf[0] = '\0';
+    canGetErrorText(stat, buf, sizeof(buf));
+    printf("%s: failed, stat=%d (%s)\n", id, (int)stat, buf);
+  }
+}
+
+static void printUsageAndExit(char *prgName)
+{
+  printf("Usage: '%s [-d depth] [-n rounds] [-r] <channel>'\n", prgName);
+  printf("  -r  read through the memory mapped receive ring\n");
+  exit(1);
+}
+
+static double nsSince(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+static canStatus writeFrame(canHandle hnd, long id)
+{
+  unsigned char data[8] = {0};
+  canStatus stat;
+
+  stat = canWrite(hnd, id, data, sizeof(data), 0);
+  if (stat == canERR_TXBUFOFL) {
+    stat = canWriteSync(hnd, 1000);
+    if (stat == canOK) {
+      stat = canWrite(hnd, id, data, sizeof(data), 0);
+    }
+  }
+  return stat;
+}
+
+static canHandle openBusOn(int channel, unsigned int queueSize, int ring)
+{
+  canHandle hnd;
+  canStatus stat;
+
+  hnd = canOpenChannel(channel, canOPEN_ACCEPT_VIRTUAL);
+  if (hnd < 0) {
+    check("canOpenChannel", hnd);
+    return hnd;
+  }
+  stat = canSetBusParams(hnd, canBITRATE_1M, 0, 0, 0, 0, 0);
+  check("canSetBusParams", stat);
+  if (queueSize) {
+    stat = canIoCtl(hnd, canIOCTL_SET_RX_QUEUE_SIZE, &queueSize, sizeof(queueSize));
+    check("canIoCtl(SET_RX_QUEUE_SIZE)", stat);
+  }
+  if (ring) {
+    stat = canIoCtl(hnd, canIOCTL_MAP_RX_RING, &queueSize, sizeof(queueSize));
+    check("canIoCtl(MAP_RX_RING)", stat);
+  }
+  stat = canBusOn(hnd);
+  check("canBusOn", stat);
+
+  return hnd;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned char data[8];
+  unsigned int dlc, flag;
+  unsigned long time;
+  struct timespec start;
+  canHandle reader, writer;
+  canStatus stat;
+  double total = 0;
+  double worst = 0;
+  double ns;
+  int depth = 500;
+  int rounds = 10000;
+  int ring = 0;
+  int channel;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "d:n:r")) != -1) {
+    switch (opt) {
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    case 'n':
+      rounds = atoi(optarg);
+      break;
+    case 'r':
+      ring = 1;
+      break;
+    default:
+      printUsageAndExit(argv[0]);
+    }
+  }
+  if ((optind != argc - 1) || (depth < 0) || (rounds < 1)) {
+    printUsageAndExit(argv[0]);
+  }
+  channel = atoi(argv[optind]);
+
+  canInitializeLibrary();
+
+  // Room for the frames that are never read and the one that is
+  reader = openBusOn(channel, depth + 16, ring);
+  writer = openBusOn(channel, 0, 0);
+  if ((reader < 0) || (writer < 0)) {
+    return -1;
+  }
+
+  for (i = 0; i < depth; i++) {
+    stat = writeFrame(writer, NOISE_ID);
+    if (stat != canOK) {
+      check("canWrite", stat);
+      return -1;
+    }
+  }
+  check("canWriteSync", canWriteSync(writer, 1000));
+
+  printf("Reading %d frames with canReadSpecific, %d frames in front%s\n",
+         rounds, depth, ring ? ", rx ring" : "");
+
+  for (i = 0; i < rounds; i++) {
+    stat = writeFrame(writer, READ_ID);
+    if (stat == canOK) {
+      stat = canReadSyncSpecific(reader, READ_ID, 1000);
+    }
+    if (stat != canOK) {
+      check("canReadSyncSpecific", stat);
+      return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stat = canReadSpecific(reader, READ_ID, data, &dlc, &flag, &time);
+    ns = nsSince(&start);
+    if (stat != canOK) {
+      check("canReadSpecific", stat);
+      return -1;
+    }
+    total += ns;
+    if (ns > worst) {
+      worst = ns;
+    }
+    if (flag & canMSGERR_OVERRUN) {
+      printf("round %d: unexpected overrun flag\n", i);
+    }
+  }
+
+  printf("canReadSpecific: %.0f ns average, %.0f ns worst\n",
+         total / rounds, worst);
+
+  check("canClose", canClose(writer));
+  check("canClose", canClose(reader));
+
+  return 0;
+}
@@ -76,7 +76,10 @@
 #include <linux/sched.h>
 #include <linux/ptrace.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 #include <linux/string.h>
+#include <linux/sort.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
 #include <linux/interrupt.h>
@@ -127,12 +130,24 @@ MODULE_AUTHOR("KVASER");
 #define THIS_MODULE 0
 #endif
 
+// Machine readable list of all channels, see kvaser_channels_show()
+#define VCAN_CHANNELS_PROC_NAME "kvaser_channels"
+
+// Drivers that have called vCanInit()
+static LIST_HEAD(vCanDriverList);
+static DEFINE_MUTEX(vCanDriverListLock);
+
+// Bumped after every change to the set of cards, so that user space can
+// tell when a cached channel list is stale
+static atomic_t vCanChannelGeneration = ATOMIC_INIT(0);
+
 # ifdef _LINUX_TIME64_H
 static long     calc_timeout        (struct timespec64 *start, unsigned long wanted_timeout);
 #else
 static long     calc_timeout        (struct timeval *start, unsigned long wanted_timeout);
 #endif
 static uint32_t read_specific       (VCanOpenFileNode *fileNodePtr, VCanRead *readOpt, VCAN_EVENT *msg);
+static void     vCanRcvIndexReset   (VCanReceiveData *rcv);
 static int      wait_tx_queue_empty (VCanOpenFileNode *fileNodePtr, unsigned long timeout);
 
 //======================================================================
@@ -148,11 +163,13 @@ static long         vCanIOCtl_unlocked(struct file *filp,
                                        unsigned int cmd, unsigned long arg);
 static int          vCanOpen(struct inode *inode, struct file *filp);
 static unsigned int vCanPoll(struct file *filp, poll_table *wait);
+static int          vCanMmap(struct file *filp, struct vm_area_struct *vma);
 
 struct file_operations fops = {
   .poll    = vCanPoll,
   .open    = vCanOpen,
   .release = vCanClose,
+  .mmap    = vCanMmap,
 #if defined(HAVE_UNLOCKED_IOCTL)
   .unlocked_ioctl = vCanIOCtl_unlocked,
 #else
@@ -287,21 +304,389 @@ EXPORT_SYMBOL(vCanFlushSendBuffer);
 
 //======================================================================
 //  Discard recieve queue
+//  Must be called with rcv.readLock and rcv.rcvLock held.
 //======================================================================
 
 int vCanFlushReceiveBuffer (VCanOpenFileNode *fileNodePtr)
 {
   fileNodePtr->rcv.bufTail = 0;
   fileNodePtr->rcv.bufHead = 0;
+  fileNodePtr->rcv.highWater = 0;
+  fileNodePtr->rcv.lockless = 1;
+  fileNodePtr->rcv.overrunPending = 0;
+  vCanRcvIndexReset(&fileNodePtr->rcv);
 
   return VCAN_STAT_OK;
 }
 
+//======================================================================
+//  Check a message id against a VCanIdFilter
+//======================================================================
+static int vCanIdFilterMatch (const VCanIdFilter *filter, uint32_t msgId)
+{
+  uint32_t id = msgId & ~VCAN_EXT_MSG_ID;
+  int      lo, hi;
+
+  if ((msgId & VCAN_EXT_MSG_ID) == 0) {
+    if (!(filter->flags & VCAN_ID_FILTER_STD)) {
+      return 1;
+    }
+    id &= 0x07FF;
+    return (filter->stdBitmap[id / 32] >> (id % 32)) & 1;
+  }
+
+  if (!(filter->flags & VCAN_ID_FILTER_EXT)) {
+    return 1;
+  }
+  id &= filter->extMask;
+  lo = 0;
+  hi = (int)filter->extCount - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+
+    if (id < filter->extRanges[mid].first) {
+      hi = mid - 1;
+    } else if (id > filter->extRanges[mid].last) {
+      lo = mid + 1;
+    } else {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int vCanIdRangeCmp (const void *a, const void *b)
+{
+  const VCanIdRange *ra = a;
+  const VCanIdRange *rb = b;
+
+  if (ra->first < rb->first) {
+    return -1;
+  }
+  return ra->first > rb->first;
+}
+
+//======================================================================
+//  Build a VCanIdFilter from a VCAN_IOC_SET_ID_FILTER request
+//  The ranges are sorted and overlapping ones merged.
+//======================================================================
+static int vCanIdFilterCreate (VCAN_IOCTL_ID_FILTER_T *req, VCanIdFilter **filterPtr)
+{
+  VCanIdFilter *filter;
+  uint32_t      count = 0;
+  uint32_t      i, n;
+
+  *filterPtr = NULL;
+  if (req->flags & ~(VCAN_ID_FILTER_STD | VCAN_ID_FILTER_EXT)) {
+    return -EINVAL;
+  }
+  if (req->flags == 0) {
+    return 0;
+  }
+  if (req->flags & VCAN_ID_FILTER_EXT) {
+    count = req->extCount;
+    if (count > VCAN_ID_FILTER_MAX_RANGES) {
+      return -EINVAL;
+    }
+  }
+
+  filter = vmalloc(sizeof(VCanIdFilter) + count * sizeof(VCanIdRange));
+  if (!filter) {
+    return -ENOMEM;
+  }
+  filter->flags   = req->flags;
+  filter->extMask = req->extMask ? (req->extMask & ~VCAN_EXT_MSG_ID) : ~VCAN_EXT_MSG_ID;
+  memcpy(filter->stdBitmap, req->stdBitmap, sizeof(filter->stdBitmap));
+  if (count && copy_from_user(filter->extRanges, req->extRanges,
+                              count * sizeof(VCanIdRange))) {
+    vfree(filter);
+    return -EFAULT;
+  }
+  for (i = 0; i < count; i++) {
+    if (filter->extRanges[i].first > filter->extRanges[i].last) {
+      vfree(filter);
+      return -EINVAL;
+    }
+  }
+
+  sort(filter->extRanges, count, sizeof(VCanIdRange), vCanIdRangeCmp, NULL);
+  for (i = 1, n = 0; i < count; i++) {
+    if (filter->extRanges[i].first <= filter->extRanges[n].last + 1ULL) {
+      if (filter->extRanges[i].last > filter->extRanges[n].last) {
+        filter->extRanges[n].last = filter->extRanges[i].last;
+      }
+    } else {
+      filter->extRanges[++n] = filter->extRanges[i];
+    }
+  }
+  filter->extCount = count ? n + 1 : 0;
+
+  *filterPtr = filter;
+  return 0;
+}
+
+//======================================================================
+//  Address of rx queue entry
+//  On a compact queue only the VCAN_COMPACT_EVENT part may be touched.
+//======================================================================
+static inline VCAN_EVENT *vCanRcvEvent (VCanReceiveData *rcv, int index)
+{
+  return (VCAN_EVENT *)((char *)rcv->fileRcvBuffer + index * rcv->evtSize);
+}
+
+//======================================================================
+//  rx queue id index
+//======================================================================
+static inline int vCanRcvIndexHash (uint32_t id)
+{
+  id &= ~VCAN_EXT_MSG_ID;
+  return (id ^ (id >> 8) ^ (id >> 16)) & (FILE_RCV_INDEX_BUCKETS - 1);
+}
+
+static void vCanRcvIndexReset (VCanReceiveData *rcv)
+{
+  int i;
+
+  if (!rcv->index) {
+    return;
+  }
+  for (i = 0; i < FILE_RCV_INDEX_BUCKETS; i++) {
+    rcv->index->head[i] = -1;
+    rcv->index->tail[i] = -1;
+  }
+}
+
+// Called when an event has been written to slot, before it is pushed
+static void vCanRcvIndexAdd (VCanReceiveData *rcv, int slot)
+{
+  VCanRcvIndex *ri = rcv->index;
+  VCAN_EVENT   *e  = vCanRcvEvent(rcv, slot);
+  int           bucket;
+
+  if (!ri || rcv->lockless) {
+    return;
+  }
+  ri->next[slot] = -1;
+  // Only messages are indexed
+  if (e->tag != V_RECEIVE_MSG) {
+    return;
+  }
+  bucket = vCanRcvIndexHash(e->tagData.msg.id);
+  if (ri->head[bucket] < 0) {
+    ri->head[bucket] = slot;
+  } else {
+    ri->next[ri->tail[bucket]] = slot;
+  }
+  ri->tail[bucket] = slot;
+}
+
+// Called when a valid slot leaves the queue. prev is the slot before it
+// in its bucket, or -1 to look it up; popped slots are always first.
+static void vCanRcvIndexRemove (VCanReceiveData *rcv, int slot, int prev)
+{
+  VCanRcvIndex *ri = rcv->index;
+  VCAN_EVENT   *e  = vCanRcvEvent(rcv, slot);
+  int           bucket;
+
+  if (!ri || rcv->lockless) {
+    return;
+  }
+  if (e->tag != V_RECEIVE_MSG) {
+    return;
+  }
+  bucket = vCanRcvIndexHash(e->tagData.msg.id);
+  if (prev < 0) {
+    int i;
+
+    for (i = ri->head[bucket]; (i >= 0) && (i != slot); i = ri->next[i]) {
+      prev = i;
+    }
+  }
+  if (prev < 0) {
+    ri->head[bucket] = ri->next[slot];
+  } else {
+    ri->next[prev] = ri->next[slot];
+  }
+  if (ri->tail[bucket] == slot) {
+    ri->tail[bucket] = prev;
+  }
+}
+
+// Set VCAN_MSG_FLAG_OVERRUN on a queued event
+static void vCanRcvMarkOverrun (VCanReceiveData *rcv, int slot)
+{
+  vCanRcvEvent(rcv, slot)->tagData.msg.flags |= VCAN_MSG_FLAG_OVERRUN;
+}
+
+// Index the queued events and leave lockless mode
+// Must be called with rcv->readLock and rcv->rcvLock held.
+static void vCanRcvIndexBuild (VCanReceiveData *rcv)
+{
+  int slot;
+
+  rcv->lockless = 0;
+  vCanRcvIndexReset(rcv);
+  for (slot = rcv->bufTail; slot != rcv->bufHead;
+       slot = (slot >= rcv->size - 1) ? 0 : slot + 1) {
+    vCanRcvIndexAdd(rcv, slot);
+  }
+}
+
+//======================================================================
+//  Allocate rx queue storage
+//======================================================================
+static int vCanAllocReceiveBuffer (VCanReceiveData *rcv, int size, int indexed)
+{
+  rcv->fileRcvBuffer = vmalloc(size * rcv->evtSize);
+  rcv->valid         = vmalloc(size * sizeof(uint8_t));
+  rcv->index         = NULL;
+  if (indexed) {
+    rcv->index = vmalloc(sizeof(VCanRcvIndex) + size * sizeof(int));
+  }
+  if (!rcv->fileRcvBuffer || !rcv->valid || (indexed && !rcv->index)) {
+    vfree(rcv->fileRcvBuffer);
+    vfree(rcv->valid);
+    vfree(rcv->index);
+    rcv->fileRcvBuffer = NULL;
+    rcv->valid         = NULL;
+    rcv->index         = NULL;
+    return VCAN_STAT_NO_MEMORY;
+  }
+  memset(rcv->valid, 0, size * sizeof(uint8_t));
+  rcv->size      = size;
+  rcv->bufHead   = 0;
+  rcv->bufTail   = 0;
+  rcv->highWater = 0;
+  vCanRcvIndexReset(rcv);
+
+  return VCAN_STAT_OK;
+}
+
+//======================================================================
+//  Free rx queue storage
+//======================================================================
+static void vCanFreeReceiveBuffer (VCanReceiveData *rcv)
+{
+  vfree(rcv->fileRcvBuffer);
+  vfree(rcv->valid);
+  vfree(rcv->index);
+  rcv->fileRcvBuffer = NULL;
+  rcv->valid         = NULL;
+  rcv->index         = NULL;
+}
+
+//======================================================================
+//  Change rx queue size and/or event size
+//  Queued events are kept, except the oldest ones if they do not fit.
+//======================================================================
+static int vCanResizeReceiveBuffer (VCanReceiveData *rcv, int size, int evtSize)
+{
+  VCanReceiveData  new_rcv;
+  unsigned long    rcvLock_irqFlags;
+  int              skip;
+  int              n = 0;
+
+  new_rcv.evtSize  = evtSize;
+  new_rcv.lockless = 1;
+  if (vCanAllocReceiveBuffer(&new_rcv, size, rcv->index != NULL) != VCAN_STAT_OK) {
+    return VCAN_STAT_NO_MEMORY;
+  }
+
+  spin_lock(&rcv->readLock);
+  spin_lock_irqsave(&rcv->rcvLock, rcvLock_irqFlags);
+  skip = getQLen(rcv->bufHead, rcv->bufTail, rcv->size) - (size - 1);
+  while (rcv->bufHead != rcv->bufTail) {
+    if (skip > 0) {
+      skip--;
+    } else {
+      memcpy(vCanRcvEvent(&new_rcv, n), vCanRcvEvent(rcv, rcv->bufTail),
+             min(evtSize, rcv->evtSize));
+      new_rcv.valid[n] = 1;
+      vCanRcvIndexAdd(&new_rcv, n);
+      n++;
+    }
+    vCanPopReceiveBuffer(rcv);
+  }
+
+  // Swap storage, old one is freed below
+  swap(rcv->fileRcvBuffer, new_rcv.fileRcvBuffer);
+  swap(rcv->valid, new_rcv.valid);
+  swap(rcv->index, new_rcv.index);
+  rcv->evtSize   = evtSize;
+  rcv->size      = size;
+  rcv->bufTail   = 0;
+  rcv->bufHead   = n;
+  rcv->highWater = n;
+  rcv->lockless  = 1;  // The copy has no holes
+  spin_unlock_irqrestore(&rcv->rcvLock, rcvLock_irqFlags);
+  spin_unlock(&rcv->readLock);
+
+  vCanFreeReceiveBuffer(&new_rcv);
+
+  return VCAN_STAT_OK;
+}
+
+//======================================================================
+//  Wake-up coalescing timer
+//======================================================================
+static enum hrtimer_restart vCanRcvWakeTimer (struct hrtimer *timer)
+{
+  VCanReceiveData *rcv = container_of(timer, VCanReceiveData, wakeTimer);
+  unsigned long    rcvLock_irqFlags;
+
+  spin_lock_irqsave(&rcv->rcvLock, rcvLock_irqFlags);
+  rcv->wakeArmed = 0;
+  spin_unlock_irqrestore(&rcv->rcvLock, rcvLock_irqFlags);
+  wake_up_interruptible(&rcv->rxWaitQ);
+
+  return HRTIMER_NORESTART;
+}
+
+static void vCanRcvWakeInit (VCanReceiveData *rcv)
+{
+  rcv->wakeCount   = 1;
+  rcv->wakeDelayUs = 0;
+  rcv->wakeArmed   = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+  hrtimer_setup(&rcv->wakeTimer, vCanRcvWakeTimer, CLOCK_MONOTONIC,
+                HRTIMER_MODE_REL);
+#else
+  hrtimer_init(&rcv->wakeTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  rcv->wakeTimer.function = vCanRcvWakeTimer;
+#endif
+}
+
+//======================================================================
+//  Wake readers of a receive queue that has level events waiting,
+//  or start the timer that will.
+//  Must be called with rcv->rcvLock held.
+//======================================================================
+static void vCanRcvWake (VCanReceiveData *rcv, uint32_t level)
+{
+  if ((rcv->wakeCount <= 1) || (level >= rcv->wakeCount)) {
+    if (rcv->wakeArmed) {
+      // If the callback is already running it only wakes once more
+      hrtimer_try_to_cancel(&rcv->wakeTimer);
+      rcv->wakeArmed = 0;
+    }
+    wake_up_interruptible(&rcv->rxWaitQ);
+  } else if (!rcv->wakeArmed) {
+    rcv->wakeArmed = 1;
+    hrtimer_start(&rcv->wakeTimer,
+                  ns_to_ktime((u64)rcv->wakeDelayUs * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+  }
+}
+
 //======================================================================
 //  Pop rx queue
 //======================================================================
 int vCanPopReceiveBuffer (VCanReceiveData *rcv)
 {
+  if (rcv->valid[rcv->bufTail]) {
+    vCanRcvIndexRemove(rcv, rcv->bufTail, -1);
+  }
   do {
     if (rcv->bufTail >= rcv->size - 1) {
       rcv->bufTail = 0;
@@ -313,22 +698,221 @@ int vCanPopReceiveBuffer (VCanReceiveData *rcv)
   return VCAN_STAT_OK;
 }
 
+//======================================================================
+//  Take the oldest event off the rx queue
+//  Must be called with rcv->readLock held. Returns the number of bytes
+//  copied to e, or 0 if the queue is empty.
+//======================================================================
+static int vCanRcvTake (VCanReceiveData *rcv, void *e)
+{
+  unsigned long rcvLock_irqFlags;
+  int           evtSize = rcv->evtSize;
+  int           tail    = rcv->bufTail;
+
+  if (rcv->lockless) {
+    // Pairs with the release in vCanPushReceiveBuffer()
+    if (smp_load_acquire(&rcv->bufHead) == tail) {
+      return 0;
+    }
+    memcpy(e, vCanRcvEvent(rcv, tail), evtSize);
+    // The producer may reuse the slot as soon as it sees the new tail
+    smp_store_release(&rcv->bufTail, (tail >= rcv->size - 1) ? 0 : tail + 1);
+    return evtSize;
+  }
+
+  spin_lock_irqsave(&rcv->rcvLock, rcvLock_irqFlags);
+  if (rcv->bufHead == rcv->bufTail) {
+    evtSize = 0;
+  } else {
+    memcpy(e, vCanRcvEvent(rcv, rcv->bufTail), evtSize);
+    vCanPopReceiveBuffer(rcv);
+  }
+  if (rcv->bufHead == rcv->bufTail) {
+    rcv->lockless = 1;
+  }
+  spin_unlock_irqrestore(&rcv->rcvLock, rcvLock_irqFlags);
+
+  return evtSize;
+}
+
 //======================================================================
 //  Push rx queue
 //======================================================================
 int vCanPushReceiveBuffer (VCanReceiveData *rcv)
 {
-  rcv->valid[rcv->bufHead] = 1;
+  uint32_t level;
+  int      head = rcv->bufHead;
+
+  rcv->valid[head] = 1;
+  vCanRcvIndexAdd(rcv, head);
+
+  // The event must be visible to lockless readers before the new head
+  smp_store_release(&rcv->bufHead, (head >= rcv->size - 1) ? 0 : head + 1);
+
+  level = getQLen(rcv->bufHead, rcv->bufTail, rcv->size);
+  if (level == 0) {
+    // The queue is full
+    level = rcv->size;
+  }
+  vCanRcvWake(rcv, level);
+
+  return VCAN_STAT_OK;
+}
+
+//======================================================================
+//  Push memory mapped rx ring
+//  Must be called with fileNodePtr->rcv.rcvLock held, which makes this
+//  the only writer of the ring head.
+//======================================================================
+static void vCanPushRxRing (VCanOpenFileNode *fileNodePtr, VCAN_EVENT *e,
+                            unsigned short int msg_flags)
+{
+  VCanRxRingHeader *hdr  = fileNodePtr->rxRing;
+  VCanRxRecord     *rec;
+  uint32_t          head = fileNodePtr->rxRingHead;
+  uint32_t          tail = *(volatile uint32_t *)&hdr->tail;
+
+  if (head - tail >= fileNodePtr->rxRingSize) {
+    // The ring is full, drop the new event and mark the next message
+    fileNodePtr->overrun.sw++;
+    fileNodePtr->rxRingOverrun = 1;
+    hdr->overruns++;
+    DEBUGPRINT(2, (TXT("File node rx ring overrun\n")));
+    return;
+  }
 
-  if (rcv->bufHead >= rcv->size - 1) {
-    rcv->bufHead = 0;
+  rec = (VCanRxRecord *)((char *)hdr + VCAN_RX_RING_HDR_SIZE) +
+        (head & (fileNodePtr->rxRingSize - 1));
+  rec->tag       = e->tag;
+  rec->timeStamp = e->timeStamp - fileNodePtr->time_start_10usec;
+  if (e->tag == V_RECEIVE_MSG) {
+    rec->id    = e->tagData.msg.id;
+    rec->flags = msg_flags;
+    rec->dlc   = e->tagData.msg.dlc;
+    memcpy(rec->data, e->tagData.msg.data, sizeof(rec->data));
+    if (fileNodePtr->rxRingOverrun) {
+      rec->flags |= VCAN_MSG_FLAG_OVERRUN;
+      fileNodePtr->rxRingOverrun = 0;
+    }
   } else {
-    rcv->bufHead++;
+    // Chip state and other events are all smaller than a message
+    rec->id    = 0;
+    rec->flags = 0;
+    rec->dlc   = 0;
+    memcpy(rec->data, &e->tagData, sizeof(rec->data));
   }
 
-  wake_up_interruptible(&rcv->rxWaitQ);
+  // The record must be visible before the new head
+  smp_wmb();
+  fileNodePtr->rxRingHead = head + 1;
+  *(volatile uint32_t *)&hdr->head = head + 1;
 
-  return VCAN_STAT_OK;
+  vCanRcvWake(&fileNodePtr->rcv, head + 1 - tail);
+}
+
+//======================================================================
+//  Number of records waiting in memory mapped rx ring
+//======================================================================
+static int vCanRxRingLevel (VCanOpenFileNode *fileNodePtr)
+{
+  uint32_t level;
+
+  level = fileNodePtr->rxRingHead -
+          *(volatile uint32_t *)&fileNodePtr->rxRing->tail;
+  // The tail is written by user space, so do not trust it
+  if (level > fileNodePtr->rxRingSize) {
+    level = fileNodePtr->rxRingSize;
+  }
+
+  return level;
+}
+
+//======================================================================
+//  Allocate a latest value mailbox with room for maxIds ids
+//======================================================================
+static VCanMailbox *vCanMailboxAlloc (uint32_t maxIds)
+{
+  VCanMailbox *mb;
+  uint32_t     size = 16;
+
+  while (size < 2 * maxIds) {
+    size <<= 1;
+  }
+  mb = vmalloc(sizeof(VCanMailbox) + size * sizeof(VCanMailboxSlot) +
+               maxIds * sizeof(uint32_t));
+  if (!mb) {
+    return NULL;
+  }
+  memset(mb->slot, 0, size * sizeof(VCanMailboxSlot));
+  mb->size        = size;
+  mb->maxIds      = maxIds;
+  mb->nUsed       = 0;
+  mb->nChanged    = 0;
+  mb->changedHead = 0;
+  mb->changedList = (uint32_t *)&mb->slot[size];
+
+  return mb;
+}
+
+//======================================================================
+//  Find the mailbox slot for an id, including VCAN_EXT_MSG_ID,
+//  optionally taking an unused slot
+//  Must be called with fileNodePtr->rcv.rcvLock held.
+//======================================================================
+static VCanMailboxSlot *vCanMailboxLookup (VCanMailbox *mb, uint32_t id,
+                                           int create)
+{
+  uint32_t i = (id * 0x9E3779B1u) >> 16;
+
+  while (1) {
+    VCanMailboxSlot *slot = &mb->slot[i & (mb->size - 1)];
+
+    if (!slot->used) {
+      if (!create || (mb->nUsed >= mb->maxIds)) {
+        return NULL;
+      }
+      slot->used = 1;
+      mb->nUsed++;
+      return slot;
+    }
+    if (slot->rec.id == id) {
+      return slot;
+    }
+    i++;
+  }
+}
+
+//======================================================================
+//  Store a received message as the latest value for its id
+//  Must be called with fileNodePtr->rcv.rcvLock held.
+//======================================================================
+static void vCanMailboxUpdate (VCanOpenFileNode *fileNodePtr, VCAN_EVENT *e,
+                               unsigned short int msg_flags)
+{
+  VCanMailbox     *mb   = fileNodePtr->mailbox;
+  VCanMailboxSlot *slot = vCanMailboxLookup(mb, e->tagData.msg.id, 1);
+
+  if (!slot) {
+    // More ids than the mailbox was set up for
+    fileNodePtr->overrun.sw++;
+    return;
+  }
+
+  slot->rec.id        = e->tagData.msg.id;
+  slot->rec.flags     = msg_flags;
+  slot->rec.dlc       = e->tagData.msg.dlc;
+  slot->rec.timeStamp = e->timeStamp - fileNodePtr->time_start_10usec;
+  memcpy(slot->rec.data, e->tagData.msg.data, sizeof(slot->rec.data));
+  slot->rec.updates++;
+  if (!slot->changed) {
+    // Each slot is listed at most once, so the list never overflows
+    slot->changed = 1;
+    mb->changedList[(mb->changedHead + mb->nChanged) % mb->maxIds] =
+      slot - mb->slot;
+    mb->nChanged++;
+    // Makes the handle readable in vCanPoll()
+    vCanRcvWake(&fileNodePtr->rcv, mb->nChanged);
+  }
 }
 
 //======================================================================
@@ -391,184 +975,657 @@ void vCanCardRemoved (VCanChanData *chd)
       }
     }
   }
+
+  vCanCardListChanged();
+}
+EXPORT_SYMBOL(vCanCardRemoved);
+
+//======================================================================
+//  A card has been added to or removed from a driver's list of cards
+//======================================================================
+void vCanCardListChanged (void)
+{
+  atomic_inc(&vCanChannelGeneration);
+}
+EXPORT_SYMBOL(vCanCardListChanged);
+
+//======================================================================
+//  Free common data for one card, allocated by vCanInitData
+//  Must not be called until all channels are closed.
+//======================================================================
+void vCanRemoveData (VCanCardData *vCard)
+{
+  unsigned int chNr;
+
+  for (chNr = 0; chNr < vCard->nrChannels; chNr++) {
+    VCanChanData *vChd = vCard->chanData[chNr];
+
+    free_percpu(vChd->busCounters);
+    vChd->busCounters = NULL;
+    free_percpu(vChd->busIdCounters);
+    vChd->busIdCounters = NULL;
+    kfree(vChd->busIdBase);
+    vChd->busIdBase = NULL;
+    vfree(rcu_dereference_protected(vChd->idMonitor, 1));
+    RCU_INIT_POINTER(vChd->idMonitor, NULL);
+  }
+
+  vCanCardListChanged();
+}
+EXPORT_SYMBOL(vCanRemoveData);
+
+//======================================================================
+//  Histogram bucket for the time between two frames, in ticks
+//======================================================================
+static unsigned int vCanIntervalBucket (uint64_t dt)
+{
+  unsigned int b = fls64(dt);
+
+  return (b >= VCAN_BUS_HIST_BUCKETS) ? VCAN_BUS_HIST_BUCKETS - 1 : b;
+}
+
+//======================================================================
+//  Allocate an id monitor with room for maxIds ids
+//======================================================================
+static VCanIdMonitor *vCanIdMonitorAlloc (uint32_t maxIds)
+{
+  VCanIdMonitor *mon;
+  uint32_t       size = 16;
+
+  while (size < 2 * maxIds) {
+    size <<= 1;
+  }
+  mon = vmalloc(sizeof(VCanIdMonitor) + size * sizeof(VCanIdMonitorRecord));
+  if (!mon) {
+    return NULL;
+  }
+  memset(mon->slot, 0, size * sizeof(VCanIdMonitorRecord));
+  spin_lock_init(&mon->lock);
+  mon->size    = size;
+  mon->maxIds  = maxIds;
+  mon->nUsed   = 0;
+  mon->dropped = 0;
+
+  return mon;
+}
+
+static void vCanIdMonitorFree (struct rcu_head *rcu)
+{
+  vfree(container_of(rcu, VCanIdMonitor, rcu));
+}
+
+//======================================================================
+//  Account one frame in the id monitor of a channel
+//======================================================================
+static void vCanIdMonitorUpdate (VCanChanData *chd, VCAN_EVENT *e)
+{
+  VCanIdMonitor       *mon;
+  VCanIdMonitorRecord *rec;
+  uint32_t             id = e->tagData.msg.id & (VCAN_EXT_MSG_ID | 0x1FFFFFFF);
+  uint32_t             i  = ((id & 0x1FFFFFFF) * 0x9E3779B1u) >> 16;
+  unsigned long        irqFlags;
+
+  rcu_read_lock();
+  mon = rcu_dereference(chd->idMonitor);
+  if (!mon) {
+    rcu_read_unlock();
+    return;
+  }
+
+  spin_lock_irqsave(&mon->lock, irqFlags);
+  while (1) {
+    rec = &mon->slot[i & (mon->size - 1)];
+    if (!rec->count) {
+      if (mon->nUsed >= mon->maxIds) {
+        mon->dropped++;
+        rec = NULL;
+      } else {
+        rec->id = id;
+        mon->nUsed++;
+      }
+      break;
+    }
+    if (rec->id == id) {
+      break;
+    }
+    i++;
+  }
+
+  if (rec) {
+    if (rec->count && e->timeStamp >= rec->lastTime) {
+      uint64_t dt = e->timeStamp - rec->lastTime;
+      uint32_t d  = (dt > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)dt;
+
+      if (rec->count == 1 || d < rec->minInterval) {
+        rec->minInterval = d;
+      }
+      if (d > rec->maxInterval) {
+        rec->maxInterval = d;
+      }
+      rec->interval[vCanIntervalBucket(dt)]++;
+    }
+    rec->lastTime = e->timeStamp;
+    rec->count++;
+  }
+  spin_unlock_irqrestore(&mon->lock, irqFlags);
+  rcu_read_unlock();
+}
+
+//======================================================================
+//  Update bus statistics, once per received frame
+//  The counters are per CPU so that no lock is needed.
+//======================================================================
+static void vCanUpdateBusStats (VCanChanData *chd, VCAN_EVENT *e)
+{
+  unsigned short int          msg_flags = e->tagData.msg.flags;
+  VCanBusCounters   __percpu *c = chd->busCounters;
+  VCanBusIdCounters __percpu *ids;
+  uint64_t                    last;
+
+  if (!c) {
+    return;
+  }
+
+  if (msg_flags & VCAN_MSG_FLAG_ERROR_FRAME) {
+    if ((msg_flags & VCAN_MSG_FLAG_TX_START) ||
+        (msg_flags & VCAN_MSG_FLAG_TXACK)) //pciefd sends txack on error frames
+    {
+      return;
+    }
+    this_cpu_add(c->bitCount, 16);
+    this_cpu_inc(c->errFrame);
+  }
+  else {
+    if (msg_flags & VCAN_MSG_FLAG_TX_START) {
+      return;
+    }
+    this_cpu_add(c->bitCount, (e->tagData.msg.dlc > 8 ? 8 : e->tagData.msg.dlc) * 10);
+    if (e->tagData.msg.id & VCAN_EXT_MSG_ID) {
+      this_cpu_add(c->bitCount, 70);
+      if (msg_flags & VCAN_MSG_FLAG_REMOTE_FRAME) {
+        this_cpu_inc(c->extRemote);
+      }
+      else {
+        this_cpu_inc(c->extData);
+      }
+    }
+    else {
+      this_cpu_add(c->bitCount, 50);
+      if (msg_flags & VCAN_MSG_FLAG_REMOTE_FRAME) {
+        this_cpu_inc(c->stdRemote);
+      }
+      else {
+        this_cpu_inc(c->stdData);
+      }
+      ids = READ_ONCE(chd->busIdCounters);
+      if (ids) {
+        this_cpu_inc(ids->count[e->tagData.msg.id & (VCAN_BUS_STD_IDS - 1)]);
+      }
+    }
+  }
+
+  // Frames on one channel are dispatched in order, so a plain
+  // timestamp is enough to get the time since the previous one.
+  last = READ_ONCE(chd->busLastFrame);
+  WRITE_ONCE(chd->busLastFrame, e->timeStamp);
+  if (last && e->timeStamp >= last) {
+    this_cpu_inc(c->interval[vCanIntervalBucket(e->timeStamp - last)]);
+  }
+
+  if (!(msg_flags & VCAN_MSG_FLAG_ERROR_FRAME)) {
+    vCanIdMonitorUpdate(chd, e);
+  }
+}
+
+//======================================================================
+//  Sum the per CPU frame counters of a channel
+//======================================================================
+static void vCanBusStatsCollect (VCanChanData *chd, VCanBusCounters *sum)
+{
+  int cpu;
+  int i;
+
+  memset(sum, 0, sizeof(*sum));
+  if (!chd->busCounters) {
+    return;
+  }
+  for_each_possible_cpu(cpu) {
+    VCanBusCounters *c = per_cpu_ptr(chd->busCounters, cpu);
+
+    sum->stdData   += c->stdData;
+    sum->stdRemote += c->stdRemote;
+    sum->extData   += c->extData;
+    sum->extRemote += c->extRemote;
+    sum->errFrame  += c->errFrame;
+    sum->bitCount  += c->bitCount;
+    for (i = 0; i < VCAN_BUS_HIST_BUCKETS; i++) {
+      sum->interval[i] += c->interval[i];
+    }
+  }
+}
+
+//======================================================================
+//  Sum the per CPU id counters of a channel, into sum
+//======================================================================
+static void vCanBusIdStatsCollect (VCanBusIdCounters __percpu *ids,
+                                   VCanBusIdCounters *sum)
+{
+  int cpu;
+  int i;
+
+  memset(sum, 0, sizeof(*sum));
+  for_each_possible_cpu(cpu) {
+    VCanBusIdCounters *c = per_cpu_ptr(ids, cpu);
+
+    for (i = 0; i < VCAN_BUS_STD_IDS; i++) {
+      sum->count[i] += c->count[i];
+    }
+  }
+}
+
+//======================================================================
+//  Restart the bus statistics of a channel
+//  The per CPU counters keep running; the current sums become the new
+//  base that is subtracted when they are read.
+//======================================================================
+static void vCanBusStatsReset (VCanChanData *chd)
+{
+  memset(&chd->busStats, 0, sizeof(chd->busStats));
+  vCanBusStatsCollect(chd, &chd->busBase);
+  chd->busBitMark = chd->busBase.bitCount;
+  WRITE_ONCE(chd->busLastFrame, 0);
+  if (chd->busIdCounters) {
+    vCanBusIdStatsCollect(chd->busIdCounters, chd->busIdBase);
+  }
+}
+
+//======================================================================
+//  Get the bus statistics of a channel
+//  stat->bitCount is counted from the last busload update.
+//======================================================================
+static void vCanBusStatsGet (VCanChanData *chd, VCanBusStatistics *stat,
+                             __u32 *interval)
+{
+  VCanBusCounters sum;
+  int             i;
+
+  vCanBusStatsCollect(chd, &sum);
+  *stat           = chd->busStats;
+  stat->stdData   = sum.stdData   - chd->busBase.stdData;
+  stat->stdRemote = sum.stdRemote - chd->busBase.stdRemote;
+  stat->extData   = sum.extData   - chd->busBase.extData;
+  stat->extRemote = sum.extRemote - chd->busBase.extRemote;
+  stat->errFrame  = sum.errFrame  - chd->busBase.errFrame;
+  stat->bitCount  = sum.bitCount  - chd->busBitMark;
+  if (interval) {
+    for (i = 0; i < VCAN_BUS_HIST_BUCKETS; i++) {
+      interval[i] = sum.interval[i] - chd->busBase.interval[i];
+    }
+  }
+}
+
+//======================================================================
+//  Deliver an event to one open file node
+//  Called under rcu_read_lock() only, so events for the same node can
+//  be delivered concurrently from different contexts.
+//======================================================================
+static void vCanDispatchToFile (VCanChanData *chd, VCanOpenFileNode *fileNodePtr,
+                                VCAN_EVENT *e)
+{
+  const VCanIdFilter *idFilter;
+  unsigned long       rcvLock_irqFlags;
+  unsigned short int  msg_flags;
+  long                objbuf_mask;
+  int                 queue_length;
+
+  if (!fileNodePtr->isBusOn && !fileNodePtr->notify) {
+    return;
+  }
+  
+  if (e->tag == V_CHIP_STATE) {
+    // Events for a node can be dispatched from several contexts at once
+    spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+    fileNodePtr->chip_status.busStatus      = e->tagData.chipState.busStatus;
+    fileNodePtr->chip_status.txErrorCounter = e->tagData.chipState.txErrorCounter;
+    fileNodePtr->chip_status.rxErrorCounter = e->tagData.chipState.rxErrorCounter;
+    spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+    if (!fileNodePtr->notify) {
+      return;
+    }
+  }
+
+  // Event filter
+  if (!(e->tag & fileNodePtr->filter.eventMask)) {
+    return;
+  }
+
+  msg_flags = e->tagData.msg.flags;
+
+  if (e->tag == V_RECEIVE_MSG && msg_flags & VCAN_MSG_FLAG_TXACK) {
+    // Skip if we sent it ourselves and we don't want the ack
+    if (e->transId == fileNodePtr->transId && !fileNodePtr->modeTx) {
+      DEBUGPRINT(2, (TXT("TXACK Skipped since we sent it ourselves and we don't want the ack!\n")));
+      return;
+    }
+    if (e->transId != fileNodePtr->transId) {
+      // Don't receive on virtual busses if explicitly denied.
+      if (fileNodePtr->modeNoTxEcho) {
+        return;
+      }
+      // Other receivers (virtual bus extension) should not see the TXACK.
+      msg_flags &= ~VCAN_MSG_FLAG_TXACK;
+
+      // dont report any SSM NACK's on other handles (on same channel).
+      if (msg_flags & VCAN_MSG_FLAG_SSM_NACK) {
+        return;
+      }
+    }
+  }
+  if (e->tag == V_RECEIVE_MSG && msg_flags & VCAN_MSG_FLAG_TXRQ) {
+    // Receive only if we sent it and we want the tx request
+    if (e->transId != fileNodePtr->transId || !fileNodePtr->modeTxRq) {
+      return;
+    }
+  }
+  // CAN filter
+  if (e->tag == V_RECEIVE_MSG || e->tag == V_TRANSMIT_MSG) {
+    unsigned int id = e->tagData.msg.id & ~VCAN_EXT_MSG_ID;
+    if ((e->tagData.msg.id & VCAN_EXT_MSG_ID) == 0) {
+
+      // Standard message
+
+      if ((fileNodePtr->filter.stdId == 0xFFFF) && (fileNodePtr->filter.stdMask == 0xFFFF)) {//from windows
+        return;
+      } else if ((fileNodePtr->filter.stdId ^ id) & fileNodePtr->filter.stdMask & 0x07FF) {
+        return;
+      }
+    } else {
+      // Extended message
+      if ((fileNodePtr->filter.extId ^ id) & fileNodePtr->filter.extMask) {
+        return;
+      }
+    }
+    idFilter = rcu_dereference(fileNodePtr->idFilter);
+    if (idFilter && !vCanIdFilterMatch(idFilter, e->tagData.msg.id)) {
+      return;
+    }
+
+    //
+    // Check against the object buffers, if any.
+    //
+    if (!(msg_flags & (VCAN_MSG_FLAG_TXRQ | VCAN_MSG_FLAG_TXACK)) &&
+        ((objbuf_mask = objbuf_filter_match(fileNodePtr->objbuf,
+                                            e->tagData.msg.id,
+                                            msg_flags)) != 0)) {
+      // This is something that matched the code/mask for at least one buffer,
+      // and it's *not* a TXRQ or a TXACK.
+#if defined(__arm__) || defined(__aarch64__)
+      unsigned int rd;
+      unsigned int new_rd;
+      do {
+        rd = atomic_read(&fileNodePtr->objbufActive);
+        new_rd = rd | objbuf_mask;
+      } while (atomic_cmpxchg(&fileNodePtr->objbufActive, rd, new_rd) != rd);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+      atomic_set_mask(objbuf_mask, &fileNodePtr->objbufActive);
+#else
+      atomic_or(objbuf_mask, &fileNodePtr->objbufActive);
+#endif
+      queue_work(fileNodePtr->objbufTaskQ,
+                 &fileNodePtr->objbufWork);
+    }
+  }
+
+  spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+  // The overrun counters are only changed with rcvLock held
+  if (((e->tag == V_RECEIVE_MSG) || (e->tag == V_TRANSMIT_MSG)) &&
+      (msg_flags & VCAN_MSG_FLAG_OVERRUN)) {
+    fileNodePtr->overrun.sw++;
+    fileNodePtr->overrun.hw++;
+  }
+  if (fileNodePtr->mailbox && (e->tag == V_RECEIVE_MSG)) {
+    vCanMailboxUpdate(fileNodePtr, e, msg_flags);
+    spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+    return;
+  }
+  if (fileNodePtr->rxRing) {
+    // All events go through the ring, to keep their order
+    vCanPushRxRing(fileNodePtr, e, msg_flags);
+    spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+    return;
+  }
+
+  if (fileNodePtr->rcv.lockless) {
+    VCanReceiveData *rcv  = &fileNodePtr->rcv;
+    int              head = rcv->bufHead;
+    int              tail = smp_load_acquire(&rcv->bufTail);
+
+    if (((head >= rcv->size - 1) ? 0 : head + 1) == tail) {
+      fileNodePtr->overrun.sw++;
+      DEBUGPRINT(2, (TXT("File node overrun\n")));
+      // Readers only move bufTail with readLock held. Without a reader
+      // the oldest event is dropped and the next one marked, as in the
+      // locked queue. A reader that holds readLock is taking the oldest
+      // event right now, so then the new event is dropped instead and the
+      // next one pushed is marked.
+      if (!spin_trylock(&rcv->readLock)) {
+        rcv->overrunPending = 1;
+        spin_unlock_irqrestore(&rcv->rcvLock, rcvLock_irqFlags);
+        return;
+      }
+      tail = (tail >= rcv->size - 1) ? 0 : tail + 1;
+      rcv->bufTail = tail;
+      vCanRcvMarkOverrun(rcv, tail);
+      spin_unlock(&rcv->readLock);
+    }
+  }
+
+  {
+    VCAN_EVENT *qe = vCanRcvEvent(&fileNodePtr->rcv, fileNodePtr->rcv.bufHead);
+
+    memcpy(qe, e, fileNodePtr->rcv.evtSize);
+    qe->tagData.msg.flags = msg_flags;
+    qe->timeStamp -= fileNodePtr->time_start_10usec;
+    if (fileNodePtr->rcv.overrunPending) {
+      qe->tagData.msg.flags |= VCAN_MSG_FLAG_OVERRUN;
+      fileNodePtr->rcv.overrunPending = 0;
+    }
+  }
+  vCanPushReceiveBuffer(&fileNodePtr->rcv);
+  queue_length = getQLen(fileNodePtr->rcv.bufHead,
+                         fileNodePtr->rcv.bufTail,
+                         fileNodePtr->rcv.size);
+
+  DEBUGPRINT(3, (TXT("Number of packets in receive queue: %d\n"), queue_length));
+  if (queue_length > fileNodePtr->rcv.highWater) {
+    fileNodePtr->rcv.highWater = queue_length;
+  }
+
+  if ((queue_length == 0) && !fileNodePtr->rcv.lockless) {
+    // The buffer is full
+    fileNodePtr->overrun.sw++;
+    DEBUGPRINT(2, (TXT("File node overrun\n")));
+    // Mark message
+    vCanPopReceiveBuffer(&fileNodePtr->rcv);
+    vCanRcvMarkOverrun(&fileNodePtr->rcv, fileNodePtr->rcv.bufTail);
+  }
+  spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
 }
-EXPORT_SYMBOL(vCanCardRemoved);
 
-int vCanDispatchEvent (VCanChanData *chd, VCAN_EVENT *e)
+//======================================================================
+//  Can a node take 11-bit (ext = 0) or 29-bit (ext = 1) frames at all
+//  Must be called with chd->openLock held.
+//======================================================================
+static int vCanMayTakeFrame (VCanOpenFileNode *fnp, int ext)
 {
-  VCanOpenFileNode *fileNodePtr;
-  unsigned long    openLock_irqFlags;
-  unsigned long    rcvLock_irqFlags;
-  long             objbuf_mask;
-  int              queue_length;
-
-  // Update and notify readers
-  // Needs to be _irqsave since some drivers call from ISR:s.
-  spin_lock_irqsave(&chd->openLock, openLock_irqFlags);
-  for (fileNodePtr = chd->openFileList; fileNodePtr != NULL;
-       fileNodePtr = fileNodePtr->next) {
+  const VCanIdFilter *idFilter;
 
-    unsigned short int msg_flags;
+  idFilter = rcu_dereference_protected(fnp->idFilter,
+                                       lockdep_is_held(&fnp->chanData->openLock));
 
-    if (!fileNodePtr->isBusOn && !fileNodePtr->notify) {
-      continue;
+  if (!fnp->isBusOn && !fnp->notify) {
+    return 0;
+  }
+  if (!(fnp->filter.eventMask & (V_RECEIVE_MSG | V_TRANSMIT_MSG))) {
+    return 0;
+  }
+  if (!ext) {
+    if ((fnp->filter.stdId == 0xFFFF) && (fnp->filter.stdMask == 0xFFFF)) {
+      return 0;
     }
-    
-    if (e->tag == V_CHIP_STATE) {
-      fileNodePtr->chip_status.busStatus      = e->tagData.chipState.busStatus;
-      fileNodePtr->chip_status.txErrorCounter = e->tagData.chipState.txErrorCounter;
-      fileNodePtr->chip_status.rxErrorCounter = e->tagData.chipState.rxErrorCounter;
-      if (!fileNodePtr->notify) {
-        continue;
+    if (idFilter && (idFilter->flags & VCAN_ID_FILTER_STD)) {
+      int i;
+
+      for (i = 0; i < ARRAY_SIZE(idFilter->stdBitmap); i++) {
+        if (idFilter->stdBitmap[i]) {
+          return 1;
+        }
       }
+      return 0;
     }
-
-    // Event filter
-    if (!(e->tag & fileNodePtr->filter.eventMask)) {
-      continue;
+  } else {
+    if (idFilter && (idFilter->flags & VCAN_ID_FILTER_EXT) &&
+        (idFilter->extCount == 0)) {
+      return 0;
     }
+  }
 
-    msg_flags = e->tagData.msg.flags;
+  return 1;
+}
 
-    if (e->tag == V_RECEIVE_MSG) {
-      // Update bus statistics
-      if (msg_flags & VCAN_MSG_FLAG_ERROR_FRAME) {
-        if (!(msg_flags & VCAN_MSG_FLAG_TX_START) && 
-            !(msg_flags & VCAN_MSG_FLAG_TXACK)) //pciefd sends txack on error frames
-        {
-          chd->busStats.bitCount += 16;
-          chd->busStats.errFrame++;
-        }
-      }
-      else {
-        if (!(msg_flags & VCAN_MSG_FLAG_TX_START)) {
-          chd->busStats.bitCount += (e->tagData.msg.dlc > 8 ? 8 : e->tagData.msg.dlc) * 10;
-          if (e->tagData.msg.id & VCAN_EXT_MSG_ID) {
-            chd->busStats.bitCount += 70;
-            if (msg_flags & VCAN_MSG_FLAG_REMOTE_FRAME) {
-              chd->busStats.extRemote++;
-            }
-            else {
-              chd->busStats.extData++;
-            }
-          }
-          else {
-            chd->busStats.bitCount += 50;
-            if (msg_flags & VCAN_MSG_FLAG_REMOTE_FRAME) {
-              chd->busStats.stdRemote++;
-            }
-            else {
-              chd->busStats.stdData++;
-            }
-          }
-        }
-      }
+//======================================================================
+//  Rebuild the listener snapshot used by vCanDispatchEvent
+//  Must be called after a node is added or removed, and after anything
+//  vCanMayTakeFrame() looks at has changed. Process context only.
+//======================================================================
+static void vCanUpdateListeners (VCanChanData *chd)
+{
+  VCanListeners    *ls = NULL;
+  VCanListeners    *old;
+  VCanOpenFileNode *fnp;
+  unsigned long     irqFlags;
+  int               max = 0;
+  int               n;
+
+  // Nodes can be added while the lock is released for the allocation.
+  // Without a snapshot, dispatch walks the whole list instead.
+  for (;;) {
+    spin_lock_irqsave(&chd->openLock, irqFlags);
+    n = 0;
+    for (fnp = chd->openFileList; fnp != NULL; fnp = fnp->next) {
+      n++;
+    }
+    if (n <= max) {
+      break;
     }
+    spin_unlock_irqrestore(&chd->openLock, irqFlags);
 
-    if (e->tag == V_RECEIVE_MSG && msg_flags & VCAN_MSG_FLAG_TXACK) {
-      // Skip if we sent it ourselves and we don't want the ack
-      if (e->transId == fileNodePtr->transId && !fileNodePtr->modeTx) {
-        DEBUGPRINT(2, (TXT("TXACK Skipped since we sent it ourselves and we don't want the ack!\n")));
-        continue;
-      }
-      if (e->transId != fileNodePtr->transId) {
-        // Don't receive on virtual busses if explicitly denied.
-        if (fileNodePtr->modeNoTxEcho) {
-          continue;
-        }
-        // Other receivers (virtual bus extension) should not see the TXACK.
-        msg_flags &= ~VCAN_MSG_FLAG_TXACK;
+    kfree(ls);
+    max = n;
+    ls  = kmalloc(sizeof(VCanListeners) + 3 * max * sizeof(ls->node[0]), GFP_KERNEL);
+    if (!ls) {
+      spin_lock_irqsave(&chd->openLock, irqFlags);
+      break;
+    }
+  }
+  if (n == 0) {
+    kfree(ls);
+    ls = NULL;
+  }
 
-        // dont report any SSM NACK's on other handles (on same channel).
-        if (msg_flags & VCAN_MSG_FLAG_SSM_NACK) {
-          continue;
-        }
+  if (ls) {
+    n = 0;
+    ls->nStd = 0;
+    for (fnp = chd->openFileList; fnp != NULL; fnp = fnp->next) {
+      if (vCanMayTakeFrame(fnp, 0)) {
+        ls->node[n++] = fnp;
+        ls->nStd++;
       }
     }
-    if (e->tag == V_RECEIVE_MSG && msg_flags & VCAN_MSG_FLAG_TXRQ) {
-      // Receive only if we sent it and we want the tx request
-      if (e->transId != fileNodePtr->transId || !fileNodePtr->modeTxRq) {
-        continue;
+    ls->nExt = 0;
+    for (fnp = chd->openFileList; fnp != NULL; fnp = fnp->next) {
+      if (vCanMayTakeFrame(fnp, 1)) {
+        ls->node[n++] = fnp;
+        ls->nExt++;
       }
     }
-    // CAN filter
-    if (e->tag == V_RECEIVE_MSG || e->tag == V_TRANSMIT_MSG) {
-      unsigned int id = e->tagData.msg.id & ~VCAN_EXT_MSG_ID;
-      if ((e->tagData.msg.id & VCAN_EXT_MSG_ID) == 0) {
+    ls->nAll = 0;
+    for (fnp = chd->openFileList; fnp != NULL; fnp = fnp->next) {
+      if (fnp->isBusOn || fnp->notify) {
+        ls->node[n++] = fnp;
+        ls->nAll++;
+      }
+    }
+  }
 
-        // Standard message
+  old = rcu_dereference_protected(chd->listeners, lockdep_is_held(&chd->openLock));
+  rcu_assign_pointer(chd->listeners, ls);
+  spin_unlock_irqrestore(&chd->openLock, irqFlags);
 
-        if ((fileNodePtr->filter.stdId == 0xFFFF) && (fileNodePtr->filter.stdMask == 0xFFFF)) {//from windows
-          continue;
-        } else if ((fileNodePtr->filter.stdId ^ id) & fileNodePtr->filter.stdMask & 0x07FF) {
-          continue;
-        }
-      } else {
-        // Extended message
-        if ((fileNodePtr->filter.extId ^ id) & fileNodePtr->filter.extMask) {
-          continue;
-        }
-      }
+  if (old) {
+    kfree_rcu(old, rcu);
+  }
+}
 
-      if (msg_flags & VCAN_MSG_FLAG_OVERRUN) {
-        fileNodePtr->overrun.sw++;
-        fileNodePtr->overrun.hw++;
-       }
+int vCanDispatchEvent (VCanChanData *chd, VCAN_EVENT *e)
+{
+  VCanListeners    *ls;
+  VCanOpenFileNode *fileNodePtr;
+  int               i;
 
-      //
-      // Check against the object buffers, if any.
-      //
-      if (!(msg_flags & (VCAN_MSG_FLAG_TXRQ | VCAN_MSG_FLAG_TXACK)) &&
-          ((objbuf_mask = objbuf_filter_match(fileNodePtr->objbuf,
-                                              e->tagData.msg.id,
-                                              msg_flags)) != 0)) {
-        // This is something that matched the code/mask for at least one buffer,
-        // and it's *not* a TXRQ or a TXACK.
-#if defined(__arm__) || defined(__aarch64__)
-        unsigned int rd;
-        unsigned int new_rd;
-        do {
-          rd = atomic_read(&fileNodePtr->objbufActive);
-          new_rd = rd | objbuf_mask;
-        } while (atomic_cmpxchg(&fileNodePtr->objbufActive, rd, new_rd) != rd);
-#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
-        atomic_set_mask(objbuf_mask, &fileNodePtr->objbufActive);
-#else
-        atomic_or(objbuf_mask, &fileNodePtr->objbufActive);
-#endif
-        queue_work(fileNodePtr->objbufTaskQ,
-                   &fileNodePtr->objbufWork);
+  if (e->tag == V_RECEIVE_MSG) {
+    vCanUpdateBusStats(chd, e);
+  }
+
+  // Update and notify readers
+  // Open file nodes are freed only after an RCU grace period, so the
+  // channel wide openLock is not needed here.
+  rcu_read_lock();
+  ls = rcu_dereference(chd->listeners);
+  if (ls) {
+    VCanOpenFileNode **node = ls->node;
+    int                n;
+
+    if ((e->tag == V_RECEIVE_MSG) || (e->tag == V_TRANSMIT_MSG)) {
+      if (e->tagData.msg.id & VCAN_EXT_MSG_ID) {
+        node += ls->nStd;
+        n     = ls->nExt;
+      } else {
+        n     = ls->nStd;
       }
+    } else {
+      node += ls->nStd + ls->nExt;
+      n     = ls->nAll;
     }
-
-    spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
-    memcpy(&(fileNodePtr->rcv.fileRcvBuffer[fileNodePtr->rcv.bufHead]), e, sizeof(VCAN_EVENT));
-    fileNodePtr->rcv.fileRcvBuffer[fileNodePtr->rcv.bufHead].tagData.msg.flags = msg_flags;
-    fileNodePtr->rcv.fileRcvBuffer[fileNodePtr->rcv.bufHead].timeStamp -= fileNodePtr->time_start_10usec;
-    vCanPushReceiveBuffer(&fileNodePtr->rcv);
-    queue_length = getQLen(fileNodePtr->rcv.bufHead,
-                           fileNodePtr->rcv.bufTail,
-                           fileNodePtr->rcv.size);
-
-    DEBUGPRINT(3, (TXT("Number of packets in receive queue: %d\n"), queue_length));
-
-    if (queue_length == 0) {
-      // The buffer is full
-      fileNodePtr->overrun.sw++;
-      DEBUGPRINT(2, (TXT("File node overrun\n")));
-      // Mark message
-      vCanPopReceiveBuffer(&fileNodePtr->rcv);
-      fileNodePtr->rcv.fileRcvBuffer[fileNodePtr->rcv.bufTail].tagData.msg.flags |= VCAN_MSG_FLAG_OVERRUN;
+    for (i = 0; i < n; i++) {
+      vCanDispatchToFile(chd, node[i], e);
+    }
+  } else {
+    for (fileNodePtr = rcu_dereference(chd->openFileList); fileNodePtr != NULL;
+         fileNodePtr = rcu_dereference(fileNodePtr->next)) {
+      vCanDispatchToFile(chd, fileNodePtr, e);
     }
-    spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
   }
-  spin_unlock_irqrestore(&chd->openLock, openLock_irqFlags);
+  rcu_read_unlock();
 
   return 0;
 }
 EXPORT_SYMBOL(vCanDispatchEvent);
 
 
+//======================================================================
+//  Count a software overrun from outside fileNodePtr->rcv.rcvLock,
+//  which protects the overrun counters
+//======================================================================
+static void vCanCountSwOverrun (VCanOpenFileNode *fileNodePtr)
+{
+  unsigned long rcvLock_irqFlags;
+
+  spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+  fileNodePtr->overrun.sw++;
+  spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+}
+
 //======================================================================
 //  vCanDispatchPrintfEvent
 //======================================================================
@@ -637,7 +1694,7 @@ int vCanDispatchPrintfEvent (VCanCardData *vCard,
 		
       // Mark message
       vCanPopReceiveBuffer(&fileNodePtr->rcv_text);
-      fileNodePtr->overrun.sw++;
+      vCanCountSwOverrun(fileNodePtr);
 		
       spin_unlock_irqrestore(&fileNodePtr->rcv_text.rcvLock, rcvTextLock_irqFlags);
 	
@@ -678,7 +1735,7 @@ int vCanDispatchPrintfEvent (VCanCardData *vCard,
 		  
       if (queue_length == 0) {
         // The buffer is full
-        fileNodePtr->overrun.sw++;
+        vCanCountSwOverrun(fileNodePtr);
         DEBUGPRINT(2, (TXT("vCanDispatchPrintfEvent() rcv-buffer overrun\n")));
         // Mark message
         vCanPopReceiveBuffer(&fileNodePtr->rcv_text);
@@ -752,12 +1809,24 @@ int vCanOpen (struct inode *inode, struct file *filp)
   init_completion(&openFileNodePtr->ioctl_completion);
   complete(&openFileNodePtr->ioctl_completion);
 
-  openFileNodePtr->rcv.size = sizeof(openFileNodePtr->rcv.fileRcvBuffer) / sizeof(openFileNodePtr->rcv.fileRcvBuffer[0]);
-  openFileNodePtr->rcv_text.size = sizeof(openFileNodePtr->rcv_text.fileRcvBuffer) / sizeof(openFileNodePtr->rcv_text.fileRcvBuffer[0]);
+  openFileNodePtr->rcv.evtSize      = sizeof(VCAN_EVENT);
+  openFileNodePtr->rcv_text.evtSize = sizeof(VCAN_EVENT);
+  if ((vCanAllocReceiveBuffer(&openFileNodePtr->rcv, FILE_RCV_BUF_SIZE, 1) != VCAN_STAT_OK) ||
+      (vCanAllocReceiveBuffer(&openFileNodePtr->rcv_text, FILE_RCV_TEXT_BUF_SIZE, 0) != VCAN_STAT_OK)) {
+    vCanFreeReceiveBuffer(&openFileNodePtr->rcv);
+    kfree(openFileNodePtr);
+    return -ENOMEM;
+  }
 
     // Init wait queue
   init_waitqueue_head(&(openFileNodePtr->rcv.rxWaitQ));
   init_waitqueue_head(&(openFileNodePtr->rcv_text.rxWaitQ));
+  spin_lock_init(&(openFileNodePtr->rcv.rcvLock));
+  spin_lock_init(&(openFileNodePtr->rcv_text.rcvLock));
+  spin_lock_init(&(openFileNodePtr->rcv.readLock));
+  spin_lock_init(&(openFileNodePtr->rcv_text.readLock));
+  vCanRcvWakeInit(&openFileNodePtr->rcv);
+  vCanRcvWakeInit(&openFileNodePtr->rcv_text);
 
   vCanFlushReceiveBuffer(openFileNodePtr);
   
@@ -777,8 +1846,6 @@ int vCanOpen (struct inode *inode, struct file *filp)
   openFileNodePtr->isBusOn              = 0;
   openFileNodePtr->notify               = 0;
   openFileNodePtr->init_access          = 0;
-  spin_lock_init(&(openFileNodePtr->rcv.rcvLock));
-  spin_lock_init(&(openFileNodePtr->rcv_text.rcvLock));
 
   // Insert this node first in list of "opens"
   spin_lock_irqsave(&chanData->openLock, irqFlags);
@@ -798,7 +1865,7 @@ int vCanOpen (struct inode *inode, struct file *filp)
 
   atomic_inc(&chanData->fileOpenCount);
   openFileNodePtr->next  = chanData->openFileList;
-  chanData->openFileList = openFileNodePtr;
+  rcu_assign_pointer(chanData->openFileList, openFileNodePtr);
 
   chanData->driverMode = 0;
 
@@ -853,10 +1920,14 @@ int vCanClose (struct inode *inode, struct file *filp)
   fileNodePtr->channelOpen   = 0;
 
   // Remove node
-  *openPtrPtr = (*openPtrPtr)->next;
+  rcu_assign_pointer(*openPtrPtr, (*openPtrPtr)->next);
 
   spin_unlock_irqrestore(&chanData->openLock, irqFlags);
 
+  // Wait until vCanDispatchEvent can no longer be using the node
+  vCanUpdateListeners(chanData);
+  synchronize_rcu();
+
   hwIf = chanData->vCard->driverData->hwIf;
   if (fileNodePtr->isBusOn) {
       // This can happen if close (unistd.h) is called for the file descriptor.
@@ -896,6 +1967,15 @@ int vCanClose (struct inode *inode, struct file *filp)
   }
 
   if (fileNodePtr != NULL) {
+    if (fileNodePtr->rxRing) {
+      vfree(fileNodePtr->rxRing);
+    }
+    hrtimer_cancel(&fileNodePtr->rcv.wakeTimer);
+    hrtimer_cancel(&fileNodePtr->rcv_text.wakeTimer);
+    vCanFreeReceiveBuffer(&fileNodePtr->rcv);
+    vCanFreeReceiveBuffer(&fileNodePtr->rcv_text);
+    vfree(rcu_dereference_protected(fileNodePtr->idFilter, 1));
+    vfree(fileNodePtr->mailbox);
     kfree(fileNodePtr);
     fileNodePtr = NULL;
   }
@@ -928,6 +2008,26 @@ int txQEmpty (VCanChanData *chd)
   return queue_empty(&chd->txChanQueue);
 }
 
+//======================================================================
+// Prepare a message taken from user space for the transmit queue
+//======================================================================
+
+static void txMsgSetOrigin (VCanOpenFileNode *fileNodePtr, CAN_MSG *bufMsgPtr)
+{
+  VCanChanData *vChd = fileNodePtr->chanData;
+
+  // This is for keeping track of the originating fileNode
+  bufMsgPtr->user_data = fileNodePtr->transId;
+  bufMsgPtr->flags &= ~(VCAN_MSG_FLAG_TX_NOTIFY | VCAN_MSG_FLAG_TX_START);
+  if ((fileNodePtr->modeTx==TXACK_OFF || fileNodePtr->modeTx==TXACK_ON) || (atomic_read(&vChd->fileOpenCount) > 1)) {
+    bufMsgPtr->flags |= VCAN_MSG_FLAG_TX_NOTIFY;
+  }
+
+  if (fileNodePtr->modeTxRq) {
+    bufMsgPtr->flags |= VCAN_MSG_FLAG_TX_START;
+  }
+}
+
 //======================================================================
 //  IOCtl - File operation
 //======================================================================
@@ -972,10 +2072,10 @@ static int ioctl_non_blocking (VCanOpenFileNode *fileNodePtr,
 
     case VCAN_IOC_RECVMSG:
     {
-      unsigned long     rcvLock_irqFlags;
       VCAN_IOCTL_READ_T ioctl_read;
       VCAN_EVENT        msg;
       VCanRead          readOpt;
+      int               evtSize;
 
       if (copy_from_user(&ioctl_read, (VCAN_IOCTL_READ_T *)arg,
                          sizeof(VCAN_IOCTL_READ_T))) {
@@ -1005,15 +2105,176 @@ static int ioctl_non_blocking (VCanOpenFileNode *fileNodePtr,
         }
       }
 
+      spin_lock(&fileNodePtr->rcv.readLock);
+      evtSize = vCanRcvTake(&fileNodePtr->rcv, &msg);
+      spin_unlock(&fileNodePtr->rcv.readLock);
+      if (evtSize == 0) {
+        return -EAGAIN;
+      }
+      copy_to_user_ret((VCAN_EVENT *)ioctl_read.msg, &msg, evtSize, -EFAULT);
+      break;
+    }
+
+    case VCAN_IOC_RECVMSG_BATCH:
+    {
+      VCAN_IOCTL_READ_BATCH_T ioctl_read;
+      VCAN_EVENT              msg[RCV_BATCH_CHUNK];
+      unsigned int            count = 0;
+      unsigned int            n;
+      int                     evtSize = 0;
+
+      if (copy_from_user(&ioctl_read, (VCAN_IOCTL_READ_BATCH_T *)arg,
+                         sizeof(VCAN_IOCTL_READ_BATCH_T))) {
+        DEBUGPRINT(1, (TXT("ERROR: VCAN_IOC_RECVMSG_BATCH\n")));
+        return -EFAULT;
+      }
+      if (ioctl_read.max == 0) {
+        return -EINVAL;
+      }
+
+      if (ioctl_read.timeout) {
+        if (ioctl_read.timeout != -1) {
+          wait_event_interruptible_timeout (fileNodePtr->rcv.rxWaitQ,
+                                            (fileNodePtr->rcv.bufHead != fileNodePtr->rcv.bufTail) || !vCard->cardPresent,
+                                            msecs_to_jiffies (ioctl_read.timeout));
+        } else {
+          wait_event_interruptible (fileNodePtr->rcv.rxWaitQ,
+                                    (fileNodePtr->rcv.bufHead != fileNodePtr->rcv.bufTail) || !vCard->cardPresent);
+        }
+
+        if (signal_pending(current)) {
+          return -ERESTARTSYS;
+        } else if (!vCard->cardPresent) {
+          return -ESHUTDOWN;
+        }
+      }
+
+      // The copy to user memory can sleep, so the events are moved out
+      // of the receive buffer a chunk at a time via a stack buffer.
+      // Events are packed with the queue's event size.
+      while (count < ioctl_read.max) {
+        spin_lock(&fileNodePtr->rcv.readLock);
+        evtSize = fileNodePtr->rcv.evtSize;
+        for (n = 0; (n < RCV_BATCH_CHUNK) && (count + n < ioctl_read.max); n++) {
+          if (!vCanRcvTake(&fileNodePtr->rcv, (char *)msg + n * evtSize)) {
+            break;
+          }
+        }
+        spin_unlock(&fileNodePtr->rcv.readLock);
+
+        if (n == 0) {
+          break;
+        }
+        copy_to_user_ret((char *)ioctl_read.msg + count * evtSize, msg, n * evtSize, -EFAULT);
+        count += n;
+        if (n < RCV_BATCH_CHUNK) {
+          break;
+        }
+      }
+
+      if (count == 0) {
+        return -EAGAIN;
+      }
+      put_user_ret(count, &((VCAN_IOCTL_READ_BATCH_T *)arg)->count, -EFAULT);
+      break;
+    }
+
+    case VCAN_IOC_READ_MAILBOX:
+    {
+      unsigned long             rcvLock_irqFlags;
+      VCAN_IOCTL_MAILBOX_READ_T ioctl_read;
+      VCanMailboxSlot          *slot = NULL;
+
+      get_user_int_ret(ioctl_read.id, &((VCAN_IOCTL_MAILBOX_READ_T *)arg)->id, -EFAULT);
+
       spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
-      if (fileNodePtr->rcv.bufHead == fileNodePtr->rcv.bufTail) {
+      if (!fileNodePtr->mailbox) {
         spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
-        return -EAGAIN;
+        return -EINVAL;
+      }
+      slot = vCanMailboxLookup(fileNodePtr->mailbox, ioctl_read.id, 0);
+      if (slot) {
+        ioctl_read.rec = slot->rec;
       }
-      msg = fileNodePtr->rcv.fileRcvBuffer[fileNodePtr->rcv.bufTail];
-      vCanPopReceiveBuffer(&fileNodePtr->rcv);
       spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
-      copy_to_user_ret((VCAN_EVENT *)ioctl_read.msg, &msg, sizeof(VCAN_EVENT), -EFAULT);
+
+      if (!slot) {
+        return -EAGAIN;
+      }
+      copy_to_user_ret(&((VCAN_IOCTL_MAILBOX_READ_T *)arg)->rec, &ioctl_read.rec,
+                       sizeof(VCanMailboxRecord), -EFAULT);
+      break;
+    }
+
+    case VCAN_IOC_MAILBOX_SNAPSHOT:
+    {
+      unsigned long                 rcvLock_irqFlags;
+      VCAN_IOCTL_MAILBOX_SNAPSHOT_T ioctl_snap;
+      VCanMailboxRecord             rec[RCV_BATCH_CHUNK];
+      uint32_t                      slotNr[RCV_BATCH_CHUNK];
+      unsigned int                  count = 0;
+      unsigned int                  n;
+
+      if (copy_from_user(&ioctl_snap, (VCAN_IOCTL_MAILBOX_SNAPSHOT_T *)arg,
+                         sizeof(VCAN_IOCTL_MAILBOX_SNAPSHOT_T))) {
+        DEBUGPRINT(1, (TXT("ERROR: VCAN_IOC_MAILBOX_SNAPSHOT\n")));
+        return -EFAULT;
+      }
+
+      // Changed slots are taken off the front of the list a chunk at a time,
+      // as for VCAN_IOC_RECVMSG_BATCH.
+      while (count < ioctl_snap.max) {
+        VCanMailbox *mb;
+
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        mb = fileNodePtr->mailbox;
+        if (!mb) {
+          spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+          return -EINVAL;
+        }
+        for (n = 0; (n < RCV_BATCH_CHUNK) && (count + n < ioctl_snap.max) &&
+                    mb->nChanged; n++) {
+          VCanMailboxSlot *slot;
+
+          slotNr[n] = mb->changedList[mb->changedHead];
+          mb->changedHead = (mb->changedHead + 1) % mb->maxIds;
+          mb->nChanged--;
+          slot = &mb->slot[slotNr[n]];
+          slot->changed = 0;
+          rec[n] = slot->rec;
+        }
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+
+        if (n == 0) {
+          break;
+        }
+        if (copy_to_user(ioctl_snap.rec + count, rec, n * sizeof(VCanMailboxRecord))) {
+          // Put the slots back first in the list, in the same order, unless
+          // they changed again meanwhile or the mailbox was replaced
+          spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+          if (fileNodePtr->mailbox == mb) {
+            while (n--) {
+              VCanMailboxSlot *slot = &mb->slot[slotNr[n]];
+
+              if (slot->used && !slot->changed) {
+                slot->changed = 1;
+                mb->changedHead = (mb->changedHead + mb->maxIds - 1) % mb->maxIds;
+                mb->changedList[mb->changedHead] = slotNr[n];
+                mb->nChanged++;
+              }
+            }
+          }
+          spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+          DEBUGPRINT(1, (TXT("ERROR: VCAN_IOC_MAILBOX_SNAPSHOT\n")));
+          return -EFAULT;
+        }
+        count += n;
+        if (n < RCV_BATCH_CHUNK) {
+          break;
+        }
+      }
+
+      put_user_ret(count, &((VCAN_IOCTL_MAILBOX_SNAPSHOT_T *)arg)->count, -EFAULT);
       break;
     }
 
@@ -1050,6 +2311,35 @@ static int ioctl_non_blocking (VCanOpenFileNode *fileNodePtr,
       break;
     }
 
+    case VCAN_IOC_RX_RING_WAIT:
+    {
+      VCAN_IOCTL_RX_RING_WAIT_T ringWait;
+
+      copy_from_user_ret(&ringWait, (VCAN_IOCTL_RX_RING_WAIT_T *)arg,
+                         sizeof(VCAN_IOCTL_RX_RING_WAIT_T), -EFAULT);
+      if (!fileNodePtr->rxRing) {
+        return -EINVAL;
+      }
+
+      if (ringWait.timeout != 0xFFFFFFFF) {
+        wait_event_interruptible_timeout (fileNodePtr->rcv.rxWaitQ,
+                                          (READ_ONCE(fileNodePtr->rxRingHead) != ringWait.head) || !vCard->cardPresent,
+                                          msecs_to_jiffies (ringWait.timeout));
+      } else {
+        wait_event_interruptible (fileNodePtr->rcv.rxWaitQ,
+                                  (READ_ONCE(fileNodePtr->rxRingHead) != ringWait.head) || !vCard->cardPresent);
+      }
+
+      if (signal_pending(current)) {
+        return -ERESTARTSYS;
+      } else if (!vCard->cardPresent) {
+        return -ESHUTDOWN;
+      } else if (READ_ONCE(fileNodePtr->rxRingHead) == ringWait.head) {
+        return -ETIMEDOUT;
+      }
+      break;
+    }
+
     case VCAN_IOC_RECVMSG_SPECIFIC:
     {
       long              timeout = 0;
@@ -1098,17 +2388,27 @@ static int ioctl_non_blocking (VCanOpenFileNode *fileNodePtr,
         {
           uint32_t   found = 0;
           VCAN_EVENT msg;
+          int        evtSize;
 
+          spin_lock (&fileNodePtr->rcv.readLock);
           spin_lock_irqsave (&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+          evtSize = fileNodePtr->rcv.evtSize;
           if (fileNodePtr->rcv.bufHead == fileNodePtr->rcv.bufTail) {
             found = 0;
           } else {
+            if (fileNodePtr->rcv.lockless) {
+              vCanRcvIndexBuild(&fileNodePtr->rcv);
+            }
             found = read_specific (fileNodePtr, &readOpt, &msg);
+            if (fileNodePtr->rcv.bufHead == fileNodePtr->rcv.bufTail) {
+              fileNodePtr->rcv.lockless = 1;
+            }
           }
           spin_unlock_irqrestore (&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+          spin_unlock (&fileNodePtr->rcv.readLock);
 
           if (found) {
-            copy_to_user_ret((VCAN_EVENT *)ioctl_read.msg, &msg, sizeof(VCAN_EVENT), -EFAULT);
+            copy_to_user_ret((VCAN_EVENT *)ioctl_read.msg, &msg, evtSize, -EFAULT);
             break;
           } else {
             timeout = calc_timeout (&start, readOpt.timeout);
@@ -1142,42 +2442,90 @@ static int ioctl_non_blocking (VCanOpenFileNode *fileNodePtr,
 
         {
           CAN_MSG *bufMsgPtr;
-          CAN_MSG message;
           int queuePos;
+          int space;
 
-          // The copy from user memory can sleep, so it must
-          // not be done while holding the queue lock.
-          // This means an extra memcpy() from a stack buffer,
-          // but that can only be avoided by changing the queue
-          // buffer "allocation" method (queue_back/push).
-          if (copy_from_user(&message, (CAN_MSG *)arg, sizeof(CAN_MSG))) {
-            DEBUGPRINT(2, (TXT("VCAN_IOC_SENDMSG - returning -EFAULT\n")));
-            return -EFAULT;
-          }
-
-          queuePos = queue_back(&vChd->txChanQueue);
+          // The copy from user memory can sleep, so the slot is
+          // reserved rather than taken under the queue lock, and
+          // the message is copied straight into it.
+          queuePos = queue_reserve(&vChd->txChanQueue, &space);
           if (queuePos < 0) {
-            queue_release(&vChd->txChanQueue);
             return -EAGAIN;
           }
           bufMsgPtr = &vChd->txChanBuffer[queuePos];
 
-          memcpy(bufMsgPtr, &message, sizeof(CAN_MSG));
-
-          // This is for keeping track of the originating fileNode
-          bufMsgPtr->user_data = fileNodePtr->transId;
-          bufMsgPtr->flags &= ~(VCAN_MSG_FLAG_TX_NOTIFY | VCAN_MSG_FLAG_TX_START);
-          if ((fileNodePtr->modeTx==TXACK_OFF || fileNodePtr->modeTx==TXACK_ON) || (atomic_read(&vChd->fileOpenCount) > 1)) {
-            bufMsgPtr->flags |= VCAN_MSG_FLAG_TX_NOTIFY;
+          if (copy_from_user(bufMsgPtr, (CAN_MSG *)arg, sizeof(CAN_MSG))) {
+            queue_commit(&vChd->txChanQueue, 0);
+            DEBUGPRINT(2, (TXT("VCAN_IOC_SENDMSG - returning -EFAULT\n")));
+            return -EFAULT;
           }
+          txMsgSetOrigin(fileNodePtr, bufMsgPtr);
+
+          queue_commit(&vChd->txChanQueue, 1);
+        }
+        hwIf->requestSend(vChd->vCard, vChd);
+        break;
+      }
+
+    case VCAN_IOC_SENDMSG_BATCH:
+      {
+        VCanChanData             *vChd = fileNodePtr->chanData;
+        VCanHWInterface          *hwIf = vChd->vCard->driverData->hwIf;
+        VCAN_IOCTL_WRITE_BATCH_T  ioctl_write;
+        unsigned int              sent = 0;
+        unsigned int              n;
+        unsigned int              i;
+        int                       queuePos;
+        int                       space;
+
+        if (!fileNodePtr->isBusOn) {
+          DEBUGPRINT(2, (TXT("VCAN_IOC_SENDMSG_BATCH Handle is not bus on. returning -EAGAIN\n")));
+          return -EAGAIN;
+        }
+
+        if (vChd->vCard->card_flags & DEVHND_CARD_REFUSE_TO_USE_CAN) {
+          DEBUGPRINT(2, (TXT("VCAN_IOC_SENDMSG_BATCH Refuse to run. returning -EACCES\n")));
+          return -EACCES;
+        }
+
+        copy_from_user_ret(&ioctl_write, (VCAN_IOCTL_WRITE_BATCH_T *)arg,
+                           sizeof(VCAN_IOCTL_WRITE_BATCH_T), -EFAULT);
 
-          if (fileNodePtr->modeTxRq) {
-            bufMsgPtr->flags |= VCAN_MSG_FLAG_TX_START;
+        // As for VCAN_IOC_SENDMSG, the messages are copied from user memory
+        // straight into reserved slots. Each contiguous run of slots is put
+        // on the queue under a single lock, and the hardware is only kicked
+        // once.
+        while (sent < ioctl_write.count) {
+          queuePos = queue_reserve(&vChd->txChanQueue, &space);
+          if (queuePos < 0) {
+            // Transmit queue is full
+            break;
+          }
+          n = ioctl_write.count - sent;
+          if (n > (unsigned int)space) {
+            n = space;
+          }
+          if (copy_from_user(&vChd->txChanBuffer[queuePos], ioctl_write.msg + sent,
+                             n * sizeof(CAN_MSG))) {
+            queue_commit(&vChd->txChanQueue, 0);
+            DEBUGPRINT(2, (TXT("VCAN_IOC_SENDMSG_BATCH - returning -EFAULT\n")));
+            if (sent == 0) {
+              return -EFAULT;
+            }
+            break;
           }
+          for (i = 0; i < n; i++) {
+            txMsgSetOrigin(fileNodePtr, &vChd->txChanBuffer[queuePos + i]);
+          }
+          queue_commit(&vChd->txChanQueue, n);
+          sent += n;
+        }
 
-          queue_push(&vChd->txChanQueue);
+        if (sent == 0) {
+          return -EAGAIN;
         }
         hwIf->requestSend(vChd->vCard, vChd);
+        put_user_ret(sent, &((VCAN_IOCTL_WRITE_BATCH_T *)arg)->sent, -EFAULT);
         break;
       }
       
@@ -1305,20 +2653,25 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
           return -EACCES;
         }
 
+        spin_lock(&fileNodePtr->rcv.readLock);
         spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
         vCanFlushReceiveBuffer(fileNodePtr);
         spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        spin_unlock(&fileNodePtr->rcv.readLock);
 
-        memset(&chd->busStats, 0, sizeof(chd->busStats));
+        vCanBusStatsReset(chd);
         vCanTime(chd->vCard, &ttime);
         chd->busStats.timestamp = (__u32) ttime;
 
         // Important to set this before channel get busOn, otherwise
         // we may miss messasges.
         fileNodePtr->isBusOn                    |= 1;
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
         fileNodePtr->chip_status.busStatus       = CHIPSTAT_ERROR_ACTIVE;
         fileNodePtr->chip_status.txErrorCounter  = 0;
         fileNodePtr->chip_status.rxErrorCounter  = 0;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        vCanUpdateListeners(chd);
 
         wait_for_completion(&chd->busOnCountCompletion);
 
@@ -1357,6 +2710,10 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
           }
         }
         complete(&chd->busOnCountCompletion);
+        if (!fileNodePtr->isBusOn) {
+          // Take the failed handle out of the snapshot again
+          vCanUpdateListeners(chd);
+        }
       }
 
       break;
@@ -1366,14 +2723,18 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
         unsigned long rcvLock_irqFlags;
 
         DEBUGPRINT(3, (TXT("VCAN_IOC_BUS_OFF\n")));
+        spin_lock(&fileNodePtr->rcv.readLock);
         spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
         vCanFlushReceiveBuffer(fileNodePtr);
         spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        spin_unlock(&fileNodePtr->rcv.readLock);
 
-        memset(&chd->busStats, 0, sizeof(chd->busStats));
+        vCanBusStatsReset(chd);
 
         if (fileNodePtr->isBusOn) {
+          spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
           fileNodePtr->chip_status.busStatus = CHIPSTAT_BUSOFF;
+          spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
           wait_for_completion(&chd->busOnCountCompletion);
           chd->busOnCount--;
           if (chd->busOnCount == 0) {
@@ -1388,6 +2749,7 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
             fileNodePtr->isBusOn = 0;
           }
           complete(&chd->busOnCountCompletion);
+          vCanUpdateListeners(chd);
         }
       }
       break;
@@ -1882,6 +3244,7 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
       ArgPtrIn(sizeof(unsigned char));
       get_user(fileNodePtr->transId, (unsigned char*)arg);
       fileNodePtr->notify = 1;
+      vCanUpdateListeners(chd);
       break;
     //------------------------------------------------------------------
     case VCAN_IOC_GET_TRANSID:
@@ -1894,6 +3257,7 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
       ArgPtrIn(sizeof(VCanMsgFilter));
       copy_from_user_ret(&(fileNodePtr->filter), (VCanMsgFilter *)arg,
                          sizeof(VCanMsgFilter), -EFAULT);
+      vCanUpdateListeners(chd);
       break;
     //------------------------------------------------------------------
     case VCAN_IOC_GET_MSG_FILTER:
@@ -1902,6 +3266,60 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
                        sizeof(VCanMsgFilter), -EFAULT);
       break;
     //------------------------------------------------------------------
+    case VCAN_IOC_SET_ID_FILTER:
+      ArgPtrIn(sizeof(VCAN_IOCTL_ID_FILTER_T));
+      {
+        VCAN_IOCTL_ID_FILTER_T  req;
+        VCanIdFilter           *filter;
+        VCanIdFilter           *old;
+        int                     ret;
+
+        copy_from_user_ret(&req, (VCAN_IOCTL_ID_FILTER_T *)arg,
+                           sizeof(VCAN_IOCTL_ID_FILTER_T), -EFAULT);
+        ret = vCanIdFilterCreate(&req, &filter);
+        if (ret) {
+          return ret;
+        }
+
+        spin_lock_irqsave(&chd->openLock, irqFlags);
+        old = rcu_dereference_protected(fileNodePtr->idFilter,
+                                        lockdep_is_held(&chd->openLock));
+        rcu_assign_pointer(fileNodePtr->idFilter, filter);
+        spin_unlock_irqrestore(&chd->openLock, irqFlags);
+        vCanUpdateListeners(chd);
+        synchronize_rcu();
+        vfree(old);
+      }
+      break;
+    //------------------------------------------------------------------
+    case VCAN_IOC_SET_MAILBOX:
+      ArgPtrIn(sizeof(uint32_t));
+      {
+        uint32_t          maxIds;
+        VCanMailbox      *mb = NULL;
+        VCanMailbox      *old;
+        unsigned long     rcvLock_irqFlags;
+
+        get_user_int_ret(maxIds, (uint32_t *)arg, -EFAULT);
+        if (maxIds > VCAN_MAILBOX_MAX_IDS) {
+          return -EINVAL;
+        }
+        if (maxIds) {
+          mb = vCanMailboxAlloc(maxIds);
+          if (!mb) {
+            return -ENOMEM;
+          }
+        }
+
+        // Dispatch and the mailbox ioctls only use the mailbox under rcvLock
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        old = fileNodePtr->mailbox;
+        fileNodePtr->mailbox = mb;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        vfree(old);
+      }
+      break;
+    //------------------------------------------------------------------
     case VCAN_IOC_GET_CARD_NUMBER:
       {
         uint32_t cardNumber = chd->vCard->cardNumber;
@@ -2162,6 +3580,32 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
       put_user_ret(chd->capabilities_ex, (uint64_t *)arg, -EFAULT);
       put_user_ret(chd->capabilities_ex_mask, ((uint64_t *)arg) +1, -EFAULT);
       break;
+    //------------------------------------------------------------------
+    // All of the above, and the driver name, in one call
+    case VCAN_IOC_GET_CHANNEL_DATA:
+      {
+        VCAN_IOCTL_CHANNEL_DATA_T data;
+
+        ArgPtrOut(sizeof(data));
+        memset(&data, 0, sizeof(data));
+        data.capabilitiesEx[0] = chd->capabilities_ex;
+        data.capabilitiesEx[1] = chd->capabilities_ex_mask;
+        data.cardNumber        = chd->vCard->cardNumber;
+        data.cardType          = chd->vCard->hw_type;
+        data.serial[0]         = chd->vCard->serialNumber;
+        memcpy(data.ean, chd->vCard->ean, sizeof(data.ean));
+        data.firmwareRev[0]    = chd->vCard->firmwareVersionBuild;
+        data.firmwareRev[1]    = (chd->vCard->firmwareVersionMajor << 16) |
+                                 chd->vCard->firmwareVersionMinor;
+        data.hardwareRev[0]    = (chd->vCard->hwRevisionMajor << 16) |
+                                 chd->vCard->hwRevisionMinor;
+        data.capabilities      = chd->capabilities;
+        data.capabilitiesMask  = chd->capabilities_mask;
+        strncpy(data.driverName, chd->vCard->driverData->deviceName,
+                sizeof(data.driverName) - 1);
+        copy_to_user_ret((void *)arg, &data, sizeof(data), -EFAULT);
+      }
+      break;
       //------------------------------------------------------------------
     case KCAN_IOCTL_LIN_MODE:
       ArgPtrIn(sizeof(int));
@@ -2210,9 +3654,11 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
     case VCAN_IOC_FLUSH_RCVBUFFER:
       {
         unsigned long    rcvLock_irqFlags;
+        spin_lock(&fileNodePtr->rcv.readLock);
         spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
         vCanFlushReceiveBuffer(fileNodePtr);
         spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        spin_unlock(&fileNodePtr->rcv.readLock);
         break;
       }
     //------------------------------------------------------------------
@@ -2249,12 +3695,26 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
     //------------------------------------------------------------------
     case VCAN_IOC_GET_OVER_ERR:
       ArgPtrOut(sizeof(VCanOverrun));
-      copy_to_user_ret((VCanOverrun *)arg, &fileNodePtr->overrun, sizeof(VCanOverrun), -EFAULT);
+      {
+        VCanOverrun   overrun;
+        unsigned long rcvLock_irqFlags;
+
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        overrun = fileNodePtr->overrun;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        copy_to_user_ret((VCanOverrun *)arg, &overrun, sizeof(VCanOverrun), -EFAULT);
+      }
       break;
     //------------------------------------------------------------------
     case VCAN_IOC_RESET_OVERRUN_COUNT:
-      fileNodePtr->overrun.sw = 0;
-      fileNodePtr->overrun.hw = 0;
+      {
+        unsigned long rcvLock_irqFlags;
+
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        fileNodePtr->overrun.sw = 0;
+        fileNodePtr->overrun.hw = 0;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+      }
       break;
     //------------------------------------------------------------------
     case VCAN_IOC_GET_RX_QUEUE_LEVEL:
@@ -2267,10 +3727,129 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
         ql = getQLen(fileNodePtr->rcv.bufHead, fileNodePtr->rcv.bufTail,
                      fileNodePtr->rcv.size);
         spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        if (fileNodePtr->rxRing) {
+          ql += vCanRxRingLevel(fileNodePtr);
+        }
         put_user_ret(ql, (int *)arg, -EFAULT);
       }
       break;
     //------------------------------------------------------------------
+    case VCAN_IOC_SET_RX_QUEUE_SIZE:
+      ArgPtrIn(sizeof(int));
+      {
+        int size;
+
+        get_user_int_ret(size, (int *)arg, -EFAULT);
+        // Resizing is only allowed while off bus. The channel ioctl lock
+        // keeps VCAN_IOC_BUS_ON out until the resize is done.
+        if (fileNodePtr->isBusOn) {
+          DEBUGPRINT(2, (TXT("VCAN_IOC_SET_RX_QUEUE_SIZE Handle is bus on\n")));
+          return -EINVAL;
+        }
+        if (size == 0) {
+          size = FILE_RCV_BUF_SIZE - 1;
+        }
+        if ((size < FILE_RCV_BUF_MIN_SIZE) || (size > FILE_RCV_BUF_MAX_SIZE)) {
+          return -EINVAL;
+        }
+        // One slot is always unused
+        vStat = vCanResizeReceiveBuffer(&fileNodePtr->rcv, size + 1,
+                                        fileNodePtr->rcv.evtSize);
+        break;
+      }
+    //------------------------------------------------------------------
+    case VCAN_IOC_SET_RX_WAKEUP:
+      ArgPtrIn(sizeof(VCAN_IOCTL_RX_WAKEUP_T));
+      {
+        VCAN_IOCTL_RX_WAKEUP_T wakeup;
+        unsigned long          rcvLock_irqFlags;
+
+        copy_from_user_ret(&wakeup, (VCAN_IOCTL_RX_WAKEUP_T *)arg,
+                           sizeof(VCAN_IOCTL_RX_WAKEUP_T), -EFAULT);
+        if ((wakeup.delayUs > VCAN_RX_WAKEUP_MAX_DELAY_US) ||
+            ((wakeup.count > 1) && (wakeup.delayUs == 0))) {
+          return -EINVAL;
+        }
+
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        fileNodePtr->rcv.wakeCount   = wakeup.count;
+        fileNodePtr->rcv.wakeDelayUs = wakeup.delayUs;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+
+        // Readers waiting under the old settings are woken, which lets
+        // them wait again under the new ones.
+        hrtimer_cancel(&fileNodePtr->rcv.wakeTimer);
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        fileNodePtr->rcv.wakeArmed = 0;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        wake_up_interruptible(&fileNodePtr->rcv.rxWaitQ);
+      }
+      break;
+    //------------------------------------------------------------------
+    case VCAN_IOC_GET_RX_QUEUE_HIGH_WATER:
+      ArgPtrOut(sizeof(int));
+      {
+        int           hw;
+        unsigned long rcvLock_irqFlags;
+
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        hw = fileNodePtr->rcv.highWater;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        put_user_ret(hw, (int *)arg, -EFAULT);
+      }
+      break;
+    //------------------------------------------------------------------
+    case VCAN_IOC_MAP_RX_RING:
+      {
+        VCAN_IOCTL_RX_RING_T  ring;
+        VCanRxRingHeader     *hdr;
+        unsigned long         bytes;
+        unsigned long         rcvLock_irqFlags;
+        uint32_t              size;
+
+        copy_from_user_ret(&ring, (VCAN_IOCTL_RX_RING_T *)arg,
+                           sizeof(VCAN_IOCTL_RX_RING_T), -EFAULT);
+        if (fileNodePtr->rxRing) {
+          return -EBUSY;
+        }
+
+        if (ring.size == 0) {
+          ring.size = VCAN_RX_RING_DEFAULT_SIZE;
+        }
+        if (ring.size > VCAN_RX_RING_MAX_SIZE) {
+          return -EINVAL;
+        }
+        // Round up to a power of two
+        for (size = 1; size < ring.size; size <<= 1) {
+        }
+
+        bytes = PAGE_ALIGN(VCAN_RX_RING_HDR_SIZE + size * sizeof(VCanRxRecord));
+        hdr   = vmalloc_user(bytes);
+        if (!hdr) {
+          return -ENOMEM;
+        }
+        hdr->size = size;
+
+        fileNodePtr->rxRingBytes   = bytes;
+        fileNodePtr->rxRingSize    = size;
+        fileNodePtr->rxRingHead    = 0;
+        fileNodePtr->rxRingOverrun = 0;
+        // From now on, vCanDispatchEvent puts all events in the ring.
+        // Nothing reads the receive queue of a ring handle, so empty it.
+        spin_lock(&fileNodePtr->rcv.readLock);
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        vCanFlushReceiveBuffer(fileNodePtr);
+        fileNodePtr->rxRing = hdr;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        spin_unlock(&fileNodePtr->rcv.readLock);
+
+        ring.size    = size;
+        ring.mapSize = bytes;
+        copy_to_user_ret((VCAN_IOCTL_RX_RING_T *)arg, &ring,
+                         sizeof(VCAN_IOCTL_RX_RING_T), -EFAULT);
+        break;
+      }
+    //------------------------------------------------------------------
     case VCAN_IOC_GET_TX_QUEUE_LEVEL:
       ArgPtrOut(sizeof(int));
       {
@@ -2282,8 +3861,14 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
     case VCAN_IOC_GET_CHIP_STATE:
       ArgPtrOut(sizeof(VCanRequestChipStatus));
       {
+        VCanRequestChipStatus chip_status;
+        unsigned long         rcvLock_irqFlags;
+
         hwIf->requestChipState(chd);
-        copy_to_user_ret((VCanRequestChipStatus *)arg, &fileNodePtr->chip_status, sizeof(VCanRequestChipStatus), -EFAULT);
+        spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        chip_status = fileNodePtr->chip_status;
+        spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+        copy_to_user_ret((VCanRequestChipStatus *)arg, &chip_status, sizeof(VCanRequestChipStatus), -EFAULT);
       }
       break;
     //------------------------------------------------------------------
@@ -2843,6 +4428,7 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
       ArgPtrIn(sizeof(KCAN_IOCTL_OPEN_MODE_T));
       copy_from_user_ret(&mode_data, (KCAN_IOCTL_OPEN_MODE_T *)arg,
                            sizeof(KCAN_IOCTL_OPEN_MODE_T), -EFAULT);
+      mode_data.flagsReply = 0;
 
       // Count the number of open handles to this channel
       spin_lock_irqsave(&chd->openLock, irqFlags);
@@ -2957,6 +4543,24 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
         break;
       }
 
+      // A classic CAN handle can have its events queued in compact form
+      if ((mode_data.action == CAN_MODE_SET) &&
+          (mode_data.status == CAN_OPEN_MODE_SUCCESS)) {
+        int evtSize = sizeof(VCAN_EVENT);
+
+        if ((mode_data.flags & CAN_OPEN_MODE_FLAG_COMPACT_EVENTS) &&
+            (mode_data.mode == OPEN_AS_CAN)) {
+          evtSize = sizeof(VCAN_COMPACT_EVENT);
+        }
+        if ((evtSize == fileNodePtr->rcv.evtSize) ||
+            (vCanResizeReceiveBuffer(&fileNodePtr->rcv, fileNodePtr->rcv.size,
+                                     evtSize) == VCAN_STAT_OK)) {
+          if (fileNodePtr->rcv.evtSize == sizeof(VCAN_COMPACT_EVENT)) {
+            mode_data.flagsReply |= CAN_OPEN_MODE_FLAG_COMPACT_EVENTS;
+          }
+        }
+      }
+
       ArgPtrOut(sizeof(KCAN_IOCTL_OPEN_MODE_T));
       copy_to_user_ret((KCAN_IOCTL_OPEN_MODE_T *)arg, &mode_data,
       sizeof(KCAN_IOCTL_OPEN_MODE_T), -EFAULT);
@@ -2971,11 +4575,14 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
         vStat = hwIf->reqBusStats(chd);
       }
       else {
-        __u32 curt, difft, btime;
+        __u32 curt, difft, btime, bits;
         uint64_t ttime;
+        VCanBusCounters sum;
         vCanTime(chd->vCard, &ttime);
         curt = (__u32) ttime;
         difft = curt - chd->busStats.timestamp;
+        vCanBusStatsCollect(chd, &sum);
+        bits = sum.bitCount - chd->busBitMark;
         btime = chd->busStats.bitTime100ns;
         if (!btime) {
           VCanBusParams busParams;
@@ -2993,7 +4600,7 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
           vStat = VCAN_STAT_OK;
         }
         if (difft != 0) {
-          chd->busStats.busLoad = (chd->busStats.bitCount * btime) / difft * 100;
+          chd->busStats.busLoad = (bits * btime) / difft * 100;
         }
         else {
           chd->busStats.busLoad = 0;
@@ -3001,7 +4608,7 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
         if (chd->busStats.busLoad > 10000) {
           chd->busStats.busLoad = 10000;
         }
-        chd->busStats.bitCount = 0;
+        chd->busBitMark = sum.bitCount;
         chd->busStats.timestamp = curt;
       }
     }
@@ -3010,13 +4617,148 @@ static int ioctl_blocking (VCanOpenFileNode *fileNodePtr,
   //------------------------------------------------------------------
   case VCAN_IOC_GET_BUS_STATS:
     {
+      VCanBusStatistics stat;
+
       ArgPtrOut(sizeof(VCanBusStatistics));
+      vCanBusStatsGet(chd, &stat, NULL);
       vStat = VCAN_STAT_OK;
-      copy_to_user_ret((void *)arg, &chd->busStats,
+      copy_to_user_ret((void *)arg, &stat,
                          sizeof(VCanBusStatistics), -EFAULT);
     }
     break;
 
+  //------------------------------------------------------------------
+  case VCAN_IOC_GET_BUS_STATS_EX:
+    {
+      VCAN_IOCTL_BUS_STATS_EX_T   statEx;
+      VCanBusIdCounters __percpu *ids;
+      VCanBusIdCounters          *sum;
+      int                         i;
+
+      ArgPtrIn(sizeof(VCAN_IOCTL_BUS_STATS_EX_T));
+      ArgPtrOut(sizeof(VCAN_IOCTL_BUS_STATS_EX_T));
+      copy_from_user_ret(&statEx, (void *)arg,
+                         sizeof(VCAN_IOCTL_BUS_STATS_EX_T), -EFAULT);
+      vCanBusStatsGet(chd, &statEx.stats, statEx.interval);
+
+      if (statEx.idCount) {
+        sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+        if (!sum) {
+          return -ENOMEM;
+        }
+        if (!chd->busIdCounters) {
+          // First request, start counting per id from zero
+          chd->busIdBase = kzalloc(sizeof(*chd->busIdBase), GFP_KERNEL);
+          ids            = alloc_percpu(VCanBusIdCounters);
+          if (!ids || !chd->busIdBase) {
+            free_percpu(ids);
+            kfree(chd->busIdBase);
+            chd->busIdBase = NULL;
+            kfree(sum);
+            return -ENOMEM;
+          }
+          smp_store_release(&chd->busIdCounters, ids);
+        }
+        vCanBusIdStatsCollect(chd->busIdCounters, sum);
+        for (i = 0; i < VCAN_BUS_STD_IDS; i++) {
+          sum->count[i] -= chd->busIdBase->count[i];
+        }
+        if (copy_to_user(statEx.idCount, sum->count, sizeof(sum->count))) {
+          kfree(sum);
+          return -EFAULT;
+        }
+        kfree(sum);
+      }
+
+      vStat = VCAN_STAT_OK;
+      copy_to_user_ret((void *)arg, &statEx,
+                       sizeof(VCAN_IOCTL_BUS_STATS_EX_T), -EFAULT);
+    }
+    break;
+
+  //------------------------------------------------------------------
+  case VCAN_IOC_SET_ID_MONITOR:
+    {
+      uint32_t       maxIds;
+      VCanIdMonitor *mon = NULL;
+      VCanIdMonitor *old;
+
+      ArgPtrIn(sizeof(uint32_t));
+      get_user_int_ret(maxIds, (uint32_t *)arg, -EFAULT);
+      if (maxIds > VCAN_ID_MONITOR_MAX_IDS) {
+        return -EINVAL;
+      }
+      if (maxIds) {
+        mon = vCanIdMonitorAlloc(maxIds);
+        if (!mon) {
+          return -ENOMEM;
+        }
+      }
+
+      // Channel ioctls are serialized, and dispatch only uses the
+      // monitor under RCU.
+      old = rcu_dereference_protected(chd->idMonitor, 1);
+      rcu_assign_pointer(chd->idMonitor, mon);
+      if (old) {
+        call_rcu(&old->rcu, vCanIdMonitorFree);
+      }
+      vStat = VCAN_STAT_OK;
+    }
+    break;
+
+  //------------------------------------------------------------------
+  case VCAN_IOC_GET_ID_MONITOR:
+    {
+      VCAN_IOCTL_ID_MONITOR_T  req;
+      VCanIdMonitorRecord      chunk[RCV_BATCH_CHUNK];
+      VCanIdMonitor           *mon;
+      unsigned int             i = 0;
+      unsigned int             n;
+      unsigned long            irqFlags;
+
+      ArgPtrIn(sizeof(VCAN_IOCTL_ID_MONITOR_T));
+      ArgPtrOut(sizeof(VCAN_IOCTL_ID_MONITOR_T));
+      copy_from_user_ret(&req, (void *)arg,
+                         sizeof(VCAN_IOCTL_ID_MONITOR_T), -EFAULT);
+
+      // Not freed under us, since it is only replaced by the ioctl above
+      mon = rcu_dereference_protected(chd->idMonitor, 1);
+      if (!mon) {
+        return -EINVAL;
+      }
+
+      // Copy a few records per lock hold. Each record is consistent, but
+      // ids may be added while the table is being walked.
+      req.count = 0;
+      while ((i < mon->size) && (req.count < req.max)) {
+        n = 0;
+        spin_lock_irqsave(&mon->lock, irqFlags);
+        while ((i < mon->size) && (n < RCV_BATCH_CHUNK) &&
+               (req.count + n < req.max)) {
+          if (mon->slot[i].count) {
+            chunk[n] = mon->slot[i];
+            chunk[n++].lastTime -= fileNodePtr->time_start_10usec;
+          }
+          i++;
+        }
+        spin_unlock_irqrestore(&mon->lock, irqFlags);
+
+        if (n && copy_to_user(req.rec + req.count, chunk, n * sizeof(chunk[0]))) {
+          return -EFAULT;
+        }
+        req.count += n;
+      }
+      spin_lock_irqsave(&mon->lock, irqFlags);
+      req.nIds    = mon->nUsed;
+      req.dropped = mon->dropped;
+      spin_unlock_irqrestore(&mon->lock, irqFlags);
+
+      vStat = VCAN_STAT_OK;
+      copy_to_user_ret((void *)arg, &req,
+                       sizeof(VCAN_IOCTL_ID_MONITOR_T), -EFAULT);
+    }
+    break;
+
   //------------------------------------------------------------------
   case VCAN_IOC_RESET_CLOCK:
     {
@@ -3187,18 +4929,72 @@ long vCanIOCtl_unlocked (struct file *filp,
     return -ESHUTDOWN;
   }
 
-  // Use semaphore to enforce mutual exclusion
-  // for a specific file descriptor.
-
   switch (ioctl_cmd)
   {
     case VCAN_IOC_RECVMSG:
     case VCAN_IOC_RECVMSG_SYNC:
     case VCAN_IOC_RECVMSG_SPECIFIC:
+    case VCAN_IOC_RECVMSG_BATCH:
     case VCAN_IOC_SENDMSG: 
+    case VCAN_IOC_SENDMSG_BATCH:
+    case VCAN_IOC_READ_MAILBOX:
+    case VCAN_IOC_MAILBOX_SNAPSHOT:
+    case VCAN_IOC_RX_RING_WAIT:
     case KCAN_IOCTL_SCRIPT_GET_TEXT:
       ret = ioctl_non_blocking (fileNodePtr, ioctl_cmd, arg);
       break;
+
+    // Status queries only read driver memory, and waiting for the transmit
+    // queue to drain only sleeps, so they neither wait for nor hold up
+    // other ioctls.
+    case VCAN_IOC_GET_NRCHANNELS:
+    case VCAN_IOC_GET_SERIAL:
+    case VCAN_IOC_GET_FIRMWARE_REV:
+    case VCAN_IOC_GET_EAN:
+    case VCAN_IOC_GET_HARDWARE_REV:
+    case VCAN_IOC_GET_CARD_TYPE:
+    case VCAN_IOC_GET_CHAN_CAP:
+    case VCAN_IOC_GET_CHAN_CAP_MASK:
+    case VCAN_IOC_GET_CHAN_CAP_EX:
+    case VCAN_IOC_GET_CHANNEL_DATA:
+    case VCAN_IOC_GET_CARD_NUMBER:
+    case VCAN_IOC_GET_DRIVER_NAME:
+    case VCAN_IOC_GET_MAX_BITRATE:
+    case VCAN_IOC_GET_TRANSID:
+    case VCAN_IOC_GET_MSG_FILTER:
+    case VCAN_IOC_GET_TXACK:
+    case VCAN_IOC_GET_OVER_ERR:
+    case VCAN_IOC_GET_RX_QUEUE_LEVEL:
+    case VCAN_IOC_GET_RX_QUEUE_HIGH_WATER:
+    case VCAN_IOC_GET_TX_QUEUE_LEVEL:
+    case VCAN_IOC_WAIT_EMPTY:
+      ret = ioctl_blocking (fileNodePtr, ioctl_cmd, arg);
+      break;
+
+    // Settings that only affect this handle, and do not go to the
+    // hardware, are serialized per handle instead of per channel.
+    case VCAN_IOC_SET_TRANSID:
+    case VCAN_IOC_SET_MSG_FILTER:
+    case VCAN_IOC_SET_ID_FILTER:
+    case VCAN_IOC_SET_MAILBOX:
+    case VCAN_IOC_SET_WRITE_TIMEOUT:
+    case VCAN_IOC_RESET_OVERRUN_COUNT:
+    case VCAN_IOC_FLUSH_RCVBUFFER:
+    case VCAN_IOC_SET_RX_WAKEUP:
+    case VCAN_IOC_MAP_RX_RING:
+    case VCAN_IOC_SET_TXACK:
+    case VCAN_IOC_SET_TXRQ:
+    case VCAN_IOC_SET_TXECHO:
+      wait_for_completion(&fileNodePtr->ioctl_completion);
+      ret = ioctl_blocking (fileNodePtr, ioctl_cmd, arg);
+      complete(&fileNodePtr->ioctl_completion);
+      break;
+
+    // Everything else changes channel state or talks to the hardware.
+    // VCAN_IOC_SET_RX_QUEUE_SIZE belongs here too, since its isBusOn
+    // check must not race with VCAN_IOC_BUS_ON. So do the bus statistics
+    // reads, since busStats is written by REQ_BUS_STATS and BUS_ON, and
+    // the per-id counters are allocated on the first GET_BUS_STATS_EX.
     default:
       wait_for_completion(&vChd->ioctl_completion);
       ret = ioctl_blocking (fileNodePtr, ioctl_cmd, arg);
@@ -3224,23 +5020,32 @@ unsigned int vCanPoll (struct file *filp, poll_table *wait)
   unsigned int      mask = 0;
   unsigned long     rcvLock_irqFlags;
 
-  // Use semaphore to enforce mutual exclusion
-  // for a specific file descriptor.
-  wait_for_completion(&fileNodePtr->ioctl_completion);
-
+  // Everything looked at here is protected by rcvLock or only read, so
+  // poll never waits for an ioctl.
   chd = fileNodePtr->chanData;
 
   // Add the channel wait queues to the poll
   poll_wait(filp, queue_space_event(&chd->txChanQueue), wait);
   poll_wait(filp, &fileNodePtr->rcv.rxWaitQ, wait);
 
-  spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
-  if (fileNodePtr->rcv.bufHead != fileNodePtr->rcv.bufTail) {
-    // Readable
-    mask |= POLLIN | POLLRDNORM;
-    DEBUGPRINT(4, (TXT("vCanPoll: Channel %d readable\n"), fileNodePtr->chanNr));
+  if (fileNodePtr->rxRing) {
+    // A ring handle gets every event through the ring, so only the ring
+    // head and tail tell if there is something to read
+    if (vCanRxRingLevel(fileNodePtr)) {
+      mask |= POLLIN | POLLRDNORM;
+    }
+  } else {
+    spin_lock_irqsave(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
+    if (fileNodePtr->rcv.bufHead != fileNodePtr->rcv.bufTail) {
+      // Readable
+      mask |= POLLIN | POLLRDNORM;
+      DEBUGPRINT(4, (TXT("vCanPoll: Channel %d readable\n"), fileNodePtr->chanNr));
+    }
+    if (fileNodePtr->mailbox && fileNodePtr->mailbox->nChanged) {
+      mask |= POLLIN | POLLRDNORM;
+    }
+    spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
   }
-  spin_unlock_irqrestore(&fileNodePtr->rcv.rcvLock, rcvLock_irqFlags);
 
   full = txQFull(chd);
 
@@ -3250,11 +5055,29 @@ unsigned int vCanPoll (struct file *filp, poll_table *wait)
     DEBUGPRINT(4, (TXT("vCanPoll: Channel %d writable\n"), fileNodePtr->chanNr));
   }
 
-  complete(&fileNodePtr->ioctl_completion);
-
   return mask;
 }
 
+//======================================================================
+//  Mmap - File operation
+//  Maps the receive ring set up by VCAN_IOC_MAP_RX_RING.
+//======================================================================
+
+int vCanMmap (struct file *filp, struct vm_area_struct *vma)
+{
+  VCanOpenFileNode *fileNodePtr = filp->private_data;
+
+  if (!fileNodePtr->rxRing) {
+    return -ENODEV;
+  }
+  if ((vma->vm_pgoff != 0) ||
+      (vma->vm_end - vma->vm_start > fileNodePtr->rxRingBytes)) {
+    return -EINVAL;
+  }
+
+  return remap_vmalloc_range(vma, fileNodePtr->rxRing, 0);
+}
+
 //======================================================================
 // Init common data structures for one card
 //======================================================================
@@ -3347,14 +5170,77 @@ int vCanInitData (VCanCardData *vCard)
     atomic_set(&vChd->chanId, 1);
     vChd->busOnCount = 0;
 
+    // Without counters the channel works, but reports no bus statistics
+    vChd->busCounters = alloc_percpu(VCanBusCounters);
+    if (!vChd->busCounters) {
+      DEBUGPRINT(1, (TXT("vCanInitData: no memory for bus statistics\n")));
+    }
+
     // vCard points back to card
     vChd->vCard = vCard;
   }
 
+  // The minor numbers are known now
+  vCanCardListChanged();
+
   return 0;
 }
 EXPORT_SYMBOL(vCanInitData);
 
+//======================================================================
+// Proc show
+// The driver's own information, followed by a summary of the channels
+// that have an id monitor.
+//======================================================================
+
+static int kvaser_proc_show(struct seq_file* m, void* v)
+{
+  VCanDriverData *driverData = m->private;
+  VCanCardData   *cardData;
+  unsigned int    chNr;
+  unsigned int    i;
+  unsigned long   irqFlags;
+  int             ret;
+
+  ret = driverData->hwIf->procRead(m, v);
+  if (ret) {
+    return ret;
+  }
+
+  spin_lock(&driverData->canCardsLock);
+  for (cardData = driverData->canCards; cardData != NULL; cardData = cardData->next) {
+    for (chNr = 0; chNr < cardData->nrChannels; chNr++) {
+      VCanChanData  *chd = cardData->chanData[chNr];
+      VCanIdMonitor *mon;
+
+      rcu_read_lock();
+      mon = rcu_dereference(chd->idMonitor);
+      if (mon) {
+        spin_lock_irqsave(&mon->lock, irqFlags);
+        seq_printf(m, "\nminor %d id monitor: %u ids, %u frames dropped\n",
+                   chd->minorNr, mon->nUsed, mon->dropped);
+        for (i = 0; i < mon->size; i++) {
+          VCanIdMonitorRecord *rec = &mon->slot[i];
+
+          if (!rec->count) {
+            continue;
+          }
+          seq_printf(m, "  %s 0x%08x count %u interval min %u max %u us\n",
+                     (rec->id & VCAN_EXT_MSG_ID) ? "ext" : "std",
+                     rec->id & ~VCAN_EXT_MSG_ID, rec->count,
+                     rec->minInterval * cardData->usPerTick,
+                     rec->maxInterval * cardData->usPerTick);
+        }
+        spin_unlock_irqrestore(&mon->lock, irqFlags);
+      }
+      rcu_read_unlock();
+    }
+  }
+  spin_unlock(&driverData->canCardsLock);
+
+  return 0;
+}
+
 //======================================================================
 // Proc open
 //======================================================================
@@ -3362,11 +5248,64 @@ EXPORT_SYMBOL(vCanInitData);
 static int kvaser_proc_open(struct inode* inode, struct file* file)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
-  VCanHWInterface *hwIf = PDE(inode)->data;
+  VCanDriverData *driverData = PDE(inode)->data;
 #else
-  VCanHWInterface *hwIf = PDE_DATA(inode);
+  VCanDriverData *driverData = PDE_DATA(inode);
 #endif
-  return single_open(file, hwIf->procRead, NULL);
+  return single_open(file, kvaser_proc_show, driverData);
+}
+
+//======================================================================
+// Channel list show
+// One "generation <n>" line followed by one line per present channel:
+//   <device name> <minor> <serial number> <ean>
+// canlib reads this instead of opening every possible device node, and
+// only rebuilds its cached channel list when the generation changes.
+//======================================================================
+
+static int kvaser_channels_show(struct seq_file* m, void* v)
+{
+  VCanDriverData *driverData;
+  VCanCardData   *cardData;
+  unsigned int    chNr;
+  uint64_t        ean;
+
+  // Read first, so a change during the walk shows up as a newer
+  // generation the next time the list is read
+  seq_printf(m, "generation %u\n", (unsigned int)atomic_read(&vCanChannelGeneration));
+
+  mutex_lock(&vCanDriverListLock);
+  list_for_each_entry(driverData, &vCanDriverList, driverList) {
+    spin_lock(&driverData->canCardsLock);
+    for (cardData = driverData->canCards; cardData != NULL; cardData = cardData->next) {
+      if (!cardData->cardPresent || cardData->chanData == NULL) {
+        continue;
+      }
+      memcpy(&ean, cardData->ean, sizeof(ean));
+      for (chNr = 0; chNr < cardData->nrChannels; chNr++) {
+        // Channels without a device node have nothing canlib can open
+        if (cardData->chanData[chNr]->minorNr < 0) {
+          continue;
+        }
+        seq_printf(m, "%s %u %u %llu\n", driverData->deviceName,
+                   (unsigned int)cardData->chanData[chNr]->minorNr,
+                   cardData->serialNumber, (unsigned long long)ean);
+      }
+    }
+    spin_unlock(&driverData->canCardsLock);
+  }
+  mutex_unlock(&vCanDriverListLock);
+
+  return 0;
+}
+
+//======================================================================
+// Channel list open
+//======================================================================
+
+static int kvaser_channels_open(struct inode* inode, struct file* file)
+{
+  return single_open(file, kvaser_channels_show, NULL);
 }
 
 
@@ -3390,6 +5329,22 @@ static const struct proc_ops kvaser_proc_fops = {
 };
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+static const struct file_operations kvaser_channels_fops = {
+    .open = kvaser_channels_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+#else
+static const struct proc_ops kvaser_channels_fops = {
+    .proc_open = kvaser_channels_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = single_release,
+};
+#endif
+
 int vCanInit (VCanDriverData *driverData, unsigned max_channels)
 {
   VCanHWInterface *hwIf;
@@ -3399,6 +5354,7 @@ int vCanInit (VCanDriverData *driverData, unsigned max_channels)
   // Initialise card and data structures
   hwIf = driverData->hwIf;
   memset(driverData, 0, sizeof(VCanDriverData));
+  driverData->hwIf = hwIf;   // Used by the /proc entry
 
   driverData->cardNumbers = kmalloc(sizeof(VCanCardNumberData) * max_channels, GFP_KERNEL);
   if(driverData->cardNumbers==NULL) {
@@ -3426,7 +5382,7 @@ int vCanInit (VCanDriverData *driverData, unsigned max_channels)
                               0,             // default mode
                               NULL,          // parent dir
                               &kvaser_proc_fops,
-                              hwIf           // client data
+                              driverData     // client data
                               )) {
     DEBUGPRINT(1, (TXT("Error creating proc read entry!\n")));
     kfree(driverData->cardNumbers);
@@ -3446,7 +5402,6 @@ int vCanInit (VCanDriverData *driverData, unsigned max_channels)
   }
 
   cdev_init(&driverData->cdev, &fops);
-  driverData->hwIf = hwIf;
   driverData->cdev.owner = THIS_MODULE;
 
   result = cdev_add(&driverData->cdev, devno, max_channels);
@@ -3459,6 +5414,11 @@ int vCanInit (VCanDriverData *driverData, unsigned max_channels)
 
   kv_do_gettimeofday(&driverData->startTime);
 
+  mutex_lock(&vCanDriverListLock);
+  list_add_tail(&driverData->driverList, &vCanDriverList);
+  mutex_unlock(&vCanDriverListLock);
+  vCanCardListChanged();
+
   return 0;
 }
 EXPORT_SYMBOL(vCanInit);
@@ -3469,6 +5429,11 @@ EXPORT_SYMBOL(vCanInit);
 //======================================================================
 void vCanCleanup (VCanDriverData *driverData)
 {
+  mutex_lock(&vCanDriverListLock);
+  list_del(&driverData->driverList);
+  mutex_unlock(&vCanDriverListLock);
+  vCanCardListChanged();
+
   if (driverData->cdev.dev > 0) {
     DEBUGPRINT(2, ("unregister chrdev_region (%s) major=%d count=%d\n",
                    driverData->deviceName, MAJOR(driverData->cdev.dev),
@@ -3478,6 +5443,8 @@ void vCanCleanup (VCanDriverData *driverData)
   }
   remove_proc_entry(driverData->deviceName, NULL /* parent dir */);
   driverData->hwIf->closeAllDevices();
+  // Wait for id monitors replaced by VCAN_IOC_SET_ID_MONITOR to be freed
+  rcu_barrier();
   kfree(driverData->cardNumbers);
 }
 EXPORT_SYMBOL(vCanCleanup);
@@ -3486,11 +5453,18 @@ EXPORT_SYMBOL(vCanCleanup);
 int init_module (void)
 {
   softSyncInitialize();
+
+  if (!proc_create(VCAN_CHANNELS_PROC_NAME, 0, NULL, &kvaser_channels_fops)) {
+    // canlib falls back to probing the device nodes
+    DEBUGPRINT(1, (TXT("Error creating proc entry %s!\n"), VCAN_CHANNELS_PROC_NAME));
+  }
+
   return 0;
 }
 
 void cleanup_module (void)
 {
+  remove_proc_entry(VCAN_CHANNELS_PROC_NAME, NULL /* parent dir */);
   softSyncDeinitialize();
 }
 
@@ -3527,44 +5501,51 @@ static long calc_timeout (struct timeval *start, unsigned long wanted_timeout) {
 }
 
 //looks for message with a specific id
+//The oldest matching message is found through the id index, so only
+//messages whose ids share a bucket are looked at.
 static uint32_t read_specific (VCanOpenFileNode *fileNodePtr, VCanRead *readOpt,
                                VCAN_EVENT *msg) {
-  int                index = fileNodePtr->rcv.bufTail;
-  uint32_t           found = 0;
-  unsigned short int flags = 0;
-
-  do {
-    if (fileNodePtr->rcv.valid[index]) {
-      if ((fileNodePtr->rcv.fileRcvBuffer[index].tagData.msg.id & ~VCAN_EXT_MSG_ID) == readOpt->specific.id) {
-        if (readOpt->specific.skip == READ_SPECIFIC_SKIP_MATCHING) {
-          fileNodePtr->rcv.valid[index] = 0;
-          if (index == fileNodePtr->rcv.bufTail) {
-            vCanPopReceiveBuffer (&fileNodePtr->rcv);
-          }
-        }
-        found = 1;
-        break;
-      } else {//save all flags so we can set OVERRUN properly
-        flags |= fileNodePtr->rcv.fileRcvBuffer[index].tagData.msg.flags;
-      }
-    }
-    index++;
-    if (index >= fileNodePtr->rcv.size) {
-      index = 0;
+  VCanReceiveData *rcv  = &fileNodePtr->rcv;
+  VCanRcvIndex    *ri   = rcv->index;
+  int              prev = -1;
+  int              index;
+
+  for (index = ri->head[vCanRcvIndexHash(readOpt->specific.id)]; index >= 0;
+       index = ri->next[index]) {
+    if ((vCanRcvEvent(rcv, index)->tagData.msg.id & ~VCAN_EXT_MSG_ID) == readOpt->specific.id) {
+      break;
     }
-  } while (index != fileNodePtr->rcv.bufHead);
+    prev = index;
+  }
+  if (index < 0) {
+    return 0;
+  }
 
-  if (found) {
-    if (readOpt->specific.skip == READ_SPECIFIC_SKIP_PRECEEDING) {
-      fileNodePtr->rcv.bufTail = index;
-      vCanPopReceiveBuffer (&fileNodePtr->rcv);
-    }
+  // Only a message that was itself flagged reports an overrun
+  memcpy(msg, vCanRcvEvent(rcv, index), rcv->evtSize);
 
-    flags = flags & VCAN_MSG_FLAG_OVERRUN;
-    *msg = fileNodePtr->rcv.fileRcvBuffer[index];
-    msg->tagData.msg.flags |= flags;
+  if (readOpt->specific.skip == READ_SPECIFIC_SKIP_MATCHING) {
+    vCanRcvIndexRemove(rcv, index, prev);
+    rcv->valid[index] = 0;
+    if (index == rcv->bufTail) {
+      vCanPopReceiveBuffer (rcv);
+    }
+  } else if (readOpt->specific.skip == READ_SPECIFIC_SKIP_PRECEEDING) {
+    int slot;
+
+    // The skipped messages are the oldest in their buckets, so each one
+    // is unlinked at the bucket head. Then the tail moves in one step.
+    for (slot = rcv->bufTail; slot != index;
+         slot = (slot >= rcv->size - 1) ? 0 : slot + 1) {
+      if (rcv->valid[slot]) {
+        vCanRcvIndexRemove(rcv, slot, -1);
+      }
+    }
+    rcv->bufTail = index;
+    vCanPopReceiveBuffer (rcv);
   }
-  return found;
+
+  return 1;
 }
 
 static int wait_tx_queue_empty (VCanOpenFileNode *fileNodePtr, unsigned long timeout)
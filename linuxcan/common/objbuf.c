@@ -125,6 +125,7 @@ static void objbuf_write_all (struct work_struct *work)
   VCanCardData     *vCard       = vChan->vCard;
   CAN_MSG          *bufMsgPtr;
   int              queuePos;
+  int              space;
 
 #if defined(__arm__) || defined(__aarch64__)
   unsigned int rd;
@@ -161,9 +162,8 @@ static void objbuf_write_all (struct work_struct *work)
     }
 
 
-    queuePos = queue_back(&vChan->txChanQueue);
+    queuePos = queue_reserve(&vChan->txChanQueue, &space);
     if (queuePos < 0) {
-      queue_release(&vChan->txChanQueue);
       break;
     }
     bufMsgPtr = &vChan->txChanBuffer[queuePos];
@@ -180,7 +180,7 @@ static void objbuf_write_all (struct work_struct *work)
       bufMsgPtr->flags |= VCAN_MSG_FLAG_TX_START;
     }
 
-    queue_push(&vChan->txChanQueue);
+    queue_commit(&vChan->txChanQueue, 1);
 
     done_mask |= (1 << i);
   }
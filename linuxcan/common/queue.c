@@ -186,8 +186,8 @@ void queue_reinit (Queue *queue)
   QUEUE_DEBUG_LOCK;
   LOCKQ(queue, flags);
 
-  queue->head = 0;
-  queue->tail = 0;
+  // Empty the queue without moving head, which may be reserved
+  queue->tail = queue->head;
 
   atomic_set(&queue->length, 0);
 
@@ -201,7 +201,9 @@ void queue_init (Queue *queue, int size)
 {
   queue->lock_type = LOCK_TYPE;
   spin_lock_init(&queue->lock);
+  mutex_init(&queue->reserve);
   queue->size = size;
+  queue->head = 0;
   init_waitqueue_head(&queue->space_event);
   queue->locked = 0;
   queue_reinit(queue);
@@ -314,6 +316,58 @@ void queue_push (Queue *queue)
 EXPORT_SYMBOL(queue_push);
 
 
+// Only producers move head, and they hold queue->reserve, so the reserved
+// elements can be filled without the lock. The consumer only adds space.
+int queue_reserve (Queue *queue, int *space)
+{
+  int back;
+  int free;
+
+  *space = 0;
+
+  QUEUE_DEBUG_RET(-1);
+  mutex_lock(&queue->reserve);
+
+  back = queue->head;
+  free = queue->size - 1 - queue_length(queue);
+  if (free <= 0) {
+    // Nothing reserved, so there is nothing to commit
+    mutex_unlock(&queue->reserve);
+    return -1;
+  }
+  *space = (free < queue->size - back) ? free : queue->size - back;
+
+  return back;
+}
+EXPORT_SYMBOL(queue_reserve);
+
+
+// queue->reserve must be held from a previous queue_reserve().
+void queue_commit (Queue *queue, int n)
+{
+  unsigned long flags = 0;
+
+  QUEUE_DEBUG;
+
+  if (n > 0) {
+    QUEUE_DEBUG_LOCK;
+    LOCKQ(queue, flags);
+
+    queue->head += n;
+    if (queue->head >= queue->size)
+      queue->head -= queue->size;
+
+    atomic_add(n, &queue->length);
+
+    QUEUE_DEBUG_UNLOCK;
+    UNLOCKQ(queue, flags);
+  }
+
+  mutex_unlock(&queue->reserve);
+}
+EXPORT_SYMBOL(queue_commit);
+
+
 // Lock will be held when this returns.
 // Must be released with a call to queue_pop/release()
 // as soon as possible. Make _sure_ not to sleep inbetween!
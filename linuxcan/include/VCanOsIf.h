@@ -77,6 +77,10 @@
 #include <linux/types.h>
 #include <linux/tty.h>
 #include <linux/completion.h>
+#include <linux/rcupdate.h>
+#include <linux/hrtimer.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
 #include <linux/time.h>
 
 #include "canIfData.h"
@@ -95,8 +99,13 @@
 /*****************************************************************************/
 
 #define MAIN_RCV_BUF_SIZE  16
-#define FILE_RCV_BUF_SIZE 500
+#define FILE_RCV_BUF_SIZE 500   // Default, can be changed per handle
+#define FILE_RCV_BUF_MIN_SIZE       16
+#define FILE_RCV_BUF_MAX_SIZE    65536
+#define FILE_RCV_TEXT_BUF_SIZE     500   // printf texts, not resizable
+#define FILE_RCV_INDEX_BUCKETS     256   // Must be a power of two
 #define TX_CHAN_BUF_SIZE  500
+#define RCV_BATCH_CHUNK     8   // Events copied per rcvLock hold in batched reads
 
 /*****************************************************************************/
 /* TXACK_<> used by modeTx. see canIOCTL_SET_TXACK for details.              */
@@ -185,9 +194,42 @@ typedef struct CanChipState {
 } CanChipState;
 
 
+/* Frame counters, one block per CPU, summed when read */
+typedef struct VCanBusCounters {
+    __u32 stdData;
+    __u32 stdRemote;
+    __u32 extData;
+    __u32 extRemote;
+    __u32 errFrame;
+    __u32 bitCount;
+    __u32 interval[VCAN_BUS_HIST_BUCKETS];
+} VCanBusCounters;
+
+/* Frames per standard id, one block per CPU */
+typedef struct VCanBusIdCounters {
+    __u32 count[VCAN_BUS_STD_IDS];
+} VCanBusIdCounters;
+
+/* Per id timing monitor, see VCAN_IOC_SET_ID_MONITOR */
+typedef struct VCanIdMonitor {
+    struct rcu_head          rcu;
+    spinlock_t               lock;
+    unsigned int             size;      // Number of slots, power of two
+    unsigned int             maxIds;
+    unsigned int             nUsed;
+    __u32                    dropped;
+    VCanIdMonitorRecord      slot[];    // Unused while count is 0
+} VCanIdMonitor;
+
 /* Channel specific data */
 typedef struct VCanChanData
 {
+    /* Read for every event in vCanDispatchEvent */
+    struct VCanListeners __rcu *listeners;       // Dispatch snapshot, NULL => walk openFileList
+    struct VCanOpenFileNode *openFileList;       // Read with RCU in vCanDispatchEvent
+    struct VCanCardData    *vCard;
+    void                   *hwChanData;
+
     int                      minorNr;
     unsigned char            channel;
     unsigned char            chipType;
@@ -212,24 +254,6 @@ typedef struct VCanChanData
     unsigned char            driverMode;
     unsigned char            analyzerAttached;
     int                      linMode;  // _STATUS_LIN_MASTER or _STATUS_LIN_SLAVE
-		  
-		  
-    /* Transmit buffer */
-    CAN_MSG                  txChanBuffer[TX_CHAN_BUF_SIZE];
-    Queue                    txChanQueue;
-
-    /* Processes waiting for all messages to be sent */
-    wait_queue_head_t        flushQ;
-
-    atomic_t                 fileOpenCount;
-    unsigned int             busOnCount;
-    struct VCanOpenFileNode *openFileList;
-
-    struct completion       busOnCountCompletion;
-
-    spinlock_t              openLock;
-    void                   *hwChanData;
-    unsigned long           waitEmpty;
 
     unsigned int            capabilities;
     unsigned int            capabilities_mask;
@@ -237,10 +261,33 @@ typedef struct VCanChanData
     uint64_t                capabilities_ex;
     uint64_t                capabilities_ex_mask;
 
-    VCanBusStatistics       busStats;
+    /* Frame counters, updated once per frame without locking */
+    VCanBusCounters   __percpu *busCounters;
+    VCanBusIdCounters __percpu *busIdCounters; // NULL until first asked for
 
-    struct VCanCardData    *vCard;
-    struct completion       ioctl_completion;
+    /* Bus statistics. The frame counters in busStats are not used; they
+     * are taken from busCounters less busBase when read. */
+    VCanBusStatistics       busStats ____cacheline_aligned_in_smp;
+    VCanBusCounters         busBase;
+    VCanBusIdCounters      *busIdBase;
+    __u32                   busBitMark;   // bitCount at last busload update
+    uint64_t                busLastFrame; // Timestamp of last frame, 0 => none
+    VCanIdMonitor __rcu    *idMonitor;    // NULL unless enabled
+
+    /* Transmit queue, written by writers and the driver's transmit path */
+    Queue                    txChanQueue ____cacheline_aligned_in_smp;
+    CAN_MSG                 *txChanBuffer;  // TX_CHAN_BUF_SIZE, allocated by the driver with the channel
+
+    /* Processes waiting for all messages to be sent */
+    wait_queue_head_t        flushQ;
+    unsigned long           waitEmpty;
+
+    /* Open and close */
+    spinlock_t              openLock ____cacheline_aligned_in_smp;
+    atomic_t                 fileOpenCount;
+    unsigned int             busOnCount;
+    struct completion       busOnCountCompletion;
+    struct completion       ioctl_completion;   // Channel state ioctls
 } VCanChanData;
 
 
@@ -281,6 +328,7 @@ typedef struct VCanDriverData
     struct cdev               cdev;
     struct VCanCardNumberData *cardNumbers;
     unsigned int              maxCardnumber;
+    struct list_head          driverList;  // Entry in the /proc/kvaser_channels list
 } VCanDriverData;
 
 /*  Cards specific data */
@@ -322,49 +370,142 @@ typedef struct VCanCardData
     struct VCanCardData    *next;
 } VCanCardData;
 
+/* Index of queued V_RECEIVE_MSG events on id, used by read_specific().
+ * Each bucket is a list of slots in the order they were queued. */
 typedef struct
 {
-    spinlock_t              rcvLock;
+    int                     head[FILE_RCV_INDEX_BUCKETS];  // Oldest slot, -1 if empty
+    int                     tail[FILE_RCV_INDEX_BUCKETS];  // Newest slot
+    int                     next[];     // Per slot, next slot in bucket or -1
+} VCanRcvIndex;
+
+/* The event producers always take rcvLock. Readers take readLock, and
+ * also rcvLock unless the queue is lockless; then bufHead and bufTail are
+ * handed over with acquire/release. A lockless queue has no holes and no
+ * id index. RECVMSG_SPECIFIC builds the index and leaves lockless mode,
+ * which is entered again when the queue runs empty. A full queue drops its
+ * oldest event. The exception is a lockless queue whose readLock is held:
+ * a reader is taking the oldest event right then, and the producer cannot
+ * wait for it, so the new event is dropped and the next one pushed is
+ * flagged instead. See vCanDispatchToFile(). */
+typedef struct
+{
+    /* Read-mostly */
+    int                     size;
+    int                     evtSize;    // sizeof(VCAN_EVENT) or sizeof(VCAN_COMPACT_EVENT)
+    VCAN_EVENT             *fileRcvBuffer;  // Use vCanRcvEvent() to index
+    uint8_t                *valid;
+    VCanRcvIndex           *index;      // NULL for the text queue
+    uint8_t                 lockless;
+    uint32_t                wakeCount;  // Wake-up coalescing, see VCAN_IOC_SET_RX_WAKEUP
+    uint32_t                wakeDelayUs;
+
+    /* Written by the producers */
+    spinlock_t              rcvLock ____cacheline_aligned_in_smp;
     int                     bufHead;
+    int                     highWater;  // Max number of queued events seen
+    uint8_t                 overrunPending;  // Mark the next pushed event
+    uint8_t                 wakeArmed;  // wakeTimer is started
+    wait_queue_head_t       rxWaitQ;
+    struct hrtimer          wakeTimer;
+
+    /* Written by the readers */
+    spinlock_t              readLock ____cacheline_aligned_in_smp;
     int                     bufTail;
 #if DEBUG
     int                     lastEmpty;
     int                     lastNotEmpty;
 #endif
-    wait_queue_head_t       rxWaitQ;
-    int                     size;
-    VCAN_EVENT              fileRcvBuffer[FILE_RCV_BUF_SIZE];
-    uint8_t                 valid[FILE_RCV_BUF_SIZE];
 } VCanReceiveData;
 
 
+/* Id filter set with VCAN_IOC_SET_ID_FILTER */
+typedef struct VCanIdFilter {
+    uint32_t                flags;
+    uint32_t                stdBitmap[2048 / 32];
+    uint32_t                extMask;
+    uint32_t                extCount;
+    VCanIdRange             extRanges[];  // Sorted, not overlapping
+} VCanIdFilter;
+
+
+/* Latest value mailbox set with VCAN_IOC_SET_MAILBOX, protected by rcv.rcvLock.
+ * Open addressing with linear probing; size is at least twice maxIds so a
+ * probe always ends at an unused slot. */
+typedef struct {
+    VCanMailboxRecord       rec;
+    uint8_t                 used;
+    uint8_t                 changed;
+} VCanMailboxSlot;
+
+typedef struct VCanMailbox {
+    uint32_t                size;       // Number of slots, a power of two
+    uint32_t                maxIds;
+    uint32_t                nUsed;
+    uint32_t                nChanged;
+    uint32_t                changedHead;  // Oldest entry in changedList
+    uint32_t               *changedList;  // Ring of nChanged slot numbers, oldest
+                                          // change first, room for maxIds
+    VCanMailboxSlot         slot[];
+} VCanMailbox;
+
+
+/* Open file nodes that may take an event, grouped by the kind of event so
+ * that vCanDispatchEvent skips handles that would reject it anyway.
+ * node[] holds nStd entries, then nExt entries, then nAll entries. */
+typedef struct VCanListeners {
+    struct rcu_head          rcu;
+    int                      nStd;    // Can take 11-bit frames
+    int                      nExt;    // Can take 29-bit frames
+    int                      nAll;    // Bus on or notify, for other events
+    struct VCanOpenFileNode *node[];
+} VCanListeners;
+
+
 /* File pointer specific data */
 typedef struct VCanOpenFileNode {
-    struct completion        ioctl_completion;
-    VCanReceiveData          rcv;
-    VCanReceiveData          rcv_text;   // printf texts
-    unsigned char            transId;
-    struct file             *filp;
+    /* Read for every event in vCanDispatchToFile */
+    struct VCanOpenFileNode *next;
     struct VCanChanData     *chanData;
-    int                      chanNr;
+    VCanMsgFilter            filter;
+    struct VCanIdFilter __rcu *idFilter; // Set under chanData->openLock, read with RCU
+    unsigned char            transId;
     unsigned char            modeTx;
     unsigned char            modeTxRq;
     unsigned char            modeNoTxEcho;
+    uint8_t                  isBusOn;
+    uint8_t                  notify;
+    OBJECT_BUFFER           *objbuf;
+    uint64_t                 time_start_10usec;
+    // Memory mapped receive ring, NULL unless VCAN_IOC_MAP_RX_RING is used
+    VCanRxRingHeader        *rxRing;
+    uint32_t                 rxRingSize;
+    // Latest value per id, NULL unless VCAN_IOC_SET_MAILBOX is used
+    VCanMailbox             *mailbox;
+
+    /* Written by vCanDispatchToFile, under rcv.rcvLock for the rx ring */
+    uint32_t                 rxRingHead ____cacheline_aligned_in_smp;
+    uint8_t                  rxRingOverrun;
+    VCanOverrun              overrun;
+    atomic_t                 objbufActive;
+    VCanRequestChipStatus    chip_status;
+
+    /* The receive queue groups its fields by writer itself */
+    VCanReceiveData          rcv;
+
+    /* Not used per event. rcv_text is cacheline aligned like rcv, so it
+     * goes first to leave no hole. */
+    VCanReceiveData          rcv_text;   // printf texts
+    struct completion        ioctl_completion; // Handle ioctls, objbuf
+    struct file             *filp;
+    int                      chanNr;
     unsigned char            channelOpen;
     unsigned char            channelLocked;
-    VCanRequestChipStatus    chip_status;
+    uint8_t                  init_access;
     long                     writeTimeout;
-    VCanMsgFilter            filter;
+    unsigned long            rxRingBytes;
     struct work_struct       objbufWork;
     struct workqueue_struct *objbufTaskQ;
-    OBJECT_BUFFER           *objbuf;
-    atomic_t                 objbufActive;
-    VCanOverrun              overrun;
-    uint8_t                  isBusOn;
-    uint8_t                  notify;
-    struct VCanOpenFileNode *next;
-    uint8_t                  init_access;
-    uint64_t                 time_start_10usec;
 	
 	  // for printf from scripts	
     unsigned int  message_subscriptions_mask;
@@ -507,6 +648,8 @@ struct timespec64 vCanCalc_dt(struct timespec64 *start); //returns now-start
 struct timeval  vCanCalc_dt(struct timeval *start); //returns now-start
 #endif
 void            vCanCardRemoved(VCanChanData *chd);
+void            vCanCardListChanged(void);
+void            vCanRemoveData(VCanCardData *vCard);
 int             vCanPopReceiveBuffer (VCanReceiveData *rcv);
 int             vCanPushReceiveBuffer (VCanReceiveData *rcv);
 
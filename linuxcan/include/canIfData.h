@@ -267,6 +267,194 @@ typedef struct {
   VCAN_EVENT *msg;
 } VCAN_IOCTL_READ_T;
 
+typedef struct {
+  unsigned long  timeout;  // Time to wait for the first event (ms), -1 is infinite
+  VCAN_EVENT    *msg;      // Array with room for at least max events, packed
+                           // as VCAN_COMPACT_EVENT on a compact handle
+  unsigned int   max;      // Max number of events to read
+  unsigned int   count;    // Out: number of events read
+} VCAN_IOCTL_READ_BATCH_T;
+
+typedef struct {
+  CAN_MSG       *msg;      // Array of count messages
+  unsigned int   count;    // Number of messages to send
+  unsigned int   sent;     // Out: number of messages put on the transmit queue
+} VCAN_IOCTL_WRITE_BATCH_T;
+
+// Memory mapped receive ring (VCAN_IOC_MAP_RX_RING)
+//===========================================================================
+// The driver is the only writer of head and the reader is the only writer
+// of tail. Both are free running, the record index is (x & (size - 1)).
+// Every event for the handle is put in the ring, in the order it arrived,
+// and tag tells which it is. Only V_RECEIVE_MSG records have id, flags and
+// dlc set; for other events data holds the start of the event's tagData.
+// Events still in the receive queue when the ring is set up are dropped.
+
+#define VCAN_RX_RING_DEFAULT_SIZE   1024
+#define VCAN_RX_RING_MAX_SIZE       65536
+#define VCAN_RX_RING_HDR_SIZE       4096   // Records start at this offset
+
+typedef struct {
+  uint32_t  size;          // Number of records, a power of two
+  uint32_t  unused[15];
+  uint32_t  head;          // Next record to be written by the driver
+  uint32_t  unused_2[15];
+  uint32_t  tail;          // Next record to be read
+  uint32_t  unused_3[15];
+  uint32_t  overruns;      // Number of records dropped because the ring was full
+} VCanRxRingHeader;
+
+typedef struct {
+  uint32_t       id;
+  uint16_t       flags;
+  uint8_t        dlc;
+  uint8_t        tag;      // V_RECEIVE_MSG, V_CHIP_STATE, ...
+  uint64_t       timeStamp;
+  unsigned char  data[64];
+} VCanRxRecord;
+
+typedef struct {
+  uint32_t  size;          // In: number of records, 0 for default
+  uint32_t  mapSize;       // Out: number of bytes to mmap() at offset 0
+} VCAN_IOCTL_RX_RING_T;
+
+// Sleep until the driver has moved head on from the given value
+// (VCAN_IOC_RX_RING_WAIT), for readers that wait for something else
+// than the ring being not empty.
+typedef struct {
+  uint32_t  head;          // Head the reader has already looked at
+  uint32_t  timeout;       // In ms, 0xFFFFFFFF to wait forever
+} VCAN_IOCTL_RX_RING_WAIT_T;
+
+// Per handle id filter (VCAN_IOC_SET_ID_FILTER)
+//===========================================================================
+// Applied in the driver after the code/mask filter in VCanMsgFilter.
+// 29-bit ids are masked with extMask and then looked up in extRanges, so
+// e.g. a J1939 PGN set can use extMask 0x03FFFF00 and ranges of pgn << 8.
+
+#define VCAN_ID_FILTER_STD          0x01   // Filter 11-bit ids on stdBitmap
+#define VCAN_ID_FILTER_EXT          0x02   // Filter 29-bit ids on extRanges
+#define VCAN_ID_FILTER_MAX_RANGES   4096
+
+typedef struct {
+  uint32_t  first;
+  uint32_t  last;          // Inclusive
+} VCanIdRange;
+
+typedef struct {
+  uint32_t     flags;              // VCAN_ID_FILTER_xxx, 0 removes the filter
+  uint32_t     stdBitmap[2048 / 32];  // Bit (id % 32) of word (id / 32) set => accept
+  uint32_t     extMask;            // 0 is the same as 0x1FFFFFFF
+  uint32_t     extCount;           // Number of ranges, may be 0 to reject all
+  VCanIdRange *extRanges;
+} VCAN_IOCTL_ID_FILTER_T;
+
+// Latest value mailbox (VCAN_IOC_SET_MAILBOX)
+//===========================================================================
+// With a mailbox, received messages are not queued. The driver keeps the
+// latest message for each id instead, and a list of the ids that changed
+// since the previous VCAN_IOC_MAILBOX_SNAPSHOT, which returns them in the
+// order they first changed. Other events are queued as usual. Ids are
+// matched including VCAN_EXT_MSG_ID, so a standard and an extended id with
+// the same value have a slot each.
+
+#define VCAN_MAILBOX_MAX_IDS        8192
+
+typedef struct {
+  uint32_t       id;           // Including VCAN_EXT_MSG_ID
+  uint16_t       flags;
+  uint8_t        dlc;
+  uint8_t        unused;
+  uint32_t       updates;      // Number of messages received with this id
+  uint32_t       unused_2;
+  uint64_t       timeStamp;    // Of the latest message
+  unsigned char  data[64];
+} VCanMailboxRecord;
+
+typedef struct {
+  uint32_t           id;       // In, including VCAN_EXT_MSG_ID
+  VCanMailboxRecord  rec;      // Out
+} VCAN_IOCTL_MAILBOX_READ_T;
+
+typedef struct {
+  VCanMailboxRecord *rec;
+  uint32_t           max;      // In: number of records rec has room for
+  uint32_t           count;    // Out: number of records returned
+} VCAN_IOCTL_MAILBOX_SNAPSHOT_T;
+
+// Receive wake-up coalescing (VCAN_IOC_SET_RX_WAKEUP)
+//===========================================================================
+// Readers blocked on the receive queue, or in poll(), are woken when count
+// events are waiting, or delayUs after the first event that did not wake
+// them. A count of 0 or 1 wakes them on every event, which is the default.
+
+#define VCAN_RX_WAKEUP_MAX_DELAY_US  1000000
+
+typedef struct {
+  uint32_t  count;
+  uint32_t  delayUs;       // Must not be 0 if count > 1
+} VCAN_IOCTL_RX_WAKEUP_T;
+
+// Extended bus statistics (VCAN_IOC_GET_BUS_STATS_EX)
+//===========================================================================
+// interval[] is a histogram of the time between consecutive frames on the
+// bus, in timestamp ticks (10 us). Bucket 0 counts frames in the same tick
+// as the previous one and bucket n (n > 0) intervals from 2^(n-1) up to
+// 2^n - 1 ticks; the last bucket also counts all longer intervals.
+// If idCount is not NULL, it receives the number of frames seen for each
+// standard id. Counting per id starts the first time it is asked for.
+
+#define VCAN_BUS_HIST_BUCKETS       20
+#define VCAN_BUS_STD_IDS            2048
+
+typedef struct {
+  VCanBusStatistics  stats;                           // Out
+  uint32_t           interval[VCAN_BUS_HIST_BUCKETS]; // Out
+  uint32_t          *idCount;  // In: room for VCAN_BUS_STD_IDS counts, or NULL
+} VCAN_IOCTL_BUS_STATS_EX_T;
+
+// Per id timing monitor (VCAN_IOC_SET_ID_MONITOR)
+//===========================================================================
+// When enabled, the driver keeps a record for each id seen on the channel
+// (standard and extended ids are kept apart), shared by all handles on it.
+// Intervals are in timestamp ticks (10 us) and bucketed as in
+// VCAN_IOCTL_BUS_STATS_EX_T. Frames with ids beyond maxIds are counted in
+// dropped only.
+
+#define VCAN_ID_MONITOR_MAX_IDS     8192
+
+typedef struct {
+  uint32_t  id;            // Including VCAN_EXT_MSG_ID
+  uint32_t  count;         // Number of frames with this id
+  uint64_t  lastTime;      // Timestamp of the latest frame, as on the handle
+  uint32_t  minInterval;   // Shortest and longest time between two frames,
+  uint32_t  maxInterval;   // both 0 until two frames have been seen
+  uint32_t  interval[VCAN_BUS_HIST_BUCKETS];
+} VCanIdMonitorRecord;
+
+typedef struct {
+  VCanIdMonitorRecord *rec;
+  uint32_t             max;      // In: number of records rec has room for
+  uint32_t             count;    // Out: number of records returned
+  uint32_t             nIds;     // Out: number of ids monitored
+  uint32_t             dropped;  // Out: frames not monitored, out of ids
+} VCAN_IOCTL_ID_MONITOR_T;
+
+// Channel data that does not change while the card is present
+// (VCAN_IOC_GET_CHANNEL_DATA), in the layout of the single item ioctls.
+typedef struct {
+  uint64_t  capabilitiesEx[2];  // VCAN_IOC_GET_CHAN_CAP_EX
+  uint32_t  cardNumber;         // VCAN_IOC_GET_CARD_NUMBER
+  uint32_t  cardType;           // VCAN_IOC_GET_CARD_TYPE
+  uint32_t  serial[2];          // VCAN_IOC_GET_SERIAL
+  uint32_t  ean[2];             // VCAN_IOC_GET_EAN
+  uint32_t  firmwareRev[2];     // VCAN_IOC_GET_FIRMWARE_REV
+  uint32_t  hardwareRev[2];     // VCAN_IOC_GET_HARDWARE_REV
+  uint32_t  capabilities;       // VCAN_IOC_GET_CHAN_CAP
+  uint32_t  capabilitiesMask;   // VCAN_IOC_GET_CHAN_CAP_MASK
+  char      driverName[32];     // VCAN_IOC_GET_DRIVER_NAME
+} VCAN_IOCTL_CHANNEL_DATA_T;
+
 typedef struct {
   VCAN_EVENT *msg;
 } KCAN_IOCTL_SCRIPT_GET_TEXT_T;
@@ -1229,6 +1229,171 @@ canStatus CANLIBAPI canReadWait (const CanHandle hnd,
                                  unsigned long *time,
                                  unsigned long timeout);
 
+  /**
+   * One message, as returned by \ref canReadBatch() and passed to
+   * \ref canWriteBatch().
+   */
+typedef struct canMsgRecord_s {
+  long           id;       ///< The CAN identifier.
+  unsigned int   flags;    ///< A combination of the \ref canMSG_xxx, \ref canFDMSG_xxx and \ref canMSGERR_xxx values.
+  unsigned int   dlc;      ///< The message length.
+  unsigned long  time;     ///< The message time stamp.
+  unsigned char  data[64]; ///< The message data (not written for remote frames).
+} canMsgRecord;
+
+/**
+ * \ingroup CAN
+ *
+ * Reads up to \a max messages from the receive buffer in one call. If no
+ * message is immediately available, the function waits until a message
+ * arrives or a timeout occurs; it then returns the messages that are
+ * available, without waiting for the buffer to fill up to \a max.
+ *
+ * Each message is returned exactly as \ref canReadWait() would have
+ * returned it, but the whole batch is fetched from the driver in a single
+ * call, which is considerably cheaper at high message rates.
+ *
+ * \param[in]  hnd     A handle to an open circuit.
+ * \param[out] msgs    Pointer to an array of at least \a max
+ *                     \ref canMsgRecord that receives the messages.
+ * \param[in]  max     The maximum number of messages to read.
+ * \param[out] got     Pointer to a buffer which receives the number of
+ *                     messages that were read.
+ * \param[in]  timeout If no message is immediately available, this parameter
+ *                     gives the number of milliseconds to wait for a message
+ *                     before returning. 0xFFFFFFFF gives an infinite timeout.
+ *
+ * \return \ref canOK (zero) if at least one message was read.
+ * \return \ref canERR_NOMSG (negative) if there was no message available.
+ * \return \ref canERR_xxx (negative) if failure
+ *
+ * \sa \ref canRead(), \ref canReadWait()
+ *
+ * \sa \ref page_user_guide_time Time Measurement
+ */
+canStatus CANLIBAPI canReadBatch (const CanHandle hnd,
+                                  canMsgRecord *msgs,
+                                  unsigned int max,
+                                  unsigned int *got,
+                                  unsigned long timeout);
+
+/**
+ * \ingroup CAN
+ *
+ * Puts up to \a count messages on the transmit queue of a channel in one
+ * call. The messages are handed to the driver together and the hardware is
+ * only notified once, which is considerably cheaper than calling
+ * \ref canWrite() for each message at high message rates.
+ *
+ * The \a id, \a flags, \a dlc and \a data fields of each \ref
+ * canMsgRecord are used as the corresponding arguments to \ref canWrite();
+ * the \a time field is ignored.
+ *
+ * If the transmit queue fills up, or a message is invalid, the messages
+ * before it are still sent and \a sent tells how many they were.
+ *
+ * \param[in]  hnd    A handle to an open CAN circuit.
+ * \param[in]  msgs   Pointer to an array of \a count messages.
+ * \param[in]  count  The number of messages to send.
+ * \param[out] sent   Pointer to a buffer which receives the number of
+ *                    messages that were put on the transmit queue.
+ *
+ * \return \ref canOK (zero) if all messages were put on the transmit queue.
+ * \return \ref canERR_TXBUFOFL (negative) if the transmit queue was full
+ *         before all messages were accepted.
+ * \return \ref canERR_xxx (negative) if failure
+ *
+ * \sa \ref canWrite(), \ref canWriteSync(), \ref canReadBatch()
+ */
+canStatus CANLIBAPI canWriteBatch (const CanHandle hnd,
+                                   const canMsgRecord *msgs,
+                                   unsigned int count,
+                                   unsigned int *sent);
+
+  /**
+   * Set in the identifier passed to \ref canReadLatest() to read an
+   * extended (29-bit) identifier.
+   */
+#define canLATEST_EXT_ID 0x80000000
+
+  /**
+   * The latest message with one id, as returned by \ref canSnapshot().
+   */
+typedef struct canLatestRecord_s {
+  long           id;       ///< The CAN identifier.
+  unsigned int   flags;    ///< A combination of the \ref canMSG_xxx, \ref canFDMSG_xxx and \ref canMSGERR_xxx values.
+  unsigned int   dlc;      ///< The message length.
+  unsigned long  time;     ///< The time stamp of the latest message.
+  unsigned long  updates;  ///< The number of messages received with this id.
+  unsigned char  data[64]; ///< The message data (not written for remote frames).
+} canLatestRecord;
+
+/**
+ * \ingroup CAN
+ *
+ * Reads the latest message received with identifier \a id on a handle in
+ * latest value mode, see \ref canIOCTL_SET_LATEST_VALUE_MODE. The message
+ * stays in the driver and is returned again until a newer one arrives.
+ *
+ * Standard and extended identifiers with the same value are kept apart.
+ * Set \ref canLATEST_EXT_ID in \a id to read an extended identifier.
+ *
+ * \param[in]  hnd     A handle to an open circuit.
+ * \param[in]  id      The desired message identifier, with
+ *                     \ref canLATEST_EXT_ID set for an extended identifier.
+ * \param[out] msg     Pointer to the buffer which receives the message data.
+ *                     This buffer must be large enough (i.e. 8 bytes for
+ *                     classic CAN and up to 64 bytes for CAN FD).
+ * \param[out] dlc     Pointer to a buffer which receives the message length.
+ * \param[out] flag    Pointer to a buffer which receives the message flags,
+ *                     which is a combination of the \ref canMSG_xxx and
+ *                     \ref canMSGERR_xxx values.
+ * \param[out] time    Pointer to a buffer which receives the message time stamp.
+ * \param[out] updates Pointer to a buffer which receives the number of
+ *                     messages received with this identifier, or NULL.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_NOMSG (negative) if no message with this identifier
+ *         has been received
+ * \return \ref canERR_PARAM (negative) if the handle is not in latest value mode
+ * \return \ref canERR_xxx (negative) if failure
+ *
+ * \sa \ref canSnapshot(), \ref canReadSpecific()
+ */
+canStatus CANLIBAPI canReadLatest (const CanHandle hnd,
+                                   long id,
+                                   void *msg,
+                                   unsigned int *dlc,
+                                   unsigned int *flag,
+                                   unsigned long *time,
+                                   unsigned long *updates);
+
+/**
+ * \ingroup CAN
+ *
+ * Returns the latest message for each identifier that has received a new
+ * message since the previous call, on a handle in latest value mode, see
+ * \ref canIOCTL_SET_LATEST_VALUE_MODE. Identifiers that do not fit in
+ * \a max are returned by the next call.
+ *
+ * \param[in]  hnd  A handle to an open circuit.
+ * \param[out] recs Pointer to an array of at least \a max
+ *                  \ref canLatestRecord.
+ * \param[in]  max  The maximum number of records to return.
+ * \param[out] got  Pointer to a buffer which receives the number of records
+ *                  returned, which is 0 if nothing has changed.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_PARAM (negative) if the handle is not in latest value mode
+ * \return \ref canERR_xxx (negative) if failure
+ *
+ * \sa \ref canReadLatest()
+ */
+canStatus CANLIBAPI canSnapshot (const CanHandle hnd,
+                                 canLatestRecord *recs,
+                                 unsigned int max,
+                                 unsigned int *got);
+
 /**
  * \ingroup CAN
  *
@@ -2811,9 +2976,13 @@ typedef struct kvBusParamLimits {
    * limited resource. Do not increase the receive buffer size unless you have
    * good reasons to do so.
    *
+   * Under linux the size must be between 16 and 65536 messages, or 0 to
+   * restore the default size of 499 messages. Messages already in the
+   * buffer are kept, except the oldest ones if they do not fit.
+   *
    * \note You can't use this function code when the channel is on bus.
    *
-   * \note Not implemented in linux.
+   * \sa \ref canIOCTL_GET_RX_QUEUE_HIGH_WATER
    */
 # define canIOCTL_SET_RX_QUEUE_SIZE               27
 
@@ -3073,6 +3242,116 @@ typedef struct kvBusParamLimits {
    * \note This is only intended for internal use.
    */
 #  define canIOCTL_LIN_MODE                               45
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * Switches the handle to a receive ring that is shared with the driver
+   * through mmap(). Received messages are then picked up by \ref canRead(),
+   * \ref canReadWait(), \ref canReadBatch() and \ref canReadSpecific() and
+   * its variants without any system call, unless the ring is empty and the
+   * call has to wait for a message.
+   *
+   * \a buf points to an unsigned int which contains the number of messages
+   * the ring should hold, rounded up to a power of two, or 0 for the
+   * default size (1024). The ring can only be set up once per handle and
+   * stays until the handle is closed.
+   *
+   * \note Messages still in the receive queue when the ring is set up are
+   * discarded, so the ring is best set up before going bus on.
+   */
+#  define canIOCTL_MAP_RX_RING                            46
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * \a buf points to an unsigned int which receives the highest number of
+   * messages that have been waiting in the receive buffer at the same time.
+   * The value is reset when the buffer is flushed or resized, and can be
+   * used to pick a size for \ref canIOCTL_SET_RX_QUEUE_SIZE.
+   */
+#  define canIOCTL_GET_RX_QUEUE_HIGH_WATER                47
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * Switches the handle to latest value mode. Received messages are then no
+   * longer queued; the driver keeps the latest message for each identifier
+   * instead, which is read with \ref canReadLatest() and \ref canSnapshot().
+   * Other events are queued as before.
+   *
+   * \a buf points to an unsigned int which contains the maximum number of
+   * identifiers to keep (at most 8192), or 0 to go back to queueing all
+   * messages. Messages with identifiers beyond that number are dropped and
+   * counted as overruns. Setting the mode again discards all kept messages.
+   */
+#  define canIOCTL_SET_LATEST_VALUE_MODE                  48
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * Lets a thread that waits for messages, e.g. in \ref canReadWait(),
+   * \ref canReadBatch() or poll() on the descriptor from \ref kvGetEventFd(),
+   * sleep until several messages are waiting instead of waking up for
+   * each message.
+   *
+   * \a buf points to a \ref canRxWakeup. The thread is woken when \a count
+   * messages are waiting, or \a delayUs microseconds (at most 1000000) after
+   * the first message it was not woken for. \a delayUs must not be 0 if
+   * \a count is larger than 1. A \a count of 0 or 1 wakes the thread for
+   * each message, which is the default.
+   *
+   * The timeout passed to the read functions still applies.
+   */
+#  define canIOCTL_SET_RX_WAKEUP                          49
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * Reads the bus statistics of the channel together with a histogram of
+   * the time between frames and, optionally, the number of frames seen for
+   * each standard identifier, in one call. As with
+   * \ref canGetBusStatistics(), the bus load is the one calculated at the
+   * latest \ref canRequestBusStatistics().
+   *
+   * \a buf points to a \ref canBusStatisticsEx. Counting per identifier
+   * starts the first time it is asked for, by setting \a idCount.
+   */
+#  define canIOCTL_GET_BUS_STATISTICS_EX                  50
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * Starts or stops monitoring the timing of each identifier on the
+   * channel. The driver then counts the messages with each identifier and
+   * keeps a histogram of the time between them, without the application
+   * having to read the messages. The monitor is shared by all handles on
+   * the channel; it is read with \ref canIOCTL_GET_ID_MONITOR and summarised
+   * in the driver's file in /proc.
+   *
+   * \a buf points to an unsigned int which contains the maximum number of
+   * identifiers to monitor (at most 8192), or 0 to stop monitoring.
+   * Setting it again restarts the monitor.
+   */
+#  define canIOCTL_SET_ID_MONITOR                         51
+
+  /**
+   * This define is used in \ref canIoCtl(), \a buf mentioned below refers to
+   * this functions argument.
+   *
+   * Reads the records of the identifier monitor started with
+   * \ref canIOCTL_SET_ID_MONITOR.
+   *
+   * \a buf points to a \ref canIdMonitor. Returns \ref canERR_PARAM if the
+   * channel has no monitor.
+   */
+#  define canIOCTL_GET_ID_MONITOR                         52
  /** @} */
 
 /** Used in \ref canIOCTL_SET_USER_IOPORT and \ref canIOCTL_GET_USER_IOPORT. */
@@ -3081,6 +3360,39 @@ typedef struct {
   unsigned int portValue;  ///< Port value used in e.g. \ref canIOCTL_SET_USER_IOPORT
 } canUserIoPortData;
 
+/** Used in \ref canIOCTL_SET_RX_WAKEUP. */
+typedef struct {
+  unsigned int count;      ///< Wake up when this many messages are waiting
+  unsigned int delayUs;    ///< or this many microseconds after the first one
+} canRxWakeup;
+
+  /**
+   * The timing of one identifier, see \ref canIOCTL_SET_ID_MONITOR.
+   */
+typedef struct {
+  long          id;           ///< The CAN identifier.
+  unsigned int  flags;        ///< \ref canMSG_STD or \ref canMSG_EXT.
+  unsigned int  count;        ///< The number of messages with this identifier.
+  unsigned long time;         ///< The time stamp of the latest message.
+  unsigned int  minInterval;  ///< Shortest time between two messages, in microseconds.
+  unsigned int  maxInterval;  ///< Longest time between two messages, in microseconds.
+
+  /**
+   * Histogram of the time between messages, as in
+   * \ref canBusStatisticsEx::interval.
+   */
+  unsigned int  interval[20];
+} canIdMonitorRecord;
+
+/** Used in \ref canIOCTL_GET_ID_MONITOR. */
+typedef struct {
+  canIdMonitorRecord *recs;   ///< Array of \a max records
+  unsigned int  max;          ///< In: number of records \a recs has room for
+  unsigned int  count;        ///< Out: number of records returned
+  unsigned int  ids;          ///< Out: number of identifiers monitored
+  unsigned int  dropped;      ///< Out: messages not monitored, out of identifiers
+} canIdMonitor;
+
 
 /**
  * \ingroup CAN
@@ -3746,6 +4058,53 @@ canStatus CANLIBAPI canSetAcceptanceFilter (const CanHandle hnd,
                                             unsigned int code,
                                             unsigned int mask,
                                             int is_extended);
+
+/** Used in \ref canSetIdFilter(). */
+typedef struct {
+  unsigned int first;  ///< First identifier in the range
+  unsigned int last;   ///< Last identifier in the range, inclusive
+} canIdRange;
+
+/**
+ * \ingroup CAN
+ *
+ * This routine sets a filter on a list of identifiers for a handle. Messages
+ * that do not pass the filter are dropped by the driver before they are put
+ * in the receive buffer of the handle. The filter is applied in addition to
+ * the one set by \ref canAccept().
+ *
+ * 11-bit identifiers are looked up in a bitmap built from \a stdIds.
+ * 29-bit identifiers are masked with \a extMask and then looked up among
+ * \a extRanges. A J1939 application can for example use the mask 0x03FFFF00
+ * and one range per PGN, (pgn << 8) to (pgn << 8), to accept those PGNs from
+ * any source address and with any priority.
+ *
+ * To remove the filter, call \ref canSetIdFilter() with both \a stdIds and
+ * \a extRanges set to NULL.
+ *
+ * \param[in] hnd        An open handle to a CAN circuit.
+ * \param[in] stdIds     Accepted 11-bit identifiers, or NULL to accept all
+ *                       11-bit identifiers.
+ * \param[in] stdCount   Number of entries in \a stdIds. 0 rejects all 11-bit
+ *                       identifiers.
+ * \param[in] extRanges  Accepted ranges of masked 29-bit identifiers, or NULL
+ *                       to accept all 29-bit identifiers.
+ * \param[in] extCount   Number of entries in \a extRanges, at most 4096.
+ *                       0 rejects all 29-bit identifiers.
+ * \param[in] extMask    Mask applied to 29-bit identifiers before the lookup,
+ *                       or 0 to use all 29 bits.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_xxx (negative) if failure
+ *
+ * \sa \ref canAccept(), \ref canSetAcceptanceFilter()
+ */
+canStatus CANLIBAPI canSetIdFilter (const CanHandle hnd,
+                                    const unsigned int *stdIds,
+                                    unsigned int stdCount,
+                                    const canIdRange *extRanges,
+                                    unsigned int extCount,
+                                    unsigned int extMask);
 /**
  * \ingroup CAN
  *
@@ -3927,6 +4286,33 @@ typedef struct canBusStatistics_s {
   unsigned long  overruns;  ///< The number of overruns detected by the hardware, firmware or driver.
 } canBusStatistics;
 
+/** Number of buckets in \ref canBusStatisticsEx::interval. */
+#define canBUS_STATISTICS_INTERVALS   20
+
+  /**
+   * Used in \ref canIOCTL_GET_BUS_STATISTICS_EX.
+   *
+   * Like \ref canBusStatistics, the values are cleared when the channel goes
+   * on bus.
+   */
+typedef struct {
+  canBusStatistics  stat;   ///< As returned by \ref canGetBusStatistics()
+
+  /**
+   * Histogram of the time between consecutive frames on the bus, in units
+   * of 10 microseconds. Bucket 0 counts frames with no measurable time
+   * since the previous one, and bucket n intervals from 2^(n-1) up to
+   * 2^n - 1 units. The last bucket also counts all longer intervals.
+   */
+  unsigned int      interval[canBUS_STATISTICS_INTERVALS];
+
+  /**
+   * NULL, or room for 2048 counts that receive the number of frames seen
+   * for each standard (11-bit) identifier.
+   */
+  unsigned int     *idCount;
+} canBusStatisticsEx;
+
 /**
  * \ingroup CAN
  *
@@ -4185,10 +4571,11 @@ typedef void (CANLIBAPI *kvCallback_t) (CanHandle hnd, void* context, unsigned i
  * To remove the callback, call \ref kvSetNotifyCallback() with a \c NULL pointer in
  * the callback argument.
  *
- * \note The callback function is called in the context of a high-priority
- * thread created by CANlib. You should take precaution not to do any time
- * consuming tasks in the callback.  You must also arrange the synchronization
- * between the callback and your other threads yourself.
+ * \note The callback function is called in the context of a thread created
+ * by CANlib, which is shared by the callbacks of all handles. You should take
+ * precaution not to do any time consuming tasks in the callback.  You must
+ * also arrange the synchronization between the callback and your other
+ * threads yourself.
  *
  * \param[in] hnd          An open handle to a CAN channel.
  * \param[in] callback     A pointer to a callback function of type
@@ -4207,6 +4594,29 @@ kvStatus CANLIBAPI kvSetNotifyCallback (const CanHandle hnd,
                                         void* context,
                                         unsigned int notifyFlags);
 
+/**
+ * \ingroup can_general
+ *
+ * Returns a file descriptor for the handle that can be waited on with
+ * poll(), select() or epoll, so that one thread can serve many handles
+ * without a callback thread. The descriptor is readable when \ref canRead()
+ * would return a message, or when \ref canSnapshot() has something to
+ * return in latest value mode. When it is readable, read until
+ * \ref canERR_NOMSG is returned, in particular if edge triggered epoll is used.
+ *
+ * The descriptor belongs to the handle. Do not read from or close it; it
+ * is closed by \ref canClose().
+ *
+ * \param[in]  hnd  An open handle to a CAN channel.
+ * \param[out] fd   Pointer to a buffer which receives the file descriptor.
+ *
+ * \return \ref canOK (zero) if success
+ * \return \ref canERR_xxx (negative) if failure
+ *
+ * \sa \ref kvSetNotifyCallback(), \ref canReadBatch()
+ */
+kvStatus CANLIBAPI kvGetEventFd (const CanHandle hnd, int *fd);
+
 /**
  * \name kvBUSTYPE_xxx
  * \anchor kvBUSTYPE_xxx
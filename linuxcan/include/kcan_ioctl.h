@@ -174,12 +174,17 @@ typedef struct s_kcan_ioctl_read_tref_list {
 #define CAN_MODE_READ         2
 #define CAN_MODE_READ_VERSION 3
 
+// flags, flagsReply
+#define CAN_OPEN_MODE_FLAG_COMPACT_EVENTS 0x01 // Queue VCAN_COMPACT_EVENT, only with OPEN_AS_CAN
+
 typedef struct {
   unsigned int mode;   // CANFD_NONISO, CANFD_ISO, CAN
   unsigned int action; // CAN_CANFD_SET, CAN_CANFD_READ
   unsigned int reply; // reply from read?
   int status; // CAN_CANFD_MATCHING, CAN_CANFD_MISMATCH
-  unsigned int unused[8];
+  unsigned int flags;      // Requested CAN_OPEN_MODE_FLAG_xxx, with CAN_MODE_SET
+  unsigned int flagsReply; // Granted CAN_OPEN_MODE_FLAG_xxx
+  unsigned int unused[6];
 } KCAN_IOCTL_OPEN_MODE_T;
 
 
@@ -76,6 +76,7 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 #include <linux/version.h>
+#include <linux/mutex.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0))
 #define wait_queue_entry_t wait_queue_t
 #endif /* KERNEL_VERSION < 4.13.0 */
@@ -91,6 +92,7 @@ typedef struct {
   wait_queue_head_t space_event;
   Lock_type lock_type;
   spinlock_t lock;
+  struct mutex reserve; // Held from queue_reserve() to queue_commit()
   int locked;           // For debugging
   int line;             // For debugging
 } Queue;
@@ -113,6 +115,18 @@ extern int  queue_front(Queue *queue);
 extern void queue_pop(Queue *queue);
 extern void queue_release(Queue *queue);
 
+// Reservation of free elements without holding the queue lock, so that
+// they can be filled from user memory. queue_reserve() may sleep and
+// returns the index of the first free element, with the number of free
+// elements from there up to the end of the buffer in *space, or -1 if the
+// queue is full. A successful reservation _must_ be paired with
+// queue_commit(), which makes the first n (possibly 0) of them visible to
+// queue_front(). After -1 there is nothing to commit.
+// Reservations are serialized, and must not be mixed with queue_back()
+// on the same queue.
+extern int  queue_reserve(Queue *queue, int *space);
+extern void queue_commit(Queue *queue, int n);
+
 extern void queue_add_wait_for_space(Queue *queue, wait_queue_entry_t *waiter);
 extern void queue_remove_wait_for_space(Queue *queue, wait_queue_entry_t *waiter);
 extern void queue_add_wait_for_data(Queue *queue, wait_queue_entry_t *waiter);
@@ -165,6 +165,22 @@
 
 #define VCAN_IOC_GET_CHAN_CAP_EX         _IO(VCAN_IOC_MAGIC,182)
 
+#define VCAN_IOC_RECVMSG_BATCH           _IO(VCAN_IOC_MAGIC,183)
+#define VCAN_IOC_SENDMSG_BATCH           _IO(VCAN_IOC_MAGIC,184)
+#define VCAN_IOC_MAP_RX_RING             _IO(VCAN_IOC_MAGIC,185)
+#define VCAN_IOC_SET_RX_QUEUE_SIZE       _IO(VCAN_IOC_MAGIC,186)
+#define VCAN_IOC_GET_RX_QUEUE_HIGH_WATER _IO(VCAN_IOC_MAGIC,187)
+#define VCAN_IOC_SET_ID_FILTER           _IO(VCAN_IOC_MAGIC,188)
+#define VCAN_IOC_SET_MAILBOX             _IO(VCAN_IOC_MAGIC,189)
+#define VCAN_IOC_READ_MAILBOX            _IO(VCAN_IOC_MAGIC,190)
+#define VCAN_IOC_MAILBOX_SNAPSHOT        _IO(VCAN_IOC_MAGIC,191)
+#define VCAN_IOC_SET_RX_WAKEUP           _IO(VCAN_IOC_MAGIC,192)
+#define VCAN_IOC_GET_BUS_STATS_EX        _IO(VCAN_IOC_MAGIC,193)
+#define VCAN_IOC_SET_ID_MONITOR          _IO(VCAN_IOC_MAGIC,194)
+#define VCAN_IOC_GET_ID_MONITOR          _IO(VCAN_IOC_MAGIC,195)
+#define VCAN_IOC_GET_CHANNEL_DATA        _IO(VCAN_IOC_MAGIC,196)
+#define VCAN_IOC_RX_RING_WAIT            _IO(VCAN_IOC_MAGIC,197)
+
 
 #define VCAN_CHANNEL_CAP_SEND_ERROR_FRAMES      0x00000001
 #define VCAN_CHANNEL_CAP_RECEIVE_ERROR_FRAMES   0x00000002
@@ -264,6 +264,38 @@ struct s_vcan_event {
 typedef struct s_vcan_event VCAN_EVENT, Vevent, *PVevent;
 
 
+/* Compact event, for handles that only see classic CAN frames.
+ * Has the same layout as the start of VCAN_EVENT. */
+#define VCAN_COMPACT_MSG_LEN        8
+
+struct s_vcan_compact_msg {  /* 15 Bytes */
+  uint32_t           id;
+  unsigned short int flags;
+  unsigned char      dlc;
+  unsigned char      data[VCAN_COMPACT_MSG_LEN];
+};
+
+union s_vcan_compact_tag_data {
+        struct s_vcan_compact_msg          msg;
+        struct s_vcan_chip_state           chipState;
+        struct s_vcan_statistic_std        statisticStd;
+        struct s_vcan_statistic_ext        statisticExt;
+        struct s_vcan_error                error;
+      };
+
+struct s_vcan_compact_event {
+         VeventTag     tag;             // 1
+         unsigned char chanIndex;       // 1
+         unsigned char transId;         // 1
+         unsigned char unused_1;        // 1
+         unsigned long timeStamp;       // 4 or 8
+         union s_vcan_compact_tag_data
+                       tagData;         // 15 Bytes
+       };
+
+typedef struct s_vcan_compact_event VCAN_COMPACT_EVENT;
+
+
 typedef struct s_can_msg {
   VeventTag          tag;
   unsigned char      channel_index;
@@ -70,7 +70,6 @@
 #include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/slab.h>
-#include <linux/kthread.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
 #include <linux/sched.h>
 #else
@@ -222,6 +221,19 @@ static VCanHWInterface hwIf = {
 #define MAX_PACKET_OUT      3072        // To device
 #define MAX_PACKET_IN       3072        // From device
 
+//----------------------------------------------------------------------------
+// The bulk in endpoint is read through a ring of rx_urbs urbs that are kept
+// submitted, so the device always has somewhere to put data while earlier
+// buffers are being parsed. Both values are read when a device is plugged in.
+//
+static unsigned int rx_urbs = 4;
+MODULE_PARM_DESC(rx_urbs, "Leaf number of read urbs per device (1-16)");
+module_param(rx_urbs, uint, 0644);
+
+static unsigned int rx_buffer_size = MAX_PACKET_IN;
+MODULE_PARM_DESC(rx_buffer_size, "Leaf size in bytes of each read urb buffer");
+module_param(rx_buffer_size, uint, 0644);
+
 static unsigned long ticks_to_10us (VCanCardData *vCard,
                                     uint64_t      ticks)
 {
@@ -252,6 +264,12 @@ static void   leaf_write_bulk_callback(struct urb *urb, struct pt_regs *regs);
 static void   leaf_write_bulk_callback(struct urb *urb);
  #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 8))
+# define USB_KILL_URB(x) usb_unlink_urb(x)
+#else
+# define USB_KILL_URB(x) usb_kill_urb(x)
+#endif
+
 
 
 static int    leaf_allocate(VCanCardData **vCard);
@@ -420,114 +438,263 @@ static void leaf_write_bulk_callback (struct urb *urb)
 //----------------------------------------------------------------------------
 
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+# define USE_CONTEXT 1
+#else
+# define USE_CONTEXT 0
+#endif
+
 //============================================================================
 //
-// leaf_rx_thread
+// leaf_rx_parse
+//
+// Interpret the commands in one buffer from the bulk in endpoint.
 //
-static int leaf_rx_thread (void *context)
+static void leaf_rx_parse (VCanCardData *vCard, unsigned char *buffer,
+                           unsigned int len)
+{
+  LeafCardData *dev        = (LeafCardData *)vCard->hwCardData;
+  filoCmd      *cmd;
+  int          loopCounter = 1000;
+  unsigned int count       = 0;
+
+
+  while (count < len) {
+    // A loop counter as a safety measure.
+    if (--loopCounter == 0) {
+      DEBUGPRINT(2, (TXT("ERROR leaf_rx_parse() LOOPMAX. \n")));
+      break;
+    }
+
+    // A command will never straddle a bulk_in_MaxPacketSize byte boundary.
+    // The firmware will place a zero in the buffer to indicate that
+    // the next command will follow after the next
+    // bulk_in_MaxPacketSize bytes boundary.
+
+    cmd = (filoCmd *)&buffer[count];
+    if (cmd->head.cmdLen == 0) {
+      count += dev->bulk_in_MaxPacketSize;
+      count &= -(dev->bulk_in_MaxPacketSize);
+      continue;
+    }
+    else {
+      count += cmd->head.cmdLen;
+    }
+
+    leaf_handle_command(cmd, vCard);
+  }
+} // _rx_parse
+
+
+//============================================================================
+//
+// leaf_rx_work
+//
+// Runs on the single threaded rxQ, so buffers are parsed in the order the
+// urbs completed. The urb is resubmitted once its buffer has been parsed;
+// the other urbs in the ring keep the endpoint busy meanwhile.
+//
+#if USE_CONTEXT
+static void leaf_rx_work (void *context)
+#else
+static void leaf_rx_work (struct work_struct *work)
+#endif
 {
-  VCanCardData *vCard   = (VCanCardData *)context;
-  LeafCardData *dev     = (LeafCardData *)vCard->hwCardData;
-  int          result  = 0;
-  int          usbErrorCounter;
+#if USE_CONTEXT
+  LeafRxUrb    *rx    = (LeafRxUrb *)context;
+#else
+  LeafRxUrb    *rx    = container_of(work, LeafRxUrb, work);
+#endif
+  VCanCardData *vCard = rx->vCard;
+  LeafCardData *dev   = (LeafCardData *)vCard->hwCardData;
+  struct urb   *urb   = rx->urb;
   int          ret;
-  int          len;
 
-  if (!try_module_get(THIS_MODULE)) {
-    return -ENODEV;
+  if (urb->status) {
+    DEBUGPRINT(2, (TXT("read bulk status (%d)\n"), urb->status));
+
+    if (urb->status == -EILSEQ || urb->status == -ESHUTDOWN ||
+        urb->status == -ENODEV) {
+      DEBUGPRINT(2, (TXT("read bulk error (%d) - Device probably ")
+                     TXT2("removed, closing down\n"), urb->status));
+      vCard->cardPresent = 0;
+      return;
+    }
+
+    if (++dev->rxErrorCounter > 100) {
+      DEBUGPRINT(2, (TXT("rx Ended - error (%d)\n"), urb->status));
+
+      // Since this has failed so many times, stop transfers to device
+      vCard->cardPresent = 0;
+      return;
+    }
+  }
+  else {
+    dev->rxErrorCounter = 0;
+    leaf_rx_parse(vCard, rx->buffer, urb->actual_length);
   }
 
-  DEBUGPRINT(3, (TXT("rx thread started\n")));
+  if (dev->rxStopped || !vCard->cardPresent) {
+    return;
+  }
+
+  ret = usb_submit_urb(urb, GFP_KERNEL);
+  if (ret) {
+    DEBUGPRINT(1, (TXT("Failed resubmitting read urb (%d)\n"), ret));
+    if (ret == -ENODEV) {
+      vCard->cardPresent = 0;
+    }
+  }
+} // _rx_work
+
+
+//============================================================================
+//  leaf_read_bulk_callback
+//
+// Interrupt handler prototype changed in 2.6.19.
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 19))
+static void leaf_read_bulk_callback (struct urb *urb, struct pt_regs *regs)
+#else
+static void leaf_read_bulk_callback (struct urb *urb)
+#endif
+{
+  LeafRxUrb    *rx  = (LeafRxUrb *)urb->context;
+  LeafCardData *dev = (LeafCardData *)rx->vCard->hwCardData;
+
+  // Killed by leaf_rx_stop(), leave it idle
+  if (urb->status == -ENOENT || urb->status == -ECONNRESET) {
+    return;
+  }
+
+  queue_work(dev->rxQ, &rx->work);
+}
+
+
+//============================================================================
+//
+// leaf_rx_start
+//
+// Allocate the ring of read urbs and submit all of them.
+//
+static int leaf_rx_start (VCanCardData *vCard)
+{
+  LeafCardData *dev = (LeafCardData *)vCard->hwCardData;
+  unsigned int i;
+  size_t       size;
 
-  dev->read_urb = 0;
+  // The buffer must hold a whole number of usb packets
+  size = max_t(size_t, rx_buffer_size, dev->bulk_in_MaxPacketSize);
+  if (dev->bulk_in_MaxPacketSize) {
+    size = roundup(size, dev->bulk_in_MaxPacketSize);
+  }
 
-  usbErrorCounter = 0;
+  dev->bulk_in_size   = size;
+  dev->rxUrbCount     = min_t(unsigned int, max_t(unsigned int, rx_urbs, 1),
+                              LEAF_MAX_RX_URBS);
+  dev->rxStopped      = 0;
+  dev->rxErrorCounter = 0;
 
-  while (vCard->cardPresent) {
+  dev->rxQ = create_singlethread_workqueue("leaf_rx");
+  if (!dev->rxQ) {
+    return VCAN_STAT_NO_MEMORY;
+  }
 
-    // Verify that the device wasn't unplugged
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    LeafRxUrb *rx = &dev->rxUrb[i];
 
-    len = 0;
-    // Do a blocking bulk read to get data from the device
-    // Timeout after 30 seconds
-    ret = usb_bulk_msg(dev->udev,
-                       usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-                       dev->bulk_in_buffer, dev->bulk_in_size, &len,
-// Timeout changed from jiffies to milliseconds in 2.6.12.
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 12))
-                       HZ * 30);
+    rx->vCard  = vCard;
+    rx->urb    = usb_alloc_urb(0, GFP_KERNEL);
+    rx->buffer = kmalloc(size, GFP_KERNEL);
+    DEBUGPRINT(2, (TXT("MALLOC read urb %u\n"), i));
+    if (!rx->urb || !rx->buffer) {
+      DEBUGPRINT(1, (TXT("Couldn't allocate read urb %u\n"), i));
+      return VCAN_STAT_NO_MEMORY;
+    }
+#if USE_CONTEXT
+    INIT_WORK(&rx->work, leaf_rx_work, rx);
 #else
-                       30000);
+    INIT_WORK(&rx->work, leaf_rx_work);
 #endif
+    usb_fill_bulk_urb(rx->urb, dev->udev,
+                      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                      rx->buffer, size, leaf_read_bulk_callback, rx);
+  }
 
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    int ret = usb_submit_urb(dev->rxUrb[i].urb, GFP_KERNEL);
     if (ret) {
-      if (ret != -ETIMEDOUT) {
-        // Save if runaway
-        if (ret == -EILSEQ || ret == -ESHUTDOWN || ret == -EINVAL) {
-          DEBUGPRINT(2, (TXT ("usb_bulk_msg error (%d) - Device probably ")
-                         TXT2("removed, closing down\n"), ret));
-          vCard->cardPresent = 0;
-          result = -ENODEV;
-          break;
-        }
+      DEBUGPRINT(1, (TXT("Failed submitting read urb %u (%d)\n"), i, ret));
+      return VCAN_STAT_FAIL;
+    }
+  }
 
-        if (usbErrorCounter > 100) {
-          DEBUGPRINT(2, (TXT("rx thread Ended - error (%d)\n"), ret));
+  DEBUGPRINT(3, (TXT("rx started, %u urbs of %zu bytes\n"),
+                 dev->rxUrbCount, size));
 
-          // Since this has failed so many times, stop transfers to device
-          vCard->cardPresent = 0;
-          result = -ENODEV;
-          break;
-        }
-      }
-    }
-    else {
-      //
-      // We got a bunch of bytes. Now interpret them.
-      //
-      unsigned char  *buffer     = (unsigned char *)dev->bulk_in_buffer;
-      filoCmd        *cmd;
-      int            loopCounter = 1000;
-      unsigned int   count       = 0;
+  return VCAN_STAT_OK;
+} // _rx_start
 
 
-      while (count < len) {
-        // A loop counter as a safety measure.
-        if (--loopCounter == 0) {
-          DEBUGPRINT(2, (TXT("ERROR leaf_rx_thread() LOOPMAX. \n")));
-          break;
-        }
+//============================================================================
+//
+// leaf_rx_stop
+//
+// Kill the read urbs and wait for pending parsing. A work item that was
+// already running may have resubmitted its urb while the first round of
+// kills was in progress, so kill once more after the flush.
+// Safe to call more than once, and before leaf_rx_start().
+//
+static void leaf_rx_stop (VCanCardData *vCard)
+{
+  LeafCardData *dev = (LeafCardData *)vCard->hwCardData;
+  unsigned int i;
 
-        // A command will never straddle a bulk_in_MaxPacketSize byte boundary.
-        // The firmware will place a zero in the buffer to indicate that
-        // the next command will follow after the next
-        // bulk_in_MaxPacketSize bytes boundary.
+  dev->rxStopped = 1;
+  smp_mb();
 
-        cmd = (filoCmd *)&buffer[count];
-        if (cmd->head.cmdLen == 0) {
-          count += dev->bulk_in_MaxPacketSize;
-          count &= -(dev->bulk_in_MaxPacketSize);
-          continue;
-        }
-        else {
-          count += cmd->head.cmdLen;
-        }
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    if (dev->rxUrb[i].urb) {
+      USB_KILL_URB(dev->rxUrb[i].urb);
+    }
+  }
 
-        leaf_handle_command(cmd, vCard);
-        usbErrorCounter = 0;
-      }
+  if (dev->rxQ) {
+    flush_workqueue(dev->rxQ);
+  }
+
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    if (dev->rxUrb[i].urb) {
+      USB_KILL_URB(dev->rxUrb[i].urb);
     }
-  } // while (vCard->cardPresent)
+  }
+} // _rx_stop
 
 
+//============================================================================
+//
+// leaf_rx_free
+//
+static void leaf_rx_free (VCanCardData *vCard)
+{
+  LeafCardData *dev = (LeafCardData *)vCard->hwCardData;
+  unsigned int i;
 
-  DEBUGPRINT(3, (TXT("rx thread Ended - finalised\n")));
+  leaf_rx_stop(vCard);
 
-  module_put(THIS_MODULE);
-  do_exit(result);
+  if (dev->rxQ) {
+    destroy_workqueue(dev->rxQ);
+    dev->rxQ = NULL;
+  }
 
-  return result;
-} // _rx_thread
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    usb_free_urb(dev->rxUrb[i].urb);
+    dev->rxUrb[i].urb = NULL;
+    kfree(dev->rxUrb[i].buffer);
+    dev->rxUrb[i].buffer = NULL;
+  }
+  dev->rxUrbCount = 0;
+  DEBUGPRINT(2, (TXT("Free read urbs\n")));
+} // _rx_free
 
 
 
@@ -1444,12 +1611,6 @@ static int leaf_get_trans_id (filoCmd *cmd)
 //============================================================================
 // _send
 //
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
-# define USE_CONTEXT 1
-#else
-# define USE_CONTEXT 0
-#endif
-
 #if USE_CONTEXT
 static void leaf_send (void *context)
 #else
@@ -2221,20 +2382,10 @@ static int leaf_plugin (struct usb_interface *interface,
         ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) ==
          USB_ENDPOINT_XFER_BULK)) {
       // We found a bulk in endpoint
-      buffer_size                = MAX_PACKET_IN;
-      dev->bulk_in_size          = buffer_size;
       dev->bulk_in_endpointAddr  = endpoint->bEndpointAddress;
-      dev->bulk_in_buffer        = kmalloc(buffer_size, GFP_KERNEL);
       dev->bulk_in_MaxPacketSize = le16_to_cpu(endpoint->wMaxPacketSize);
       DEBUGPRINT(2, (TXT("MaxPacketSize in = %d\n"),
                      dev->bulk_in_MaxPacketSize));
-
-      DEBUGPRINT(2, (TXT("MALLOC bulk_in_buffer\n")));
-      if (!dev->bulk_in_buffer) {
-        DEBUGPRINT(1, (TXT("Couldn't allocate bulk_in_buffer\n")));
-        goto error;
-      }
-      memset(dev->bulk_in_buffer, 0, buffer_size);
     }
 
     if (!dev->bulk_out_endpointAddr &&
@@ -2305,9 +2456,16 @@ static int leaf_plugin (struct usb_interface *interface,
 
 
   // Start up vital stuff
-  {
-    int r;
-    r = leaf_start(vCard);
+  if (leaf_start(vCard) != VCAN_STAT_OK) {
+    DEBUGPRINT(1, (TXT("Couldn't start the device\n")));
+    vCard->cardPresent = 0;
+    leaf_rx_stop(vCard);
+    if (dev->txTaskQ) {
+      destroy_workqueue(dev->txTaskQ);
+    }
+    USB_KILL_URB(dev->write_urb);
+    retval = -EIO;
+    goto error;
   }
 
   vCard->usb_root_hub_id = get_usb_root_hub_id (udev);
@@ -2341,8 +2499,8 @@ error:
 static int leaf_start (VCanCardData *vCard)
 {
   LeafCardData *dev = (LeafCardData *)vCard->hwCardData;
-  struct task_struct* rx_thread;
   unsigned int i;
+  int          r;
 
   DEBUGPRINT(3, (TXT("leaf: _start\n")));
 
@@ -2368,8 +2526,15 @@ static int leaf_start (VCanCardData *vCard)
   INIT_WORK(&dev->txWork, leaf_send);
 #endif
   dev->txTaskQ = create_workqueue("leaf_tx");
+  if (!dev->txTaskQ) {
+    return VCAN_STAT_NO_MEMORY;
+  }
 
-  rx_thread = kthread_run(leaf_rx_thread, vCard, "Kvaser kernel thread");
+  r = leaf_rx_start(vCard);
+  if (r != VCAN_STAT_OK) {
+    DEBUGPRINT(1, (TXT("Couldn't start reading from device\n")));
+    return r;
+  }
 
   // Gather some card info
   leaf_get_card_info_dummy(vCard);
@@ -2385,7 +2550,6 @@ static int leaf_start (VCanCardData *vCard)
   vCanInitData(vCard);
 
   if (vCard->card_flags & DEVHND_CARD_EXTENDED_CAPABILITIES) {
-    int r;
     r = leaf_capabilities (vCard, VCAN_CHANNEL_CAP_SILENTMODE);
     if (r != VCAN_STAT_OK) DEBUGPRINT(2, (TXT("Failed reading capability: VCAN_CHANNEL_CAP_SILENTMODE\n")));
 
@@ -2421,7 +2585,6 @@ static int leaf_start (VCanCardData *vCard)
 
   // Set all channels in normal mode.
   for (i = 0; i < vCard->nrChannels; i++) {
-    int r;
     filoCmd cmd;
 
     cmd.setDrivermodeReq.cmdNo      = CMD_SET_DRIVERMODE_REQ;
@@ -2451,6 +2614,7 @@ static int leaf_allocate (VCanCardData **in_vCard)
     VCanChanData  *dataPtrArray[MAX_CARD_CHANNELS];
     VCanChanData  vChd[MAX_CARD_CHANNELS];
     LeafChanData  hChd[MAX_CARD_CHANNELS];
+    CAN_MSG       txBuf[MAX_CARD_CHANNELS][TX_CHAN_BUF_SIZE];
   } ChanHelperStruct;
 
   int              chNr;
@@ -2485,6 +2649,7 @@ static int leaf_allocate (VCanCardData **in_vCard)
   for (chNr = 0; chNr < MAX_CARD_CHANNELS; chNr++) {
     chs->dataPtrArray[chNr]    = &chs->vChd[chNr];
     chs->vChd[chNr].hwChanData = &chs->hChd[chNr];
+    chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
     chs->vChd[chNr].minorNr    = -1;   // No preset minor number
   }
   vCard->chanData = chs->dataPtrArray;
@@ -2494,6 +2659,7 @@ static int leaf_allocate (VCanCardData **in_vCard)
   vCard->next = driverData.canCards;
   driverData.canCards = vCard;
   spin_unlock(&driverData.canCardsLock);
+  vCanCardListChanged();
 
   *in_vCard = vCard;
 
@@ -2522,11 +2688,8 @@ static void leaf_deallocate (VCanCardData *vCard)
   // Make sure all workqueues are finished
   //flush_workqueue(&dev->txTaskQ);
 
-  if (dev->bulk_in_buffer != NULL) {
-    kfree(dev->bulk_in_buffer);
-    DEBUGPRINT(2, (TXT("Free bulk_in_buffer\n")));
-    dev->bulk_in_buffer = NULL;
-  }
+  leaf_rx_free(vCard);
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35))
   usb_buffer_free(dev->udev, dev->bulk_out_size,
                   dev->bulk_out_buffer,
@@ -2579,6 +2742,7 @@ static void leaf_deallocate (VCanCardData *vCard)
   }
   if (vCard->chanData != NULL) {
     DEBUGPRINT(2, (TXT("Free vCard->chanData\n")));
+    vCanRemoveData(vCard);
     kfree(vCard->chanData);
     vCard->chanData = NULL;
   }
@@ -2590,21 +2754,14 @@ static void leaf_deallocate (VCanCardData *vCard)
 } // _deallocate
 
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 8))
-# define USB_KILL_URB(x) usb_unlink_urb(x)
-#else
-# define USB_KILL_URB(x) usb_kill_urb(x)
-#endif
-
 //============================================================================
 //     leaf_remove
 //
 //     Called by the usb core when the device is removed from the system.
 //
 //     This routine guarantees that the driver will not submit any more urbs
-//     by clearing dev->udev.  It is also supposed to terminate any currently
-//     active urbs.  Unfortunately, usb_bulk_msg(), does not provide any way
-//     to do this.  But at least we can cancel an active write.
+//     by clearing dev->udev.  It also terminates the read urbs and any
+//     active write.
 //
 static void leaf_remove (struct usb_interface *interface)
 {
@@ -2664,6 +2821,9 @@ static void leaf_remove (struct usb_interface *interface)
   flush_scheduled_work();
 
 
+  // Terminate reads
+  leaf_rx_stop(vCard);
+
   // Terminate an ongoing write
   DEBUGPRINT(6, (TXT("Ongoing write terminated\n")));
   USB_KILL_URB(dev->write_urb);
@@ -186,6 +186,16 @@ typedef struct LeafChanData
 
 
 
+#define LEAF_MAX_RX_URBS 16
+
+typedef struct LeafRxUrb {
+  struct urb          *urb;
+  unsigned char       *buffer;
+  struct work_struct   work;        // parses the buffer and resubmits the urb
+  VCanCardData        *vCard;
+} LeafRxUrb;
+
+
 /*  Cards specific data */
 typedef struct LeafCardData {
 
@@ -214,8 +224,7 @@ typedef struct LeafCardData {
   struct usb_device       *udev;               // save off the usb device pointer
   struct usb_interface    *interface;          // the interface for this device
 
-  unsigned char *         bulk_in_buffer;      // the buffer to receive data
-  size_t                  bulk_in_size;        // the size of the receive buffer
+  size_t                  bulk_in_size;        // the size of each receive buffer
   __u8                    bulk_in_endpointAddr;// the address of the bulk in endpoint
   unsigned int            bulk_in_MaxPacketSize;
 
@@ -225,10 +234,16 @@ typedef struct LeafCardData {
   unsigned int            bulk_out_MaxPacketSize;
 
   struct urb *            write_urb;           // the urb used to send data
-  struct urb *            read_urb;            // the urb used to receive data
   __u8                    bulk_out_endpointAddr;//the address of the bulk out endpoint
   struct completion       write_finished;       // wait for the write to finish
 
+  // Ring of urbs kept submitted on the bulk in endpoint
+  LeafRxUrb               rxUrb[LEAF_MAX_RX_URBS];
+  unsigned int            rxUrbCount;
+  struct workqueue_struct *rxQ;                // single threaded, keeps buffer order
+  int                     rxStopped;
+  int                     rxErrorCounter;
+
   VCanCardData           *vCard;
 
   // General data (from Windows version)
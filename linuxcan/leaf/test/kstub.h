@@ -0,0 +1,306 @@
+/*
+**             Copyright 2017 by Kvaser AB, Molndal, Sweden
+**                         http://www.kvaser.com
+**
+** This software is dual licensed under the following two licenses:
+** BSD-new and GPLv2. You may use either one. See the included
+** COPYING file for details.
+**
+** License: BSD-new
+** ==============================================================================
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of the <organization> nor the
+**       names of its contributors may be used to endorse or promote products
+**       derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+** BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+** IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+**
+**
+** License: GPLv2
+** ==============================================================================
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+**
+**
+** IMPORTANT NOTICE:
+** ==============================================================================
+** This source code is made available for free, as an open license, by Kvaser AB,
+** for use with its applications. Kvaser AB does not accept any liability
+** whatsoever for any third party patent or other immaterial property rights
+** violations that may result from any usage of this source code, regardless of
+** the combination of source code and various applications that it can be used
+** in, or with.
+**
+** -----------------------------------------------------------------------------
+*/
+
+/*
+ * Kvaser Linux Leaf driver
+ * Kernel API stubs for building leafHWIf.c in userspace
+ *
+ * Only what leafHWIf.c and the headers it includes need is declared.
+ * The types carry a few extra fields that the fake host controller and
+ * workqueue in rxurb.c use to keep track of pending urbs and work.
+ */
+
+#ifndef KSTUB_H
+#define KSTUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LINUX_VERSION_CODE    0x050f00
+#define _LINUX_TIME64_H
+#define KERNEL_VERSION(a,b,c) (((a) << 16) + ((b) << 8) + (c))
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t   s8;
+typedef int16_t  s16;
+typedef int32_t  s32;
+typedef int64_t  s64;
+typedef int8_t   __s8;
+typedef int32_t  __s32;
+typedef uint8_t  __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+typedef unsigned int gfp_t;
+typedef uint64_t dma_addr_t;
+typedef long long ktime_t;
+
+#define __user
+#define __rcu
+#define __percpu
+#define likely(x)   (x)
+#define unlikely(x) (x)
+#define smp_mb()    do {} while (0)
+#define smp_wmb()   do {} while (0)
+#define smp_rmb()   do {} while (0)
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+
+#define min(a,b)      ((a) < (b) ? (a) : (b))
+#define max(a,b)      ((a) > (b) ? (a) : (b))
+#define min_t(t,a,b)  ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t,a,b)  ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define roundup(x,y)  ((((x) + ((y) - 1)) / (y)) * (y))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define MODULE_LICENSE(x)     extern int kstub_module_license
+#define MODULE_AUTHOR(x)      extern int kstub_module_author
+#define MODULE_DESCRIPTION(x) extern int kstub_module_description
+#define MODULE_VERSION(x)     extern int kstub_module_version
+#define MODULE_DEVICE_TABLE(a,b) extern int kstub_module_device_table
+#define MODULE_PARM_DESC(a,b) extern int kstub_parm_desc_##a
+#define module_param(a,b,c)   extern int kstub_parm_##a
+#define module_init(x)        extern int kstub_module_init
+#define module_exit(x)        extern int kstub_module_exit
+#define THIS_MODULE           ((void *)0)
+#define __init
+#define __exit
+
+int printk(const char *fmt, ...);
+int sprintf(char *, const char *, ...);
+
+#define ENOENT      2
+#define EIO         5
+#define ENOMEM      12
+#define EFAULT      14
+#define EBUSY       16
+#define ENODEV      19
+#define EINVAL      22
+#define EPROTO      71
+#define EILSEQ      84
+#define ECONNRESET  104
+#define ESHUTDOWN   108
+#define ETIMEDOUT   110
+#define EINPROGRESS 115
+#define ERESTARTSYS 512
+
+// Atomics and bits
+typedef struct { volatile int counter; } atomic_t;
+int  atomic_read(const atomic_t *);
+void atomic_set(atomic_t *, int);
+void atomic_inc(atomic_t *);
+int  test_and_clear_bit(int, volatile unsigned long *);
+uint64_t div_u64(uint64_t, uint32_t);
+
+// Locks
+typedef struct { int x; } spinlock_t;
+void spin_lock_init(spinlock_t *);
+void spin_lock(spinlock_t *);
+void spin_unlock(spinlock_t *);
+#define spin_lock_irqsave(l, f)      do { (f) = 0; spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, f) do { (void)(f); spin_unlock(l); } while (0)
+struct mutex { int x; };
+struct rcu_head { void *next; };
+
+// Lists
+struct list_head { struct list_head *next, *prev; };
+void INIT_LIST_HEAD(struct list_head *);
+void list_add(struct list_head *, struct list_head *);
+void list_del(struct list_head *);
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_safe(pos, n, head) \
+  for (pos = (head)->next, n = pos->next; pos != (head); pos = n, n = pos->next)
+
+// Scheduling and waiting
+struct task_struct { int pid; };
+extern struct task_struct *current;
+typedef struct { int x; } wait_queue_head_t;
+typedef struct { int x; } wait_queue_entry_t;
+#define init_waitqueue_entry(w, t) do {} while (0)
+void wake_up_interruptible(wait_queue_head_t *);
+int  signal_pending(struct task_struct *);
+void set_current_state(int);
+#define TASK_RUNNING         0
+#define TASK_INTERRUPTIBLE   1
+#define TASK_UNINTERRUPTIBLE 2
+long schedule_timeout(long);
+#define HZ 100
+extern volatile unsigned long jiffies;
+struct timespec64 { long long tv_sec; long tv_nsec; };
+unsigned long msecs_to_jiffies(unsigned int);
+
+struct completion { unsigned int done; };
+void init_completion(struct completion *);
+void complete(struct completion *);
+void wait_for_completion(struct completion *);
+long wait_for_completion_timeout(struct completion *, unsigned long);
+
+struct hrtimer { int x; };
+struct cdev { int x; };
+struct file;
+struct seq_file { void *private; };
+int seq_printf(struct seq_file *, const char *, ...);
+int seq_puts(struct seq_file *, const char *);
+
+// Memory
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+void *kmalloc(size_t, gfp_t);
+void  kfree(const void *);
+
+// Work, run from the test when it flushes the queue
+struct work_struct {
+  void (*func)(struct work_struct *);
+  int pending;
+};
+struct workqueue_struct;
+#define INIT_WORK(w, f) do { (w)->func = (f); (w)->pending = 0; } while (0)
+struct workqueue_struct *create_workqueue(const char *);
+struct workqueue_struct *create_singlethread_workqueue(const char *);
+void destroy_workqueue(struct workqueue_struct *);
+void flush_workqueue(struct workqueue_struct *);
+void flush_scheduled_work(void);
+int  queue_work(struct workqueue_struct *, struct work_struct *);
+
+// Byte order, the test runs little endian
+unsigned short le16_to_cpu(uint16_t);
+void le16_to_cpus(void *);
+void le32_to_cpus(void *);
+
+// Usb, with a fake host controller behind usb_submit_urb()
+struct device { void *driver_data; };
+struct usb_device_descriptor { unsigned short idVendor, idProduct, bcdDevice; };
+struct usb_bus { int busnum; };
+struct usb_device {
+  struct usb_device_descriptor descriptor;
+  struct device dev;
+  struct usb_bus *bus;
+};
+struct usb_endpoint_descriptor {
+  uint8_t  bEndpointAddress;
+  uint8_t  bmAttributes;
+  uint16_t wMaxPacketSize;
+};
+struct usb_host_endpoint { struct usb_endpoint_descriptor desc; };
+struct usb_interface_descriptor { uint8_t bNumEndpoints; };
+struct usb_host_interface {
+  struct usb_interface_descriptor desc;
+  struct usb_host_endpoint *endpoint;
+};
+struct usb_interface {
+  struct usb_host_interface *cur_altsetting;
+  struct usb_host_interface *altsetting;
+  struct usb_device *udev;
+  void *intfdata;
+};
+struct usb_device_id { uint16_t match_flags, idVendor, idProduct; };
+struct usb_driver {
+  const char *name;
+  int  (*probe)(struct usb_interface *, const struct usb_device_id *);
+  void (*disconnect)(struct usb_interface *);
+  const struct usb_device_id *id_table;
+};
+struct urb;
+typedef void (*usb_complete_t)(struct urb *);
+struct urb {
+  int status;
+  unsigned int actual_length;
+  unsigned int transfer_buffer_length;
+  void *transfer_buffer;
+  void *context;
+  dma_addr_t transfer_dma;
+  unsigned int transfer_flags;
+  struct usb_device *dev;
+  usb_complete_t complete;
+  unsigned int pipe;
+  int submitted;
+};
+#define URB_NO_TRANSFER_DMA_MAP    0x4
+#define USB_DEVICE(v, p)           .match_flags = 3, .idVendor = (v), .idProduct = (p)
+#define USB_DIR_IN                 0x80
+#define USB_ENDPOINT_XFER_BULK     2
+#define USB_ENDPOINT_XFERTYPE_MASK 3
+struct urb *usb_alloc_urb(int, gfp_t);
+void usb_free_urb(struct urb *);
+int  usb_submit_urb(struct urb *, gfp_t);
+void usb_kill_urb(struct urb *);
+void usb_fill_bulk_urb(struct urb *, struct usb_device *, unsigned int,
+                       void *, int, usb_complete_t, void *);
+unsigned int usb_rcvbulkpipe(struct usb_device *, unsigned int);
+unsigned int usb_sndbulkpipe(struct usb_device *, unsigned int);
+void *usb_alloc_coherent(struct usb_device *, size_t, gfp_t, dma_addr_t *);
+void usb_free_coherent(struct usb_device *, size_t, void *, dma_addr_t);
+struct usb_device *interface_to_usbdev(struct usb_interface *);
+void  usb_set_intfdata(struct usb_interface *, void *);
+void *usb_get_intfdata(struct usb_interface *);
+int  usb_register(struct usb_driver *);
+void usb_deregister(struct usb_driver *);
+
+#endif
@@ -0,0 +1,729 @@
+/*
+**             Copyright 2017 by Kvaser AB, Molndal, Sweden
+**                         http://www.kvaser.com
+**
+** This software is dual licensed under the following two licenses:
+** BSD-new and GPLv2. You may use either one. See the included
+** COPYING file for details.
+**
+** License: BSD-new
+** ==============================================================================
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of the <organization> nor the
+**       names of its contributors may be used to endorse or promote products
+**       derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+** BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+** IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+**
+**
+** License: GPLv2
+** ==============================================================================
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+**
+**
+** IMPORTANT NOTICE:
+** ==============================================================================
+** This source code is made available for free, as an open license, by Kvaser AB,
+** for use with its applications. Kvaser AB does not accept any liability
+** whatsoever for any third party patent or other immaterial property rights
+** violations that may result from any usage of this source code, regardless of
+** the combination of source code and various applications that it can be used
+** in, or with.
+**
+** -----------------------------------------------------------------------------
+*/
+
+/*
+ * Kvaser Linux Leaf driver
+ * Userspace test of the bulk in urb ring
+ *
+ * leafHWIf.c is built here against the stubs in kstub.h. Behind
+ * usb_submit_urb() sits a fake host controller: a submitted urb stays
+ * pending until the test completes it, with data or an error status, or
+ * until it is killed. Work queued on a workqueue only runs when the test
+ * flushes that queue, so the test decides the order of completions and
+ * parsing. Allocations are counted, and each test checks that nothing is
+ * left allocated or submitted when the ring has been freed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "../leafHWIf.c"
+
+#define MAX_DISPATCHED 256
+#define MAX_WORK       64
+
+static int failures = 0;
+static int verbose  = 0;
+
+#define expect(cond) do {                                               \
+    if (!(cond)) {                                                      \
+      printf("%s:%d: expected %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+
+//======================================================================
+// Kernel stubs
+//======================================================================
+struct task_struct *current = NULL;
+volatile unsigned long jiffies = 0;
+
+static int allocations     = 0;   // kmalloc, usb_alloc_urb, usb_alloc_coherent
+static int workqueues      = 0;
+static int pendingUrbs     = 0;
+static int submits         = 0;
+static int submitsUntilFail = -1;  // Fail that submit, -1 for never
+static int submitError     = -EIO;
+
+static unsigned int dispatched[MAX_DISPATCHED];
+static int          nDispatched = 0;
+
+int printk (const char *fmt, ...)
+{
+  va_list ap;
+  int     n = 0;
+
+  if (verbose) {
+    va_start(ap, fmt);
+    n = vprintf(fmt, ap);
+    va_end(ap);
+  }
+  return n;
+}
+
+int  atomic_read (const atomic_t *a)       { return a->counter; }
+void atomic_set (atomic_t *a, int v)       { a->counter = v; }
+void atomic_inc (atomic_t *a)              { a->counter++; }
+
+int test_and_clear_bit (int nr, volatile unsigned long *addr)
+{
+  int old = (*addr >> nr) & 1;
+
+  *addr &= ~(1UL << nr);
+  return old;
+}
+
+uint64_t div_u64 (uint64_t n, uint32_t d) { return n / d; }
+
+void spin_lock_init (spinlock_t *l)  { (void)l; }
+void spin_lock (spinlock_t *l)       { (void)l; }
+void spin_unlock (spinlock_t *l)     { (void)l; }
+
+void INIT_LIST_HEAD (struct list_head *h)
+{
+  h->next = h;
+  h->prev = h;
+}
+
+void list_add (struct list_head *n, struct list_head *h)
+{
+  n->next       = h->next;
+  n->prev       = h;
+  h->next->prev = n;
+  h->next       = n;
+}
+
+void list_del (struct list_head *e)
+{
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+void wake_up_interruptible (wait_queue_head_t *q) { (void)q; }
+int  signal_pending (struct task_struct *t)       { (void)t; return 0; }
+void set_current_state (int s)                    { (void)s; }
+long schedule_timeout (long t)                    { jiffies += t; return 0; }
+unsigned long msecs_to_jiffies (unsigned int ms)  { return ms / (1000 / HZ); }
+
+void init_completion (struct completion *c) { c->done = 0; }
+void complete (struct completion *c)        { c->done++; }
+
+void wait_for_completion (struct completion *c)
+{
+  // Nothing else runs, so this would never return
+  expect(c->done > 0);
+  if (c->done) {
+    c->done--;
+  }
+}
+
+long wait_for_completion_timeout (struct completion *c, unsigned long t)
+{
+  (void)t;
+  if (!c->done) {
+    return 0;
+  }
+  c->done--;
+  return 1;
+}
+
+int seq_printf (struct seq_file *m, const char *fmt, ...) { (void)m; (void)fmt; return 0; }
+int seq_puts (struct seq_file *m, const char *s)          { (void)m; (void)s; return 0; }
+
+void *kmalloc (size_t size, gfp_t flags)
+{
+  void *p = malloc(size);
+
+  (void)flags;
+  if (p) {
+    allocations++;
+  }
+  return p;
+}
+
+void kfree (const void *p)
+{
+  if (p) {
+    allocations--;
+    free((void *)p);
+  }
+}
+
+struct workqueue_struct {
+  struct work_struct *work[MAX_WORK];
+  unsigned int        head;
+  unsigned int        tail;
+};
+
+static struct workqueue_struct *kstub_create_workqueue (void)
+{
+  struct workqueue_struct *wq = calloc(1, sizeof(*wq));
+
+  workqueues++;
+  return wq;
+}
+
+struct workqueue_struct *create_workqueue (const char *name)
+{
+  (void)name;
+  return kstub_create_workqueue();
+}
+
+struct workqueue_struct *create_singlethread_workqueue (const char *name)
+{
+  (void)name;
+  return kstub_create_workqueue();
+}
+
+int queue_work (struct workqueue_struct *wq, struct work_struct *w)
+{
+  if (w->pending) {
+    return 0;
+  }
+  expect(wq->tail - wq->head < MAX_WORK);
+  w->pending = 1;
+  wq->work[wq->tail++ % MAX_WORK] = w;
+  return 1;
+}
+
+void flush_workqueue (struct workqueue_struct *wq)
+{
+  while (wq->head != wq->tail) {
+    struct work_struct *w = wq->work[wq->head++ % MAX_WORK];
+
+    w->pending = 0;
+    w->func(w);
+  }
+}
+
+void destroy_workqueue (struct workqueue_struct *wq)
+{
+  flush_workqueue(wq);
+  free(wq);
+  workqueues--;
+}
+
+void flush_scheduled_work (void) {}
+
+unsigned short le16_to_cpu (uint16_t v) { return v; }
+void le16_to_cpus (void *p)             { (void)p; }
+void le32_to_cpus (void *p)             { (void)p; }
+
+struct urb *usb_alloc_urb (int iso, gfp_t flags)
+{
+  struct urb *urb = kmalloc(sizeof(struct urb), flags);
+
+  (void)iso;
+  if (urb) {
+    memset(urb, 0, sizeof(*urb));
+  }
+  return urb;
+}
+
+void usb_free_urb (struct urb *urb)
+{
+  if (urb) {
+    expect(!urb->submitted);
+  }
+  kfree(urb);
+}
+
+void usb_fill_bulk_urb (struct urb *urb, struct usb_device *dev,
+                        unsigned int pipe, void *buffer, int length,
+                        usb_complete_t complete_fn, void *context)
+{
+  memset(urb, 0, sizeof(*urb));
+  urb->dev                    = dev;
+  urb->pipe                   = pipe;
+  urb->transfer_buffer        = buffer;
+  urb->transfer_buffer_length = length;
+  urb->complete               = complete_fn;
+  urb->context                = context;
+}
+
+int usb_submit_urb (struct urb *urb, gfp_t flags)
+{
+  (void)flags;
+  if (submitsUntilFail >= 0 && submitsUntilFail-- == 0) {
+    return submitError;
+  }
+  // Submitting an urb that is already in flight is a driver bug
+  expect(!urb->submitted);
+  urb->submitted = 1;
+  urb->status    = -EINPROGRESS;
+  pendingUrbs++;
+  submits++;
+  return 0;
+}
+
+// Hand an urb back to the driver, as the host controller does when a
+// transfer ends
+static void kstub_complete_urb (struct urb *urb, int status,
+                                const void *data, unsigned int len)
+{
+  expect(urb->submitted);
+  expect(len <= urb->transfer_buffer_length);
+  urb->submitted     = 0;
+  urb->status        = status;
+  urb->actual_length = len;
+  if (len) {
+    memcpy(urb->transfer_buffer, data, len);
+  }
+  pendingUrbs--;
+  urb->complete(urb);
+}
+
+void usb_kill_urb (struct urb *urb)
+{
+  if (urb->submitted) {
+    kstub_complete_urb(urb, -ENOENT, NULL, 0);
+  }
+}
+
+unsigned int usb_rcvbulkpipe (struct usb_device *d, unsigned int ep) { (void)d; return 0x100 | ep; }
+unsigned int usb_sndbulkpipe (struct usb_device *d, unsigned int ep) { (void)d; return ep; }
+
+void *usb_alloc_coherent (struct usb_device *d, size_t size, gfp_t flags,
+                          dma_addr_t *dma)
+{
+  (void)d;
+  *dma = 0;
+  return kmalloc(size, flags);
+}
+
+void usb_free_coherent (struct usb_device *d, size_t size, void *p,
+                        dma_addr_t dma)
+{
+  (void)d;
+  (void)size;
+  (void)dma;
+  kfree(p);
+}
+
+struct usb_device *interface_to_usbdev (struct usb_interface *intf) { return intf->udev; }
+void  usb_set_intfdata (struct usb_interface *intf, void *p) { intf->intfdata = p; }
+void *usb_get_intfdata (struct usb_interface *intf)          { return intf->intfdata; }
+int   usb_register (struct usb_driver *d)   { (void)d; return 0; }
+void  usb_deregister (struct usb_driver *d) { (void)d; }
+
+unsigned int get_usb_root_hub_id (struct usb_device *udev) { (void)udev; return 0; }
+uint8_t convert_vcan_to_hydra_cmd (uint32_t cmd) { (void)cmd; return 0; }
+
+void set_capability_value (VCanCardData *vCard, uint32_t cap, uint32_t to,
+                           uint32_t channel_mask, uint32_t n_channels_max)
+{
+  (void)vCard; (void)cap; (void)to; (void)channel_mask; (void)n_channels_max;
+}
+
+void set_capability_mask (VCanCardData *vCard, uint32_t cap, uint32_t to,
+                          uint32_t channel_mask, uint32_t n_channels_max)
+{
+  (void)vCard; (void)cap; (void)to; (void)channel_mask; (void)n_channels_max;
+}
+
+void queue_reinit (Queue *q)            { (void)q; }
+void queue_init (Queue *q, int size)    { (void)q; (void)size; }
+int  queue_length (Queue *q)            { (void)q; return 0; }
+int  queue_empty (Queue *q)             { (void)q; return 1; }
+int  queue_back (Queue *q)              { (void)q; return -1; }
+void queue_push (Queue *q)              { (void)q; }
+int  queue_front (Queue *q)             { (void)q; return -1; }
+void queue_pop (Queue *q)               { (void)q; }
+void queue_release (Queue *q)           { (void)q; }
+void queue_wakeup_on_space (Queue *q)   { (void)q; }
+void queue_add_wait_for_space (Queue *q, wait_queue_entry_t *w)    { (void)q; (void)w; }
+void queue_remove_wait_for_space (Queue *q, wait_queue_entry_t *w) { (void)q; (void)w; }
+
+uint64_t softSyncLoc2Glob (CARD_INFO *ci, uint64_t stamp)          { (void)ci; return stamp; }
+void softSyncHandleTRef (CARD_INFO *ci, uint64_t tRef, unsigned id) { (void)ci; (void)tRef; (void)id; }
+int  softSyncAddMember (CARD_INFO *ci, int id)                     { (void)ci; (void)id; return 0; }
+void softSyncRemoveMember (CARD_INFO *ci)                          { (void)ci; }
+
+void     ticks_init (ticks_class *self) { memset(self, 0, sizeof(*self)); }
+uint64_t ticks_to_64bit_ns (ticks_class *self, uint64_t n, uint32_t f)
+{
+  (void)self;
+  return f ? n * 1000 / f : n;
+}
+
+int vCanDispatchEvent (VCanChanData *chd, VCAN_EVENT *e)
+{
+  (void)chd;
+  if (e->tag == V_RECEIVE_MSG && nDispatched < MAX_DISPATCHED) {
+    dispatched[nDispatched++] = e->tagData.msg.id;
+  }
+  return 0;
+}
+
+int  vCanInitData (VCanCardData *vCard)        { (void)vCard; return 0; }
+void vCanRemoveData (VCanCardData *vCard)      { (void)vCard; }
+void vCanCardListChanged (void)                {}
+void vCanCardRemoved (VCanChanData *chd)       { (void)chd; }
+int  vCanFlushSendBuffer (VCanChanData *chd)   { (void)chd; return 0; }
+int  vCanInit (VCanDriverData *d, unsigned n)  { (void)d; (void)n; return 0; }
+void vCanCleanup (VCanDriverData *d)           { (void)d; }
+
+
+//======================================================================
+// Test device
+//======================================================================
+#define EP_IN           0x81
+#define EP_OUT          0x02
+#define MAX_PACKET_SIZE 64
+
+static struct usb_host_endpoint endpoints[2] = {
+  { { EP_IN,  USB_ENDPOINT_XFER_BULK, MAX_PACKET_SIZE } },
+  { { EP_OUT, USB_ENDPOINT_XFER_BULK, MAX_PACKET_SIZE } },
+};
+static struct usb_host_interface altsetting = { { 2 }, endpoints };
+static struct usb_bus bus;
+static struct usb_device udev = {
+  { KVASER_VENDOR_ID, USB_LEAF_PRO_PRODUCT_ID, 0 }, { NULL }, &bus
+};
+static struct usb_interface interface = { &altsetting, &altsetting, &udev, NULL };
+
+// A card as far as leaf_plugin() sets it up before leaf_start(), except
+// that the rx ring is started by the tests themselves
+static VCanCardData *newCard (void)
+{
+  VCanCardData *vCard;
+  LeafCardData *dev;
+  unsigned int  i;
+
+  expect(leaf_allocate(&vCard) == VCAN_STAT_OK);
+  dev = vCard->hwCardData;
+  dev->udev                  = &udev;
+  dev->bulk_in_endpointAddr  = EP_IN;
+  dev->bulk_in_MaxPacketSize = MAX_PACKET_SIZE;
+  dev->bulk_out_size         = MAX_PACKET_OUT;
+  dev->write_urb             = usb_alloc_urb(0, GFP_KERNEL);
+  dev->bulk_out_buffer       = usb_alloc_coherent(&udev, dev->bulk_out_size,
+                                                  GFP_KERNEL,
+                                                  &dev->write_urb->transfer_dma);
+  // As leaf_start() does, since parsing checks the list for waiters
+  spin_lock_init(&dev->replyWaitListLock);
+  INIT_LIST_HEAD(&dev->replyWaitList);
+  vCard->nrChannels  = 2;
+  vCard->cardPresent = 1;
+  for (i = 0; i < MAX_CARD_CHANNELS; i++) {
+    vCard->chanData[i]->channel = i;
+  }
+
+  return vCard;
+}
+
+static void freeCard (VCanCardData *vCard)
+{
+  leaf_deallocate(vCard);
+  expect(driverData.canCards == NULL);
+}
+
+// Put a standard id message for channel 0 at buf[pos]
+static unsigned int putMessage (unsigned char *buf, unsigned int pos,
+                                unsigned int id)
+{
+  filoCmd *cmd = (filoCmd *)&buf[pos];
+
+  memset(cmd, 0, sizeof(cmdRxCanMessage));
+  cmd->rxCanMessage.cmdLen        = sizeof(cmdRxCanMessage);
+  cmd->rxCanMessage.cmdNo         = CMD_RX_STD_MESSAGE;
+  cmd->rxCanMessage.rawMessage[0] = (id >> 6) & 0x1F;
+  cmd->rxCanMessage.rawMessage[1] = id & 0x3F;
+
+  return pos + sizeof(cmdRxCanMessage);
+}
+
+
+//======================================================================
+// Tests
+//======================================================================
+static void testRingSetup (void)
+{
+  static const struct { unsigned int urbs, size, expUrbs, expSize; } cases[] = {
+    { 4,   1000, 4,                1024            },  // Rounded up to packets
+    { 0,   64,   1,                MAX_PACKET_SIZE },  // At least one urb
+    { 100, 1,    LEAF_MAX_RX_URBS, MAX_PACKET_SIZE },  // At most the max
+  };
+  unsigned int c;
+
+  for (c = 0; c < ARRAY_SIZE(cases); c++) {
+    VCanCardData *vCard;
+    LeafCardData *dev;
+    unsigned int  i;
+
+    rx_urbs        = cases[c].urbs;
+    rx_buffer_size = cases[c].size;
+    vCard = newCard();
+    dev   = vCard->hwCardData;
+
+    expect(leaf_rx_start(vCard) == VCAN_STAT_OK);
+    expect(dev->rxUrbCount == cases[c].expUrbs);
+    expect(pendingUrbs == (int)cases[c].expUrbs);
+    for (i = 0; i < dev->rxUrbCount; i++) {
+      expect(dev->rxUrb[i].urb->submitted);
+      expect(dev->rxUrb[i].urb->pipe == usb_rcvbulkpipe(&udev, EP_IN));
+      expect(dev->rxUrb[i].urb->transfer_buffer_length == cases[c].expSize);
+    }
+
+    freeCard(vCard);
+    expect(pendingUrbs == 0);
+    expect(allocations == 0);
+    expect(workqueues == 0);
+  }
+}
+
+// Buffers are parsed in completion order, and each urb goes back to the
+// host controller once its buffer has been parsed
+static void testCompletionOrder (void)
+{
+  VCanCardData  *vCard;
+  LeafCardData  *dev;
+  unsigned char buf[2 * MAX_PACKET_SIZE];
+  unsigned int  len;
+  int           before;
+
+  rx_urbs        = 4;
+  rx_buffer_size = sizeof(buf);
+  vCard  = newCard();
+  dev    = vCard->hwCardData;
+  expect(leaf_rx_start(vCard) == VCAN_STAT_OK);
+  before = submits;
+  nDispatched = 0;
+
+  len = putMessage(buf, 0, 0x102);
+  kstub_complete_urb(dev->rxUrb[2].urb, 0, buf, len);
+  len = putMessage(buf, 0, 0x100);
+  kstub_complete_urb(dev->rxUrb[0].urb, 0, buf, len);
+
+  // Two messages, the second after a zero length filler that moves it
+  // to the next usb packet
+  memset(buf, 0, sizeof(buf));
+  putMessage(buf, 0, 0x103);
+  len = putMessage(buf, MAX_PACKET_SIZE, 0x104);
+  kstub_complete_urb(dev->rxUrb[3].urb, 0, buf, len);
+
+  // Nothing is parsed or resubmitted until the work runs
+  expect(nDispatched == 0);
+  expect(pendingUrbs == 1);
+
+  flush_workqueue(dev->rxQ);
+  expect(nDispatched == 4);
+  expect(dispatched[0] == 0x102);
+  expect(dispatched[1] == 0x100);
+  expect(dispatched[2] == 0x103);
+  expect(dispatched[3] == 0x104);
+  expect(submits - before == 3);
+  expect(pendingUrbs == 4);
+
+  freeCard(vCard);
+  expect(pendingUrbs == 0);
+  expect(allocations == 0);
+}
+
+// Transient errors are retried until more than 100 in a row, a fatal
+// status ends reading at once
+static void testErrors (void)
+{
+  static const int fatal[] = { -EILSEQ, -ESHUTDOWN, -ENODEV };
+  VCanCardData  *vCard;
+  LeafCardData  *dev;
+  unsigned char buf[MAX_PACKET_SIZE];
+  unsigned int  len;
+  unsigned int  i;
+
+  rx_urbs        = 2;
+  rx_buffer_size = MAX_PACKET_SIZE;
+  vCard = newCard();
+  dev   = vCard->hwCardData;
+  expect(leaf_rx_start(vCard) == VCAN_STAT_OK);
+
+  for (i = 0; i < 100; i++) {
+    kstub_complete_urb(dev->rxUrb[i & 1].urb, -EPROTO, NULL, 0);
+    flush_workqueue(dev->rxQ);
+  }
+  expect(vCard->cardPresent);
+  expect(pendingUrbs == 2);
+
+  // A good buffer resets the count
+  len = putMessage(buf, 0, 0x123);
+  kstub_complete_urb(dev->rxUrb[0].urb, 0, buf, len);
+  flush_workqueue(dev->rxQ);
+  for (i = 0; i < 100; i++) {
+    kstub_complete_urb(dev->rxUrb[i & 1].urb, -EPROTO, NULL, 0);
+    flush_workqueue(dev->rxQ);
+  }
+  expect(vCard->cardPresent);
+  expect(pendingUrbs == 2);
+
+  kstub_complete_urb(dev->rxUrb[0].urb, -EPROTO, NULL, 0);
+  flush_workqueue(dev->rxQ);
+  expect(!vCard->cardPresent);
+  expect(pendingUrbs == 1);
+  freeCard(vCard);
+
+  for (i = 0; i < ARRAY_SIZE(fatal); i++) {
+    vCard = newCard();
+    dev   = vCard->hwCardData;
+    expect(leaf_rx_start(vCard) == VCAN_STAT_OK);
+    kstub_complete_urb(dev->rxUrb[1].urb, fatal[i], NULL, 0);
+    flush_workqueue(dev->rxQ);
+    expect(!vCard->cardPresent);
+    expect(pendingUrbs == 1);
+    freeCard(vCard);
+  }
+
+  // The device is gone when the urb cannot be resubmitted
+  vCard = newCard();
+  dev   = vCard->hwCardData;
+  expect(leaf_rx_start(vCard) == VCAN_STAT_OK);
+  kstub_complete_urb(dev->rxUrb[0].urb, 0, buf, len);
+  submitsUntilFail = 0;
+  submitError      = -ENODEV;
+  flush_workqueue(dev->rxQ);
+  submitsUntilFail = -1;
+  expect(!vCard->cardPresent);
+  expect(pendingUrbs == 1);
+  freeCard(vCard);
+
+  expect(pendingUrbs == 0);
+  expect(allocations == 0);
+}
+
+// Stopping kills the urbs in flight and parses, but does not resubmit,
+// the buffers that had already completed
+static void testStop (void)
+{
+  VCanCardData  *vCard;
+  LeafCardData  *dev;
+  unsigned char buf[MAX_PACKET_SIZE];
+  unsigned int  len;
+  int           before;
+
+  rx_urbs        = 4;
+  rx_buffer_size = MAX_PACKET_SIZE;
+  vCard = newCard();
+  dev   = vCard->hwCardData;
+  expect(leaf_rx_start(vCard) == VCAN_STAT_OK);
+  nDispatched = 0;
+
+  len = putMessage(buf, 0, 0x10);
+  kstub_complete_urb(dev->rxUrb[0].urb, 0, buf, len);
+  len = putMessage(buf, 0, 0x11);
+  kstub_complete_urb(dev->rxUrb[1].urb, 0, buf, len);
+  before = submits;
+
+  leaf_rx_stop(vCard);
+  expect(pendingUrbs == 0);
+  expect(submits == before);
+  expect(nDispatched == 2);
+
+  // Safe to call again, and the ring can still be freed
+  leaf_rx_stop(vCard);
+  freeCard(vCard);
+  expect(allocations == 0);
+  expect(workqueues == 0);
+}
+
+// The probe fails, and leaves nothing behind, if reading cannot start
+static void testProbeFailure (void)
+{
+  int fail;
+
+  rx_urbs        = 4;
+  rx_buffer_size = MAX_PACKET_SIZE;
+
+  for (fail = 0; fail < 4; fail++) {
+    submitsUntilFail = fail;
+    submitError      = -EIO;
+    expect(leaf_plugin(&interface, NULL) == -EIO);
+    submitsUntilFail = -1;
+
+    expect(pendingUrbs == 0);
+    expect(allocations == 0);
+    expect(workqueues == 0);
+    expect(driverData.canCards == NULL);
+  }
+}
+
+int main (int argc, char *argv[])
+{
+  if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+    verbose = 1;
+  }
+
+  testRingSetup();
+  testCompletionOrder();
+  testErrors();
+  testStop();
+  testProbeFailure();
+
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+
+  return 0;
+}
@@ -71,7 +71,6 @@
 #include <linux/string.h>
 #include <linux/module.h>
 #include <linux/slab.h>
-#include <linux/kthread.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
 #include <linux/sched.h>
 #else
@@ -295,6 +294,27 @@ static VCanHWInterface hwIf = {
 #define MAX_PACKET_OUT      3072         // To device
 #define MAX_PACKET_IN       FATPIPE_SIZE // From device
 
+//----------------------------------------------------------------------------
+// The command pipe is read through a ring of rx_urbs urbs that are kept
+// submitted, so the device always has somewhere to put data while earlier
+// buffers are being parsed. Both values are read when a device is plugged in.
+//
+static unsigned int rx_urbs = 4;
+MODULE_PARM_DESC(rx_urbs, "Mhydra number of read urbs per device (1-16)");
+module_param(rx_urbs, uint, 0644);
+
+static unsigned int rx_buffer_size = MAX_PACKET_IN;
+MODULE_PARM_DESC(rx_buffer_size, "Mhydra size in bytes of each read urb buffer");
+module_param(rx_buffer_size, uint, 0644);
+
+//----------------------------------------------------------------------------
+// Up to tx_urbs writes can be in flight on the bulk out endpoint, so the
+// next buffer is filled while earlier ones are being transferred.
+//
+static unsigned int tx_urbs = 4;
+MODULE_PARM_DESC(tx_urbs, "Mhydra number of write urbs per device (1-8)");
+module_param(tx_urbs, uint, 0644);
+
 static unsigned long ticks_to_10us (VCanCardData *vCard, uint64_t ticks)
 {
   MhydraCardData *dev       = vCard->hwCardData;
@@ -323,6 +343,12 @@ static void   mhydra_write_bulk_callback(struct urb *urb, struct pt_regs *regs);
 static void   mhydra_write_bulk_callback(struct urb *urb);
  #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 8))
+# define USB_KILL_URB(x) usb_unlink_urb(x)
+#else
+# define USB_KILL_URB(x) usb_kill_urb(x)
+#endif
+
 
 
 static int    mhydra_allocate(VCanCardData **vCard);
@@ -331,7 +357,7 @@ static void   mhydra_deallocate(VCanCardData *vCard);
 static int    mhydra_start(VCanCardData *vCard);
 
 static int    mhydra_tx_available(VCanChanData *vChan);
-static int    mhydra_transmit(VCanCardData *vCard);
+static int    mhydra_transmit(VCanCardData *vCard, MhydraTxUrb *tx);
 
 static size_t mhydra_cmd_size(hydraHostCmd *cmd);
 static void mhydra_handle_command(hydraHostCmd *cmd, VCanCardData *vCard);
@@ -552,6 +578,59 @@ void print_reply(uint32_t cmd)
 //
 //------------------------------------------------------
 
+//============================================================================
+//  mhydra_tx_urb_get
+//
+// Take a free urb from the write pool, or NULL if all are in flight.
+//
+static MhydraTxUrb *mhydra_tx_urb_get (MhydraCardData *dev)
+{
+  MhydraTxUrb   *tx = NULL;
+  unsigned long irqFlags;
+  unsigned int  i;
+
+  spin_lock_irqsave(&dev->txUrbLock, irqFlags);
+  for (i = 0; i < dev->txUrbCount; i++) {
+    if (!(dev->txUrbBusy & (1UL << i))) {
+      dev->txUrbBusy |= 1UL << i;
+      tx = &dev->txUrb[i];
+      break;
+    }
+  }
+  spin_unlock_irqrestore(&dev->txUrbLock, irqFlags);
+
+  return tx;
+} // _tx_urb_get
+
+
+//============================================================================
+//  mhydra_tx_urb_put
+//
+static void mhydra_tx_urb_put (MhydraCardData *dev, MhydraTxUrb *tx)
+{
+  unsigned long irqFlags;
+
+  spin_lock_irqsave(&dev->txUrbLock, irqFlags);
+  dev->txUrbBusy &= ~(1UL << (tx - dev->txUrb));
+  spin_unlock_irqrestore(&dev->txUrbLock, irqFlags);
+} // _tx_urb_put
+
+
+//============================================================================
+//  mhydra_tx_kill
+//
+static void mhydra_tx_kill (MhydraCardData *dev)
+{
+  unsigned int i;
+
+  for (i = 0; i < dev->txUrbCount; i++) {
+    if (dev->txUrb[i].urb) {
+      USB_KILL_URB(dev->txUrb[i].urb);
+    }
+  }
+} // _tx_kill
+
+
 //============================================================================
 //  mhydra_write_bulk_callback
 //
@@ -562,7 +641,8 @@ static void mhydra_write_bulk_callback (struct urb *urb, struct pt_regs *regs)
 static void mhydra_write_bulk_callback (struct urb *urb)
 #endif
 {
-  VCanCardData *vCard = urb->context;
+  MhydraTxUrb    *tx    = urb->context;
+  VCanCardData   *vCard = tx->vCard;
   MhydraCardData *dev   = vCard->hwCardData;
 
   // sync/async unlink faults aren't errors
@@ -573,8 +653,13 @@ static void mhydra_write_bulk_callback (struct urb *urb)
                    __FUNCTION__, urb->status));
   }
 
-  // Notify anyone waiting that the write has finished
-  complete(&dev->write_finished);
+  mhydra_tx_urb_put(dev, tx);
+
+  // mhydra_send may have found all urbs busy, let it fill this one
+  if (vCard->cardPresent &&
+      urb->status != -ENOENT && urb->status != -ECONNRESET) {
+    queue_work(dev->txTaskQ, &dev->txWork);
+  }
 }
 
 
@@ -668,143 +753,278 @@ static void mhydra_memo_bulk (struct work_struct *work)
 
 //============================================================================
 //
-// mhydra_rx_thread
+// mhydra_rx_parse
+//
+// Interpret the commands in one buffer from the command pipe. A command
+// may straddle two buffers; the first part is then kept in rxCmdBuffer
+// until the next buffer arrives.
 //
-static int mhydra_rx_thread (void *context)
+static void mhydra_rx_parse (VCanCardData *vCard, unsigned char *buffer,
+                             unsigned int len)
 {
-  VCanCardData *vCard   = context;
-  MhydraCardData *dev     = vCard->hwCardData;
-  int          result  = 0;
-  int          usbErrorCounter;
-  int          len;
+  MhydraCardData *dev        = vCard->hwCardData;
+  int            loopCounter = 1000;
+  unsigned int   count       = 0;
 
-  if (!try_module_get(THIS_MODULE)) {
-    return -ENODEV;
+
+  while (count < len) {
+    hydraHostCmd *cmd;
+    size_t chunkSize;
+    size_t commandLength;
+
+    // A loop counter as a safety measure.
+    if (--loopCounter == 0) {
+      DEBUGPRINT(2, (TXT("ERROR mhydra_rx_parse() LOOPMAX. \n")));
+      break;
+    }
+
+    chunkSize = len - count;
+
+    // First check if there is leftovers in temp storage. Fill up until we have a complete command.
+    if (dev->rxCmdBufferLevel > 0) {
+      commandLength = mhydra_cmd_size((hydraHostCmd *)dev->rxCmdBuffer);
+      chunkSize = min(commandLength - dev->rxCmdBufferLevel, chunkSize);
+      memcpy(&(dev->rxCmdBuffer[dev->rxCmdBufferLevel]), &buffer[count], chunkSize);
+      dev->rxCmdBufferLevel += chunkSize;
+      count += chunkSize;
+      if (dev->rxCmdBufferLevel == commandLength) {
+        DEBUGPRINT(4, (TXT("Temp storage out\n")));
+        mhydra_handle_command((hydraHostCmd *)dev->rxCmdBuffer, vCard);
+        dev->rxCmdBufferLevel = 0;
+      }
+      continue;
+    }
+
+    cmd = (hydraHostCmd *)&buffer[count];
+    if (cmd->cmdNo == 0) {
+      DEBUGPRINT(2, (TXT("ERROR mhydra_rx_parse() cmd->cmdNo == 0\n")));
+      break;
+    }
+    commandLength = mhydra_cmd_size(cmd);
+    chunkSize = min(chunkSize, commandLength);
+    if (chunkSize < commandLength) {
+      DEBUGPRINT(4, (TXT("Temp storage in (%u) (%zu). \n"), dev->rxCmdBufferLevel, chunkSize));
+      // Must store part of command until next read buffer arrives.
+      memcpy(&dev->rxCmdBuffer[dev->rxCmdBufferLevel], &buffer[count], chunkSize);
+      dev->rxCmdBufferLevel += chunkSize;
+      count += chunkSize;
+    }
+    else {
+      count += mhydra_cmd_size(cmd);
+      mhydra_handle_command(cmd, vCard);
+    }
   }
+} // _rx_parse
 
-  DEBUGPRINT(3, (TXT("rx thread started\n")));
 
-  usbErrorCounter = 0;
+//============================================================================
+//
+// mhydra_rx_work
+//
+// Runs on the single threaded rxQ, so buffers are parsed in the order the
+// urbs completed. The urb is resubmitted once its buffer has been parsed;
+// the other urbs in the ring keep the pipe busy meanwhile.
+//
+#if USE_CONTEXT
+static void mhydra_rx_work (void *context)
+#else
+static void mhydra_rx_work (struct work_struct *work)
+#endif
+{
+#if USE_CONTEXT
+  MhydraRxUrb    *rx    = context;
+#else
+  MhydraRxUrb    *rx    = container_of(work, MhydraRxUrb, work);
+#endif
+  VCanCardData   *vCard = rx->vCard;
+  MhydraCardData *dev   = vCard->hwCardData;
+  struct urb     *urb   = rx->urb;
+  int            ret;
+
+  if (urb->status) {
+    DEBUGPRINT(2, (TXT("read bulk status (%d)\n"), urb->status));
+
+    if (urb->status == -EILSEQ || urb->status == -ESHUTDOWN ||
+        urb->status == -ENODEV) {
+      DEBUGPRINT(2, (TXT("read bulk error (%d) - Device probably ")
+                     TXT2("removed, closing down\n"), urb->status));
+      vCard->cardPresent = 0;
+      return;
+    }
 
-  while (vCard->cardPresent) {
-    int ret;
+    if (++dev->rxErrorCounter > 100) {
+      DEBUGPRINT(2, (TXT("rx Ended - error (%d)\n"), urb->status));
 
+      // Since this has failed so many times, stop transfers to device
+      vCard->cardPresent = 0;
+      return;
+    }
+  }
+  else {
+    dev->rxErrorCounter = 0;
+    mhydra_rx_parse(vCard, rx->buffer, urb->actual_length);
+  }
 
-    // Verify that the device wasn't unplugged
+  if (dev->rxStopped || !vCard->cardPresent) {
+    return;
+  }
 
-    len = 0;
-    // Do a blocking bulk read to get data from the device
-    // dev->bulk_in[0].buffer is the first "normal" pipe
-    // Timeout after 30 seconds
-    ret = usb_bulk_msg(dev->udev,
-                       usb_rcvbulkpipe(dev->udev, dev->bulk_in[EP_ADDR_TO_INDEX(EP_IN_ADDR_COMMAND)].endpointAddr),
-                       dev->bulk_in[EP_ADDR_TO_INDEX(EP_IN_ADDR_COMMAND)].buffer,
-                       dev->bulk_in[EP_ADDR_TO_INDEX(EP_IN_ADDR_COMMAND)].size,
-                       &len,
-// Timeout changed from jiffies to milliseconds in 2.6.12.
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 12))
-                       HZ * 30
+  ret = usb_submit_urb(urb, GFP_KERNEL);
+  if (ret) {
+    DEBUGPRINT(1, (TXT("Failed resubmitting read urb (%d)\n"), ret));
+    if (ret == -ENODEV) {
+      vCard->cardPresent = 0;
+    }
+  }
+} // _rx_work
+
+
+//============================================================================
+//  mhydra_read_bulk_callback
+//
+// Interrupt handler prototype changed in 2.6.19.
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 19))
+static void mhydra_read_bulk_callback (struct urb *urb, struct pt_regs *regs)
 #else
-                       30000
+static void mhydra_read_bulk_callback (struct urb *urb)
 #endif
-                       );
+{
+  MhydraRxUrb    *rx  = urb->context;
+  MhydraCardData *dev = rx->vCard->hwCardData;
 
-    if (vCard->cardPresent == 0) {
-      result = -ENODEV;
-      break;
+  // Killed by mhydra_rx_stop(), leave it idle
+  if (urb->status == -ENOENT || urb->status == -ECONNRESET) {
+    return;
+  }
+
+  queue_work(dev->rxQ, &rx->work);
+}
+
+
+//============================================================================
+//
+// mhydra_rx_start
+//
+// Allocate the ring of read urbs and submit all of them.
+//
+static int mhydra_rx_start (VCanCardData *vCard)
+{
+  MhydraCardData    *dev  = vCard->hwCardData;
+  MhydraUsbPipeInfo *pipe = &dev->bulk_in[EP_ADDR_TO_INDEX(EP_IN_ADDR_COMMAND)];
+  unsigned int      i;
+  size_t            size;
+
+  // The buffer must hold a whole number of usb packets
+  size = max_t(size_t, rx_buffer_size, pipe->maxPacketSize);
+  if (pipe->maxPacketSize) {
+    size = roundup(size, pipe->maxPacketSize);
+  }
+
+  dev->rxBufferSize   = size;
+  dev->rxUrbCount     = min_t(unsigned int, max_t(unsigned int, rx_urbs, 1),
+                              MHYDRA_MAX_RX_URBS);
+  dev->rxStopped      = 0;
+  dev->rxErrorCounter = 0;
+
+  dev->rxQ = create_singlethread_workqueue("mhydra_rx");
+  if (!dev->rxQ) {
+    return VCAN_STAT_NO_MEMORY;
+  }
+
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    MhydraRxUrb *rx = &dev->rxUrb[i];
+
+    rx->vCard  = vCard;
+    rx->urb    = usb_alloc_urb(0, GFP_KERNEL);
+    rx->buffer = kmalloc(size, GFP_KERNEL);
+    if (!rx->urb || !rx->buffer) {
+      DEBUGPRINT(1, (TXT("Couldn't allocate read urb %u\n"), i));
+      return VCAN_STAT_NO_MEMORY;
     }
+#if USE_CONTEXT
+    INIT_WORK(&rx->work, mhydra_rx_work, rx);
+#else
+    INIT_WORK(&rx->work, mhydra_rx_work);
+#endif
+    usb_fill_bulk_urb(rx->urb, dev->udev,
+                      usb_rcvbulkpipe(dev->udev, pipe->endpointAddr),
+                      rx->buffer, size, mhydra_read_bulk_callback, rx);
+  }
 
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    int ret = usb_submit_urb(dev->rxUrb[i].urb, GFP_KERNEL);
     if (ret) {
-      DEBUGPRINT(2, (TXT ("usb_bulk_msg error (%d)\n"), ret));
-
-      if (ret != -ETIMEDOUT) {
-        // Save if runaway
-        if (ret == -EILSEQ || ret == -ESHUTDOWN || ret == -EINVAL) {
-          DEBUGPRINT(2, (TXT ("usb_bulk_msg error (%d) - Device probably ")
-                         TXT2("removed, closing down\n"), ret));
-          vCard->cardPresent = 0;
-          result = -ENODEV;
-          break;
-        }
+      DEBUGPRINT(1, (TXT("Failed submitting read urb %u (%d)\n"), i, ret));
+      return VCAN_STAT_FAIL;
+    }
+  }
 
-        if (usbErrorCounter > 100) {
-          DEBUGPRINT(2, (TXT("rx thread Ended - error (%d)\n"), ret));
+  DEBUGPRINT(3, (TXT("rx started, %u urbs of %zu bytes\n"),
+                 dev->rxUrbCount, size));
 
-          // Since this has failed so many times, stop transfers to device
-          vCard->cardPresent = 0;
-          result = -ENODEV;
-          break;
-        }
-      }
-    }
-    else {
-      //
-      // We got a bunch of bytes. Now interpret them.
-      //
-      unsigned char  *buffer     = (unsigned char *)dev->bulk_in[EP_ADDR_TO_INDEX(EP_IN_ADDR_COMMAND)].buffer;
-      int            loopCounter = 1000;
-      unsigned int   count       = 0;
+  return VCAN_STAT_OK;
+} // _rx_start
 
 
-      while (count < len) {
-        hydraHostCmd *cmd;
-        size_t chunkSize;
-        size_t commandLength;
+//============================================================================
+//
+// mhydra_rx_stop
+//
+// Kill the read urbs and wait for pending parsing. A work item that was
+// already running may have resubmitted its urb while the first round of
+// kills was in progress, so kill once more after the flush.
+// Safe to call more than once, and before mhydra_rx_start().
+//
+static void mhydra_rx_stop (VCanCardData *vCard)
+{
+  MhydraCardData *dev = vCard->hwCardData;
+  unsigned int   i;
 
-        // A loop counter as a safety measure.
-        if (--loopCounter == 0) {
-          DEBUGPRINT(2, (TXT("ERROR mhydra_rx_thread() LOOPMAX. \n")));
-          break;
-        }
+  dev->rxStopped = 1;
+  smp_mb();
 
-        chunkSize = len - count;
-
-        // First check if there is leftovers in temp storage. Fill up until we have a complete command.
-        if (dev->rxCmdBufferLevel > 0) {
-          commandLength = mhydra_cmd_size((hydraHostCmd *)dev->rxCmdBuffer);
-          chunkSize = min(commandLength - dev->rxCmdBufferLevel, chunkSize);
-          memcpy(&(dev->rxCmdBuffer[dev->rxCmdBufferLevel]), &buffer[count], chunkSize);
-          dev->rxCmdBufferLevel += chunkSize;
-          count += chunkSize;
-          if (dev->rxCmdBufferLevel == commandLength) {
-            DEBUGPRINT(4, (TXT("Temp storage out\n")));
-            mhydra_handle_command((hydraHostCmd *)dev->rxCmdBuffer, vCard);
-            dev->rxCmdBufferLevel = 0;
-          }
-          continue;
-        }
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    if (dev->rxUrb[i].urb) {
+      USB_KILL_URB(dev->rxUrb[i].urb);
+    }
+  }
 
-        cmd = (hydraHostCmd *)&buffer[count];
-        if (cmd->cmdNo == 0) {
-          DEBUGPRINT(2, (TXT("ERROR mhydra_rx_thread() cmd->cmdNo == 0\n")));
-          break;
-        }
-        commandLength = mhydra_cmd_size(cmd);
-        chunkSize = min(chunkSize, commandLength);
-        if (chunkSize < commandLength) {
-          DEBUGPRINT(4, (TXT("Temp storage in (%u) (%zu). \n"), dev->rxCmdBufferLevel, chunkSize));
-          // Must store part of command until next read buffer arrives.
-          memcpy(&dev->rxCmdBuffer[dev->rxCmdBufferLevel], &buffer[count], chunkSize);
-          dev->rxCmdBufferLevel += chunkSize;
-          count += chunkSize;
-        }
-        else {
-          count += mhydra_cmd_size(cmd);
-          mhydra_handle_command(cmd, vCard);
-        }
+  if (dev->rxQ) {
+    flush_workqueue(dev->rxQ);
+  }
 
-        usbErrorCounter = 0;
-      }
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    if (dev->rxUrb[i].urb) {
+      USB_KILL_URB(dev->rxUrb[i].urb);
     }
-  } // while (vCard->cardPresent)
+  }
+} // _rx_stop
 
-  DEBUGPRINT(3, (TXT("rx thread Ended - finalised\n")));
 
-  module_put(THIS_MODULE);
-  do_exit(result);
+//============================================================================
+//
+// mhydra_rx_free
+//
+static void mhydra_rx_free (VCanCardData *vCard)
+{
+  MhydraCardData *dev = vCard->hwCardData;
+  unsigned int   i;
+
+  mhydra_rx_stop(vCard);
+
+  if (dev->rxQ) {
+    destroy_workqueue(dev->rxQ);
+    dev->rxQ = NULL;
+  }
 
-  return result;
-} // _rx_thread
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    usb_free_urb(dev->rxUrb[i].urb);
+    dev->rxUrb[i].urb = NULL;
+    kfree(dev->rxUrb[i].buffer);
+    dev->rxUrb[i].buffer = NULL;
+  }
+  dev->rxUrbCount = 0;
+} // _rx_free
 
 
 
@@ -2039,17 +2259,6 @@ static void mhydra_send (struct work_struct *work)
     return;
   }
 
-  // Wait for a previous write to finish up; we don't use a timeout
-  // and so a nonresponsive device can delay us indefinitely.
-  wait_for_completion(&dev->write_finished);
-
-  if (!vCard->cardPresent) {
-    // The device was unplugged before the file was released
-    // We cannot deallocate here it is to early and handled elsewhere
-    complete(&dev->write_finished);
-    return;
-  }
-
   // Do we have any cmd to send
   DEBUGPRINT(5, (TXT("cmd queue length: %d\n"), queue_length(&dev->txCmdQueue)));
 
@@ -2078,11 +2287,17 @@ static void mhydra_send (struct work_struct *work)
   }
 
   if (tx_needed) {
-    int result;
+    MhydraTxUrb *tx = mhydra_tx_urb_get(dev);
+    int         result;
+
+    if (tx == NULL) {
+      // All writes are in flight; the write callback queues us again
+      return;
+    }
 
-    if ((result = mhydra_transmit(vCard)) <= 0) {
-      // The transmission failed - mark write as finished
-      complete(&dev->write_finished);
+    if ((result = mhydra_transmit(vCard, tx)) <= 0) {
+      // The transmission failed - return the urb to the pool
+      mhydra_tx_urb_put(dev, tx);
     }
 
     // Wake up those who are waiting to send a cmd or msg
@@ -2104,9 +2319,6 @@ static void mhydra_send (struct work_struct *work)
       queue_work(dev->txTaskQ, &dev->txWork);
     }
   }
-  else {
-    complete(&dev->write_finished);
-  }
 
   return;
 } // _send
@@ -2351,6 +2563,7 @@ static int mhydra_fill_usb_buffer (VCanCardData *vCard, unsigned char *buffer,
       DEBUGPRINT(5, (TXT("t mhydra, chan %d, out %d\n"),
                      j, mhydraChan->outstanding_tx));
 
+      dev->txFrames++;
       queue_pop(&vChan->txChanQueue);
     } // !queue_empty(&vChan->txChanQueue)
   }
@@ -2363,14 +2576,13 @@ static int mhydra_fill_usb_buffer (VCanCardData *vCard, unsigned char *buffer,
 //============================================================================
 // The actual sending
 //
-static int mhydra_transmit (VCanCardData *vCard /*, void *cmd*/)
+static int mhydra_transmit (VCanCardData *vCard, MhydraTxUrb *tx)
 {
   MhydraCardData *dev     = vCard->hwCardData;
   int            retval   = 0;
   int            fill     = 0;
 
-  fill = mhydra_fill_usb_buffer(vCard, dev->write_urb->transfer_buffer,
-                                MAX_PACKET_OUT);
+  fill = mhydra_fill_usb_buffer(vCard, tx->buffer, MAX_PACKET_OUT);
 
   if (fill == 0) {
     // No data to send...
@@ -2378,7 +2590,7 @@ static int mhydra_transmit (VCanCardData *vCard /*, void *cmd*/)
     return 0;
   }
 
-  dev->write_urb->transfer_buffer_length = fill;
+  tx->urb->transfer_buffer_length = fill;
 
   if (!vCard->cardPresent) {
     // The device was unplugged before the file was released.
@@ -2386,15 +2598,23 @@ static int mhydra_transmit (VCanCardData *vCard /*, void *cmd*/)
     return VCAN_STAT_NO_DEVICE;
   }
 
-  retval = usb_submit_urb(dev->write_urb, GFP_KERNEL);
+  retval = usb_submit_urb(tx->urb, GFP_KERNEL);
   if (retval) {
     DEBUGPRINT(1, (TXT("%s - failed submitting write urb, error %d"),
                    __FUNCTION__, retval));
     retval = VCAN_STAT_FAIL;
   }
   else {
-    // The semaphore is released on successful transmission
+    unsigned int inFlight = hweight_long(dev->txUrbBusy);
+
+    // The write callback returns the urb to the pool
     retval = sizeof(hydraHostCmd);
+
+    dev->txBytes += fill;
+    dev->txUrbsSent++;
+    if (inFlight > dev->txUrbsInFlightMax) {
+      dev->txUrbsInFlightMax = inFlight;
+    }
   }
 
   return retval;
@@ -2896,6 +3116,8 @@ static int mhydra_plugin (struct usb_interface *interface,
       // We found a bulk-in endpoint
       switch (endpoint->bEndpointAddress) {
         case EP_IN_ADDR_COMMAND:
+          buffer_size = 0; // Read urbs are setup in mhydra_rx_start()
+          break;
         case EP_IN_ADDR_FAT:
           buffer_size = MAX_PACKET_IN;
           break;
@@ -2921,13 +3143,10 @@ static int mhydra_plugin (struct usb_interface *interface,
         !(endpoint->bEndpointAddress & USB_DIR_IN) &&
         ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) ==
          USB_ENDPOINT_XFER_BULK)) {
+      unsigned int j;
+
       // We found a bulk out endpoint
       // A probe() may sleep and has no restrictions on memory allocations
-      dev->write_urb = usb_alloc_urb(0, GFP_KERNEL);
-      if (!dev->write_urb) {
-        DEBUGPRINT(1, (TXT("No free urbs available\n")));
-        goto error;
-      }
       dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
 
       // On some platforms using this kind of buffer alloc
@@ -2943,25 +3162,37 @@ static int mhydra_plugin (struct usb_interface *interface,
       dev->bulk_out_MaxPacketSize    = le16_to_cpu(endpoint->wMaxPacketSize);
       DEBUGPRINT(2, (TXT("MaxPacketSize out = %d\n"),
                      dev->bulk_out_MaxPacketSize));
-      dev->write_urb->transfer_flags = (URB_NO_TRANSFER_DMA_MAP);
+      dev->txUrbCount = min_t(unsigned int, max_t(unsigned int, tx_urbs, 1),
+                              MHYDRA_MAX_TX_URBS);
+      for (j = 0; j < dev->txUrbCount; j++) {
+        MhydraTxUrb *tx = &dev->txUrb[j];
+
+        tx->vCard = vCard;
+        tx->urb   = usb_alloc_urb(0, GFP_KERNEL);
+        if (!tx->urb) {
+          DEBUGPRINT(1, (TXT("No free urbs available\n")));
+          goto error;
+        }
+        tx->urb->transfer_flags = (URB_NO_TRANSFER_DMA_MAP);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35))
-      dev->bulk_out_buffer = usb_buffer_alloc(dev->udev,
-                                              buffer_size, GFP_KERNEL,
-                                              &dev->write_urb->transfer_dma);
+        tx->buffer = usb_buffer_alloc(dev->udev,
+                                      buffer_size, GFP_KERNEL,
+                                      &tx->urb->transfer_dma);
 #else
-      dev->bulk_out_buffer = usb_alloc_coherent(dev->udev,
-                                                buffer_size, GFP_KERNEL,
-                                                &dev->write_urb->transfer_dma);
+        tx->buffer = usb_alloc_coherent(dev->udev,
+                                        buffer_size, GFP_KERNEL,
+                                        &tx->urb->transfer_dma);
 #endif
-      if (!dev->bulk_out_buffer) {
-        DEBUGPRINT(1, (TXT("Couldn't allocate bulk_out_buffer\n")));
-        goto error;
+        if (!tx->buffer) {
+          DEBUGPRINT(1, (TXT("Couldn't allocate bulk_out_buffer\n")));
+          goto error;
+        }
+        usb_fill_bulk_urb(tx->urb, dev->udev,
+                          usb_sndbulkpipe(dev->udev,
+                                          endpoint->bEndpointAddress),
+                          tx->buffer, buffer_size,
+                          mhydra_write_bulk_callback, tx);
       }
-      usb_fill_bulk_urb(dev->write_urb, dev->udev,
-                        usb_sndbulkpipe(dev->udev,
-                                        endpoint->bEndpointAddress),
-                        dev->bulk_out_buffer, buffer_size,
-                        mhydra_write_bulk_callback, vCard);
     }
   }
 
@@ -2999,6 +3230,22 @@ static int mhydra_plugin (struct usb_interface *interface,
 
   // Start up vital stuff
   if (mhydra_start(vCard) != VCAN_STAT_OK) {
+    DEBUGPRINT(1, (TXT("Couldn't start the device\n")));
+    // mhydra_start() may fail after the read urbs are submitted,
+    // so undo it the same way as mhydra_remove() does.
+    vCard->cardPresent = 0;
+    mhydra_rx_stop(vCard);
+    mhydra_tx_kill(dev);
+    if (dev->txTaskQ) {
+      flush_workqueue(dev->txTaskQ);
+      mhydra_tx_kill(dev);
+      destroy_workqueue(dev->txTaskQ);
+    }
+    if (dev->memo.bulkQ != NULL) {
+      destroy_workqueue(dev->memo.bulkQ);
+      dev->memo.bulkQ = NULL;
+    }
+    retval = -EIO;
     goto error;
   }
 
@@ -3062,8 +3309,7 @@ static int mhydra_start (VCanCardData *vCard)
     mhydraChan->current_tx_message_index = 1;
   }
 
-  init_completion(&dev->write_finished);
-  complete(&dev->write_finished);
+  spin_lock_init(&dev->txUrbLock);
 
   init_completion(&dev->memo.completion);
 
@@ -3078,14 +3324,18 @@ static int mhydra_start (VCanCardData *vCard)
     INIT_WORK(&dev->memo.bulkWork, mhydra_memo_bulk);
   }
 #endif
-  dev->txTaskQ = create_workqueue("mhydra_tx");
+  // Single threaded, as only one mhydra_send may fill buffers at a time
+  dev->txTaskQ = create_singlethread_workqueue("mhydra_tx");
   if (dev->bulk_in[EP_ADDR_TO_INDEX(EP_IN_ADDR_FAT)].endpointAddr != 0) {
     dev->memo.bulkQ = create_workqueue("mhydra_bulk");
   } else {
     dev->memo.bulkQ = NULL;
   }
 
-  kthread_run(mhydra_rx_thread, vCard, "Kvaser kernel thread");
+  ret = mhydra_rx_start(vCard);
+  if (ret != VCAN_STAT_OK) {
+    goto error_exit;
+  }
   mhydra_map_channels(vCard);
   ret = device_request_firmware_info(vCard);
   if (ret != VCAN_STAT_OK) {
@@ -3214,6 +3464,7 @@ static int mhydra_allocate (VCanCardData **in_vCard)
     VCanChanData  *dataPtrArray[HYDRA_MAX_CARD_CHANNELS];
     VCanChanData  vChd[HYDRA_MAX_CARD_CHANNELS];
     MhydraChanData  hChd[HYDRA_MAX_CARD_CHANNELS];
+    CAN_MSG         txBuf[HYDRA_MAX_CARD_CHANNELS][TX_CHAN_BUF_SIZE];
   } ChanHelperStruct;
 
   int              chNr;
@@ -3248,6 +3499,7 @@ static int mhydra_allocate (VCanCardData **in_vCard)
   for (chNr = 0; chNr < HYDRA_MAX_CARD_CHANNELS; chNr++) {
     chs->dataPtrArray[chNr]    = &chs->vChd[chNr];
     chs->vChd[chNr].hwChanData = &chs->hChd[chNr];
+    chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
     chs->vChd[chNr].minorNr    = -1;   // No preset minor number
   }
   vCard->chanData = chs->dataPtrArray;
@@ -3257,6 +3509,7 @@ static int mhydra_allocate (VCanCardData **in_vCard)
   vCard->next = driverData.canCards;
   driverData.canCards = vCard;
   spin_unlock(&driverData.canCardsLock);
+  vCanCardListChanged();
 
   *in_vCard = vCard;
 
@@ -3286,6 +3539,8 @@ static void mhydra_deallocate (VCanCardData *vCard)
   // Make sure all workqueues are finished
   //flush_workqueue(&dev->txTaskQ);
 
+  mhydra_rx_free(vCard);
+
   for (pipe_id = 0; pipe_id < NUM_IN_PIPES; pipe_id++) {
     if (dev->bulk_in[pipe_id].buffer != NULL) {
       kfree(dev->bulk_in[pipe_id].buffer);
@@ -3297,16 +3552,25 @@ static void mhydra_deallocate (VCanCardData *vCard)
   // Instruct memo bulk thread to exit read loop
   //complete(&dev->bulk_in_1_data_read);
 
+  mhydra_tx_kill(dev);
+  for (i = 0; i < dev->txUrbCount; i++) {
+    MhydraTxUrb *tx = &dev->txUrb[i];
+
+    if (tx->buffer != NULL) {
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35))
-  usb_buffer_free(dev->udev, dev->bulk_out_size,
-                  dev->bulk_out_buffer,
-                  dev->write_urb->transfer_dma);
+      usb_buffer_free(dev->udev, dev->bulk_out_size,
+                      tx->buffer,
+                      tx->urb->transfer_dma);
 #else
-  usb_free_coherent(dev->udev, dev->bulk_out_size,
-                    dev->bulk_out_buffer,
-                    dev->write_urb->transfer_dma);
+      usb_free_coherent(dev->udev, dev->bulk_out_size,
+                        tx->buffer,
+                        tx->urb->transfer_dma);
 #endif
-  usb_free_urb(dev->write_urb);
+      tx->buffer = NULL;
+    }
+    usb_free_urb(tx->urb);
+    tx->urb = NULL;
+  }
 
   if (dev->dmBuffer != NULL) {
     kfree(dev->dmBuffer);
@@ -3354,6 +3618,7 @@ static void mhydra_deallocate (VCanCardData *vCard)
   }
   if (vCard->chanData != NULL) {
     DEBUGPRINT(2, (TXT("Free vCard->chanData\n")));
+    vCanRemoveData(vCard);
     kfree(vCard->chanData);
     vCard->chanData = NULL;
   }
@@ -3362,21 +3627,14 @@ static void mhydra_deallocate (VCanCardData *vCard)
 } // _deallocate
 
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 8))
-# define USB_KILL_URB(x) usb_unlink_urb(x)
-#else
-# define USB_KILL_URB(x) usb_kill_urb(x)
-#endif
-
 //============================================================================
 //     mhydra_remove
 //
 //     Called by the usb core when the device is removed from the system.
 //
 //     This routine guarantees that the driver will not submit any more urbs
-//     by clearing dev->udev.  It is also supposed to terminate any currently
-//     active urbs.  Unfortunately, usb_bulk_msg(), does not provide any way
-//     to do this.  But at least we can cancel an active write.
+//     by clearing dev->udev.  It also terminates the read urbs and any
+//     active writes.
 //
 static void mhydra_remove (struct usb_interface *interface)
 {
@@ -3438,14 +3696,18 @@ static void mhydra_remove (struct usb_interface *interface)
   flush_scheduled_work();
 
 
-  // Terminate an ongoing write
-  DEBUGPRINT(6, (TXT("Ongoing write terminated\n")));
-  USB_KILL_URB(dev->write_urb);
-  DEBUGPRINT(6, (TXT("Unlinking urb\n")));
-  wait_for_completion(&dev->write_finished);
+  // Terminate reads
+  mhydra_rx_stop(vCard);
 
-  // Flush and destroy tx workqueue
+  // Terminate ongoing writes
+  DEBUGPRINT(6, (TXT("Ongoing writes terminated\n")));
+  mhydra_tx_kill(dev);
+
+  // Flush and destroy tx workqueue. A send that was already running may
+  // have submitted a write after the kill, so kill once more.
   DEBUGPRINT(2, (TXT("destroy_workqueue\n")));
+  flush_workqueue(dev->txTaskQ);
+  mhydra_tx_kill(dev);
   destroy_workqueue(dev->txTaskQ);
   if (dev->memo.bulkQ != NULL) {
     destroy_workqueue(dev->memo.bulkQ);
@@ -4339,6 +4601,16 @@ static int mhydra_proc_read (struct seq_file* m, void* v)
   }
   seq_puts(m, "\n");
 
+  spin_lock(&driverData.canCardsLock);
+  for (cardData = driverData.canCards; cardData != NULL; cardData = cardData->next) {
+    MhydraCardData *dev = cardData->hwCardData;
+
+    seq_printf(m, "card %u tx %lu bytes, %lu frames in %lu urbs (max %u of %u in flight)\n",
+               cardData->cardNumber, dev->txBytes, dev->txFrames,
+               dev->txUrbsSent, dev->txUrbsInFlightMax, dev->txUrbCount);
+  }
+  spin_unlock(&driverData.canCardsLock);
+
   return 0;
 } // _proc_read
 
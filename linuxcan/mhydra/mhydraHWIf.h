@@ -196,6 +196,23 @@ typedef struct MhydraUsbPipeInfo {
   uint32_t  maxPacketSize;
 } MhydraUsbPipeInfo;
 
+#define MHYDRA_MAX_RX_URBS 16
+
+typedef struct MhydraRxUrb {
+  struct urb          *urb;
+  uint8_t             *buffer;
+  struct work_struct   work;        // parses the buffer and resubmits the urb
+  VCanCardData        *vCard;
+} MhydraRxUrb;
+
+#define MHYDRA_MAX_TX_URBS 8
+
+typedef struct MhydraTxUrb {
+  struct urb          *urb;
+  uint8_t             *buffer;
+  VCanCardData        *vCard;
+} MhydraTxUrb;
+
 typedef struct MhydraMemoInfo {
   struct workqueue_struct  *bulkQ;
   struct work_struct        bulkWork;
@@ -301,16 +318,32 @@ typedef struct MhydraCardData {
   MhydraUsbPipeInfo  bulk_in[NUM_IN_PIPES];
   MhydraMemoInfo     memo;
 
+  // Ring of urbs kept submitted on the command in pipe
+  MhydraRxUrb               rxUrb[MHYDRA_MAX_RX_URBS];
+  unsigned int              rxUrbCount;
+  size_t                    rxBufferSize;
+  struct workqueue_struct  *rxQ;        // single threaded, keeps buffer order
+  int                       rxStopped;
+  int                       rxErrorCounter;
+
   uint8_t   bulk_in_endpointAddrDiag;   // the address of the diag bulk in endpoint
 
-  uint8_t   *bulk_out_buffer;           // the buffer to send data
-  size_t    bulk_out_size;              // the size of the send buffer
+  size_t    bulk_out_size;              // the size of each send buffer
 
   uint32_t  bulk_out_MaxPacketSize;
 
-  struct urb *write_urb;                // the urb used to send data
+  // Pool of urbs used to send data, filled one at a time by mhydra_send
+  MhydraTxUrb    txUrb[MHYDRA_MAX_TX_URBS];
+  unsigned int   txUrbCount;
+  unsigned long  txUrbBusy;             // bit n set while txUrb[n] is submitted
+  spinlock_t     txUrbLock;
   uint8_t    bulk_out_endpointAddr;    // the address of the bulk out endpoint
-  struct completion   write_finished;     // wait for the write to finish
+
+  // Throughput counters, shown in /proc
+  unsigned long  txBytes;
+  unsigned long  txFrames;
+  unsigned long  txUrbsSent;
+  unsigned int   txUrbsInFlightMax;
 
   VCanCardData  *vCard;
 
@@ -1813,6 +1813,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
         VCanChanData *dataPtrArray[MAX_CARD_CHANNELS];
         VCanChanData vChd[MAX_CARD_CHANNELS];
         PciCanChanData hChd[MAX_CARD_CHANNELS];
+        CAN_MSG        txBuf[MAX_CARD_CHANNELS][TX_CHAN_BUF_SIZE];
     } ChanHelperStruct;
 
     ChanHelperStruct *chs;
@@ -1843,6 +1844,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
     for (chNr = 0; chNr < MAX_CARD_CHANNELS; chNr++){
       chs->dataPtrArray[chNr]     = &chs->vChd[chNr];
       chs->vChd[chNr].hwChanData  = &chs->hChd[chNr];
+      chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
       chs->vChd[chNr].minorNr     = -1;   // No preset minor number
     }
     vCard->chanData = chs->dataPtrArray;
@@ -1888,6 +1890,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
     vCard->next = driverData.canCards;
     driverData.canCards = vCard;
     spin_unlock(&driverData.canCardsLock);
+    vCanCardListChanged();
 
     return VCAN_STAT_OK;
 
@@ -1908,6 +1911,7 @@ probe_err:
     pci_disable_device(dev);
     pci_release_regions(dev);
 pci_err:
+    vCanRemoveData(vCard);
     kfree(vCard->chanData);
 chan_alloc_err:
     kfree(vCard);
@@ -1983,6 +1987,7 @@ static void pciCanRemoveOne (struct pci_dev *dev)
   }
   spin_unlock(&driverData.canCardsLock);
 
+  vCanRemoveData(vCard);
   kfree(vCard->chanData);
   kfree(vCard);
 }
@@ -1726,6 +1726,7 @@ static int pciCanInitOne (struct pci_dev *dev,
         VCanChanData *dataPtrArray[MAX_CARD_CHANNELS];
         VCanChanData vChd[MAX_CARD_CHANNELS];
         PciCan2ChanData hChd[MAX_CARD_CHANNELS];
+        CAN_MSG         txBuf[MAX_CARD_CHANNELS][TX_CHAN_BUF_SIZE];
     } ChanHelperStruct;
 
     ChanHelperStruct *chs;
@@ -1756,6 +1757,7 @@ static int pciCanInitOne (struct pci_dev *dev,
     for (chNr = 0; chNr < MAX_CARD_CHANNELS; chNr++){
         chs->dataPtrArray[chNr]    = &chs->vChd[chNr];
         chs->vChd[chNr].hwChanData = &chs->hChd[chNr];
+        chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
         chs->vChd[chNr].minorNr    = -1;   // No preset minor number
     }
     vCard->chanData = chs->dataPtrArray;
@@ -1801,6 +1803,7 @@ static int pciCanInitOne (struct pci_dev *dev,
     vCard->next = driverData.canCards;
     driverData.canCards = vCard;
     spin_unlock(&driverData.canCardsLock);
+    vCanCardListChanged();
 
     return VCAN_STAT_OK;
 
@@ -1819,6 +1822,7 @@ probe_err:
     pci_disable_device(dev);
     pci_release_regions(dev);
 pci_err:
+    vCanRemoveData(vCard);
     kfree(vCard->chanData);
 chan_alloc_err:
     kfree(vCard);
@@ -1919,6 +1923,7 @@ static void pciCanRemoveOne (struct pci_dev *dev)
     }
   }
 
+  vCanRemoveData(vCard);
   kfree(vCard->chanData);
   kfree(vCard);
 }
@@ -172,6 +172,11 @@ int getErrorField(pciefd_packet_t *packet);
 int getErrorFieldPos(pciefd_packet_t *packet);
 void printErrorCode(pciefd_packet_t *packet);
 
+// +----------------------------------------------------------------------------
+// | DMA buffer packets
+// +----------------------------------------------------------------------------
+int readDmaPacket(const uint32_t *buffer, unsigned int avail, pciefd_packet_t *packet);
+
 // +----------------------------------------------------------------------------
 // | Transmit packets
 // +----------------------------------------------------------------------------
@@ -488,6 +488,82 @@ int bytesToWordsCeil(int bytes)
   return (bytes+3)/4;
 }
 
+// +----------------------------------------------------------------------------
+// | DMA buffer packets
+// | A packet is a size word, counting itself, followed by the id and control
+// | words and, depending on the packet type, a 64-bit timestamp and data
+// | words. The whole packet is checked against the words left in the buffer
+// | and against the size its type calls for before anything is copied.
+// |
+// | Returns the number of words the packet takes up, 0 at the end of the
+// | buffer and -1 if the packet is corrupt.
+// +----------------------------------------------------------------------------
+int readDmaPacket(const uint32_t *buffer, unsigned int avail, pciefd_packet_t *packet)
+{
+  const uint32_t *words;
+  unsigned int size;
+  unsigned int nwords;
+  unsigned int expected;
+
+  if (!avail) return -1;
+
+  size = buffer[0];
+
+  // End of buffer reached
+  if (!size) return 0;
+
+  if ((size < 3) || (size > 5 + NR_OF_DATA_WORDS) || (size > avail)) return -1;
+
+  words  = &buffer[1];
+  nwords = size - 1;
+
+  packet->id      = words[0];
+  packet->control = words[1];
+
+  if (isDataPacket(packet)) {
+    int nbytes;
+
+    if (isFlexibleDataRateFormat(packet)) {
+      nbytes = dlcToBytesFD(getDLC(packet));
+    }
+    else {
+      nbytes = dlcToBytes(getDLC(packet));
+    }
+
+    if (isRemoteRequest(packet)) {
+      nbytes = 0;
+    }
+
+    if (bytesToWordsCeil(nbytes) > NR_OF_DATA_WORDS) return -1;
+
+    expected = 4 + bytesToWordsCeil(nbytes);
+  }
+  else if (isAckPacket(packet)       ||
+           isTxrqPacket(packet)      ||
+           isEFlushAckPacket(packet) ||
+           isEFrameAckPacket(packet) ||
+           isErrorPacket(packet)     ||
+           isBusLoadPacket(packet)   ||
+           isStatusPacket(packet)) {
+    expected = 4;
+  }
+  else if (isOffsetPacket(packet) || isDelayPacket(packet)) {
+    expected = 2;
+  }
+  else {
+    return -1;
+  }
+
+  if (nwords != expected) return -1;
+
+  if (nwords >= 4) {
+    memcpy(&packet->timestamp, &words[2], sizeof(packet->timestamp));
+    memcpy(packet->data, &words[4], (nwords - 4) * sizeof(uint32_t));
+  }
+
+  return size;
+}
+
 // +----------------------------------------------------------------------------
 // | Transmit packets
 // +----------------------------------------------------------------------------
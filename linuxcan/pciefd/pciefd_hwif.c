@@ -161,6 +161,26 @@ MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("KVASER");
 MODULE_DESCRIPTION("PCIe CAN module.");
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30))
+#define PCIEFD_RX_THREAD 1
+#endif
+
+//
+// Receive handling.
+// In latency mode (rx_poll=0) all received packets are handled in the
+// interrupt handler. In throughput mode (rx_poll=1) the interrupt handler
+// masks the receive buffer interrupt and leaves the packets to a threaded
+// handler, which handles at most rx_budget packets per pass before letting
+// others run, and unmasks the interrupt when the buffer is empty.
+//
+static int rx_poll = 0;
+MODULE_PARM_DESC(rx_poll, "PCIe CAN receive mode, 0 = latency (in interrupt), 1 = throughput (threaded, budgeted)");
+module_param(rx_poll, int, 0644);
+
+static unsigned int rx_budget = 64;
+MODULE_PARM_DESC(rx_budget, "PCIe CAN packets handled per pass in throughput mode");
+module_param(rx_budget, uint, 0644);
+
 #define PCIEFD_VENDOR (0x1a07)
 #define PCIEFD_4HS_ID     (0x000d)
 #define PCIEFD_2HS_ID     (0x000e)
@@ -578,118 +598,16 @@ static int stopDMA(VCanCardData *vCard)
 }
 
 //======================================================================
-//
-//======================================================================
-static int getDmaWord(VCanCardData *vCard, uint32_t *data)
-{
-  PciCanCardData *hCard = vCard->hwCardData;
-  dmaCtx_t *dmaCtx = &hCard->dmaCtx;
-  uint32_t *buffer;
-
-  // Sanity check used during development
-  if( (dmaCtx->active < 0) || (dmaCtx->active > 1) )
-    {
-      DEBUGPRINT(1,"Error: Invalid buffer\n");
-      return VCAN_STAT_BAD_PARAMETER;
-    }
-
-  buffer = dmaCtx->bufferCtx[dmaCtx->active].data;
-
-  if(!buffer)
-    {
-      DEBUGPRINT(1,"Error: DMA buffer uninitialized\n");
-      return VCAN_STAT_NO_DEVICE;
-    }
-
-  if(dmaCtx->position >= DMA_BUFFER_SZ/4)
-    {
-      DEBUGPRINT(1,"Error: DMA buffer pointer wraparound\n");
-      return VCAN_STAT_BAD_PARAMETER;
-    }
-
-  --dmaCtx->psize; // Decrement before assigning data (data could be a pointer to psize!)
-
-  *data = buffer[dmaCtx->position];
-
-  ++dmaCtx->position;
-
-  return VCAN_STAT_OK;
-}
-
-//======================================================================
-//
-//======================================================================
-static int getDmaPacketSize(VCanCardData *vCard)
-{
-  PciCanCardData *hCard = vCard->hwCardData;
-  dmaCtx_t *dmaCtx = &hCard->dmaCtx;
-  int status;
-  uint32_t tmp;
-
-  status = getDmaWord(vCard, &tmp);
-
-  if( status ) {
-    DEBUGPRINT(1, "Error: Failed to get packet size\n");
-    dmaCtx->active = -1;
-    return status;
-  }
-
-  dmaCtx->psize = (unsigned int)tmp;
-
-  if(dmaCtx->psize > 21) {
-    DEBUGPRINT(1,"Error: Buffer corruption detected psize:%u pos:%u\n",
-               dmaCtx->psize,dmaCtx->position);
-
-    dmaCtx->active = -1;
-
-    return VCAN_STAT_FAIL;
-  }
-
-  if( !dmaCtx->psize )
-    {
-      // End of buffer reached
-      dmaCtx->active = -1;
-    }
-  else
-    {
-      --dmaCtx->psize;
-    }
-
-  return dmaCtx->psize;
-}
-
-//======================================================================
-//
-//======================================================================
-static int getDmaPacketTS(VCanCardData *vCard, pciefd_packet_t *packet)
-{
-  PciCanCardData *hCard = vCard->hwCardData;
-  dmaCtx_t *dmaCtx = &hCard->dmaCtx;
-  int status;
-  uint32_t *timestamp = (uint32_t*)&packet->timestamp;
-
-  status = getDmaWord(vCard, &timestamp[0]);
-
-  if( status ) return status;
-
-  if( !dmaCtx->psize ) DEBUGPRINT(1,"Error: Packet unaligned\n");
-
-  status = getDmaWord(vCard, &timestamp[1]);
-
-  if( status ) return status;
-
-  return VCAN_STAT_OK;
-}
-
-//======================================================================
-//
+//  Read the next packet from the active DMA buffer
+//  See readDmaPacket() for how a packet is checked and decoded.
 //======================================================================
 int readDMA(VCanCardData * vCard, pciefd_packet_t *packet)
 {
   PciCanCardData *hCard = vCard->hwCardData;
   dmaCtx_t *dmaCtx = &hCard->dmaCtx;
-  int status;
-  int channel;
+  const uint32_t *buffer;
+  unsigned int pos;
+  int size;
 
   if(dmaCtx->active < 0)
     {
@@ -703,140 +621,47 @@ int readDMA(VCanCardData * vCard, pciefd_packet_t *packet)
       return VCAN_STAT_BAD_PARAMETER;
     }
 
-  if(!dmaCtx->bufferCtx[dmaCtx->active].data)
+  buffer = dmaCtx->bufferCtx[dmaCtx->active].data;
+
+  if(!buffer)
     {
       DEBUGPRINT(1,"dmaCtx.buffer uninitialized\n");
       return VCAN_STAT_BAD_PARAMETER;
     }
 
-  status = getDmaPacketSize(vCard);
-  if( status < 0 ) goto leave;
-  if( status == 0 ) {
-    status = VCAN_STAT_FAIL;
-    goto leave;
-  }
-
-  // Read first two words to determine packet type
-  status = getDmaWord(vCard, &packet->id);
-
-  if(status) goto leave;
-
-  status = getDmaWord(vCard, &packet->control);
-
-  if(status) goto leave;
+  pos = dmaCtx->position;
 
-  channel = packetChannelId(packet);
-
-  if( isDataPacket(packet) )
+  if(pos >= DMA_BUFFER_SZ/4)
     {
-      int i;
-      int dlc;
-      int nbytes;
-      int nwords;
-
-      DEBUGPRINT(3, "Data packet CH:%u.%u\n",channel, dmaCtx->active);
-
-      if( !dmaCtx->psize ) goto unaligned;
-
-      dlc = getDLC(packet);
-
-      if((dlc > 0) && !dmaCtx->psize) goto unaligned;
-
-      if(isFlexibleDataRateFormat(packet))
-        {
-          nbytes = dlcToBytesFD(dlc);
-        }
-      else
-        {
-          nbytes = dlcToBytes(dlc);
-        }
-
-      if ( isRemoteRequest(packet) ) {
-        nbytes = 0;
-      }
-
-      nwords = bytesToWordsCeil(nbytes);
-
-      status = getDmaPacketTS(vCard, packet);
-      if(status) goto leave;
-
-      for(i=0;i<nwords;i++)
-        {
-          if( !dmaCtx->psize ) goto unaligned;
-          status = getDmaWord(vCard, &packet->data[i]);
-          if(status) goto leave;
-        }
-
-      if( dmaCtx->psize ) goto unaligned;
-
-      goto leave;
-    }
-  else if( isAckPacket(packet)       ||
-           isTxrqPacket(packet)      ||
-           isEFlushAckPacket(packet) ||
-           isEFrameAckPacket(packet))
-    {
-      DEBUGPRINT(3,"ack packet CH:%u.%u\n",channel, dmaCtx->active);
-      status = getDmaPacketTS(vCard, packet);
-      if( dmaCtx->psize ) goto unaligned;
-      goto leave;
+      DEBUGPRINT(1,"Error: DMA buffer pointer wraparound\n");
+      dmaCtx->active = -1;
+      return VCAN_STAT_FAIL;
     }
-  else if( isErrorPacket(packet) )
-    {
-      DEBUGPRINT(3,"error packet CH:%u.%u\n",channel, dmaCtx->active);
 
-      if( !dmaCtx->psize ) goto unaligned;
+  size = readDmaPacket(&buffer[pos], DMA_BUFFER_SZ/4 - pos, packet);
 
-      status = getDmaPacketTS(vCard, packet);
-      if( dmaCtx->psize ) goto unaligned;
-    }
-  else if( isOffsetPacket(packet) )
+  if( !size )
     {
-      DEBUGPRINT(3,"offset CH:%u.%u\n",channel, dmaCtx->active);
-      if( dmaCtx->psize ) goto unaligned;
-    }
-  else if( isBusLoadPacket(packet) )
-    {
-      DEBUGPRINT(3,"bus load CH:%u.%u\n",channel, dmaCtx->active);
-
-      if( !dmaCtx->psize ) goto unaligned;
-
-      status = getDmaPacketTS(vCard, packet);
-
-      if( dmaCtx->psize ) goto unaligned;
+      // End of buffer reached
+      dmaCtx->active = -1;
+      return VCAN_STAT_FAIL;
     }
-  else if( isStatusPacket(packet) )
-    {
-      DEBUGPRINT(3,"status CH:%u.%u\n",channel, dmaCtx->active);
-
-      if( !dmaCtx->psize ) goto unaligned;
-
-      status = getDmaPacketTS(vCard, packet);
 
-      if( dmaCtx->psize ) goto unaligned;
-    }
-  else if( isDelayPacket(packet) )
+  if( size < 0 )
     {
-      DEBUGPRINT(3,"delay CH:%u.%u\n",channel, dmaCtx->active);
-      if( dmaCtx->psize ) goto unaligned;
+      DEBUGPRINT(1,"Error: Buffer corruption detected psize:%u pos:%u\n",
+                 buffer[pos], pos);
+      dmaCtx->active = -1;
+      return VCAN_STAT_FAIL;
     }
-  else{
-    DEBUGPRINT(1,"Undefined packet CH:%u.%u. id = 0x%08x, ctrl = 0x%08x\n",
-               channel, dmaCtx->active, packet->id, packet->control);
-    goto deactivate;
-  }
-
-  goto leave;
 
- unaligned:
-  DEBUGPRINT(1,"Packet unaligned\n");
+  dmaCtx->position = pos + size;
 
- deactivate:
-  status = VCAN_STAT_FAIL;
-  dmaCtx->active = -1;
+  DEBUGPRINT(3,"packet CH:%u.%u id = 0x%08x, ctrl = 0x%08x\n",
+             packetChannelId(packet), dmaCtx->active,
+             packet->id, packet->control);
 
- leave:
-  return status;
+  return VCAN_STAT_OK;
 }
 #endif // USE_DMA
 
@@ -901,8 +726,27 @@ static int pciCanTime(VCanCardData *vCard, uint64_t *time)
 //======================================================================
 static int pciCanProcRead (struct seq_file* m, void* v)
 {
+  VCanCardData *vCard;
+
   seq_printf(m, "\ntotal channels %d\n", driverData.noOfDevices);
 
+  spin_lock(&driverData.canCardsLock);
+  for (vCard = driverData.canCards; vCard != NULL; vCard = vCard->next) {
+    PciCanCardData *hCard = vCard->hwCardData;
+    unsigned int    chNr;
+
+    seq_printf(m, "card %u rx polls %lu, budget exhausted %lu, packets %lu (max %u per poll)\n",
+               vCard->cardNumber, hCard->rxPolls, hCard->rxBudgetExhausted,
+               hCard->rxPollPackets, hCard->rxPollMax);
+    for (chNr = 0; chNr < vCard->nrChannels; chNr++) {
+      PciCanChanData *hChd = vCard->chanData[chNr]->hwChanData;
+
+      seq_printf(m, "  channel %u tx frames %d in %d bursts\n", chNr,
+                 hChd->debug.tx_packet_count, hChd->debug.tx_burst_count);
+    }
+  }
+  spin_unlock(&driverData.canCardsLock);
+
   return 0;
 }
 
@@ -2167,10 +2011,18 @@ static void pciCanInterrupts (VCanCardData *vCard, int enable)
 
   spin_lock_irqsave(&hCard->lock, irqFlags);
 
+  hCard->irqEnabled = enable;
+
   // Disable/enable interrupts from card
   if (enable) {
-    DEBUGPRINT(3,"Enable interrupts:%08x\n",ALL_INTERRUPT_SOURCES_MSK);
-    IOWR_PCIE_IEN(hCard->pcie, ALL_INTERRUPT_SOURCES_MSK);
+    uint32_t ien = ALL_INTERRUPT_SOURCES_MSK;
+
+    // The receive thread unmasks the receive buffer when it is done
+    if (hCard->rxPolling) {
+      ien &= ~RECEIVE_BUFFER_IRQ;
+    }
+    DEBUGPRINT(3,"Enable interrupts:%08x\n",ien);
+    IOWR_PCIE_IEN(hCard->pcie, ien);
   }else{
     DEBUGPRINT(3,"Disable interrupts\n");
     IOWR_PCIE_IEN(hCard->pcie, 0);
@@ -2493,7 +2345,8 @@ static void receivedPacketHandler (VCanCardData *vCard)
               }
             if (!queue_empty(&vChd->txChanQueue))
               {
-                pciCanRequestSend(vCard, vChd);
+                // One request per receive pass, see pciCanReceiveIsr
+                set_bit(0, &hChd->txKick);
               } else {
               DEBUGPRINT(4, "Queue empty\n");
             }
@@ -2691,9 +2544,11 @@ static void interruptRestart (struct timer_list *t)
 //  Interrupt handling functions
 //  Must be called with channel locked (to avoid access interference).
 //  * Will be called without lock as all the receive FIFO accesses are card
-//    specific and are accessed only from the interrupt context.
+//    specific and are accessed only from the interrupt context, or from
+//    the receive thread while the receive buffer interrupt is masked.
+//  Handles at most budget packets, and returns the number handled.
 //======================================================================
-static void pciCanReceiveIsr (VCanCardData *vCard)
+static unsigned int pciCanReceiveIsr (VCanCardData *vCard, unsigned int budget)
 {
   PciCanCardData *hCard = vCard->hwCardData;
   VCanCardTimerData timerData;
@@ -2703,8 +2558,10 @@ static void pciCanReceiveIsr (VCanCardData *vCard)
   unsigned int dataValid = 0;
   unsigned int irqHandled = 0;
   unsigned int irq;
+  unsigned int handled = 0;
+  unsigned int i;
 
-  while(1)
+  while(handled < budget)
     {
       dataValid = 0;
       // A loop counter as a safety measure.
@@ -2901,14 +2758,69 @@ static void pciCanReceiveIsr (VCanCardData *vCard)
           fifoIrqClear(hCard->canRxBuffer, irq & ~irqHandled);
         }
 
-      if(dataValid)
+      if(dataValid) {
         receivedPacketHandler(vCard);
+        handled++;
+      }
       else
         break;//return;
     }
+
+  // Refill the transmit FIFOs once for all the acks handled above
+  for (i = 0; i < vCard->nrChannels; i++) {
+    VCanChanData   *vChd = vCard->chanData[i];
+    PciCanChanData *hChd = vChd->hwChanData;
+
+    if (test_and_clear_bit(0, &hChd->txKick)) {
+      pciCanRequestSend(vCard, vChd);
+    }
+  }
+
+  return handled;
 } // pciCanReceiveIsr
 
 
+#if PCIEFD_RX_THREAD
+//======================================================================
+//  Receive thread, throughput mode
+//  Woken by pciCanInterrupt with the receive buffer interrupt masked.
+//======================================================================
+static irqreturn_t pciCanRxThread (int irq, void *dev_id)
+{
+  VCanCardData   *vCard = (VCanCardData *)dev_id;
+  PciCanCardData *hCard = vCard->hwCardData;
+  unsigned int    budget = rx_budget ? rx_budget : 1;
+  unsigned int    n;
+  unsigned long   irqFlags;
+
+  do {
+    n = pciCanReceiveIsr(vCard, budget);
+
+    hCard->rxPolls++;
+    hCard->rxPollPackets += n;
+    if (n > hCard->rxPollMax) {
+      hCard->rxPollMax = n;
+    }
+    if (n < budget) {
+      break;
+    }
+    hCard->rxBudgetExhausted++;
+    cond_resched();
+  } while (vCard->cardPresent);
+
+  // Re-arm. Packets that arrived after the last pass raise it at once.
+  spin_lock_irqsave(&hCard->lock, irqFlags);
+  hCard->rxPolling = 0;
+  if (hCard->irqEnabled && vCard->cardPresent) {
+    IOWR_PCIE_IEN(hCard->pcie, ALL_INTERRUPT_SOURCES_MSK);
+  }
+  spin_unlock_irqrestore(&hCard->lock, irqFlags);
+
+  return IRQ_HANDLED;
+} // pciCanRxThread
+#endif
+
+
 //======================================================================
 //  Transmit interrupt handler
 //  Must be called with channel locked (to avoid access interference).
@@ -2977,6 +2889,7 @@ irqreturn_t pciCanInterrupt (int irq, void *dev_id, struct pt_regs *regs)
   PciCanCardData  *hCard;
   unsigned int    loopmax  = 10000;
   int             handled = 0;
+  int             wakeThread = 0;
   unsigned long   pcie_irq;
 
   if(!vCard)
@@ -2988,7 +2901,9 @@ irqreturn_t pciCanInterrupt (int irq, void *dev_id, struct pt_regs *regs)
   hCard = vCard->hwCardData;
 
   // Read interrupt status from Altera PCIe HW
-  while ( (pcie_irq = (IORD_PCIE_IRQ(hCard->pcie) & ALL_INTERRUPT_SOURCES_MSK)) )
+  // (the receive buffer is left alone while the receive thread drains it)
+  while ( (pcie_irq = (IORD_PCIE_IRQ(hCard->pcie) & ALL_INTERRUPT_SOURCES_MSK &
+                       ~(hCard->rxPolling ? RECEIVE_BUFFER_IRQ : 0))) )
     {
       int i;
 
@@ -3004,7 +2919,19 @@ irqreturn_t pciCanInterrupt (int irq, void *dev_id, struct pt_regs *regs)
 
       // Handle shared receive buffer interrupt first
       if ( pcie_irq & RECEIVE_BUFFER_IRQ ) {
-        pciCanReceiveIsr(vCard);
+#if PCIEFD_RX_THREAD
+        if (rx_poll) {
+          spin_lock(&hCard->lock);
+          hCard->rxPolling = 1;
+          IOWR_PCIE_IEN(hCard->pcie, ALL_INTERRUPT_SOURCES_MSK & ~RECEIVE_BUFFER_IRQ);
+          spin_unlock(&hCard->lock);
+          wakeThread = 1;
+        }
+        else
+#endif
+        {
+          pciCanReceiveIsr(vCard, ~0U);
+        }
       }
 
       // Handle interrupts for each can controllerCFLAGS
@@ -3021,6 +2948,10 @@ irqreturn_t pciCanInterrupt (int irq, void *dev_id, struct pt_regs *regs)
       }
     }
 
+  if (wakeThread) {
+    return IRQ_WAKE_THREAD;
+  }
+
   return IRQ_RETVAL(handled);
 } // pciCanInterrupt
 
@@ -3494,9 +3425,12 @@ static void pciCanSend (void *void_chanData)
   VCanChanData   *chd = devChan->vChan;
 #endif
   int queuePos;
+  int sent = 0;
 
   wait_for_completion(&devChan->busOnCompletion);
 
+  // Fill the transmit FIFO with as many messages as it takes, and wake
+  // up writers waiting for room once for the whole burst.
   while (1) {
     if (!chd->isOnBus) {
       DEBUGPRINT(4, "Attempt to send when not on bus\n");
@@ -3518,7 +3452,7 @@ static void pciCanSend (void *void_chanData)
     if (queuePos >= 0) {
       if (pciCanTransmitMessage(chd, &chd->txChanBuffer[queuePos]) == VCAN_STAT_OK) {
         queue_pop(&chd->txChanQueue);
-        queue_wakeup_on_space(&chd->txChanQueue);
+        sent++;
       } else {
         queue_release(&chd->txChanQueue);
         break;
@@ -3529,6 +3463,11 @@ static void pciCanSend (void *void_chanData)
     }
   }
 
+  if (sent) {
+    ++devChan->debug.tx_burst_count;
+    queue_wakeup_on_space(&chd->txChanQueue);
+  }
+
   complete(&devChan->busOnCompletion);
 }
 
@@ -3612,6 +3551,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
     VCanChanData *dataPtrArray[MAX_CARD_CHANNELS];
     VCanChanData vChd[MAX_CARD_CHANNELS];
     PciCanChanData hChd[MAX_CARD_CHANNELS];
+    CAN_MSG        txBuf[MAX_CARD_CHANNELS][TX_CHAN_BUF_SIZE];
   } ChanHelperStruct;
 
   ChanHelperStruct *chs;
@@ -3646,6 +3586,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
   for (chNr = 0; chNr < MAX_CARD_CHANNELS; chNr++){
     chs->dataPtrArray[chNr]    = &chs->vChd[chNr];
     chs->vChd[chNr].hwChanData = &chs->hChd[chNr];
+    chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
     chs->vChd[chNr].minorNr    = -1;   // No preset minor number
   }
   vCard->chanData = chs->dataPtrArray;
@@ -3667,6 +3608,10 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
 
   pci_set_drvdata(dev, vCard);
 
+#if PCIEFD_RX_THREAD
+  if (request_threaded_irq(hCard->irq, pciCanInterrupt, pciCanRxThread,
+                           IRQF_SHARED, "Kvaser PCIe CAN", vCard)) {
+#else
   if (request_irq(hCard->irq, pciCanInterrupt,
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 18))
                   SA_SHIRQ,
@@ -3674,6 +3619,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
                   IRQF_SHARED,
 #endif
                   "Kvaser PCIe CAN", vCard)) {
+#endif
     DEBUGPRINT(1, "request_irq failed\n");
     goto irq_err;
   }
@@ -3738,6 +3684,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
   vCard->next = driverData.canCards;
   driverData.canCards = vCard;
   spin_unlock(&driverData.canCardsLock);
+  vCanCardListChanged();
 
 
 #if USE_DMA
@@ -3773,6 +3720,7 @@ static int pciCanInitOne (struct pci_dev *dev, const struct pci_device_id *id)
   pci_release_regions(dev);
  pci_err:
   DEBUGPRINT(1,"free chandata\n");
+  vCanRemoveData(vCard);
   kfree(vCard->chanData);
  chan_alloc_err:
   DEBUGPRINT(1,"free card\n");
@@ -3900,6 +3848,7 @@ static void pciCanRemoveOne (struct pci_dev *dev)
 
   DEBUGPRINT(3, "pciCanRemoveOne (7/8)\n");
 
+  vCanRemoveData(vCard);
   kfree(vCard->chanData);
   kfree(vCard);
 
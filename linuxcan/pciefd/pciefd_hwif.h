@@ -158,7 +158,6 @@ typedef struct {
   dmaCtxBuffer_t bufferCtx[2];
   int active;
   unsigned int position;
-  unsigned int psize;
   unsigned int enabled;
 } dmaCtx_t;
 
@@ -186,6 +185,7 @@ typedef struct PciCanChanData
   struct  completion busOnCompletion; // Used to make sure that multiple bus on commands in a row is not executed.
 
   spinlock_t lock;
+  unsigned long txKick; // Bit 0: acks made room, request send after the receive pass
 #if !defined(TRY_RT_QUEUE)
   struct work_struct txTaskQ;
 #else
@@ -221,6 +221,7 @@ typedef struct PciCanChanData
     int trq_packet_count;
     int err_packet_count;
     int tx_packet_count;
+    int tx_burst_count;   // pciCanSend passes that sent anything
 
     int requested_status;
     int received_status;
@@ -326,6 +327,13 @@ typedef struct PciCanCardData {
 
   atomic_t status_seq_no;
 
+  // Receive polling, see rx_poll
+  int                irqEnabled;      // As set by pciCanInterrupts
+  int                rxPolling;       // Receive interrupt masked, thread draining
+  unsigned long      rxPolls;         // Passes made by the receive thread
+  unsigned long      rxBudgetExhausted; // Passes that stopped at rx_budget
+  unsigned long      rxPollPackets;   // Packets handled by the receive thread
+  unsigned int       rxPollMax;       // Most packets handled in one pass
 
 } PciCanCardData;
 
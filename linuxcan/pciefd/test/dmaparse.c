@@ -0,0 +1,312 @@
+/*
+**             Copyright 2017 by Kvaser AB, Molndal, Sweden
+**                         http://www.kvaser.com
+**
+** This software is dual licensed under the following two licenses:
+** BSD-new and GPLv2. You may use either one. See the included
+** COPYING file for details.
+**
+** License: BSD-new
+** ==============================================================================
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions are met:
+**     * Redistributions of source code must retain the above copyright
+**       notice, this list of conditions and the following disclaimer.
+**     * Redistributions in binary form must reproduce the above copyright
+**       notice, this list of conditions and the following disclaimer in the
+**       documentation and/or other materials provided with the distribution.
+**     * Neither the name of the <organization> nor the
+**       names of its contributors may be used to endorse or promote products
+**       derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+** AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+** IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+** ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+** LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+** CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+** SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+** BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER
+** IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+** ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+** POSSIBILITY OF SUCH DAMAGE.
+**
+**
+** License: GPLv2
+** ==============================================================================
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+**
+**
+** IMPORTANT NOTICE:
+** ==============================================================================
+** This source code is made available for free, as an open license, by Kvaser AB,
+** for use with its applications. Kvaser AB does not accept any liability
+** whatsoever for any third party patent or other immaterial property rights
+** violations that may result from any usage of this source code, regardless of
+** the combination of source code and various applications that it can be used
+** in, or with.
+**
+** -----------------------------------------------------------------------------
+*/
+
+/*
+ * Kvaser Linux PCIEcan driver
+ * Userspace test and benchmark of the DMA buffer packet parser
+ *
+ * readDmaPacket() is built here without the kernel and run against
+ * well-formed, truncated, zero-length and corrupt packets, and against
+ * packets that end exactly at, or run past, the end of the buffer. Each
+ * buffer is allocated to the exact size, so a read past its end shows up
+ * under valgrind or -fsanitize=address. After the tests, a buffer full of
+ * CAN FD packets is parsed -n times and the time per packet is printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "HAL/inc/pciefd_packet.h"
+
+// Same as DMA_BUFFER_SZ in pciefd_hwif.h
+#define DMA_BUFFER_WORDS (4096/4)
+
+static int failures = 0;
+
+#define expect(cond) do {                                               \
+    if (!(cond)) {                                                      \
+      printf("%s:%d: expected %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+static void printUsageAndExit(char *prgName)
+{
+  printf("Usage: '%s [-n rounds]'\n", prgName);
+  exit(1);
+}
+
+// Write a packet of the given type at words[0], with a size word that
+// is correct for the type unless size is given. Returns the size word.
+static unsigned int putPacket(uint32_t *words, int ptype, uint32_t id,
+                              int fd, int dlc, unsigned int size)
+{
+  unsigned int nbytes = 0;
+  unsigned int i;
+
+  words[1] = id;
+  words[2] = ((uint32_t)ptype << RPACKET_PTYPE_LSHIFT) |
+             RTPACKET_FDF(fd) | RTPACKET_DLC(dlc);
+
+  switch (ptype) {
+  case RPACKET_PTYPE_DATA:
+    if (!RTPACKET_RTR_GET(id)) {
+      nbytes = fd ? dlcToBytesFD(dlc) : dlcToBytes(dlc);
+    }
+    if (!size) {
+      size = 5 + bytesToWordsCeil(nbytes);
+    }
+    break;
+  case RPACKET_PTYPE_OFFSET:
+  case RPACKET_PTYPE_DELAY:
+    if (!size) {
+      size = 3;
+    }
+    break;
+  default:
+    if (!size) {
+      size = 5;
+    }
+    break;
+  }
+
+  words[0] = size;
+  for (i = 3; i < size; i++) {
+    words[i] = 0x11111111 * i;
+  }
+
+  return size;
+}
+
+// Copy the packet to the end of an exactly sized buffer and parse it there
+static int parseAtEnd(const uint32_t *words, unsigned int avail,
+                      pciefd_packet_t *packet)
+{
+  uint32_t *buf = malloc(avail * sizeof(uint32_t));
+  int ret;
+
+  memcpy(buf, words, avail * sizeof(uint32_t));
+  ret = readDmaPacket(buf, avail, packet);
+  free(buf);
+
+  return ret;
+}
+
+static void testPackets(void)
+{
+  uint32_t words[32];
+  pciefd_packet_t packet;
+  uint64_t ts;
+  unsigned int size;
+
+  // Classic data packet
+  memset(&packet, 0, sizeof(packet));
+  size = putPacket(words, RPACKET_PTYPE_DATA, 0x123, 0, 8, 0);
+  expect(size == 7);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 7);
+  expect(packet.id == 0x123);
+  expect(getDLC(&packet) == 8);
+  memcpy(&ts, &words[3], sizeof(ts));
+  expect(packet.timestamp == ts);
+  expect(packet.data[0] == words[5] && packet.data[1] == words[6]);
+
+  // Largest CAN FD data packet
+  size = putPacket(words, RPACKET_PTYPE_DATA, 0x456, 1, 15, 0);
+  expect(size == 5 + NR_OF_DATA_WORDS);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == (int)size);
+  expect(packet.data[NR_OF_DATA_WORDS - 1] == words[size - 1]);
+
+  // Zero-length data and remote request: size, id, control and timestamp
+  memset(&packet, 0, sizeof(packet));
+  size = putPacket(words, RPACKET_PTYPE_DATA, 0x1, 0, 0, 0);
+  expect(size == 5);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 5);
+  expect(packet.data[0] == 0);
+  size = putPacket(words, RPACKET_PTYPE_DATA, RTPACKET_RTR(1) | 0x2, 0, 8, 0);
+  expect(size == 5);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 5);
+  expect(isRemoteRequest(&packet));
+
+  // Short packets without a timestamp
+  putPacket(words, RPACKET_PTYPE_OFFSET, 0, 0, 0, 0);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 3);
+  putPacket(words, RPACKET_PTYPE_DELAY, 0, 0, 0, 0);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 3);
+  putPacket(words, RPACKET_PTYPE_ACK, 0, 0, 0, 0);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 5);
+
+  // End of buffer marker, and no words left at all
+  words[0] = 0;
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == 0);
+  expect(readDmaPacket(words, 0, &packet) == -1);
+
+  // Truncated: the size word is too small for the header or for the type
+  putPacket(words, RPACKET_PTYPE_DATA, 0x123, 0, 0, 2);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+  putPacket(words, RPACKET_PTYPE_DATA, 0x123, 0, 8, 5);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+  putPacket(words, RPACKET_PTYPE_DATA, 0x123, 1, 15, 20);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+  putPacket(words, RPACKET_PTYPE_ACK, 0, 0, 0, 3);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+
+  // Too long for the type, or for any packet
+  putPacket(words, RPACKET_PTYPE_DATA, 0x123, 0, 0, 7);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+  putPacket(words, RPACKET_PTYPE_OFFSET, 0, 0, 0, 5);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+  words[0] = 6 + NR_OF_DATA_WORDS;
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+  words[0] = 0xffffffff;
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+
+  // Unknown packet type
+  putPacket(words, 7, 0, 0, 0, 5);
+  expect(readDmaPacket(words, DMA_BUFFER_WORDS, &packet) == -1);
+
+  // A packet that ends exactly at the end of the buffer is read...
+  size = putPacket(words, RPACKET_PTYPE_DATA, 0x123, 1, 15, 0);
+  expect(parseAtEnd(words, size, &packet) == (int)size);
+  size = putPacket(words, RPACKET_PTYPE_DATA, 0x1, 0, 0, 0);
+  expect(parseAtEnd(words, size, &packet) == (int)size);
+
+  // ...but one that runs past it is rejected before anything is read
+  size = putPacket(words, RPACKET_PTYPE_DATA, 0x123, 1, 15, 0);
+  expect(parseAtEnd(words, size - 1, &packet) == -1);
+  expect(parseAtEnd(words, 1, &packet) == -1);
+}
+
+static void benchmark(unsigned long rounds)
+{
+  uint32_t *buf = calloc(DMA_BUFFER_WORDS, sizeof(uint32_t));
+  pciefd_packet_t packet;
+  struct timespec start, stop;
+  unsigned long packets = 0;
+  unsigned long r;
+  unsigned int pos = 0;
+  double ns;
+
+  // Fill the buffer with CAN FD packets, and end it with a zero size word
+  while (pos + 5 + NR_OF_DATA_WORDS < DMA_BUFFER_WORDS) {
+    pos += putPacket(&buf[pos], RPACKET_PTYPE_DATA, 0x123, 1, 15, 0);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (r = 0; r < rounds; r++) {
+    int size;
+
+    pos = 0;
+    while ((size = readDmaPacket(&buf[pos], DMA_BUFFER_WORDS - pos, &packet)) > 0) {
+      pos += size;
+      packets++;
+    }
+    if (size < 0) {
+      printf("Parse error at word %u\n", pos);
+      failures++;
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+
+  ns = (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+  printf("%lu packets, %.1f ns per packet\n", packets,
+         packets ? ns / packets : 0.0);
+
+  free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long rounds = 100000;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:")) != -1) {
+    switch (c) {
+    case 'n':
+      rounds = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      printUsageAndExit(argv[0]);
+    }
+  }
+  if (optind != argc) {
+    printUsageAndExit(argv[0]);
+  }
+
+  testPackets();
+  if (rounds) {
+    benchmark(rounds);
+  }
+
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+
+  return 0;
+}
@@ -69,7 +69,6 @@
 #include <linux/seq_file.h>
 #include <linux/module.h>
 #include <linux/slab.h>
-#include <linux/kthread.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0))
 #include <linux/sched.h>
 #else
@@ -196,6 +195,19 @@ static VCanHWInterface hwIf = {
 #define MAX_PACKET_OUT      3072        // To device
 #define MAX_PACKET_IN       3072        // From device
 
+//----------------------------------------------------------------------------
+// The bulk in endpoint is read through a ring of rx_urbs urbs that are kept
+// submitted, so the device always has somewhere to put data while earlier
+// buffers are being parsed. Both values are read when a device is plugged in.
+//
+static unsigned int rx_urbs = 4;
+MODULE_PARM_DESC(rx_urbs, "USBcanII number of read urbs per device (1-16)");
+module_param(rx_urbs, uint, 0644);
+
+static unsigned int rx_buffer_size = MAX_PACKET_IN;
+MODULE_PARM_DESC(rx_buffer_size, "USBcanII size in bytes of each read urb buffer");
+module_param(rx_buffer_size, uint, 0644);
+
 
 
 //======================================================================
@@ -211,11 +223,17 @@ static void   usbcan_write_bulk_callback(struct urb *urb, struct pt_regs *regs);
 static void   usbcan_write_bulk_callback(struct urb *urb);
  #endif
 
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 8))
+# define USB_KILL_URB(x) usb_unlink_urb(x)
+#else
+# define USB_KILL_URB(x) usb_kill_urb(x)
+#endif
+
 
 static int    usbcan_allocate(VCanCardData **vCard);
 static void   usbcan_deallocate(VCanCardData *vCard);
 
-static void   usbcan_start(VCanCardData *vCard);
+static int    usbcan_start(VCanCardData *vCard);
 
 static int    usbcan_tx_available(VCanChanData *vChan);
 static int    usbcan_transmit(VCanCardData *vCard);
@@ -333,123 +351,263 @@ static void usbcan_write_bulk_callback (struct urb *urb)
 //----------------------------------------------------------------------------
 
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
+# define USE_CONTEXT 1
+#else
+# define USE_CONTEXT 0
+#endif
+
 //============================================================================
 //
-// usbcan_rx_thread
+// usbcan_rx_parse
+//
+// Interpret the commands in one buffer from the bulk in endpoint.
 //
-static int usbcan_rx_thread (void *context)
+static void usbcan_rx_parse (VCanCardData *vCard, unsigned char *buffer,
+                             unsigned int len)
 {
-  VCanCardData *vCard   = (VCanCardData *)context;
-  UsbcanCardData *dev   = (UsbcanCardData *)vCard->hwCardData;
-  int          result  = 0;
-  int          usbErrorCounter;
-  int          ret;
-  int          len;
+  UsbcanCardData *dev        = (UsbcanCardData *)vCard->hwCardData;
+  heliosCmd      *cmd;
+  int            loopCounter = 1000;
+  unsigned int   count       = 0;
 
-  if (!try_module_get(THIS_MODULE)) {
-    return -ENODEV;
+
+  while (count < len) {
+    // A loop counter as a safety measure.
+    if (--loopCounter == 0) {
+      DEBUGPRINT(2, (TXT("ERROR usbcan_rx_parse() LOOPMAX. \n")));
+      break;
+    }
+
+    // A command will never straddle a bulk_in_MaxPacketSize byte boundary.
+    // The firmware will place a zero in the buffer to indicate that
+    // the next command will follow after the next
+    // bulk_in_MaxPacketSize bytes boundary.
+
+    cmd = (heliosCmd *)&buffer[count];
+    if (cmd->head.cmdLen == 0) {
+      count += dev->bulk_in_MaxPacketSize;
+      count &= -(dev->bulk_in_MaxPacketSize);
+      continue;
+    }
+    else {
+      count += cmd->head.cmdLen;
+    }
+
+    usbcan_handle_command(cmd, vCard);
   }
+} // _rx_parse
+
+
+//============================================================================
+//
+// usbcan_rx_work
+//
+// Runs on the single threaded rxQ, so buffers are parsed in the order the
+// urbs completed. The urb is resubmitted once its buffer has been parsed;
+// the other urbs in the ring keep the endpoint busy meanwhile.
+//
+#if USE_CONTEXT
+static void usbcan_rx_work (void *context)
+#else
+static void usbcan_rx_work (struct work_struct *work)
+#endif
+{
+#if USE_CONTEXT
+  UsbcanRxUrb    *rx    = (UsbcanRxUrb *)context;
+#else
+  UsbcanRxUrb    *rx    = container_of(work, UsbcanRxUrb, work);
+#endif
+  VCanCardData   *vCard = rx->vCard;
+  UsbcanCardData *dev   = (UsbcanCardData *)vCard->hwCardData;
+  struct urb     *urb   = rx->urb;
+  int            ret;
 
-  DEBUGPRINT(3, (TXT("rx thread started\n")));
+  if (urb->status) {
+    DEBUGPRINT(2, (TXT("read bulk status (%d)\n"), urb->status));
 
-  dev->read_urb = 0;
+    if (urb->status == -EILSEQ || urb->status == -ESHUTDOWN ||
+        urb->status == -ENODEV) {
+      DEBUGPRINT(2, (TXT("read bulk error (%d) - Device probably ")
+                     TXT2("removed, closing down\n"), urb->status));
+      vCard->cardPresent = 0;
+      return;
+    }
 
-  usbErrorCounter = 0;
+    if (++dev->rxErrorCounter > 100) {
+      DEBUGPRINT(2, (TXT("rx Ended - error (%d)\n"), urb->status));
 
-  while (vCard->cardPresent) {
+      // Since this has failed so many times, stop transfers to device
+      vCard->cardPresent = 0;
+      return;
+    }
+  }
+  else {
+    dev->rxErrorCounter = 0;
+    usbcan_rx_parse(vCard, rx->buffer, urb->actual_length);
+  }
 
-    // Verify that the device wasn't unplugged
-    if (!vCard->cardPresent){
-      DEBUGPRINT(3, (TXT("rx thread Ended - device removed\n")));
-      result = -ENODEV;
-      break;
+  if (dev->rxStopped || !vCard->cardPresent) {
+    return;
+  }
+
+  ret = usb_submit_urb(urb, GFP_KERNEL);
+  if (ret) {
+    DEBUGPRINT(1, (TXT("Failed resubmitting read urb (%d)\n"), ret));
+    if (ret == -ENODEV) {
+      vCard->cardPresent = 0;
     }
+  }
+} // _rx_work
+
 
-    len = 0;
-    // Do a blocking bulk read to get data from the device
-    ret = usb_bulk_msg(dev->udev,
-                       usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
-                       dev->bulk_in_buffer, dev->bulk_in_size, &len,
-// Timeout changed from jiffies to milliseconds in 2.6.12.
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 12))
-                       HZ * 30);
+//============================================================================
+//  usbcan_read_bulk_callback
+//
+// Interrupt handler prototype changed in 2.6.19.
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 19))
+static void usbcan_read_bulk_callback (struct urb *urb, struct pt_regs *regs)
 #else
-                       30000);
+static void usbcan_read_bulk_callback (struct urb *urb)
 #endif
+{
+  UsbcanRxUrb    *rx  = (UsbcanRxUrb *)urb->context;
+  UsbcanCardData *dev = (UsbcanCardData *)rx->vCard->hwCardData;
 
-    if (ret) {
-      if (ret != -ETIMEDOUT) {
-        // Save if runaway
-        if (ret == -EILSEQ || ret == -ESHUTDOWN || ret == -EINVAL) {
-          DEBUGPRINT(2, (TXT ("usb_bulk_msg error (%d) - Device probably ")
-                         TXT2("removed, closing down\n"), ret));
-          vCard->cardPresent = 0;
-          result = -ENODEV;
-          break;
-        }
+  // Killed by usbcan_rx_stop(), leave it idle
+  if (urb->status == -ENOENT || urb->status == -ECONNRESET) {
+    return;
+  }
 
-#if DEBUG
-        if (usbErrorCounter++ % 10 == 0)
-          DEBUGPRINT(2, (TXT("usb_bulk_msg error (%d) %dth time\n"),
-                         ret, usbErrorCounter));
+  queue_work(dev->rxQ, &rx->work);
+}
+
+
+//============================================================================
+//
+// usbcan_rx_start
+//
+// Allocate the ring of read urbs and submit all of them.
+//
+static int usbcan_rx_start (VCanCardData *vCard)
+{
+  UsbcanCardData *dev = (UsbcanCardData *)vCard->hwCardData;
+  unsigned int   i;
+  size_t         size;
+
+  // The buffer must hold a whole number of usb packets
+  size = max_t(size_t, rx_buffer_size, dev->bulk_in_MaxPacketSize);
+  if (dev->bulk_in_MaxPacketSize) {
+    size = roundup(size, dev->bulk_in_MaxPacketSize);
+  }
+
+  dev->bulk_in_size   = size;
+  dev->rxUrbCount     = min_t(unsigned int, max_t(unsigned int, rx_urbs, 1),
+                              USBCAN_MAX_RX_URBS);
+  dev->rxStopped      = 0;
+  dev->rxErrorCounter = 0;
+
+  dev->rxQ = create_singlethread_workqueue("usbcan_rx");
+  if (!dev->rxQ) {
+    return VCAN_STAT_NO_MEMORY;
+  }
+
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    UsbcanRxUrb *rx = &dev->rxUrb[i];
+
+    rx->vCard  = vCard;
+    rx->urb    = usb_alloc_urb(0, GFP_KERNEL);
+    rx->buffer = kmalloc(size, GFP_KERNEL);
+    DEBUGPRINT(2, (TXT("MALLOC read urb %u\n"), i));
+    if (!rx->urb || !rx->buffer) {
+      DEBUGPRINT(1, (TXT("Couldn't allocate read urb %u\n"), i));
+      return VCAN_STAT_NO_MEMORY;
+    }
+#if USE_CONTEXT
+    INIT_WORK(&rx->work, usbcan_rx_work, rx);
+#else
+    INIT_WORK(&rx->work, usbcan_rx_work);
 #endif
-        if (usbErrorCounter > 100) {
-          DEBUGPRINT(2, (TXT("rx thread Ended - error (%d)\n"), ret));
+    usb_fill_bulk_urb(rx->urb, dev->udev,
+                      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+                      rx->buffer, size, usbcan_read_bulk_callback, rx);
+  }
 
-          // Since this has failed so many times, stop transfers to device
-          vCard->cardPresent = 0;
-          result = -ENODEV;
-          break;
-        }
-      }
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    int ret = usb_submit_urb(dev->rxUrb[i].urb, GFP_KERNEL);
+    if (ret) {
+      DEBUGPRINT(1, (TXT("Failed submitting read urb %u (%d)\n"), i, ret));
+      return VCAN_STAT_FAIL;
     }
-    else {
-      //
-      // We got a bunch of bytes. Now interpret them.
-      //
-      unsigned char  *buffer     = (unsigned char *)dev->bulk_in_buffer;
-      heliosCmd      *cmd;
-      int            loopCounter = 1000;
-      unsigned int   count       = 0;
+  }
 
+  DEBUGPRINT(3, (TXT("rx started, %u urbs of %zu bytes\n"),
+                 dev->rxUrbCount, size));
 
-      while (count < len) {
-        // A loop counter as a safety measure.
-        if (--loopCounter == 0) {
-          DEBUGPRINT(2, (TXT("ERROR usbcan_rx_thread() LOOPMAX. \n")));
-          break;
-        }
+  return VCAN_STAT_OK;
+} // _rx_start
 
-        // A command will never straddle a bulk_in_MaxPacketSize byte boundary.
-        // The firmware will place a zero in the buffer to indicate that
-        // the next command will follow after the next
-        // bulk_in_MaxPacketSize bytes boundary.
 
-        cmd = (heliosCmd *)&buffer[count];
-        if (cmd->head.cmdLen == 0) {
-          count += dev->bulk_in_MaxPacketSize;
-          count &= -(dev->bulk_in_MaxPacketSize);
-          continue;
-        }
-        else {
-          count += cmd->head.cmdLen;
-        }
+//============================================================================
+//
+// usbcan_rx_stop
+//
+// Kill the read urbs and wait for pending parsing. A work item that was
+// already running may have resubmitted its urb while the first round of
+// kills was in progress, so kill once more after the flush.
+// Safe to call more than once, and before usbcan_rx_start().
+//
+static void usbcan_rx_stop (VCanCardData *vCard)
+{
+  UsbcanCardData *dev = (UsbcanCardData *)vCard->hwCardData;
+  unsigned int   i;
 
-        usbcan_handle_command(cmd, vCard);
-        usbErrorCounter = 0;
-      }
+  dev->rxStopped = 1;
+  smp_mb();
+
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    if (dev->rxUrb[i].urb) {
+      USB_KILL_URB(dev->rxUrb[i].urb);
+    }
+  }
+
+  if (dev->rxQ) {
+    flush_workqueue(dev->rxQ);
+  }
+
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    if (dev->rxUrb[i].urb) {
+      USB_KILL_URB(dev->rxUrb[i].urb);
     }
-  } // while (vCard->cardPresent)
+  }
+} // _rx_stop
 
 
+//============================================================================
+//
+// usbcan_rx_free
+//
+static void usbcan_rx_free (VCanCardData *vCard)
+{
+  UsbcanCardData *dev = (UsbcanCardData *)vCard->hwCardData;
+  unsigned int   i;
 
-  DEBUGPRINT(3, (TXT("rx thread Ended - finalised\n")));
+  usbcan_rx_stop(vCard);
 
-  module_put(THIS_MODULE);
-  do_exit(result);
+  if (dev->rxQ) {
+    destroy_workqueue(dev->rxQ);
+    dev->rxQ = NULL;
+  }
 
-  return result;
-} // _rx_thread
+  for (i = 0; i < dev->rxUrbCount; i++) {
+    usb_free_urb(dev->rxUrb[i].urb);
+    dev->rxUrb[i].urb = NULL;
+    kfree(dev->rxUrb[i].buffer);
+    dev->rxUrb[i].buffer = NULL;
+  }
+  dev->rxUrbCount = 0;
+  DEBUGPRINT(2, (TXT("Free read urbs\n")));
+} // _rx_free
 
 
 //======================================================================
@@ -986,12 +1144,6 @@ static int usbcan_get_trans_id (heliosCmd *cmd)
 //============================================================================
 // _send
 //
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 20)
-# define USE_CONTEXT 1
-#else
-# define USE_CONTEXT 0
-#endif
-
 #if USE_CONTEXT
 static void usbcan_send (void *context)
 #else
@@ -1640,20 +1792,10 @@ static int usbcan_plugin (struct usb_interface *interface,
         ((endpoint->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) ==
          USB_ENDPOINT_XFER_BULK)) {
       // We found a bulk in endpoint
-      buffer_size                = MAX_PACKET_IN;
-      dev->bulk_in_size          = buffer_size;
       dev->bulk_in_endpointAddr  = endpoint->bEndpointAddress;
-      dev->bulk_in_buffer        = kmalloc(buffer_size, GFP_KERNEL);
       dev->bulk_in_MaxPacketSize = le16_to_cpu(endpoint->wMaxPacketSize);
       DEBUGPRINT(2, (TXT("MaxPacketSize in = %d\n"),
                      dev->bulk_in_MaxPacketSize));
-
-      DEBUGPRINT(2, (TXT("MALLOC bulk_in_buffer\n")));
-      if (!dev->bulk_in_buffer) {
-        DEBUGPRINT(1, (TXT("Couldn't allocate bulk_in_buffer\n")));
-        goto error;
-      }
-      memset(dev->bulk_in_buffer, 0, buffer_size);
     }
 
     if (!dev->bulk_out_endpointAddr &&
@@ -1722,7 +1864,17 @@ static int usbcan_plugin (struct usb_interface *interface,
   }
 
   // Start up vital stuff
-  usbcan_start(vCard);
+  if (usbcan_start(vCard) != VCAN_STAT_OK) {
+    DEBUGPRINT(1, (TXT("Couldn't start the device\n")));
+    vCard->cardPresent = 0;
+    usbcan_rx_stop(vCard);
+    if (dev->txTaskQ) {
+      destroy_workqueue(dev->txTaskQ);
+    }
+    USB_KILL_URB(dev->write_urb);
+    retval = -EIO;
+    goto error;
+  }
 
   // Let the user know what node this device is now attached to
   DEBUGPRINT(2, (TXT("------------------------------\n")));
@@ -1750,10 +1902,11 @@ error:
 //
 // Init stuff, called from end of _plugin
 //
-static void usbcan_start (VCanCardData *vCard)
+static int usbcan_start (VCanCardData *vCard)
 {
   UsbcanCardData *dev = (UsbcanCardData *)vCard->hwCardData;
   unsigned int i;
+  int          r;
 
   DEBUGPRINT(3, (TXT("usbcan: _start\n")));
 
@@ -1782,14 +1935,23 @@ static void usbcan_start (VCanCardData *vCard)
  INIT_WORK(&dev->txWork, usbcan_send);
 #endif
   dev->txTaskQ = create_workqueue("usbcan_tx");
+  if (!dev->txTaskQ) {
+    return VCAN_STAT_NO_MEMORY;
+  }
 
-  kthread_run(usbcan_rx_thread, vCard, "Kvaser kernel thread");
+  r = usbcan_rx_start(vCard);
+  if (r != VCAN_STAT_OK) {
+    DEBUGPRINT(1, (TXT("Couldn't start reading from device\n")));
+    return r;
+  }
 
   // Gather some card info
   usbcan_get_card_info(vCard);
   DEBUGPRINT(2, (TXT("vcard chnr: %d\n"), vCard->nrChannels));
   vCard->driverData = &driverData;
   vCanInitData(vCard);
+
+  return VCAN_STAT_OK;
 } // _start
 
 
@@ -1804,6 +1966,7 @@ static int usbcan_allocate (VCanCardData **in_vCard)
     VCanChanData    *dataPtrArray[MAX_CARD_CHANNELS];
     VCanChanData    vChd[MAX_CARD_CHANNELS];
     UsbcanChanData  hChd[MAX_CARD_CHANNELS];
+    CAN_MSG         txBuf[MAX_CARD_CHANNELS][TX_CHAN_BUF_SIZE];
   } ChanHelperStruct;
 
   int              chNr;
@@ -1838,6 +2001,7 @@ static int usbcan_allocate (VCanCardData **in_vCard)
   for (chNr = 0; chNr < MAX_CARD_CHANNELS; chNr++) {
     chs->dataPtrArray[chNr]    = &chs->vChd[chNr];
     chs->vChd[chNr].hwChanData = &chs->hChd[chNr];
+    chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
     chs->vChd[chNr].minorNr    = -1;   // No preset minor number
   }
   vCard->chanData = chs->dataPtrArray;
@@ -1847,6 +2011,7 @@ static int usbcan_allocate (VCanCardData **in_vCard)
   vCard->next = driverData.canCards;
   driverData.canCards = vCard;
   spin_unlock(&driverData.canCardsLock);
+  vCanCardListChanged();
 
   *in_vCard = vCard;
 
@@ -1877,11 +2042,8 @@ static void usbcan_deallocate (VCanCardData *vCard)
   // Make sure all workqueues are finished
   //flush_workqueue(&dev->txTaskQ);
 
-  if (dev->bulk_in_buffer != NULL) {
-    DEBUGPRINT(2, (TXT("Free bulk_in_buffer\n")));
-    kfree(dev->bulk_in_buffer);
-    dev->bulk_in_buffer = NULL;
-  }
+  usbcan_rx_free(vCard);
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 35))
   usb_buffer_free(dev->udev, dev->bulk_out_size,
                   dev->bulk_out_buffer,
@@ -1934,6 +2096,7 @@ static void usbcan_deallocate (VCanCardData *vCard)
   }
   if (vCard->chanData != NULL) {
     DEBUGPRINT(2, (TXT("Free vCard->chanData\n")));
+    vCanRemoveData(vCard);
     kfree(vCard->chanData);
     vCard->chanData = NULL;
   }
@@ -1945,21 +2108,14 @@ static void usbcan_deallocate (VCanCardData *vCard)
 } // _deallocate
 
 
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 8))
-# define USB_KILL_URB(x) usb_unlink_urb(x)
-#else
-# define USB_KILL_URB(x) usb_kill_urb(x)
-#endif
-
 //============================================================================
 //     usbcan_remove
 //
 //     Called by the usb core when the device is removed from the system.
 //
 //     This routine guarantees that the driver will not submit any more urbs
-//     by clearing dev->udev.  It is also supposed to terminate any currently
-//     active urbs.  Unfortunately, usb_bulk_msg(), does not provide any way
-//     to do this.  But at least we can cancel an active write.
+//     by clearing dev->udev.  It also terminates the read urbs and any
+//     active write.
 //
 static void usbcan_remove (struct usb_interface *interface)
 {
@@ -2018,6 +2174,9 @@ static void usbcan_remove (struct usb_interface *interface)
   // Give back our minor
   //usb_deregister_dev(interface, &usbcan_class);
 
+  // Terminate reads
+  usbcan_rx_stop(vCard);
+
   // Terminate an ongoing write
   DEBUGPRINT(6, (TXT("Ongoing write terminated\n")));
   USB_KILL_URB(dev->write_urb);
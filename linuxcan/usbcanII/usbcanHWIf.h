@@ -114,6 +114,16 @@ typedef struct UsbcanChanData
 
 
 
+#define USBCAN_MAX_RX_URBS 16
+
+typedef struct UsbcanRxUrb {
+  struct urb          *urb;
+  unsigned char       *buffer;
+  struct work_struct   work;        // parses the buffer and resubmits the urb
+  VCanCardData        *vCard;
+} UsbcanRxUrb;
+
+
 /*  Cards specific data */
 typedef struct UsbcanCardData {
 
@@ -144,8 +154,7 @@ typedef struct UsbcanCardData {
   struct usb_device       *udev;               // save off the usb device pointer
   struct usb_interface    *interface;          // the interface for this device
 
-  unsigned char *         bulk_in_buffer;      // the buffer to receive data
-  size_t                  bulk_in_size;        // the size of the receive buffer
+  size_t                  bulk_in_size;        // the size of each receive buffer
   __u8                    bulk_in_endpointAddr;// the address of the bulk in endpoint
   unsigned int            bulk_in_MaxPacketSize;
 
@@ -154,10 +163,16 @@ typedef struct UsbcanCardData {
   unsigned int            bulk_out_MaxPacketSize;
 
   struct urb *            write_urb;           // the urb used to send data
-  struct urb *            read_urb;            // the urb used to receive data
   __u8                    bulk_out_endpointAddr;//the address of the bulk out endpoint
   struct completion       write_finished;       // wait for the write to finish
 
+  // Ring of urbs kept submitted on the bulk in endpoint
+  UsbcanRxUrb             rxUrb[USBCAN_MAX_RX_URBS];
+  unsigned int            rxUrbCount;
+  struct workqueue_struct *rxQ;                // single threaded, keeps buffer order
+  int                     rxStopped;
+  int                     rxErrorCounter;
+
   VCanCardData           *vCard;
 } UsbcanCardData;
 
@@ -632,6 +632,7 @@ static int virtualInitOne (void)
         VCanChanData    *dataPtrArray[MAX_CHANNELS];
         VCanChanData    vChd[MAX_CHANNELS];
         virtualChanData hChd[MAX_CHANNELS];
+        CAN_MSG         txBuf[MAX_CHANNELS][TX_CHAN_BUF_SIZE];
     } ChanHelperStruct;
 
     ChanHelperStruct   *chs;
@@ -659,6 +660,7 @@ static int virtualInitOne (void)
     for (chNr = 0; chNr < MAX_CHANNELS; chNr++) {
         chs->dataPtrArray[chNr]    = &chs->vChd[chNr];
         chs->vChd[chNr].hwChanData = &chs->hChd[chNr];
+        chs->vChd[chNr].txChanBuffer = chs->txBuf[chNr];
         chs->vChd[chNr].minorNr    = -1;   // No preset minor number
     }
     vCard->chanData = chs->dataPtrArray;
@@ -677,6 +679,7 @@ static int virtualInitOne (void)
     vCard->next = driverData.canCards;
     driverData.canCards    = vCard;
     spin_unlock(&driverData.canCardsLock);
+    vCanCardListChanged();
 
     return 1;
 
@@ -704,6 +707,7 @@ static void virtualRemoveOne (VCanCardData *vCard)
     }
   }
 
+  vCanRemoveData(vCard);
   kfree(vCard->chanData);
   kfree(vCard);
 }